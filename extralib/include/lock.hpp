@@ -45,6 +45,8 @@ typedef pthread_rwlock_t PTHREAD_RW_RWLOCK_T;
 #define PTHREAD_RW_READ_UNLOCK(l) pthread_rwlock_unlock((PTHREAD_RW_RWLOCK_T*)(l))
 #define PTHREAD_RW_WRITE_LOCK(l) pthread_rwlock_wrlock((PTHREAD_RW_RWLOCK_T*)(l))
 #define PTHREAD_RW_WRITE_UNLOCK(l) pthread_rwlock_unlock((PTHREAD_RW_RWLOCK_T*)(l))
+#define PTHREAD_RW_READ_TRYLOCK(l) (pthread_rwlock_tryrdlock((PTHREAD_RW_RWLOCK_T*)(l)) == 0)
+#define PTHREAD_RW_WRITE_TRYLOCK(l) (pthread_rwlock_trywrlock((PTHREAD_RW_RWLOCK_T*)(l)) == 0)
 
 /* PTHREAD_SIMPLE */
 // PTHREAD_RW_*READ/WRITE*() makes no sense, don't use it.
@@ -60,6 +62,7 @@ typedef pthread_mutex_t PTHREAD_SIMPLE_LOCK_T;
 
 #define PTHREAD_SIMPLE_LOCK(l) pthread_mutex_lock((PTHREAD_SIMPLE_LOCK_T*)(l))
 #define PTHREAD_SIMPLE_UNLOCK(l) pthread_mutex_unlock((PTHREAD_SIMPLE_LOCK_T*)(l))
+#define PTHREAD_SIMPLE_TRYLOCK(l) (pthread_mutex_trylock((PTHREAD_SIMPLE_LOCK_T*)(l)) == 0)
 
 /* PTHREAD_SPIN */
 typedef pthread_spinlock_t PTHREAD_SPIN_LOCK_T;
@@ -74,6 +77,7 @@ typedef pthread_spinlock_t PTHREAD_SPIN_LOCK_T;
 
 #define PTHREAD_SPIN_LOCK(l) pthread_spin_lock((PTHREAD_SPIN_LOCK_T*)(l))
 #define PTHREAD_SPIN_UNLOCK(l) pthread_spin_unlock((PTHREAD_SPIN_LOCK_T*)(l))
+#define PTHREAD_SPIN_TRYLOCK(l) (pthread_spin_trylock((PTHREAD_SPIN_LOCK_T*)(l)) == 0)
 
 #endif
 
@@ -88,6 +92,7 @@ typedef SpinLock GOOGLE_SPIN_LOCK_T;
 
 #define GOOGLE_SPIN_LOCK(l) ((GOOGLE_SPIN_LOCK_T*)(l))->Lock()
 #define GOOGLE_SPIN_UNLOCK(l) ((GOOGLE_SPIN_LOCK_T*)(l))->Unlock()
+#define GOOGLE_SPIN_TRYLOCK(l) ((GOOGLE_SPIN_LOCK_T*)(l))->TryLock()
 
 #endif
 
@@ -103,6 +108,7 @@ typedef std::mutex CPP11_LOCK_T;
 
 #define CPP11_LOCK(l) ((CPP11_LOCK_T*)(l))->lock()
 #define CPP11_UNLOCK(l) ((CPP11_LOCK_T*)(l))->unlock()
+#define CPP11_TRYLOCK(l) ((CPP11_LOCK_T*)(l))->try_lock()
 
 #endif
 
@@ -122,6 +128,8 @@ typedef PTHREAD_RW_RWLOCK_T RWLOCK_T;
 #define READ_UNLOCK(l) PTHREAD_RW_READ_UNLOCK((l))
 #define WRITE_LOCK(l) PTHREAD_RW_WRITE_LOCK((l))
 #define WRITE_UNLOCK(l) PTHREAD_RW_WRITE_UNLOCK((l))
+#define READ_TRYLOCK(l) PTHREAD_RW_READ_TRYLOCK((l))
+#define WRITE_TRYLOCK(l) PTHREAD_RW_WRITE_TRYLOCK((l))
 
 //==============================================================================
 #elif defined(PTHREAD_SIMPLE_LOCKS)
@@ -140,6 +148,8 @@ typedef PTHREAD_SIMPLE_LOCK_T RWLOCK_T;
 #define READ_UNLOCK(l) PTHREAD_SIMPLE_UNLOCK((l))
 #define WRITE_LOCK(l) PTHREAD_SIMPLE_LOCK((l))
 #define WRITE_UNLOCK(l) PTHREAD_SIMPLE_UNLOCK((l))
+#define READ_TRYLOCK(l) PTHREAD_SIMPLE_TRYLOCK((l))
+#define WRITE_TRYLOCK(l) PTHREAD_SIMPLE_TRYLOCK((l))
 
 //==============================================================================
 #elif defined(PTHREAD_SPIN_LOCKS)
@@ -158,6 +168,8 @@ typedef PTHREAD_SPIN_LOCK_T RWLOCK_T;
 #define READ_UNLOCK(l) PTHREAD_SPIN_UNLOCK((l))
 #define WRITE_LOCK(l) PTHREAD_SPIN_LOCK((l))
 #define WRITE_UNLOCK(l) PTHREAD_SPIN_UNLOCK((l))
+#define READ_TRYLOCK(l) PTHREAD_SPIN_TRYLOCK((l))
+#define WRITE_TRYLOCK(l) PTHREAD_SPIN_TRYLOCK((l))
 
 //==============================================================================
 #elif defined(GOOGLE_SPIN_LOCKS)
@@ -177,6 +189,8 @@ typedef GOOGLE_SPIN_LOCK_T RWLOCK_T;
 #define READ_UNLOCK(l) GOOGLE_SPIN_UNLOCK((l))
 #define WRITE_LOCK(l) GOOGLE_SPIN_LOCK((l))
 #define WRITE_UNLOCK(l) GOOGLE_SPIN_UNLOCK((l))
+#define READ_TRYLOCK(l) GOOGLE_SPIN_TRYLOCK((l))
+#define WRITE_TRYLOCK(l) GOOGLE_SPIN_TRYLOCK((l))
 
 //==============================================================================
 #elif defined(CPP11LOCKS)
@@ -196,6 +210,8 @@ typedef CPP11_LOCK_T RWLOCK_T;
 #define READ_UNLOCK(l) CPP11_UNLOCK((l))
 #define WRITE_LOCK(l) CPP11_LOCK((l))
 #define WRITE_UNLOCK(l) CPP11_UNLOCK((l))
+#define READ_TRYLOCK(l) CPP11_TRYLOCK((l))
+#define WRITE_TRYLOCK(l) CPP11_TRYLOCK((l))
 
 //==============================================================================
 #else
@@ -227,6 +243,84 @@ typedef CPP11_LOCK_T RWLOCK_T;
 #define WRITE_LOCK(l) int[-1];
 /// Obtain a write unlock in the context of a locking object
 #define WRITE_UNLOCK(l) int[-1];
+/// Try to obtain a read lock without waiting, giving whether it was obtained
+#define READ_TRYLOCK(l) int[-1];
+/// Try to obtain a write lock without waiting, giving whether it was obtained
+#define WRITE_TRYLOCK(l) int[-1];
+
+#endif
+
+/* OPTIMISTIC READS */
+/// Readers of a structure that is read far more often than it is written can skip
+///the lock, which they'd otherwise all be writing to, and read optimistically
+///instead. The writers, still holding the lock, bump a version counter on the way
+///in and out, so that it's odd while a write is in progress. A reader notes the
+///version before it starts, and checks that it hasn't moved before it follows any
+///pointer it read, and again before it trusts what it found. If it has moved, the
+///reader starts over, or gives up and takes the read lock.
+///
+/// Checking the version keeps a reader from acting on a half-written structure,
+///but not from following a pointer to memory that a writer freed after the check.
+///So optimistic readers also enter an epoch (see EpochReclaimer), and writers
+///retire what they unlink rather than free it.
+///
+/// This file has no include guard, and some files include it twice, so the
+///definitions below carry one of their own.
+#ifndef LOCK_OPTIMISTIC_READS
+#define LOCK_OPTIMISTIC_READS
+
+#include <stdint.h>
+
+#if (CMAKE_COMPILER_SUITE_GCC)
+#include <sched.h>
+#define SEQ_BARRIER() __sync_synchronize()
+#define SEQ_READ_BARRIER() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define SEQ_ATOMIC_INC(v) __sync_add_and_fetch(&(v), 1)
+#define SEQ_CAS64(v, o, n) __sync_bool_compare_and_swap(&(v), (o), (n))
+#define SEQ_THREAD_LOCAL __thread
+#define SEQ_YIELD() sched_yield()
+#elif defined(WIN32)
+#include <Windows.h>
+#define SEQ_BARRIER() MemoryBarrier()
+#define SEQ_READ_BARRIER() MemoryBarrier()
+#define SEQ_ATOMIC_INC(v) InterlockedIncrement64((volatile LONG64*)&(v))
+#define SEQ_CAS64(v, o, n) (InterlockedCompareExchange64((volatile LONG64*)&(v), (LONG64)(n), (LONG64)(o)) == (LONG64)(o))
+#define SEQ_THREAD_LOCAL __declspec(thread)
+#define SEQ_YIELD() SwitchToThread()
+#elif (CMAKE_COMPILER_SUITE_SUN)
+#include <atomic.h>
+#include <sched.h>
+// membar_exit() and membar_enter() between them order everything either side.
+#define SEQ_BARRIER() (membar_exit(), membar_enter())
+#define SEQ_READ_BARRIER() membar_consumer()
+#define SEQ_ATOMIC_INC(v) atomic_inc_64_nv((volatile uint64_t*)&(v))
+#define SEQ_CAS64(v, o, n) (atomic_cas_64((volatile uint64_t*)&(v), (uint64_t)(o), (uint64_t)(n)) == (uint64_t)(o))
+#define SEQ_THREAD_LOCAL __thread
+#define SEQ_YIELD() sched_yield()
+#else
+#error "Can't find a way to do atomic operations for optimistic reads."
+#endif
+
+/// Version counter type. Only writers holding the lock change it.
+typedef volatile uint64_t SEQLOCK_T;
+
+#define SEQ_WRITE_BEGIN(v) { (v)++; SEQ_BARRIER(); } (void)0
+#define SEQ_WRITE_END(v) { SEQ_BARRIER(); (v)++; } (void)0
+
+/// Start an optimistic read. An odd version means a write is in progress, and the
+///read can't succeed.
+static inline uint64_t seq_read_begin(SEQLOCK_T* v)
+{
+    uint64_t s = *v;
+    SEQ_READ_BARRIER();
+    return s;
+}
+
+#define SEQ_READ_BEGIN(v) seq_read_begin(&(v))
+
+/// Whether everything read since SEQ_READ_BEGIN() returned s is from one consistent
+///state of the structure.
+#define SEQ_READ_VALID(v, s) (SEQ_READ_BARRIER(), (((v) == (s)) && !((s) & 1)))
 
 #endif
 
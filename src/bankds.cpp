@@ -24,6 +24,9 @@
 #include "archive.hpp"
 #include "common.hpp"
 #include "index.hpp"
+#include "comparator.hpp"
+#include "scheduler.hpp"
+#include "epoch.hpp"
 
 #include "lock.hpp"
 
@@ -34,6 +37,9 @@
 #define SET_QUERY_COUNT(x, c, dlen) (GET_QUERY_COUNT(x, dlen) = c);
 #define UPDATE_QUERY_COUNT(x, dlen) (GET_QUERY_COUNT(x, dlen)++);
 
+/// How many times get_at() starts over before it takes the read lock.
+#define BANKDS_OPTIMISTIC_RETRIES 4
+
 namespace libodb
 {
 
@@ -61,6 +67,9 @@ namespace libodb
     inline void BankDS::init(DataStore* _parent, bool(*_prune)(void* rawdata), uint64_t _datalen, uint64_t _cap)
     {
         deleted = new std::stack < void* > ;
+        old_lists = new std::vector<char**>();
+        vacated = new std::deque<std::pair<uint64_t, void*> >();
+        version = 0;
 
         // Initialize the cursor position and data count
         posA = 0;
@@ -88,7 +97,7 @@ namespace libodb
 
     BankDS::~BankDS()
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         // To avoid creating more variables, just use posA. Since posA holds byte-offsets, it must be decremented by sizeof(char*).
         // In order to free the 'last' bucket, have no start condition which leaves posA at the appropriate value.
         // Since posA is unsigned, stop when posA==0.
@@ -101,11 +110,18 @@ namespace libodb
         // Free the 'first' bucket.
         free(*data);
 
-        // Free the list of buckets.
+        // Free the list of buckets, and the ones it replaced.
         free(data);
 
+        for (size_t i = 0; i < old_lists->size(); i++)
+        {
+            free(old_lists->at(i));
+        }
+
+        delete old_lists;
+        delete vacated;
         delete deleted;
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline void* BankDS::add_data(void* rawdata)
@@ -134,7 +150,16 @@ namespace libodb
     {
         void* ret;
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
+
+        // Anything removed long enough ago that nobody can still be looking at it
+        // can be handed out again.
+        while (!vacated->empty() && EpochReclaimer::is_safe(vacated->front().first))
+        {
+            deleted->push(vacated->front().second);
+            vacated->pop_front();
+        }
+
         // Check if any locations are marked as empty. If none are...
         if (deleted->empty())
         {
@@ -153,18 +178,28 @@ namespace libodb
                 // Move the cursor to the next bucket.
                 posA += sizeof(char*);
 
+                SEQ_WRITE_BEGIN(version);
+
                 // If posA is at the end of the bucket list...
                 if (posA == list_size)
                 {
                     // Make sure to update how big we 'think' the list is.
                     list_size *= 2;
 
-                    // realloc us some new space.
-                    SAFE_REALLOC(char**, data, data, (size_t)(list_size * sizeof(char*)));
+                    // Copy the list into some new space, rather than realloc it, since
+                    // get_at() may still be reading the old one.
+                    char** new_data;
+                    SAFE_MALLOC(char**, new_data, (size_t)(list_size * sizeof(char*)));
+                    memcpy(new_data, data, (size_t)(posA * sizeof(char*)));
+
+                    old_lists->push_back(data);
+                    data = new_data;
                 }
 
                 // Allocate a new bucket.
                 SAFE_MALLOC(char*, *(data + posA), (size_t)(cap * datalen));
+
+                SEQ_WRITE_END(version);
             }
         }
         // If there are empty locations...
@@ -180,7 +215,7 @@ namespace libodb
         // Increment the number of data items in the datastore.
         data_count++;
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         // Return the pointer to the data.
         return ret;
@@ -207,10 +242,27 @@ namespace libodb
 
     inline void* BankDS::get_at(uint64_t index)
     {
-        READ_LOCK(rwlock);
+        uint64_t s;
+        void* ret;
+
+        // The bucket list only changes when a bucket is added, so in the common case
+        // this doesn't need to touch the lock at all.
+        for (uint32_t i = 0; i < BANKDS_OPTIMISTIC_RETRIES; i++)
+        {
+            s = SEQ_READ_BEGIN(version);
+            char** d = data;
+            ret = *(d + (index / cap) * sizeof(char*)) + (index % cap) * datalen;
+
+            if (SEQ_READ_VALID(version, s))
+            {
+                return ret;
+            }
+        }
+
+        rwlock->read_lock();
         // Get the location in memory of the data item at location index.
-        void* ret = *(data + (index / cap) * sizeof(char*)) + (index % cap) * datalen;
-        READ_UNLOCK(rwlock);
+        ret = *(data + (index / cap) * sizeof(char*)) + (index % cap) * datalen;
+        rwlock->read_unlock();
         return ret;
     }
 
@@ -227,11 +279,11 @@ namespace libodb
         // If we're removing anything except the last item, then push it onto the deleted stack: Do it the hard way.
         if (index < data_count - 1)
         {
-            WRITE_LOCK(rwlock);
-            // Push the memory location onto the stack.
-            deleted->push(*(data + (index / cap) * sizeof(char*)) + (index % cap) * datalen);
+            rwlock->write_lock();
+            // Set the memory location aside to be reused.
+            vacate(*(data + (index / cap) * sizeof(char*)) + (index % cap) * datalen);
             data_count--;
-            WRITE_UNLOCK(rwlock);
+            rwlock->write_unlock();
 
             // Return success
             return true;
@@ -239,7 +291,7 @@ namespace libodb
         // If we're removing the last item, it is far easier.
         else if (index == data_count - 1)
         {
-            WRITE_LOCK(rwlock);
+            rwlock->write_lock();
             // If we are in the the middle of a row, then it is trivial:
             if (posB > 0)
             {
@@ -249,13 +301,13 @@ namespace libodb
             {
                 // It is important to observe that this will never be reached when posA==0, so we dont need to worry about that case.
                 // If we're not in the middle of a row, we need to backtrack to the end of the previous row, as well as free the current row.
-                free(*(data + posA));
+                EpochReclaimer::retire(*(data + posA));
                 posA--;
                 posB = cap - 1;
             }
 
             data_count--;
-            WRITE_UNLOCK(rwlock);
+            rwlock->write_unlock();
 
             return true;
         }
@@ -265,6 +317,11 @@ namespace libodb
         }
     }
 
+    inline void BankDS::vacate(void* addr)
+    {
+        vacated->push_back(std::make_pair(EpochReclaimer::get_epoch(), addr));
+    }
+
     inline bool BankDS::remove_addr(void* addr)
     {
         bool found = false;
@@ -282,10 +339,10 @@ namespace libodb
 
         if (found)
         {
-            WRITE_LOCK(rwlock);
+            rwlock->write_lock();
             data_count--;
-            deleted->push(addr);
-            WRITE_UNLOCK(rwlock);
+            vacate(addr);
+            rwlock->write_unlock();
         }
         return found;
     }
@@ -298,7 +355,7 @@ namespace libodb
         marked[2] = new std::vector<void*>();
         marked[3] = new std::vector<void*>();
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         // Intialize some local pointers to work backwards through the banks.
         uint64_t posA_t = posA;
@@ -428,6 +485,9 @@ namespace libodb
         /// search... We're already using a vector, and we're not looking for anything?
         /// This also applies to the same code-block in BankIDS::remove_sweep(Archive* archive)
         bool(*temp)(void*);
+
+        // Held throughout, so a result can't be deleted out from under the loop.
+        LOCK(clones_lock);
         for (uint32_t i = 0; i < clones->size(); i++)
         {
             temp = clones->at(i)->get_prune();
@@ -435,6 +495,7 @@ namespace libodb
             clones->at(i)->remove_sweep();
             clones->at(i)->set_prune(temp);
         }
+        UNLOCK(clones_lock);
 
         sort(marked[0]->begin(), marked[0]->end());
         return marked;
@@ -447,7 +508,7 @@ namespace libodb
         marked[1] = NULL;
         marked[2] = NULL;
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         // Intialize some local pointers to work backwards through the banks.
         uint64_t posA_t = posA;
@@ -556,9 +617,10 @@ namespace libodb
 
         data_count -= marked[0]->size();
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         bool(*temp)(void*);
+        LOCK(clones_lock);
         for (uint32_t i = 0; i < clones->size(); i++)
         {
             temp = clones->at(i)->get_prune();
@@ -566,6 +628,7 @@ namespace libodb
             clones->at(i)->remove_sweep();
             clones->at(i)->set_prune(temp);
         }
+        UNLOCK(clones_lock);
 
         sort(marked[0]->begin(), marked[0]->end());
         return marked;
@@ -578,14 +641,14 @@ namespace libodb
 
         while (shift >= cap_size)
         {
-            free(*(data + posA));
+            EpochReclaimer::retire(*(data + posA));
             posA -= sizeof(void*);
             shift -= cap_size;
         }
 
         if (shift > posB)
         {
-            free(*(data + posA));
+            EpochReclaimer::retire(*(data + posA));
             posA -= sizeof(void*);
             posB = cap_size - shift + posB;
         }
@@ -594,7 +657,7 @@ namespace libodb
             posB -= shift;
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         delete marked[0];
         delete marked[2];
@@ -610,16 +673,18 @@ namespace libodb
 
     inline void BankDS::purge(void(*freep)(void*))
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         //! @todo Again, extern "C" is causing issues.
         if (freep == free)
         {
+            LOCK(clones_lock);
             size_t num_clones = clones->size();
             for (size_t i = 0; i < num_clones; i++)
             {
                 clones->at(i)->purge();
             }
+            UNLOCK(clones_lock);
 
             // To avoid creating more variables, just use posA. Since posA holds byte-offsets, it must be decremented by sizeof(char*).
             // In order to free the 'last' bucket, have no start condition which leaves posA at the appropriate value.
@@ -627,9 +692,12 @@ namespace libodb
             for (; posA > 0; posA -= sizeof(char*))
                 // Each time free the bucket pointed to by the value.
             {
-                free(*(data + posA));
+                EpochReclaimer::retire(*(data + posA));
             }
 
+            // Nothing removed before now is coming back.
+            vacated->clear();
+
             // Free the 'first' bucket.
             //free(*data);
 
@@ -661,7 +729,7 @@ namespace libodb
                 {
                     freep(*(data + i) + j);
                 }
-                free(*(data + i));
+                EpochReclaimer::retire(*(data + i));
             }
 
             for (uint64_t j = 0; j < posB; j += datalen)
@@ -669,15 +737,15 @@ namespace libodb
                 freep(*(data + posA) + j);
             }
 
-            free(*(data + posA));
+            EpochReclaimer::retire(*(data + posA));
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline void BankDS::populate(Index* index)
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
 
         // Index over the whole datastore and add each item to the index.
         // Since we're a friend of Index, we have access to the add_data_v command which avoids the overhead of verifying data integrity, since that is guaranteed in this situation.
@@ -695,12 +763,12 @@ namespace libodb
             index->add_data_v(*(data + posA) + j);
         }
 
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
     }
 
     inline void BankIDS::populate(Index* index)
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         // Index over the whole datastore and add each item to the index.
         // Since we're a friend of Index, we have access to the add_data_v command which avoids the overhead of verifying data integrity, since that is guaranteed in this situation.
         // Last bucket needs to be handled specially.
@@ -715,7 +783,182 @@ namespace libodb
             index->add_data_v(*(reinterpret_cast<void**>(*(data + posA) + j)));
         }
 
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
+    }
+
+    /// Get the item stored at a location in a bank. Indirect datastores store a
+    ///pointer to the item instead of the item itself.
+#define BANK_ITEM(x, indirect) ((indirect) ? *reinterpret_cast<void**>(x) : reinterpret_cast<void*>(x))
+
+    inline void BankDS::query(Condition* condition, DataStore* ds)
+    {
+        query(condition, ds, false);
+    }
+
+    inline void BankIDS::query(Condition* condition, DataStore* ds)
+    {
+        BankDS::query(condition, ds, true);
+    }
+
+    void BankDS::query(Condition* condition, DataStore* ds, bool indirect)
+    {
+        rwlock->read_lock();
+
+        // The number of slots in use, deleted or not, across all of the banks.
+        uint64_t num_items = (posA / sizeof(char*)) * cap + posB / datalen;
+        bool parallel = ((scheduler != NULL) && (scheduler->get_num_threads() > 0) && (num_items >= PARALLEL_QUERY_MIN));
+
+        // A Predicate can be run over a whole bank at a time, as long as the items
+        // are stored in the bank. Indirect datastores only store pointers, so those
+        // fall back to testing one item at a time.
+        Predicate* predicate = (indirect ? NULL : dynamic_cast<Predicate*>(condition));
+
+        uint64_t limit;
+
+        if (!parallel)
+        {
+            // Without helpers there's nothing to gain from buffering, so results go
+            // straight into ds, bank by bank.
+            uint64_t words = PREDICATE_BITMAP_WORDS(cap);
+            uint64_t* bitmap = (predicate == NULL ? NULL : new uint64_t[words * (1 + predicate->scratch_bitmaps())]);
+            uint64_t bits;
+            char* start;
+            void* item;
+
+            for (uint64_t i = 0; i <= posA; i += sizeof(char*))
+            {
+                limit = ((i < posA) ? cap_size : posB);
+                start = *(data + i);
+
+                if (predicate != NULL)
+                {
+                    uint64_t n = limit / datalen;
+                    predicate->match(start, datalen, n, bitmap, bitmap + words);
+
+                    for (uint64_t w = 0; w < PREDICATE_BITMAP_WORDS(n); w++)
+                    {
+                        bits = bitmap[w];
+
+                        for (uint64_t b = 0; bits != 0; b++, bits >>= 1)
+                        {
+                            if (bits & 1)
+                            {
+                                ds->add_data(start + (w * 64 + b) * datalen);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    for (uint64_t j = 0; j < limit; j += datalen)
+                    {
+                        item = BANK_ITEM(start + j, indirect);
+
+                        if (condition->condition(item))
+                        {
+                            ds->add_data(item);
+                        }
+                    }
+                }
+            }
+
+            delete [] bitmap;
+            rwlock->read_unlock();
+            return;
+        }
+
+        // Banks are the natural unit to split on, but there may be fewer banks
+        // than threads, so cut the banks down further into
+        // runs of roughly equal size. Runs never cross into the next bank.
+        uint32_t num_parts = 4 * (scheduler->get_num_threads() + 1);
+        uint64_t run_size = MIN((num_items / num_parts + 1) * datalen, cap_size);
+
+        std::vector<void*> parts;
+        struct query_part* part;
+
+        // Last bucket needs to be handled specially.
+        for (uint64_t i = 0; i <= posA; i += sizeof(char*))
+        {
+            limit = ((i < posA) ? cap_size : posB);
+
+            for (uint64_t j = 0; j < limit; j += run_size)
+            {
+                SAFE_MALLOC(struct query_part*, part, sizeof(struct query_part));
+                part->condition = condition;
+                part->predicate = predicate;
+                part->start = *(data + i) + j;
+                part->nbytes = MIN(run_size, limit - j);
+                part->datalen = datalen;
+                part->indirect = indirect;
+                part->results = new std::vector<void*>();
+                parts.push_back(part);
+            }
+        }
+
+        scheduler->run_batch(query_part_workload, &parts[0], (uint32_t)parts.size());
+
+        // Merging the buffers in part order keeps the results in storage order.
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            part = (struct query_part*)parts[i];
+
+            for (size_t j = 0; j < part->results->size(); j++)
+            {
+                ds->add_data(part->results->at(j));
+            }
+
+            delete part->results;
+            free(part);
+        }
+
+        rwlock->read_unlock();
+    }
+
+    void* BankDS::query_part_workload(void* partV)
+    {
+        struct query_part* part = (struct query_part*)partV;
+
+        if (part->predicate != NULL)
+        {
+            uint64_t n = part->nbytes / part->datalen;
+            uint64_t words = PREDICATE_BITMAP_WORDS(n);
+            uint64_t* bitmap = new uint64_t[words * (1 + part->predicate->scratch_bitmaps())];
+            uint64_t bits;
+
+            part->predicate->match(part->start, part->datalen, n, bitmap, bitmap + words);
+
+            for (uint64_t w = 0; w < words; w++)
+            {
+                bits = bitmap[w];
+
+                // Selective predicates leave most words empty, so skip those whole.
+                for (uint64_t b = 0; bits != 0; b++, bits >>= 1)
+                {
+                    if (bits & 1)
+                    {
+                        part->results->push_back(part->start + (w * 64 + b) * part->datalen);
+                    }
+                }
+            }
+
+            delete [] bitmap;
+        }
+        else
+        {
+            void* item;
+
+            for (uint64_t j = 0; j < part->nbytes; j += part->datalen)
+            {
+                item = BANK_ITEM(part->start + j, part->indirect);
+
+                if (part->condition->condition(item))
+                {
+                    part->results->push_back(item);
+                }
+            }
+        }
+
+        return NULL;
     }
 
     inline DataStore* BankDS::clone()
@@ -724,15 +967,34 @@ namespace libodb
         return new BankDS(this, prune, datalen, flags, cap);
     }
 
-    inline DataStore* BankDS::clone_indirect()
+    inline DataStore* BankDS::clone_indirect(uint64_t hint)
     {
+        // Most results are nowhere near a full bank, and the first bank is allocated
+        // up front, so size the banks to what the caller expects.
+        uint64_t _cap = BANK_MIN_CAP;
+
+        while ((_cap < hint) && (_cap < cap))
+        {
+            _cap *= 2;
+        }
+
+        if (_cap > cap)
+        {
+            _cap = cap;
+        }
+
         // Return an indirect version of this datastore, with this datastore marked as its parent.
-        return new BankIDS(this, prune, flags, cap);
+        return new BankIDS(this, prune, flags, _cap);
+    }
+
+    uint64_t BankDS::mem_size()
+    {
+        return data_count * datalen;
     }
 
     Iterator* BankDS::it_first()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
 
         BankDSIterator* it = new BankDSIterator();
         it->dstore = this;
@@ -751,7 +1013,7 @@ namespace libodb
 
     Iterator* BankDS::it_last()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
 
         BankDSIterator* it = new BankDSIterator();
         it->dstore = this;
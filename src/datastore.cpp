@@ -27,20 +27,28 @@ namespace libodb
     DataStore::DataStore()
     {
         clones = new std::vector<ODB*>();
+        LOCK_INIT(clones_lock);
         data_count = 0;
         parent = NULL;
-        RWLOCK_INIT(rwlock);
+        scheduler = NULL;
+        rwlock = RWLock::create();
     }
 
     DataStore::~DataStore()
     {
+        ODB* clone;
+
+        // Take each one off before deleting it, since it would look for itself here
+        // otherwise.
         while (!clones->empty())
         {
-            delete clones->back();
+            clone = clones->back();
             clones->pop_back();
+            delete clone;
         }
         delete clones;
-        RWLOCK_DESTROY(rwlock);
+        LOCK_DESTROY(clones_lock);
+        delete rwlock;
     }
 
     inline void* DataStore::add_data(void* rawdata)
@@ -95,12 +103,16 @@ namespace libodb
     {
     }
 
+    inline void DataStore::query(Condition* condition, DataStore* ds)
+    {
+    }
+
     inline DataStore* DataStore::clone()
     {
         return NULL;
     }
 
-    inline DataStore* DataStore::clone_indirect()
+    inline DataStore* DataStore::clone_indirect(uint64_t hint)
     {
         return NULL;
     }
@@ -120,9 +132,16 @@ namespace libodb
         return data_count;
     }
 
+    uint64_t DataStore::mem_size()
+    {
+        return data_count * datalen;
+    }
+
     inline void DataStore::update_parent(ODB* odb)
     {
+        LOCK(parent->clones_lock);
         parent->clones->push_back(odb);
+        UNLOCK(parent->clones_lock);
     }
 
     inline Iterator* DataStore::it_first()
@@ -143,7 +162,7 @@ namespace libodb
             delete it;
         }
 
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
     }
 
 }
@@ -0,0 +1,234 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for implementation of epoch-based memory reclamation.
+/// @file epoch.cpp
+
+#include "epoch.hpp"
+
+#include <vector>
+
+#include "common.hpp"
+#include "lock.hpp"
+
+/// Number of slots readers are counted in. Threads past this many share slots.
+#define EPOCH_SLOTS 64
+
+/// Number of retirements between attempts to free what has been retired.
+#define EPOCH_RECLAIM_BATCH 64
+
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define EPOCH_CAS64(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define EPOCH_ADD64(p, v) __sync_add_and_fetch((p), (v))
+#elif defined(WIN32)
+#define EPOCH_CAS64(p, o, n) (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(n), (LONG64)(o)) == (LONG64)(o))
+#define EPOCH_ADD64(p, v) InterlockedAdd64((volatile LONG64*)(p), (v))
+#elif (CMAKE_COMPILER_SUITE_SUN)
+#include <atomic.h>
+#define EPOCH_CAS64(p, o, n) (atomic_cas_64((volatile uint64_t*)(p), (uint64_t)(o), (uint64_t)(n)) == (uint64_t)(o))
+#define EPOCH_ADD64(p, v) atomic_add_64_nv((volatile uint64_t*)(p), (v))
+#else
+#error "Can't find a way to atomically compare-and-swap for the EpochReclaimer."
+#endif
+
+namespace libodb
+{
+    /// A slot readers are counted in, padded out to a cache line of its own.
+    ///Readers are counted by the parity of the epoch they entered in, which is
+    ///enough since the epoch can't move on while anyone is still in the one
+    ///before it.
+    struct epoch_slot
+    {
+        volatile uint64_t count[2];
+        char pad[48];
+    };
+
+    struct epoch_retired
+    {
+        void* p;
+        void (*freep)(void*);
+        uint64_t epoch;
+    };
+
+    static volatile uint64_t global_epoch = 2;
+    static struct epoch_slot slots[EPOCH_SLOTS];
+    static volatile uint32_t next_slot = 0;
+    static SEQ_THREAD_LOCAL uint32_t thread_slot = 0;
+
+    // The retired list is touched only by writers, and rarely, so a plain lock
+    // will do. It is created on first use, since there's no telling what order
+    // the library's statics are set up in.
+    static void* retired_lock = NULL;
+    static std::vector<struct epoch_retired>* retired = NULL;
+    static uint64_t retired_since = 0;
+
+    static void epoch_init()
+    {
+        static volatile uint64_t initialized = 0;
+
+        if (initialized != 2)
+        {
+            if (EPOCH_CAS64(&initialized, (uint64_t)0, (uint64_t)1))
+            {
+                LOCK_INIT(retired_lock);
+                retired = new std::vector<struct epoch_retired>();
+                SEQ_BARRIER();
+                initialized = 2;
+            }
+            else
+            {
+                while (initialized != 2)
+                {
+                    SEQ_YIELD();
+                }
+            }
+        }
+    }
+
+    static inline struct epoch_slot* epoch_thread_slot()
+    {
+        // Slots are numbered from one here, so that zero means this thread hasn't
+        // got one yet.
+        if (thread_slot == 0)
+        {
+            thread_slot = (SEQ_ATOMIC_INC(next_slot) % EPOCH_SLOTS) + 1;
+        }
+
+        return &(slots[thread_slot - 1]);
+    }
+
+    uint64_t EpochReclaimer::enter()
+    {
+        struct epoch_slot* slot = epoch_thread_slot();
+        uint64_t e;
+
+        // Being counted has to be visible before anything is read, and the epoch
+        // can't have moved on in between, or the writer advancing it might not
+        // have seen us.
+        while (true)
+        {
+            e = global_epoch;
+            EPOCH_ADD64(&(slot->count[e & 1]), 1);
+
+            if (global_epoch == e)
+            {
+                return e;
+            }
+
+            EPOCH_ADD64(&(slot->count[e & 1]), -1);
+        }
+    }
+
+    void EpochReclaimer::exit(uint64_t epoch)
+    {
+        EPOCH_ADD64(&(epoch_thread_slot()->count[epoch & 1]), -1);
+    }
+
+    uint64_t EpochReclaimer::get_epoch()
+    {
+        SEQ_BARRIER();
+        return global_epoch;
+    }
+
+    bool EpochReclaimer::is_safe(uint64_t epoch)
+    {
+        // Anything let go in an epoch may be seen by readers in it and in the one
+        // before it, and they're all gone once the epoch has moved on twice.
+        if (global_epoch >= epoch + 2)
+        {
+            return true;
+        }
+
+        advance();
+        return (global_epoch >= epoch + 2);
+    }
+
+    bool EpochReclaimer::advance()
+    {
+        uint64_t e = global_epoch;
+
+        SEQ_BARRIER();
+
+        // Readers of the epoch before this one are counted under the same parity
+        // as the next one.
+        for (uint32_t i = 0; i < EPOCH_SLOTS; i++)
+        {
+            if (slots[i].count[(e + 1) & 1] != 0)
+            {
+                return false;
+            }
+        }
+
+        return EPOCH_CAS64(&global_epoch, e, e + 1);
+    }
+
+    void EpochReclaimer::retire(void* p, void (*freep)(void*))
+    {
+        epoch_init();
+
+        struct epoch_retired r;
+        r.p = p;
+        r.freep = freep;
+        r.epoch = get_epoch();
+
+        LOCK(retired_lock);
+        retired->push_back(r);
+        bool due = ((++retired_since) >= EPOCH_RECLAIM_BATCH);
+        UNLOCK(retired_lock);
+
+        if (due)
+        {
+            reclaim();
+        }
+    }
+
+    void EpochReclaimer::reclaim()
+    {
+        epoch_init();
+
+        std::vector<struct epoch_retired> ready;
+
+        advance();
+
+        LOCK(retired_lock);
+        retired_since = 0;
+
+        // Items go on in epoch order, so the safe ones are all at the front.
+        size_t n = 0;
+        while ((n < retired->size()) && is_safe(retired->at(n).epoch))
+        {
+            n++;
+        }
+
+        ready.assign(retired->begin(), retired->begin() + n);
+        retired->erase(retired->begin(), retired->begin() + n);
+        UNLOCK(retired_lock);
+
+        // Free outside the lock, in case freeing retires anything else.
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            ready[i].freep(ready[i].p);
+        }
+    }
+
+    void EpochReclaimer::synchronize()
+    {
+        uint64_t e = get_epoch();
+
+        while (!is_safe(e))
+        {
+            SEQ_YIELD();
+        }
+
+        reclaim();
+    }
+}
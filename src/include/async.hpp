@@ -0,0 +1,385 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for the coroutine layer over the Scheduler.
+/// @file async.hpp
+
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+// The library itself doesn't need coroutines, so this is all header-only, and only
+// there for code that is compiled with them turned on (C++20, or -fcoroutines).
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <stdint.h>
+
+#include "scheduler.hpp"
+#include "odb.hpp"
+
+namespace libodb
+{
+
+    /// Resume a coroutine from inside a workload, so that it runs on a worker.
+    inline void* async_resume_workload(void* handle)
+    {
+        std::coroutine_handle<>::from_address(handle).resume();
+        return NULL;
+    }
+
+    /// A coroutine that produces a void*, the same as a workload does. It starts
+    /// running as soon as it's called, on the calling thread, and carries on from
+    /// wherever it's resumed after each co_await.
+    class Task
+    {
+    public:
+        struct promise_type
+        {
+            //! What the coroutine has got to: still running, done, abandoned by
+            //! its Task, or the address of the coroutine awaiting it.
+            std::atomic<uintptr_t> state;
+            void* result;
+
+            promise_type() : state(TASK_RUNNING), result(NULL)
+            {
+            }
+
+            Task get_return_object()
+            {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_never initial_suspend()
+            {
+                return std::suspend_never();
+            }
+
+            struct final_awaiter
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                // Hand the thread straight to whoever is waiting on the result,
+                // without going back through the scheduler.
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                {
+                    uintptr_t old = h.promise().state.exchange(TASK_DONE, std::memory_order_acq_rel);
+
+                    if (old == TASK_DETACHED)
+                    {
+                        h.destroy();
+                    }
+                    else if (old != TASK_RUNNING)
+                    {
+                        return std::coroutine_handle<>::from_address((void*)old);
+                    }
+
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+
+            final_awaiter final_suspend() noexcept
+            {
+                return final_awaiter();
+            }
+
+            void return_value(void* v)
+            {
+                result = v;
+            }
+
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+
+        Task(Task&& other) : handle(other.handle)
+        {
+            other.handle = std::coroutine_handle<promise_type>();
+        }
+
+        /// A Task that goes away before its coroutine is done leaves the coroutine to
+        /// clean up after itself, so fire-and-forget requests don't need to be kept.
+        ~Task()
+        {
+            if (handle && (handle.promise().state.exchange(TASK_DETACHED, std::memory_order_acq_rel) == TASK_DONE))
+            {
+                handle.destroy();
+            }
+        }
+
+        bool ready()
+        {
+            return (handle.promise().state.load(std::memory_order_acquire) == TASK_DONE);
+        }
+
+        /// Block the calling thread until the coroutine is done. This is for the
+        /// code at the edge that isn't a coroutine itself, and needs the scheduler
+        /// to have worker threads if the coroutine ever waits on it.
+        void* wait()
+        {
+            while (!ready())
+            {
+                std::this_thread::yield();
+            }
+
+            return handle.promise().result;
+        }
+
+        bool await_ready()
+        {
+            return ready();
+        }
+
+        // If the coroutine finished between await_ready() and here, just carry on.
+        bool await_suspend(std::coroutine_handle<> awaiting)
+        {
+            uintptr_t expected = TASK_RUNNING;
+            return handle.promise().state.compare_exchange_strong(expected, (uintptr_t)(awaiting.address()), std::memory_order_acq_rel);
+        }
+
+        void* await_resume()
+        {
+            return handle.promise().result;
+        }
+
+    private:
+        static const uintptr_t TASK_RUNNING = 0;
+        static const uintptr_t TASK_DONE = 1;
+        static const uintptr_t TASK_DETACHED = 2;
+
+        explicit Task(std::coroutine_handle<promise_type> h) : handle(h)
+        {
+        }
+
+        Task(const Task&);
+        Task& operator=(const Task&);
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    /// Awaiting this moves the coroutine onto a Scheduler worker. With a class ID,
+    ///the rest of the coroutine, up to its next co_await, runs as a workload in
+    ///that interference class.
+    class ScheduleAwaiter
+    {
+    public:
+        ScheduleAwaiter(Scheduler* _scheduler, uint64_t _class_id, bool _classed, uint32_t _flags)
+            : scheduler(_scheduler), class_id(_class_id), classed(_classed), flags(_flags)
+        {
+        }
+
+        bool await_ready()
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            if (classed)
+            {
+                scheduler->add_work(async_resume_workload, h.address(), NULL, class_id, flags);
+            }
+            else
+            {
+                scheduler->add_work(async_resume_workload, h.address(), NULL, flags);
+            }
+        }
+
+        void await_resume()
+        {
+        }
+
+    private:
+        Scheduler* scheduler;
+        uint64_t class_id;
+        bool classed;
+        uint32_t flags;
+    };
+
+    inline ScheduleAwaiter schedule(Scheduler* scheduler, uint32_t flags = Scheduler::NONE)
+    {
+        return ScheduleAwaiter(scheduler, 0, false, flags);
+    }
+
+    // The classed forms have names of their own, since a class ID passed where the
+    // flags go would otherwise convert quietly and be taken for them.
+    inline ScheduleAwaiter schedule_class(Scheduler* scheduler, uint64_t class_id, uint32_t flags = Scheduler::NONE)
+    {
+        return ScheduleAwaiter(scheduler, class_id, true, flags);
+    }
+
+    /// Runs a function as a workload, and resumes the coroutine on the same worker
+    ///once it returns, with its return value as the result of the co_await.
+    class AsyncAwaiter
+    {
+    public:
+        AsyncAwaiter(Scheduler* _scheduler, void* (*_func)(void*), void* _args, uint64_t _class_id, bool _classed, uint32_t _flags)
+            : scheduler(_scheduler), func(_func), args(_args), class_id(_class_id), classed(_classed), flags(_flags), result(NULL)
+        {
+        }
+
+        // Without a scheduler there's nothing to wait on, so just do it here.
+        bool await_ready()
+        {
+            if (scheduler == NULL)
+            {
+                result = func(args);
+                return true;
+            }
+
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+
+            if (classed)
+            {
+                scheduler->add_work(workload, this, NULL, class_id, flags);
+            }
+            else
+            {
+                scheduler->add_work(workload, this, NULL, flags);
+            }
+        }
+
+        void* await_resume()
+        {
+            return result;
+        }
+
+    private:
+        // The awaiter lives in the coroutine's frame, so nothing can touch it once the
+        // coroutine has been resumed.
+        static void* workload(void* v)
+        {
+            AsyncAwaiter* a = (AsyncAwaiter*)v;
+            a->result = a->func(a->args);
+            a->handle.resume();
+            return NULL;
+        }
+
+        Scheduler* scheduler;
+        void* (*func)(void*);
+        void* args;
+        uint64_t class_id;
+        bool classed;
+        uint32_t flags;
+        void* result;
+        std::coroutine_handle<> handle;
+    };
+
+    inline AsyncAwaiter async(Scheduler* scheduler, void* (*func)(void*), void* args, uint32_t flags = Scheduler::NONE)
+    {
+        return AsyncAwaiter(scheduler, func, args, 0, false, flags);
+    }
+
+    inline AsyncAwaiter async_class(Scheduler* scheduler, void* (*func)(void*), void* args, uint64_t class_id, uint32_t flags = Scheduler::NONE)
+    {
+        return AsyncAwaiter(scheduler, func, args, class_id, true, flags);
+    }
+
+    /// Runs ODB::query() on the ODB's scheduler, and resumes the coroutine with the
+    ///results. An ODB without a scheduler runs the query on the spot.
+    class QueryAwaiter
+    {
+    public:
+        QueryAwaiter(ODB* _odb, Condition* _condition, bool (*_condition_f)(void*))
+            : odb(_odb), condition(_condition), condition_f(_condition_f),
+              inner(_odb->get_scheduler(), workload, this, 0, false, Scheduler::READ_ONLY)
+        {
+        }
+
+        bool await_ready()
+        {
+            return inner.await_ready();
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            inner.await_suspend(h);
+        }
+
+        ODB* await_resume()
+        {
+            return (ODB*)(inner.await_resume());
+        }
+
+    private:
+        static void* workload(void* v)
+        {
+            QueryAwaiter* a = (QueryAwaiter*)v;
+            return ((a->condition != NULL) ? a->odb->query(a->condition) : a->odb->query(a->condition_f));
+        }
+
+        QueryAwaiter(const QueryAwaiter&);
+
+        ODB* odb;
+        Condition* condition;
+        bool (*condition_f)(void*);
+        AsyncAwaiter inner;
+    };
+
+    inline QueryAwaiter query_async(ODB* odb, bool (*condition)(void*))
+    {
+        return QueryAwaiter(odb, NULL, condition);
+    }
+
+    inline QueryAwaiter query_async(ODB* odb, Condition* condition)
+    {
+        return QueryAwaiter(odb, condition, NULL);
+    }
+}
+
+#endif
+
+#endif
+
+/// @class Task
+/// The return type of a coroutine that uses the Scheduler. A handler written as a
+///Task can co_await schedule(), schedule_class(), async(), async_class(),
+///query_async(), and other Tasks, and each of those suspends it, instead of
+///blocking a thread, until it can go on. Each resumption happens on a Scheduler
+///worker, so a handful of workers can carry any number of multi-step requests
+///that are in flight.
+
+/// @fn Task::wait()
+/// Blocks the calling thread until the coroutine has returned.
+/// @return The value the coroutine returned with co_return.
+
+/// @fn schedule_class(Scheduler* scheduler, uint64_t class_id, uint32_t flags = Scheduler::NONE)
+/// Suspend the coroutine and resume it as a workload in the given interference
+///class, so that it is ordered against the rest of the work in that class.
+/// @param [in] scheduler Scheduler to resume on.
+/// @param [in] class_id Interference class to resume in.
+/// @param [in] flags Flags for the workload that resumes the coroutine.
+
+/// @fn async_class(Scheduler* scheduler, void* (*func)(void*), void* args, uint64_t class_id, uint32_t flags = Scheduler::NONE)
+/// Suspend the coroutine while func runs as a workload in the given interference
+///class, and resume it with func's return value.
+
+/// @fn query_async(ODB* odb, bool (*condition)(void*))
+/// Suspend the coroutine while the query runs as a READ_ONLY workload.
+/// @return When awaited, a new ODB holding the results of the query.
+/// @see ODB::query
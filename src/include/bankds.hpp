@@ -19,12 +19,18 @@
 #include "dll.hpp"
 
 #include <stack>
+#include <deque>
+#include <utility>
 
 #include "datastore.hpp"
 #include "iterator.hpp"
 
+/// Smallest bank, in rows, given to an indirect datastore sized by a hint.
+#define BANK_MIN_CAP 64
+
 namespace libodb
 {
+    class Predicate;
 
     class LIBODB_API BankDS : public DataStore
     {
@@ -54,7 +60,24 @@ namespace libodb
         virtual void purge(void(*freep)(void*));
         virtual void populate(Index* index);
         virtual DataStore* clone();
-        virtual DataStore* clone_indirect();
+        virtual DataStore* clone_indirect(uint64_t hint);
+        virtual uint64_t mem_size();
+
+        /// A run of a single bank for a parallel query to scan on one thread.
+        struct query_part
+        {
+            Condition* condition;
+            Predicate* predicate;
+            char* start;
+            uint64_t nbytes;
+            uint64_t datalen;
+            bool indirect;
+            std::vector<void*>* results;
+        };
+
+        virtual void query(Condition* condition, DataStore* ds);
+        void query(Condition* condition, DataStore* ds, bool indirect);
+        static void* query_part_workload(void* partV);
 
         Iterator* it_first();
         Iterator* it_last();
@@ -67,6 +90,27 @@ namespace libodb
         uint64_t cap_size;
         uint64_t datalen;
         std::stack<void*>* deleted;
+
+        /// Version counter for get_at(), which doesn't take the lock. Writers bump it
+        ///around every change to the list of buckets, so it is odd while one is in
+        ///progress.
+        volatile uint64_t version;
+
+        /// Lists of buckets that have been outgrown. Readers that skip the lock may
+        ///still be reading them, so they are kept until the datastore is destroyed.
+        ///Each list is half the size of the next, so together they never take up
+        ///more room than the current one.
+        std::vector<char**>* old_lists;
+
+        /// Locations that have been removed, with the epoch they were removed in.
+        ///Readers without the lock may still be looking at them, so they only move
+        ///on to the deleted stack, to be reused, once the EpochReclaimer says
+        ///those readers are gone.
+        std::deque<std::pair<uint64_t, void*> >* vacated;
+
+        /// Mark a location as removed, to be reused once it is safe to.
+        /// @param[in] addr The location.
+        void vacate(void* addr);
     };
 
     class LIBODB_API BankIDS : public BankDS
@@ -91,6 +135,7 @@ namespace libodb
         virtual std::vector<void*>** remove_sweep(Archive* archive);
         virtual void remove_cleanup(std::vector<void*>** marked);
         virtual void populate(Index* index);
+        virtual void query(Condition* condition, DataStore* ds);
     };
 
     class LIBODB_API BankDSIterator : public Iterator
@@ -185,6 +230,8 @@ namespace libodb
 ///location.
 /// Since BankDS is a locally contiguous data structure, it is possible to
 ///index into it.
+/// This reads the list of buckets optimistically, without the lock, and only
+///falls back to the read lock if writers keep changing the list underneath it.
 /// @param [in] index A value indicating where to look into the datastore.
 /// @return Returns a pointer to the desired data.
 
@@ -228,8 +275,12 @@ namespace libodb
 /// @return A pointer to an indirect datastore (an instance of BankDS) that
 ///references back to this instance of BankDS as its parent.
 
-/// @fn DataStore* BankDS::clone_indirect()
+/// @fn DataStore* BankDS::clone_indirect(uint64_t hint)
 /// Clone the datastore and return an indirect version.
+/// @param[in] hint How many rows the indirect version is expected to hold. Its
+///banks are sized to the next power of two up from that, between BANK_MIN_CAP
+///and this datastore's bank size, so a small result doesn't pay for a whole
+///bank up front and a large one still gets big banks.
 /// @return A pointer to an indirect datastore (an instance of BankIDS) that
 ///references back to this instance of BankDS as its parent.
 
@@ -51,6 +51,305 @@ namespace libodb
         bool(*c)(void*);
     };
 
+    /// Match bitmaps hold one bit per item, 64 items to a word, with item i in
+    ///bit (i % 64) of word (i / 64).
+#define PREDICATE_BITMAP_WORDS(n) (((n) + 63) / 64)
+
+    /// @class Predicate
+    /// A Condition described by what it tests, rather than by a function.
+    ///
+    /// Because a Predicate knows where in an item it looks and what it compares
+    ///against, a datastore that keeps its items contiguous (BankDS) can hand it a
+    ///whole run of items through match() and get a bitmap back, instead of making
+    ///a virtual call per item. Predicates can still be used anywhere a Condition
+    ///can, in which case they are evaluated one item at a time.
+    class LIBODB_API Predicate : public Condition
+    {
+    public:
+        /// Comparison against the constant(s) given at construction time. RANGE
+        ///passes values v where low <= v < high.
+        typedef enum { EQ, NE, LT, LE, GT, GE, RANGE } PredicateOp;
+
+        virtual ~Predicate()
+        {
+        }
+
+        /// Test a run of items.
+        /// @param[in] base Address of the first item.
+        /// @param[in] stride Number of bytes from the start of one item to the next.
+        /// @param[in] n Number of items in the run.
+        /// @param[out] bitmap PREDICATE_BITMAP_WORDS(n) words, which have the bit
+        ///for each passing item set and all other bits cleared.
+        /// @param[in] scratch Room for scratch_bitmaps() more bitmaps of the same
+        ///size, for combinations to hold their children's results in. Its
+        ///contents are overwritten.
+        virtual void match(char* base, uint64_t stride, uint64_t n, uint64_t* bitmap, uint64_t* scratch) = 0;
+
+        /// @return How many bitmaps of scratch space match() needs, besides the
+        ///one it fills in.
+        virtual uint32_t scratch_bitmaps() = 0;
+    };
+
+    template <typename T, int OP> inline bool predicate_test(T v, T low, T high)
+    {
+        // OP is a constant, so this collapses down to the single comparison.
+        switch (OP)
+        {
+        case Predicate::EQ:
+            return (v == low);
+        case Predicate::NE:
+            return (v != low);
+        case Predicate::LT:
+            return (v < low);
+        case Predicate::LE:
+            return (v <= low);
+        case Predicate::GT:
+            return (v > low);
+        case Predicate::GE:
+            return (v >= low);
+        default:
+            return ((v >= low) & (v < high));
+        }
+    }
+
+    /// Scalar batch kernel. The inner loop is branch-free so that the compiler
+    ///can vectorize it for whatever instruction set it is built for.
+    template <typename T, int OP> inline void predicate_kernel(char* base, uint64_t stride, uint64_t n, T low, T high, uint64_t* bitmap)
+    {
+        T v;
+
+        for (uint64_t w = 0; w < n; w += 64)
+        {
+            uint64_t m = (((n - w) < 64) ? (n - w) : 64);
+            uint64_t bits = 0;
+            char* p = base + w * stride;
+
+            for (uint64_t i = 0; i < m; i++)
+            {
+                memcpy(&v, p, sizeof(T));
+                bits |= (static_cast<uint64_t>(predicate_test<T, OP>(v, low, high)) << i);
+                p += stride;
+            }
+
+            bitmap[w / 64] = bits;
+        }
+    }
+
+    // The library is built for a baseline target, so an AVX2 build of the same
+    // kernel is kept alongside it and picked at runtime when the CPU has it.
+#if (CMAKE_COMPILER_SUITE_GCC) && (defined(__x86_64__) || defined(__i386__)) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define PREDICATE_AVX2_DISPATCH
+
+    template <typename T, int OP> __attribute__((target("avx2"))) void predicate_kernel_avx2(char* base, uint64_t stride, uint64_t n, T low, T high, uint64_t* bitmap)
+    {
+        predicate_kernel<T, OP>(base, stride, n, low, high, bitmap);
+    }
+
+    inline int& predicate_avx2_state()
+    {
+        static int have = -1;
+        return have;
+    }
+
+    inline bool predicate_have_avx2()
+    {
+        int& have = predicate_avx2_state();
+
+        if (have < 0)
+        {
+            __builtin_cpu_init();
+            have = (__builtin_cpu_supports("avx2") ? 1 : 0);
+        }
+
+        return (have == 1);
+    }
+#endif
+
+    /// Turn the AVX2 kernels off, or back on if the CPU has them. The scalar
+    ///kernels are otherwise never run on a machine with AVX2, so this is mostly
+    ///for testing them.
+    inline void predicate_set_avx2(bool enable)
+    {
+#ifdef PREDICATE_AVX2_DISPATCH
+        predicate_avx2_state() = (enable ? -1 : 0);
+#endif
+    }
+
+    template <typename T, int OP> inline void predicate_dispatch(char* base, uint64_t stride, uint64_t n, T low, T high, uint64_t* bitmap)
+    {
+#ifdef PREDICATE_AVX2_DISPATCH
+        if (predicate_have_avx2())
+        {
+            predicate_kernel_avx2<T, OP>(base, stride, n, low, high, bitmap);
+            return;
+        }
+#endif
+        predicate_kernel<T, OP>(base, stride, n, low, high, bitmap);
+    }
+
+    /// @class PredicateField
+    /// Compare a field of type T, at a fixed byte offset into each item, against
+    ///a constant (or a pair of constants for RANGE).
+    template <typename T> class PredicateField : public Predicate
+    {
+    public:
+        PredicateField(uint32_t _offset, PredicateOp _op, T _low, T _high = T())
+        {
+            this->offset = _offset;
+            this->op = _op;
+            this->low = _low;
+            this->high = _high;
+        }
+
+        virtual inline bool condition(void* a)
+        {
+            T v;
+            memcpy(&v, reinterpret_cast<char*>(a) + offset, sizeof(T));
+
+            switch (op)
+            {
+            case EQ:
+                return predicate_test<T, EQ>(v, low, high);
+            case NE:
+                return predicate_test<T, NE>(v, low, high);
+            case LT:
+                return predicate_test<T, LT>(v, low, high);
+            case LE:
+                return predicate_test<T, LE>(v, low, high);
+            case GT:
+                return predicate_test<T, GT>(v, low, high);
+            case GE:
+                return predicate_test<T, GE>(v, low, high);
+            default:
+                return predicate_test<T, RANGE>(v, low, high);
+            }
+        }
+
+        virtual void match(char* base, uint64_t stride, uint64_t n, uint64_t* bitmap, uint64_t* scratch)
+        {
+            base += offset;
+
+            switch (op)
+            {
+            case EQ:
+                predicate_dispatch<T, EQ>(base, stride, n, low, high, bitmap);
+                break;
+            case NE:
+                predicate_dispatch<T, NE>(base, stride, n, low, high, bitmap);
+                break;
+            case LT:
+                predicate_dispatch<T, LT>(base, stride, n, low, high, bitmap);
+                break;
+            case LE:
+                predicate_dispatch<T, LE>(base, stride, n, low, high, bitmap);
+                break;
+            case GT:
+                predicate_dispatch<T, GT>(base, stride, n, low, high, bitmap);
+                break;
+            case GE:
+                predicate_dispatch<T, GE>(base, stride, n, low, high, bitmap);
+                break;
+            default:
+                predicate_dispatch<T, RANGE>(base, stride, n, low, high, bitmap);
+            }
+        }
+
+        virtual uint32_t scratch_bitmaps()
+        {
+            return 0;
+        }
+
+    private:
+        uint32_t offset;
+        PredicateOp op;
+        T low;
+        T high;
+    };
+
+    /// @class PredicateAnd
+    /// Passes items that pass both of its children. The children are not owned.
+    class LIBODB_API PredicateAnd : public Predicate
+    {
+    public:
+        PredicateAnd(Predicate* _a, Predicate* _b)
+        {
+            this->a = _a;
+            this->b = _b;
+        }
+
+        virtual inline bool condition(void* x)
+        {
+            return (a->condition(x) && b->condition(x));
+        }
+
+        virtual void match(char* base, uint64_t stride, uint64_t n, uint64_t* bitmap, uint64_t* scratch)
+        {
+            uint64_t words = PREDICATE_BITMAP_WORDS(n);
+
+            // b's result goes in the first scratch bitmap, and b works in the rest.
+            a->match(base, stride, n, bitmap, scratch);
+            b->match(base, stride, n, scratch, scratch + words);
+
+            for (uint64_t i = 0; i < words; i++)
+            {
+                bitmap[i] &= scratch[i];
+            }
+        }
+
+        virtual uint32_t scratch_bitmaps()
+        {
+            uint32_t sa = a->scratch_bitmaps();
+            uint32_t sb = b->scratch_bitmaps() + 1;
+            return ((sa > sb) ? sa : sb);
+        }
+
+    private:
+        Predicate* a;
+        Predicate* b;
+    };
+
+    /// @class PredicateOr
+    /// Passes items that pass either of its children. The children are not owned.
+    class LIBODB_API PredicateOr : public Predicate
+    {
+    public:
+        PredicateOr(Predicate* _a, Predicate* _b)
+        {
+            this->a = _a;
+            this->b = _b;
+        }
+
+        virtual inline bool condition(void* x)
+        {
+            return (a->condition(x) || b->condition(x));
+        }
+
+        virtual void match(char* base, uint64_t stride, uint64_t n, uint64_t* bitmap, uint64_t* scratch)
+        {
+            uint64_t words = PREDICATE_BITMAP_WORDS(n);
+
+            // b's result goes in the first scratch bitmap, and b works in the rest.
+            a->match(base, stride, n, bitmap, scratch);
+            b->match(base, stride, n, scratch, scratch + words);
+
+            for (uint64_t i = 0; i < words; i++)
+            {
+                bitmap[i] |= scratch[i];
+            }
+        }
+
+        virtual uint32_t scratch_bitmaps()
+        {
+            uint32_t sa = a->scratch_bitmaps();
+            uint32_t sb = b->scratch_bitmaps() + 1;
+            return ((sa > sb) ? sa : sb);
+        }
+
+    private:
+        Predicate* a;
+        Predicate* b;
+    };
+
     class LIBODB_API Pruner
     {
     public:
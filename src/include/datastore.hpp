@@ -17,6 +17,7 @@
 #define DATASTORE_HPP
 
 #include "dll.hpp"
+#include "rwlock.hpp"
 
 #include <vector>
 #include <stdint.h>
@@ -29,6 +30,8 @@ namespace libodb
     class Index;
     class Archive;
     class Iterator;
+    class Condition;
+    class Scheduler;
 
     class LIBODB_API DataStore
     {
@@ -37,8 +40,12 @@ namespace libodb
         friend class Index;
         friend class LinkedListI;
         friend class RedBlackTreeI;
+        friend class SkipListI;
+        friend class BankDS;
         friend class BankIDS;
+        friend class LinkedListDS;
         friend class LinkedListIDS;
+        friend class Snapshot;
 
     public:
         typedef enum { NONE = 0, TIME_STAMP = 1, QUERY_COUNT = 2 } DataStoreFlags;
@@ -63,8 +70,15 @@ namespace libodb
         virtual void remove_cleanup(std::vector<void*>** marked);
         virtual void purge(void(*freep)(void*));
         virtual void populate(Index* index);
+
+        /// Perform a general query over every item in the datastore.
+        /// @param[in] condition Condition that items must pass to be included.
+        /// @param[in] ds A pointer to a datastore that will be filled with the
+        ///results of the query.
+        virtual void query(Condition* condition, DataStore* ds);
+
         virtual DataStore* clone();
-        virtual DataStore* clone_indirect();
+        virtual DataStore* clone_indirect(uint64_t hint);
         virtual bool(*get_prune())(void*);
         virtual void set_prune(bool(*prune)(void*));
         virtual void update_parent(ODB* odb);
@@ -77,8 +91,17 @@ namespace libodb
         /// @return The number of items in this datastore.
         virtual uint64_t size();
 
+        /// Get roughly how much memory the datastore's rows take up.
+        /// @return The number of bytes held by rows that haven't been swept,
+        ///counting per-row overhead but not allocations kept for reuse.
+        virtual uint64_t mem_size();
+
         DataStore* parent;
         std::vector<ODB*>* clones;
+
+        //! Opaque pointer to the lock guarding the list of clones, which queries
+        //! add to while the owning ODB may be reading it.
+        void* clones_lock;
         bool(*prune)(void* rawdata);
         uint64_t datalen;
         uint64_t true_datalen;
@@ -90,10 +113,12 @@ namespace libodb
         /// The number of items in this datastore.
         uint64_t data_count;
 
-        //! Opaque pointer to a read-write lock.
-        //! This is opaque because it allows us to abstract in the
-        //! implementation as opposed to the header.
-        void* rwlock;
+        /// Scheduler, shared with the owning ODB, that full scans are split
+        ///across. NULL if the scan should run on the calling thread.
+        Scheduler* scheduler;
+
+        //! The read-write lock, whose kind the owning ODB can choose.
+        RWLock* rwlock;
     };
 
 }
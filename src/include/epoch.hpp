@@ -0,0 +1,91 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for epoch-based memory reclamation.
+/// @file epoch.hpp
+
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include "dll.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace libodb
+{
+
+    class LIBODB_API EpochReclaimer
+    {
+    public:
+        static uint64_t enter();
+        static void exit(uint64_t epoch);
+
+        static void retire(void* p, void (*freep)(void*) = free);
+        static uint64_t get_epoch();
+        static bool is_safe(uint64_t epoch);
+        static void reclaim();
+        static void synchronize();
+
+    private:
+        static bool advance();
+    };
+
+}
+
+#endif
+
+/// @class EpochReclaimer
+/// Process-wide epoch-based reclamation, for memory that readers without a lock
+///may still be looking at when a writer unlinks it.
+///
+/// Readers bracket the time they hold such pointers with enter() and exit().
+///Writers, once they have unlinked something, hand it to retire() instead of
+///freeing it, and it is freed once every reader that could have seen it has
+///left. Nothing is waited for on the write side; the epoch moves on, and the
+///retired memory is freed, whenever nobody is still in the epoch before it.
+///
+/// Readers are counted in a fixed set of slots, and threads past that many
+///share them, so any number of threads can take part. A reader must not block
+///on a lock while it is in an epoch, since the writer holding the lock may be
+///waiting in synchronize().
+
+/// @fn uint64_t EpochReclaimer::enter()
+/// Start a read-side critical section. These nest.
+/// @return The epoch entered, to be passed to exit().
+
+/// @fn void EpochReclaimer::exit(uint64_t epoch)
+/// End a read-side critical section.
+/// @param [in] epoch The value returned by the matching enter().
+
+/// @fn void EpochReclaimer::retire(void* p, void (*freep)(void*) = free)
+/// Free something once no reader can be looking at it. It must already be
+///unreachable for readers that enter from now on.
+/// @param [in] p Memory to free.
+/// @param [in] freep Function to free it with.
+
+/// @fn uint64_t EpochReclaimer::get_epoch()
+/// @return The current epoch. Things that are reused rather than freed can be
+///tagged with this when they are let go, and reused once is_safe() says so.
+
+/// @fn bool EpochReclaimer::is_safe(uint64_t epoch)
+/// @param [in] epoch An epoch returned by get_epoch().
+/// @return Whether every reader that was in an epoch at or before that one has
+///left it.
+
+/// @fn void EpochReclaimer::reclaim()
+/// Move the epoch on if possible, and free whatever retired memory is safe to.
+///retire() calls this every so often, so it rarely needs calling directly.
+
+/// @fn void EpochReclaimer::synchronize()
+/// Wait until everything retired so far has been freed. This must not be called
+///from inside a read-side critical section.
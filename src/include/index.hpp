@@ -17,8 +17,11 @@
 #define INDEX_HPP
 
 #include "dll.hpp"
+#include "rwlock.hpp"
 
 #include <vector>
+#include <utility>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace libodb
@@ -61,6 +64,10 @@ namespace libodb
         /// Requires ability to create and manipulate DataObj.
         friend class LLIterator;
 
+        /// Requires ability to create and manipulate DataObj.
+        friend class SkipListI;
+        friend class SLIterator;
+
         friend class BankDS;
         friend class BankDSIterator;
 
@@ -130,7 +137,7 @@ namespace libodb
         virtual void query_gt(void* rawdata, DataStore* ds);
         virtual std::vector<Index*>* flatten(std::vector<Index*>* list);
 
-        void* rwlock;
+        RWLock* rwlock;
 
     private:
         std::vector<IndexGroup*>* indices;
@@ -163,9 +170,15 @@ namespace libodb
         /// and won't fit into a normal function pointer.
         friend void* add_data_v_wrapper(void* args);
 
+        /// Allows a Snapshot to run queries into its own results.
+        friend class Snapshot;
+
     public:
+        virtual ~Index();
+
         virtual void add_data(DataObj* data);
         virtual uint64_t size();
+        virtual uint64_t mem_size();
         virtual uint64_t luid();
         virtual bool remove(DataObj* data);
         virtual ODB* query(bool(*condition)(void*));
@@ -173,12 +186,27 @@ namespace libodb
         virtual ODB* query_eq(void* rawdata);
         virtual ODB* query_lt(void* rawdata);
         virtual ODB* query_gt(void* rawdata);
+        std::vector<void*>* query_top_k(uint64_t k, int8_t dir = 1);
+        virtual std::vector<void*>* query_top_k(Condition* condition, uint64_t k, int8_t dir = 1);
         virtual Iterator* it_first();
         virtual Iterator* it_last();
         virtual Iterator* it_lookup(void* rawdata, int8_t dir = 0);
+        virtual void* lookup(void* rawdata);
         virtual void it_release(Iterator* it);
 
+        static uint64_t join(Index* a, Index* b, Comparator* compare, void (*pair)(void* a, void* b, void* context), void* context = NULL);
+        static std::vector<std::pair<void*, void*> >* join(Index* a, Index* b, Comparator* compare = NULL);
+
+        void set_cache(uint32_t max_entries);
+        uint64_t get_cache_hits();
+        uint64_t get_cache_misses();
+
+        void set_lock(RWLock::LockType type, bool stats = false);
+        RWLock* get_lock();
+
     protected:
+        typedef enum { CACHE_EQ = 0, CACHE_LT = 1, CACHE_GT = 2 } CacheOp;
+
         Index();
         void add_data_v(void* rawdata);
         //     void* add_data_v_wrapper(void* args);
@@ -194,11 +222,26 @@ namespace libodb
         virtual bool remove(void* rawdata);
         virtual void remove_sweep(std::vector<void*>* marked);
 
+        ODB* cache_query(CacheOp op, void* rawdata);
+        void cache_invalidate(void* rawdata);
+        void cache_clear();
+
         Comparator* compare;
         Merger* merge;
         uint64_t count;
         bool drop_duplicates;
         uint64_t luid_val;
+
+        //! Opaque pointer to the ordered map of cached query results.
+        void* cache;
+        void* cache_lock;
+        uint32_t cache_max;
+        uint64_t cache_gen;
+        volatile uint64_t cache_hits;
+        volatile uint64_t cache_misses;
+
+        //! Opaque pointer to the lock ODB::upsert() misses on this table take turns on.
+        void* upsert_lock;
     };
 
 }
@@ -390,7 +433,26 @@ namespace libodb
 ///data fails (and will not be returned in the results).
 /// @return A pointer to an ODB object that represents the query results.
 /// @attention This operation is O(N), where N is the number of items in this
-///index table.
+///index table. If the index table has a scheduler, the scan is split across
+///its worker threads, so the condition must be safe to call concurrently.
+
+/// @fn std::vector<void*>* Index::query_top_k(uint64_t k, int8_t dir = 1)
+/// Get the items at one end of the index order.
+/// Equivalent to query_top_k(NULL, k, dir).
+
+/// @fn std::vector<void*>* Index::query_top_k(Condition* condition, uint64_t k, int8_t dir = 1)
+/// Get the first k items, in index order, that pass a condition.
+/// Unlike the other queries this does not build a result ODB. The walk stops
+///as soon as k items have passed and the result is a plain list of pointers to
+///the items, which stay valid until they are removed from the datastore.
+/// @param [in] condition Condition the items have to pass, or NULL to take
+///every item.
+/// @param [in] k Maximum number of items to return.
+/// @param [in] dir Where to start. If non-negative, start from the last (greatest)
+///item and work down, otherwise start from the first (least) item and work up.
+/// @return A list, owned by the caller, of at most k items, in the order they
+///were reached.
+/// @attention This does not count against the query counts of the items.
 
 /// @fn uint64_t Index::size()
 /// Get the number of elements in the table.
@@ -399,6 +461,12 @@ namespace libodb
 ///then this does not necessarily return the number of items in the table,
 ///but rather the number of items in the table as well as in all embedded lists.
 
+/// @fn uint64_t Index::mem_size()
+/// Get roughly how much memory the table's nodes take up. This is worked out
+///from the number of items, so costs nothing to call.
+/// @return The number of bytes in the table's nodes, not counting the data
+///they point to, which belongs to the DataStore.
+
 /// @fn bool Index::remove(DataObj* data)
 /// Remove an item from the index table. This matches memory location exactly.
 /// @param [in] data A piece of data representing what is to be removed.
@@ -417,12 +485,83 @@ namespace libodb
 /// Iterator initialization method.
 /// @return A pointer to an iterator that starts at the specified data.
 
+/// @fn void* Index::lookup(void* rawdata)
+/// Find an item in the index table that compares as equal to the given prototype.
+/// Index tables that can't do better just take the first item from it_lookup(), and
+///those that have no it_lookup() find nothing.
+/// @param [in] rawdata Prototypical piece of data to compare against.
+/// @return One of the equal items, or NULL if there are none.
+
 /// @fn void Index::it_release(Iterator* it)
 /// Release the specified iterator.
 /// This releases the memory held by the iterator and takes care of releasing
 ///the read lock that was acquired then the iterator was created.
 /// @param [in] it Iterator to release.
 
+/// @fn uint64_t Index::join(Index* a, Index* b, Comparator* compare, void (*pair)(void* a, void* b, void* context), void* context = NULL)
+/// Find every pair of items, one from each index table, that compare as equal.
+/// Both index tables are walked once, in order, side by side (a merge join),
+///so they must both be sorted in an order consistent with the comparator. For
+///a run of equal items on both sides, every item from a is paired with every
+///item from b.
+/// @param [in] a The left index table.
+/// @param [in] b The right index table.
+/// @param [in] compare Comparator that is given an item from a and an item from
+///b, in that order. If NULL, the comparator of a is used.
+/// @param [in] pair Function called with each matching pair, in index order,
+///and the context.
+/// @param [in] context Passed through to pair untouched.
+/// @return The number of pairs found.
+/// @attention Both index tables are read-locked for the duration, so pair must
+///not modify either of them. The locks are always taken in the same order,
+///whichever way round the tables are given, so concurrent joins of the same
+///two tables can't deadlock on each other. A table joined with itself is
+///walked once, under a single read lock.
+/// @see RWLock::LockType
+
+/// @fn std::vector<std::pair<void*, void*> >* Index::join(Index* a, Index* b, Comparator* compare = NULL)
+/// Find every pair of items, one from each index table, that compare as equal.
+/// Identical to the callback form, but collects the pairs into a list, owned
+///by the caller, instead.
+
+/// @fn void Index::set_cache(uint32_t max_entries)
+/// Turn on caching of the results of query_eq, query_lt and query_gt.
+/// Results are cached per (operation, key bytes) pair. An entry is dropped as
+///soon as an insertion or removal lands in its range (equal to, less than or
+///greater than its key), and the whole cache is dropped when items are moved
+///in memory, a sweep removes anything, or the index is purged. Once max_entries results are held, new
+///results are not cached until something is dropped.
+/// @param [in] max_entries Maximum number of cached results. Zero turns the
+///cache off and releases everything it holds.
+///Throws CACHE_UNSIZED if the ODB, or the one a result was drawn from, has an
+///indirect or variable-width DataStore, since keys there have no fixed size to
+///cache them by.
+
+/// @fn uint64_t Index::get_cache_hits()
+/// @return The number of queries served out of the result cache.
+
+/// @fn uint64_t Index::get_cache_misses()
+/// @return The number of cacheable queries that had to run against the index.
+
+/// @fn void Index::set_lock(RWLock::LockType type, bool stats = false)
+/// Replace the index table's lock with a different kind. This has to happen
+///before anything else is done with the table from another thread; usually
+///straight after ODB::create_index.
+/// @param [in] type The kind of lock to use.
+/// @param [in] stats Whether the lock should count acquisitions and waits.
+/// @see RWLock
+
+/// @fn RWLock* Index::get_lock()
+/// @return The index table's lock, to read its counters from.
+
+/// @fn ODB* Index::cache_query(CacheOp op, void* rawdata)
+/// Run a query_eq, query_lt or query_gt through the result cache, filling the
+///cache on a miss.
+
+/// @fn void Index::cache_invalidate(void* rawdata)
+/// Drop every cached result whose range an item that was added or removed
+///falls into.
+
 /// @fn Index::Index()
 /// Protected default constructor.
 /// By reserving the default constructor as protected the compiler cannot
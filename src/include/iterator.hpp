@@ -32,6 +32,10 @@ namespace libodb
         friend class RedBlackTreeI;
         friend class LinkedListI;
 
+        /// Walks the shards of a ShardedIndex, counting rows the way the tables'
+        ///own queries do.
+        friend void* shard_index_workload(void* argsV);
+
     public:
         virtual ~Iterator();
         virtual DataObj* next();
@@ -19,7 +19,6 @@
 #include "dll.hpp"
 
 #include <stdint.h>
-#include <deque>
 
 namespace libodb
 {
@@ -35,10 +34,47 @@ namespace libodb
         uint64_t size();
 
     private:
-        std::deque<void*>* base;
-        void* rwlock;
+        struct segment;
+
+        struct segment* new_segment(uint64_t base);
+
+        //! Oldest segment that may still hold items.
+        struct segment* volatile head;
+        //! Newest segment, where items are being added.
+        struct segment* volatile tail;
+
+        //! Position of the next item to be added. Producers and consumers are kept
+        //! on separate cache lines.
+        volatile uint64_t enq_pos;
+        char pad0[64 - sizeof(uint64_t)];
+        //! Position of the next item to be removed.
+        volatile uint64_t deq_pos;
+        char pad1[64 - sizeof(uint64_t)];
     };
 
 }
 
 #endif
+
+/// @class LFQueue
+/// An unbounded, lock-free, multi-producer multi-consumer FIFO queue.
+///
+/// Items live in a chain of fixed-size segments. Every item added to the queue
+///gets the next position from a 64-bit counter, and every slot in a segment
+///carries a sequence number that says whether the item for its position has
+///been written yet, so producers and consumers only ever have to compare-and-swap
+///a counter to claim a slot. When the consumers run off the end of a segment it
+///is retired to the EpochReclaimer, and freed once every operation that could
+///still be looking at it has finished, however busy the queue stays.
+///
+/// NULL cannot be stored in the queue, as it is what pop_front() and peek()
+///return when the queue is empty.
+
+/// @fn void* LFQueue::peek()
+/// @return The item at the front of the queue, without removing it, or NULL if
+///the queue is empty. With other consumers active, the item may be gone by the
+///time it is looked at.
+
+/// @fn uint64_t LFQueue::size()
+/// @return The number of items in the queue, including any that are partway
+///through being added.
@@ -65,8 +65,10 @@ namespace libodb
         virtual void purge(void(*freep)(void*));
         virtual void* get_at(uint64_t index);
         virtual void populate(Index* index);
+        virtual void query(Condition* condition, DataStore* ds);
         virtual DataStore* clone();
-        virtual DataStore* clone_indirect();
+        virtual DataStore* clone_indirect(uint64_t hint);
+        virtual uint64_t mem_size();
 
         Iterator* it_first();
         Iterator* it_last();
@@ -99,6 +101,7 @@ namespace libodb
         virtual void* get_at(uint64_t index);
         virtual std::vector<void*>** remove_sweep(Archive* archive);
         virtual void populate(Index* index);
+        virtual void query(Condition* condition, DataStore* ds);
     };
 
     class LIBODB_API LinkedListVDS : public LinkedListDS
@@ -125,10 +128,16 @@ namespace libodb
         virtual void* get_addr();
         virtual void* get_addr(uint32_t nbytes);
         virtual DataStore* clone();
-        virtual DataStore* clone_indirect();
+        virtual DataStore* clone_indirect(uint64_t hint);
+        virtual uint64_t mem_size();
 
         struct datanode* bottom;
         uint32_t(*len)(void*);
+
+        /// Rows ever added, and the bytes of variable-length data they carried,
+        ///so that the average row can stand in for the rows still here.
+        uint64_t added_rows;
+        uint64_t added_bytes;
     };
 
     class LIBODB_API LinkedListDSIterator : public Iterator
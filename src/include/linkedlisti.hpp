@@ -53,9 +53,19 @@ namespace libodb
             void* data;
         };
 
+        /// A run of the list for a parallel query to scan on one thread.
+        struct query_part
+        {
+            Condition* condition;
+            struct node* start;
+            uint64_t len;
+            std::vector<void*>* results;
+        };
+
         virtual bool add_data_v2(void* data);
         virtual void purge();
         void query(Condition* condition, DataStore* ds);
+        static void* query_part_workload(void* partV);
         //! @bug What are the impacts of assigning a -1 to a uint here?
         virtual void update(std::vector<void*>* old_addr, std::vector<void*>* new_addr, uint64_t datalen = -1);
         static void free_list(struct node* head);
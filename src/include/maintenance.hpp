@@ -0,0 +1,100 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for the process-wide maintenance service that sweeps ODBs.
+/// @file maintenance.hpp
+
+#ifndef MAINTENANCE_HPP
+#define MAINTENANCE_HPP
+
+#include "dll.hpp"
+
+#include <stdint.h>
+
+namespace libodb
+{
+    class ODB;
+    struct maint_entry;
+
+    class LIBODB_API MaintenanceService
+    {
+    public:
+        /// Passed as the offset to let the service pick when the first sweep is.
+        static const uint32_t STAGGER = 0xFFFFFFFF;
+
+        static void add(ODB* odb, uint32_t period, uint32_t offset = STAGGER);
+        static void remove(ODB* odb);
+
+        static uint32_t set_workers(uint32_t num_threads);
+        static uint32_t next_due(ODB* odb);
+        static uint64_t get_sweeps();
+
+    private:
+        static void init();
+        static void queue_sweep(struct maint_entry* e);
+        static void* timer(void* arg);
+        static void* sweep_workload(void* arg);
+        static void* check_workload(void* arg);
+    };
+
+}
+
+#endif
+
+/// @class MaintenanceService
+/// Process-wide service that keeps ODBs' clocks current and sweeps them on
+///schedule, in place of a thread for every ODB.
+///
+/// A single timer thread ticks once a second. On every tick it updates the time
+///of every registered ODB, and has the ones not already being swept checked
+///against their soft memory watermark. ODBs are kept on a timer wheel with a slot per
+///second, so a tick only looks at the ODBs whose sweeps might be due. Sweeps
+///that are due, and the watermark checks, are handed to a small pool of worker
+///threads, two unless set_workers() says otherwise, so an ODB that is held
+///locked for a while only holds up a worker. A sweep
+///also hands its swept rows to the ODB's Archive, if it has one. An ODB has at
+///most one scheduled sweep and one watermark check in flight at a time, and a
+///check that is stuck waiting on the ODB's lock doesn't cost a scheduled sweep
+///its turn.
+///
+/// Unless told otherwise, the first sweep of an ODB is put in the least busy
+///second within its period, so ODBs that are created together don't all sweep
+///together, and stay apart from then on.
+///
+/// The threads are started when the first ODB is added, and last for the
+///life of the process.
+
+/// @fn void MaintenanceService::add(ODB* odb, uint32_t period, uint32_t offset = STAGGER)
+/// Start maintaining an ODB. ODB::start_mem_checker calls this.
+/// @param[in] odb The ODB. It must be removed before it is destroyed.
+/// @param[in] period Seconds between sweeps.
+/// @param[in] offset How many seconds into its period the ODB already is, so
+///that the first sweep comes period - offset seconds from now. STAGGER lets the
+///service pick.
+
+/// @fn void MaintenanceService::remove(ODB* odb)
+/// Stop maintaining an ODB. If a sweep of it is in progress, this waits for it
+///to finish, so must not be called while holding any of the ODB's locks.
+/// @param[in] odb An ODB that was added.
+
+/// @fn uint32_t MaintenanceService::set_workers(uint32_t num_threads)
+/// Change the number of worker threads that sweeps run on.
+/// @param[in] num_threads Number of worker threads.
+/// @return The number of worker threads.
+
+/// @fn uint32_t MaintenanceService::next_due(ODB* odb)
+/// @param[in] odb An ODB that was added.
+/// @return How many ticks until the ODB's next scheduled sweep, or 0 if it
+///isn't being maintained.
+
+/// @fn uint64_t MaintenanceService::get_sweeps()
+/// @return How many sweeps the service has run.
@@ -20,6 +20,7 @@
 #define ODB_HPP
 
 #include "dll.hpp"
+#include "rwlock.hpp"
 
 #include <stdint.h>
 #include <string.h>
@@ -39,6 +40,8 @@ namespace libodb
     class Keygen;
     class Iterator;
     class Scheduler;
+    class Condition;
+    class Snapshot;
 
     inline uint32_t len_v(void* rawdata)
     {
@@ -61,9 +64,17 @@ namespace libodb
         /// Allows the scheduled workload on an Index Group from ODB to access the private members.
         friend void* ig_sched_workload(void* argsV);
 
-        /// The memory checking thread needs access to private functions
-        /// for time checking and updating.
-        friend void * mem_checker(void * arg);
+        /// The maintenance service sweeps ODBs and checks them against their
+        ///watermarks.
+        friend class MaintenanceService;
+
+        /// Snapshots build their results the same way queries on the ODB do, and
+        ///check rows against what the ODB has recorded.
+        friend class Snapshot;
+
+        /// A ShardedODB registers its shards for sweeping itself, so that their
+        ///sweeps are spread out.
+        friend class ShardedODB;
 
     public:
         /// Enum defining the types of flags that an Index can have on creation.
@@ -87,7 +98,7 @@ namespace libodb
         ///and may result in more complicated compare functions. Key-value index
         ///tables however require a keygen function that generates a key from a piece
         ///of data.
-        typedef enum { LINKED_LIST = 8, RED_BLACK_TREE = 16 } IndexType;
+        typedef enum { LINKED_LIST = 8, RED_BLACK_TREE = 16, SKIP_LIST = 1024 } IndexType;
 
         /// Enum defining the specific fixed-width DataStore timplementations available
         /// Fixed-width DataStore implementations require that a fixed value be
@@ -127,26 +138,39 @@ namespace libodb
         void add_data(void* rawdata, uint32_t nbytes);
         DataObj* add_data(void* rawdata, bool add_to_all);
         DataObj* add_data(void* rawdata, uint32_t nbytes, bool add_to_all);
+        bool upsert(void* rawdata, Index* key_index);
         void remove_sweep();
         void purge();
         void set_prune(bool (*prune)(void*));
         virtual bool(*get_prune())(void*);
         uint64_t size();
+        ODB* query(bool (*condition)(void*));
+        ODB* query(Condition* condition);
         void update_time(time_t t);
         time_t get_time();
 
         uint32_t start_scheduler(uint32_t num_threads);
+        Scheduler* get_scheduler();
         void block_until_done();
 
         Iterator* it_first();
         Iterator* it_last();
         void it_release(Iterator* it);
 
-        /// The memory limit, in pages (usually 4k), that the memory sweeping
-        ///thread uses as a maximum limit for this ODB to consume.
-        uint64_t mem_limit;
+        Snapshot* snapshot();
+        void snapshot_release(Snapshot* snap);
+
+        void set_lock(RWLock::LockType type, bool stats = false);
+        void set_datastore_lock(RWLock::LockType type, bool stats = false);
+        RWLock* get_lock();
+        RWLock* get_datastore_lock();
+
+        void set_mem_limits(uint64_t soft, uint64_t hard);
+        void set_mem_overrun(void (*overrun)(ODB* odb, uint64_t used));
+        uint64_t get_mem_overruns();
+        uint64_t mem_size();
 
-        /// Used to determine if memory checker thread is running or not.
+        /// Used to determine if the ODB is being swept by the MaintenanceService.
         bool is_running()
         {
             return running;
@@ -161,8 +185,15 @@ namespace libodb
         ODB();
         ODB(DataStore* dt, uint64_t ident, uint64_t datalen);
 
-        void init(DataStore* data, uint64_t ident, uint64_t datalen, Archive* archive, void(*freep)(void*), uint32_t sleep_duration);
+        void init(DataStore* data, uint64_t ident, uint64_t datalen, Archive* archive, void(*freep)(void*), uint32_t sleep_duration, bool pooled = false);
+        bool shell_take();
+        bool shell_put();
+        void start_mem_checker(uint32_t sleep_duration, uint32_t offset);
         void update_tables(std::vector<void*>* old_addr, std::vector<void*>* new_addr);
+        void* add_row(void* rawdata, uint32_t nbytes, bool sized);
+        void snapshot_filter(uint64_t seq, std::vector<void*>* rows);
+        void mem_check();
+        void mem_govern();
 
         /// Identity of this ODB insance in this process' context.
         uint64_t ident;
@@ -190,12 +221,8 @@ namespace libodb
         ///methods are called.
         DataObj* dataobj;
 
-        /// Opaque pointer to thread that the memory checker runs in.
-        void* mem_thread;
-
-        /// Duration that the memory checker thread sleeps between sweeps. If this
-        ///value is set to zero at ODB creation time, the memory checker thread
-        ///is not started.
+        /// Duration, in seconds, between sweeps. If this value is set to zero at
+        ///ODB creation time, the ODB is not swept on a schedule.
         uint32_t sleep_duration;
 
         /// Archiving method used when objects are swept from the Datastore.
@@ -208,11 +235,51 @@ namespace libodb
         /// Scheduler that the ODB uses for multithreaded performance.
         Scheduler* scheduler;
 
-        /// Whether or not the memory checker thread is running.
+        /// Whether or not the ODB is registered with the MaintenanceService.
         bool running;
 
-        /// Opaque pointer to locking context.
-        void* rwlock;
+        /// Lock guarding the ODB's own state.
+        RWLock* rwlock;
+
+        /// Snapshots of this ODB that haven't been released yet.
+        std::vector<Snapshot*>* snapshots;
+
+        /// How many snapshots are open, read without a lock on every insertion.
+        volatile uint32_t snapshots_open;
+
+        /// Sequence number given to the most recent snapshot.
+        uint64_t snapshot_seq;
+
+        /// Opaque pointer to the map from each row added while snapshots were open
+        ///to the sequence number of the newest snapshot at the time.
+        void* births;
+
+        /// Whether a sweep was put off because there were snapshots open.
+        bool sweep_deferred;
+
+        /// Opaque pointer to the lock covering the snapshot state above.
+        void* snapshot_lock;
+
+        /// Opaque pointer to the lock that keeps sweeps one at a time, since they
+        ///only hold the ODB's read lock.
+        void* sweep_lock;
+
+        /// Soft and hard memory watermarks, in bytes. Zero if not set.
+        uint64_t mem_soft;
+        uint64_t mem_hard;
+
+        /// Insertions since memory use was last looked at. Updated without a
+        ///lock, so it can lose counts, which only delays the next look.
+        uint32_t mem_adds;
+
+        /// Number of times a sweep past the hard mark didn't bring usage back
+        ///under it, and the function told each time, if any.
+        uint64_t mem_overruns;
+        void (*mem_overrun)(ODB* odb, uint64_t used);
+
+        /// Whether this is a query result, whose containers are handed on to the
+        ///next result when it is destroyed.
+        bool pooled;
         
         /// A comparator for comparing memory pointers.
         static CompareCust* compare_addr;
@@ -385,13 +452,105 @@ namespace libodb
 ///DataStore::QUERY_COUNT
 
 /// @fn ODB::ODB(DataStore* dt, uint64_t ident, uint32_t datalen)
-/// Work horse for ODB creation. Everything else just abstracts away the detals
-///and this function does the common work.
+/// Wrap a query result's datastore in an ODB. Queries make a lot of these and
+///throw most of them away soon after, so rather than allocate its own lists,
+///index group, lock and so on, the ODB takes those left by a result that was
+///destroyed, if there are any, and leaves its own for the next one.
 /// @param[in] dt Datastore type.
 /// @param[in] ident ODB identity in this process' context.
 /// @param[in] datalen Length of the user data that will be inserted into this
 ///ODB.
 
+/// @fn bool ODB::shell_take()
+/// Take the containers left by a destroyed query result, instead of allocating
+///new ones.
+/// @return Whether there were any to take.
+
+/// @fn bool ODB::shell_put()
+/// Leave the ODB's containers, emptied, for the next query result.
+/// @return Whether they were kept, or need to be freed because enough are kept
+///already.
+
+/// @fn ODB::start_mem_checker(uint32_t sleep_duration, uint32_t offset)
+/// Register the ODB with the MaintenanceService, which sweeps it every so
+///often, and early if it is past its soft memory watermark.
+/// @param[in] sleep_duration The duration, in seconds, between sweeps.
+/// @param[in] offset How far, in seconds, into the first of those to start,
+///so that a set of ODBs started together don't all sweep at once.
+///MaintenanceService::STAGGER lets the service pick.
+
+/// @fn void ODB::set_mem_limits(uint64_t soft, uint64_t hard)
+/// Set the memory watermarks the ODB is kept under, in terms of mem_size().
+///
+/// Past the soft mark, the ODB is swept early: by the memory checker thread on
+///its next tick if it is running, or otherwise by whichever insertion notices.
+///Past the hard mark, the insertion that notices sweeps the ODB itself before
+///going ahead, so that writers are slowed to the rate that sweeps can keep up
+///with. Nothing is ever refused; if the pruning function keeps everything,
+///the ODB simply grows. Usage is looked at every few thousand insertions, so
+///either mark can be overshot by that many rows.
+///
+/// When a sweep leaves the ODB still past the hard mark, because there is no
+///pruning function, it kept too much, or the sweep was put off for an open
+///snapshot, that is counted as an overrun. In the snapshot case the writer also
+///backs off for a moment before going ahead, to give the snapshot's holder a
+///chance to release it.
+/// @param[in] soft Soft watermark, in bytes, or zero for none.
+/// @param[in] hard Hard watermark, in bytes, or zero for none.
+/// @see set_mem_overrun
+
+/// @fn void ODB::set_mem_overrun(void (*overrun)(ODB* odb, uint64_t used))
+/// Have a function told about every overrun of the hard memory watermark.
+/// @param[in] overrun Called, by the writer that found the overrun and with no
+///locks held, with the ODB and its usage in bytes after the sweep. NULL to stop
+///being told.
+
+/// @fn uint64_t ODB::get_mem_overruns()
+/// @return The number of times a sweep past the hard memory watermark left the
+///ODB still past it.
+
+/// @fn uint64_t ODB::mem_size()
+/// Get roughly how much memory the ODB is using. This is the sum of what the
+///DataStore, each index table, and each query result still held by the ODB
+///report. It is worked out from their counts, so it is cheap, but it doesn't
+///see allocator overhead or memory that is kept around for reuse.
+/// @return The number of bytes in use.
+
+/// @fn Snapshot* ODB::snapshot()
+/// Take a read-only view of the rows in the ODB as they are now.
+/// Insertions carry on as normal while the snapshot is open, but sweeps are put
+///off until every snapshot has been released, at which point the last one to
+///be put off is run. With a scheduler running, call block_until_done() first
+///if the index tables need to have caught up with the DataStore. The results
+///of a query can't be snapshotted, since they are swept along with the ODB
+///they came from regardless, and trying throws SNAP_CLONE.
+/// @return A new Snapshot, which must be handed back to snapshot_release().
+
+/// @fn void ODB::snapshot_release(Snapshot* snap)
+/// Release a snapshot. Results already taken from it are unaffected.
+/// @param [in] snap A snapshot returned by snapshot() on this ODB.
+
+/// @fn void ODB::set_lock(RWLock::LockType type, bool stats = false)
+/// Replace the lock that guards the ODB's own state, such as its list of index
+///tables, with a different kind. This has to happen before the ODB is shared
+///with other threads, and before the memory checker thread is started.
+/// @param [in] type The kind of lock to use.
+/// @param [in] stats Whether the lock should count acquisitions and waits.
+/// @see RWLock
+
+/// @fn void ODB::set_datastore_lock(RWLock::LockType type, bool stats = false)
+/// Replace the lock that guards the DataStore, which every insertion, sweep
+///and full-scan query takes, with a different kind. The same restrictions as
+///for set_lock() apply.
+/// @param [in] type The kind of lock to use.
+/// @param [in] stats Whether the lock should count acquisitions and waits.
+
+/// @fn RWLock* ODB::get_lock()
+/// @return The lock guarding the ODB's own state, to read its counters from.
+
+/// @fn RWLock* ODB::get_datastore_lock()
+/// @return The lock guarding the DataStore, to read its counters from.
+
 /// @fn ODB::create_index(IndexType type, uint32_t flags, int32_t (*compare)(void*, void*), void* (*merge)(void*, void*) = NULL, void* (*keygen)(void*) = NULL, int32_t keylen = -1)
 /// Create an Index table associated with this ODB object.
 /// @param[in] type Index table type
@@ -482,6 +641,38 @@ namespace libodb
 ///choice would be false. A default value makes the call ambiguous with the
 ///one above.
 
+/// @fn bool ODB::upsert(void* rawdata, Index* key_index)
+/// Add data to the ODB unless a row with the same key is already there, in
+///which case it is merged into that row instead. This is add_data() for
+///tables of counters and the like, where most insertions land on an existing
+///row. Adding those with add_data() copies every one into the DataStore before
+///the index table merges it, and the copies are only reclaimed by a sweep.
+///Here the index table is looked in first, and the DataStore is only touched
+///for new keys.
+///
+/// The merge is done with the index table's merge function, with the same
+///arguments and under the same lock as when the index table merges a
+///duplicate itself, so it must update the existing row in place and must not
+///change its key. Only the key index table's lock is held, so it must not
+///change any field that other index tables of this ODB sort on either, or
+///they are left out of order. Without a merge function, the new data is
+///dropped.
+///
+/// Misses on the same key index table take turns and look again before adding,
+///so upserts racing on a new key add exactly one row between them. Rows added
+///by a miss go into the index tables before this returns, even with a
+///scheduler running, so the next upsert of the key finds them. This only holds
+///among upserts; a plain add_data() of the same key can still race one.
+///
+/// A merge changes the row in place, and snapshots share rows rather than
+///copying them, so an open Snapshot that can see the row sees the change too.
+/// @param[in] rawdata Data to add to the ODB.
+/// @param[in] key_index An index table of this ODB created with DROP_DUPLICATES,
+///that add_data() inserts into. It decides which rows have the same key.
+/// @return True if the data was merged into an existing row, false if it was
+///added. Throws IDENT_MISMATCH if the index table belongs to another ODB, and
+///NO_DROP_DUPS if it wasn't created with DROP_DUPLICATES.
+
 /// @fn ODB::remove_sweep()
 /// Perform a sweep of the ODB that applies its prune function to the elements
 ///in the datastore, then iterates through the index tables and removes references
@@ -505,14 +696,22 @@ namespace libodb
 /// @see DataStore::remove_cleanup
 /// @see ODB::update_tables
 /// @see Index::remove_sweep
-/// @attention This function locks the ODB object for the duration of the sweep.
-///This means that no data can be added, or removed, from the ODB during the
-///sweep. This is important since in real-time operations this will cause
-///the inserting thread to block until the sweep completes.
+/// @attention This function holds the ODB's read lock for the duration of the
+///sweep, and sweeps of one ODB run one at a time. That keeps snapshots, purges
+///and new index tables out, but not mem_size() and the like. Each index table
+///is write locked while it is swept and updated, and a BankDS from the start of
+///the sweep to the end, so data can't be added during the sweep, and the sweep
+///waits for open iterators. This is important since in real-time operations
+///this will cause the inserting thread to block until the sweep completes.
+///Index::lookup(), Index::query_eq() on a RedBlackTreeI, and BankDS::get_at()
+///don't take those locks, and carry on alongside the sweep.
+/// @attention While any snapshot is open, the sweep is put off until the last
+///one is released.
 
 /// @fn ODB::purge()
 /// Purge the ODB and all of its associated Index tables and its DataStore
-///of all data.
+///of all data. This throws SNAP_OPEN if any snapshot is open, since it can't
+///be put off the way a sweep can.
 
 /// @fn ODB::set_prune(bool (*prune)(void*))
 /// Set the pruning function.
@@ -527,6 +726,22 @@ namespace libodb
 /// @return The number of elements in the DataStore.
 /// @see DataStore::size()
 
+/// @fn ODB::query(bool (*condition)(void*))
+/// Perform a general query over every item in the DataStore, without going
+///through an index table.
+/// @param[in] condition A condition function that returns true if the piece
+///of data 'passes' (and should be added to the query results) and false if
+///the data fails (and will not be returned in the results).
+/// @return A new ODB holding the results of the query.
+
+/// @fn ODB::query(Condition* condition)
+/// Perform a general query over every item in the DataStore, without going
+///through an index table.
+/// If the ODB has a running scheduler, the scan is split across the worker
+///threads, so the condition must be safe to call concurrently.
+/// @param[in] condition The condition that data must pass to be included.
+/// @return A new ODB holding the results of the query.
+
 /// @fn ODB::update_time(time_t t)
 /// Set the time of the ODB object.
 /// @param[in] t The new time to stamp on objects put into the ODB.
@@ -544,6 +759,10 @@ namespace libodb
 /// @see Scheduler::Scheduler
 /// @see Scheduler::update_num_threads
 
+/// @fn ODB::get_scheduler()
+/// Get the ODB's scheduler, so that other work can be ordered against the ODB's.
+/// @return The scheduler, or NULL if start_scheduler() hasn't been called.
+
 /// @fn ODB::block_until_done()
 /// Blocks the calling thread until all currently scheduled workloads in the
 ///scheduler are completed.
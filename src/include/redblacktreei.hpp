@@ -74,6 +74,14 @@ namespace libodb
     ///(http://eternallyconfuzzled.com/tuts/datastructures/jsw_tut_rbtree.aspx)
     ///and some notes in a blog
     ///(http://www.canonware.com/~ttt/2008/04/left-leaning-red-black-trees-are-hard.html)
+    ///
+    /// Point lookups (lookup() and query_eq()) don't take the read lock. Writers
+    ///bump a version counter around every change to the tree, and a lookup walks
+    ///down the tree without the lock, checking the version before it follows each
+    ///node it reads, and starting over if a write got in the way. After a few
+    ///failed tries it falls back to the read lock. Nodes that a write unlinks are
+    ///retired to the EpochReclaimer, so they are only freed once every optimistic
+    ///reader that might have reached them is done, and writers never wait on them.
     //! @todo Bring the bottom-up insertion code back. It is prototyped in changeset
     ///134 so look there.
     //! @todo Implement the RBT_PROFILE code paths in the deletion and lookup
@@ -86,6 +94,7 @@ namespace libodb
         using Index::query_lt;
         using Index::query_eq;
         using Index::query_gt;
+        using Index::query_top_k;
         using Index::remove;
         /// @}
 
@@ -141,6 +150,8 @@ namespace libodb
         ///head of it. That is, it is a node ready to be inserted into the tree.
         static bool e_remove(struct e_tree_root* root, void* rawdata, void** del_node);
 
+        virtual std::vector<void*>* query_top_k(Condition* condition, uint64_t k, int8_t dir = 1);
+
         virtual Iterator* it_first();
         static Iterator* e_it_first(struct e_tree_root* root);
 
@@ -157,6 +168,12 @@ namespace libodb
 
         static void e_it_release(struct e_tree_root* root, Iterator* it);
 
+        /// Find an item that compares as equal to the given prototype.
+        /// @param[in] rawdata Prototypical piece of data to compare against.
+        /// @return One of the equal items, or NULL if there are none.
+        virtual void* lookup(void* rawdata);
+        virtual uint64_t mem_size();
+
         static void* e_pop_first(struct e_tree_root* root);
         static void* e_pop_last(struct e_tree_root* root);
 
@@ -217,6 +234,9 @@ namespace libodb
         ///being a particular issue.
         struct tree_node* sub_false_root;
 
+        /// Version counter for optimistic readers. Odd while a write is in progress.
+        volatile uint64_t version;
+
         /// Perform a single tree rotation in one direction.
         /// @param[in] n Pointer to the top node of the rotation.
         /// @param[in] dir Direction in which to perform the rotation. Since this
@@ -297,12 +317,82 @@ namespace libodb
         ///results of the query.
         void query(Condition* condition, DataStore* ds);
 
+        /// A slice of the tree for a parallel query to scan on one thread.
+        /// Either a whole subtree, or a single node whose children have been
+        ///stripped off (kept in the single member) so that the subtree iterator
+        ///only visits that node's values.
+        struct query_part
+        {
+            RedBlackTreeI* index;
+            Condition* condition;
+            struct tree_node* node;
+            struct tree_node single;
+            std::vector<void*>* results;
+        };
+
+        /// Split the tree, in order, into subtrees rooted at the given depth and the
+        ///single nodes above them.
+        /// @param[in] n Root of the subtree to split.
+        /// @param[in] depth Number of levels below n before whole subtrees are taken.
+        /// @param[in] condition Condition to be carried by each part.
+        /// @param[out] parts List the parts are appended to, in tree order.
+        void query_partition(struct tree_node* n, uint32_t depth, Condition* condition, std::vector<void*>* parts);
+
+        /// Scan one part of a parallel query, collecting matches into its result buffer.
+        /// @param[in] partV Pointer to a query_part.
+        static void* query_part_workload(void* partV);
+
+        /// Walk a subtree in order, from one end, collecting the items that pass a
+        ///condition until there are enough of them. Recursion stands in for the
+        ///iterator's explicit stack, and the walk is abandoned as soon as it is
+        ///done.
+        /// @param[in] n Root of the subtree to walk.
+        /// @param[in] dir Child to walk first; 0 to walk up from the least item
+        ///and 1 to walk down from the greatest.
+        /// @param[in] condition Condition to test the items with, or NULL to take
+        ///every item.
+        /// @param[in] k Number of items wanted in total.
+        /// @param[out] results List the passing items are appended to.
+        /// @return Whether the results are full and the walk should stop.
+        static bool top_k_n(struct tree_node* n, uint8_t dir, Condition* condition, uint64_t k, std::vector<void*>* results);
+
         /// Query this index table for all values that compare as equal to the given prototype.
         /// @param[in] rawdata Prototypical piece of data to compare against.
         /// @param[in] ds A pointer to a datastore that will be filled with the
         ///results of the query.
         void query_eq(void* rawdata, DataStore* ds);
 
+        /// Walk down to the node holding the values equal to the given prototype,
+        ///without the lock.
+        /// @param[in] rawdata Prototypical piece of data to compare against.
+        /// @param[in] s Version of the tree the walk started from.
+        /// @param[out] data The node's data pointer, which is the root of an embedded
+        ///tree if the node holds duplicates, or NULL if there is no such node.
+        /// @param[out] value The first of the equal values, or NULL.
+        /// @param[out] tree Whether the node holds duplicates.
+        /// @return Whether the walk saw a consistent tree. If not, the outputs are
+        ///meaningless.
+        bool lookup_n(void* rawdata, uint64_t s, void** data, void** value, bool* tree);
+
+        /// Collect the values in an embedded tree, in order, without the lock.
+        /// @param[in] n Root of the subtree to collect.
+        /// @param[in] s Version of the tree the walk started from.
+        /// @param[out] results List the values are appended to.
+        /// @return Whether the walk saw a consistent tree.
+        bool collect_n(struct tree_node* n, uint64_t s, std::vector<void*>* results);
+
+        /// Hand nodes unlinked by a write to the EpochReclaimer, to be freed once the
+        ///optimistic readers that might still be looking at them are gone.
+        /// @param[in] retired Nodes to free.
+        static void free_retired(std::vector<void*>* retired);
+
+        /// Free a whole detached tree, for the EpochReclaimer. There's one for trees
+        ///that drop duplicates and one for those that don't.
+        /// @{
+        static void free_tree(void* root);
+        static void free_tree_drop(void* root);
+        /// @}
+
         /// Query this index table for all values that compare as less than the given prototype.
         /// @param[in] rawdata Prototypical piece of data to compare against.
         /// @param[in] ds A pointer to a datastore that will be filled with the
@@ -324,7 +414,8 @@ namespace libodb
             Comparator* compare,
             Merger* merge,
             bool drop_duplicates,
-            void* rawdata);
+            void* rawdata,
+            std::vector<void*>* retired = NULL);
         static struct RedBlackTreeI::tree_node* e_remove_n(struct tree_node* data,
         struct tree_node* false_root,
         struct tree_node* sub_false_root,
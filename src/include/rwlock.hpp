@@ -0,0 +1,121 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for RWLock, the read/write locks that ODBs, DataStores and Index
+///tables are guarded by.
+/// @file rwlock.hpp
+
+#ifndef RWLOCK_HPP
+#define RWLOCK_HPP
+
+#include "dll.hpp"
+
+#include <stdint.h>
+
+namespace libodb
+{
+
+    class LIBODB_API RWLock
+    {
+    public:
+        /// The kinds of lock that can be chosen for each structure.
+        ///
+        /// - DEFAULT is whichever lock family the library was built with in
+        ///lock.hpp.
+        /// - SPIN is a test-and-test-and-set spin lock, with readers and
+        ///writers alike taking it exclusively.
+        /// - TICKET is a fair spin lock that hands the lock out in the order it
+        ///was asked for, again exclusively.
+        /// - READER_BIASED counts readers in per-thread slots, each on a cache
+        ///line of its own, so that readers never write to a shared line. Writers
+        ///have to look at every slot, so it suits structures that are read far
+        ///more than they are written.
+        ///
+        /// None of them can be re-entered for reading. SPIN and TICKET hand out
+        ///reads exclusively, so a thread that asks again waits on itself for
+        ///good. DEFAULT and READER_BIASED may let a second read in, but not once a
+        ///writer is waiting, and the writer is waiting on the first read. The
+        ///library never takes a lock it already holds.
+        typedef enum { DEFAULT = 0, SPIN = 1, TICKET = 2, READER_BIASED = 3 } LockType;
+
+        /// Counters kept by a lock created with stats turned on. Wait times are
+        ///in nanoseconds, and only count acquisitions that had to wait.
+        struct lock_stats
+        {
+            uint64_t read_acquisitions;
+            uint64_t write_acquisitions;
+            uint64_t read_contended;
+            uint64_t write_contended;
+            uint64_t read_wait_ns;
+            uint64_t write_wait_ns;
+        };
+
+        static RWLock* create(LockType type = DEFAULT, bool stats = false);
+        virtual ~RWLock();
+
+        void read_lock();
+        void read_unlock();
+        void write_lock();
+        void write_unlock();
+
+        LockType get_type();
+        bool get_stats(struct lock_stats* stats);
+        void reset_stats();
+
+    protected:
+        RWLock(LockType type, bool stats);
+
+        virtual void rd_lock() = 0;
+        virtual bool rd_trylock() = 0;
+        virtual void rd_unlock() = 0;
+        virtual void wr_lock() = 0;
+        virtual bool wr_trylock() = 0;
+        virtual void wr_unlock() = 0;
+
+        LockType type;
+
+        /// Counters, or NULL if this lock doesn't keep them.
+        struct lock_stats* stats;
+    };
+
+}
+
+#endif
+
+/// @class RWLock
+/// A read/write lock whose implementation is picked when it is created, rather
+///than for the whole library when it is built.
+///
+/// The ODB, its DataStore and each of its Index tables each have one of these,
+///and ODB::set_lock, ODB::set_datastore_lock and Index::set_lock swap in a
+///different kind for any one of them. None of the kinds can be taken for
+///reading twice by the same thread, and none can be released by a thread other
+///than the one that took it.
+///
+/// A lock created with stats turned on counts its acquisitions, how many of them
+///found the lock already held, and how long those waited. Every acquisition
+///first tries the lock, so that one that doesn't have to wait costs no more than
+///a few atomic additions. Without stats, there is nothing but the check that
+///they are off.
+
+/// @fn RWLock* RWLock::create(LockType type = DEFAULT, bool stats = false)
+/// @param[in] type The kind of lock to create.
+/// @param[in] stats Whether the lock should keep counters.
+/// @return A new lock, which belongs to the caller.
+
+/// @fn bool RWLock::get_stats(struct lock_stats* stats)
+/// @param[out] stats Filled with the lock's counters. Since they are read
+///without stopping anyone, they may be a few acquisitions apart.
+/// @return Whether the lock keeps counters. If not, stats is left alone.
+
+/// @fn void RWLock::reset_stats()
+/// Zero the lock's counters, if it keeps any.
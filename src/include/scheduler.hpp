@@ -21,10 +21,28 @@
 #include "dll.hpp"
 
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 
 #include "lfqueue.hpp"
-#include "redblacktreei.hpp"
+
+/// How many bytes of arguments add_work_copy() keeps in the workload itself. Larger
+///arguments are copied to the heap instead.
+#ifndef SCHEDULER_INLINE_ARGS
+#define SCHEDULER_INLINE_ARGS 32
+#endif
+
+/// Number of buckets in a LatencyHistogram: four per power of two, up to 2^64.
+#define SCHEDULER_HIST_BUCKETS 252
+
+/// The ways workloads are broken down by flag in a Scheduler::snapshot. Index i is
+///for workloads with flag (1 << i) set, and the last is for those with no flags.
+#define SCHEDULER_FLAG_KINDS 6
+
+/// How many spent workload descriptors a Scheduler keeps around for reuse.
+#ifndef SCHEDULER_POOL_MAX
+#define SCHEDULER_POOL_MAX 65536
+#endif
 
 namespace libodb
 {
@@ -46,13 +64,112 @@ namespace libodb
         void* l;
     };
 
+    class Scheduler;
+
+    /// A histogram of durations, in nanoseconds, with buckets that grow with the value
+    /// so that the error is within 25% anywhere in the range, in the style of an HDR
+    /// histogram. Recording is a couple of instructions, and histograms recorded on
+    /// different threads can be merged afterwards.
+    class LIBODB_API LatencyHistogram
+    {
+    public:
+        LatencyHistogram();
+
+        void record(uint64_t ns);
+        void record_atomic(uint64_t ns);
+        void merge(LatencyHistogram* other);
+        void clear();
+
+        uint64_t get_count();
+        uint64_t get_max();
+        uint64_t get_mean();
+        uint64_t get_percentile(double percent);
+
+    private:
+        static uint32_t bucket(uint64_t ns);
+        static uint64_t bucket_high(uint32_t b);
+
+        uint64_t counts[SCHEDULER_HIST_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+    };
+
+    /// A handle on a single workload handed to a Scheduler, which can be waited on
+    /// or have more work chained off of it. Handles are reference counted, so they
+    /// can be copied around freely and dropped at any time, including before the
+    /// workload has run.
+    class LIBODB_API WorkHandle
+    {
+        friend class Scheduler;
+
+    public:
+        WorkHandle();
+        WorkHandle(const WorkHandle& other);
+        ~WorkHandle();
+        WorkHandle& operator=(const WorkHandle& other);
+
+        bool valid();
+        bool ready();
+        void* wait();
+
+        WorkHandle then(void* (*func)(void*), void** retval = NULL, uint32_t flags = 0);
+        WorkHandle then(void* (*func)(void*), void** retval, uint64_t class_id, uint32_t flags);
+
+    private:
+        WorkHandle(Scheduler* scheduler, void* work);
+
+        Scheduler* scheduler;
+        //! Opaque pointer to the Scheduler::workload this refers to.
+        void* work;
+    };
+
+    /// Where a Scheduler's worker threads run.
+    /// Workers are pinned one to a CPU, in turn, from the CPUs that have been added,
+    ///spreading them across the NUMA nodes before doubling up on any one node. With
+    ///no CPUs added, workers aren't pinned, and everything is on node 0.
+    class LIBODB_API SchedulerConfig
+    {
+        friend class Scheduler;
+
+    public:
+        SchedulerConfig();
+        SchedulerConfig(uint32_t num_threads);
+
+        void set_num_threads(uint32_t num_threads);
+        uint32_t get_num_threads();
+
+        void add_cpu(uint32_t cpu, uint32_t node);
+        bool add_topology();
+
+        uint32_t get_num_cpus();
+        uint32_t get_num_nodes();
+        uint32_t get_cpu(uint32_t i);
+        uint32_t get_node(uint32_t i);
+
+    private:
+        uint32_t num_threads;
+        std::vector<uint32_t> cpus;
+        std::vector<uint32_t> nodes;
+    };
+
     /* BEHAVIOUR DESCRIPTION
-     * - Addition of new workloads is thread-safe, but blocking. Threads will block
-     *      if multiple threads attempt to add workloads concurrently. This is due
-     *      to the fact that a red-black tree is used to manage the workqueues, and
-     *      a non-blocking implementation is not available. Once the workload is
-     *      added to a workqueue though, the thread will continueq asynchronously
-     *      from the actual work.
+     * - Addition of new workloads is thread-safe and non-blocking. The only lock
+     *      taken is a short one around the lookup of an interference class's
+     *      workqueue by its ID. Once the workload is added to a workqueue, the
+     *      thread will continue asynchronously from the actual work.
+     * - Workqueues that have work and aren't being held by a worker sit in one of
+     *      three ready rings, one per tier: high priority, normal, and background.
+     *      A workqueue is put on a ring when it goes from having nothing to do to
+     *      having something to do, so each ring is in order of readiness, and
+     *      dispatch is a pop off of the first non-empty ring.
+     * - Non-interfering workloads without flags skip the ready rings entirely. Each worker
+     *      thread has a queue of its own, these workloads are handed out to them
+     *      round-robin without taking any locks, and a worker that runs out of work
+     *      steals from the others.
+     * - Worker threads that run out of work spin for a few microseconds, backing
+     *      off as they go, before they park. Adding work only takes the mutex and
+     *      signals the condvar when some worker is parked, or about to be.
      * - The scheduler essentially schedules workqueues that represent interference
      *      classes.
      * - Under normal circumstances, workloads are processed in the order in which
@@ -69,12 +186,31 @@ namespace libodb
      *      the entire class of work is removed from the scheduler until the workload
      *      is complete, at which point the workqueue is inserted back into the
      *      schedule.
+     * - With a SchedulerConfig, workers are pinned to CPUs and grouped by NUMA
+     *      node. Each node has its own ready rings, and an interference class can
+     *      be placed on a node with set_class_node(). Workers look on their own
+     *      node's rings, and steal from their own node's workers, before looking
+     *      anywhere else.
+     * - Deadline workloads, added with add_work_deadline(), are kept in order of
+     *      their deadlines, and taken ahead of everything else once their deadline
+     *      is close. Otherwise they are run when there is nothing else to do.
+     * - An interference class can be given a share of the worker time with
+     *      set_class_share(). Its workqueue goes on a ring of its own, and it is
+     *      served ahead of the regular rings whenever it has used less than its
+     *      share, regardless of BACKGROUND flags on its workloads.
+     * - Every workload added returns a WorkHandle. Continuations chained on with
+     *      then() are added to the scheduler as soon as the workload they hang off
+     *      of is complete, with its return value as their argument, so dependent
+     *      stages can be pipelined without waiting on everything else.
+     * - Each worker keeps its own counters and histograms, which only it writes,
+     *      and get_snapshot() adds them up when asked. Timing every workload costs
+     *      two clock reads, so it is only done after set_instrumented().
      */
 
     class LIBODB_API Scheduler
     {
+        friend class WorkHandle;
         friend void* scheduler_worker_thread(void* args_v);
-        friend int32_t compare_workqueue(void* aV, void* bV);
 
     public:
         /// These flags aren't currently propagated to the containing queues when appropriate,
@@ -84,8 +220,8 @@ namespace libodb
         /// Below is the list of flags that are currently implemented, and where the code is.
         ///
         /// READ_ONLY           get_work
-        /// HIGH_PRIORITY       compare_workqueue, update_queue_push_flags, update_queue_pop_flags
-        /// BACKGROUND          compare_workqueue, update_queue_push_flags, update_queue_pop_flags
+        /// HIGH_PRIORITY       queue_tier, update_queue_push_flags, update_queue_pop_flags
+        /// BACKGROUND          queue_tier
 
         /* FLAG DESCRIPTIONS
          * NONE
@@ -121,38 +257,159 @@ namespace libodb
          */
         typedef enum { NONE = 0x00, READ_ONLY = 0x01, BARRIER = 0x02, BACKGROUND = 0x04, HIGH_PRIORITY = 0x08, URGENT = 0x10 } WorkFlags;
 
+        /// Statistics kept for each interference class.
+        struct class_stats
+        {
+            //! Workloads started.
+            uint64_t started;
+            //! Total and worst time workloads waited between being added and being started.
+            uint64_t total_delay_ns;
+            uint64_t max_delay_ns;
+            //! Total time spent running workloads.
+            uint64_t run_ns;
+            //! The percentage of worker time set with set_class_share().
+            uint32_t share;
+        };
+
+        struct worker_snapshot
+        {
+            uint64_t completed;
+            //! Time since the worker started, split into running workloads, parked, and
+            //! the rest, which is spent looking for work. Busy time is only counted while
+            //! the scheduler is instrumented.
+            uint64_t uptime_ns;
+            uint64_t busy_ns;
+            uint64_t parked_ns;
+            uint64_t idle_ns;
+            //! Workloads taken from another worker's deque.
+            uint64_t steals;
+        };
+
+        struct class_snapshot
+        {
+            uint64_t class_id;
+            struct class_stats stats;
+            //! Workloads waiting in the class now, and the most there have ever been.
+            uint64_t depth;
+            uint64_t depth_hwm;
+            LatencyHistogram latency;
+            LatencyHistogram run_time;
+        };
+
+        /// Everything the scheduler keeps track of, as of when it was taken.
+        struct snapshot
+        {
+            uint64_t completed;
+            uint64_t available;
+            uint64_t available_hwm;
+            std::vector<struct worker_snapshot> workers;
+            std::vector<struct class_snapshot> classes;
+            //! Enqueue-to-start latency and run time, by flag; see SCHEDULER_FLAG_KINDS.
+            //! Only recorded while the scheduler is instrumented.
+            LatencyHistogram latency[SCHEDULER_FLAG_KINDS];
+            LatencyHistogram run_time[SCHEDULER_FLAG_KINDS];
+        };
+
         Scheduler(uint32_t num_threads);
+        Scheduler(SchedulerConfig& config);
         ~Scheduler();
 
         // Add a workload that can be performed independently of all other workloads
-        void add_work(void* (*func)(void*), void* args, void** retval, uint32_t flags);
+        WorkHandle add_work(void* (*func)(void*), void* args, void** retval, uint32_t flags);
 
         // Add a workload that is a member of some interference class identified uniquely by the work_class
         // The work-class is a 64-bit unsigned integer which is versatile without the overhead.
-        void add_work(void* (*func)(void*), void* args, void** retval, uint64_t class_id, uint32_t flags);
+        WorkHandle add_work(void* (*func)(void*), void* args, void** retval, uint64_t class_id, uint32_t flags);
+
+        // The same as add_work, except that nbytes of args are copied in with the workload,
+        // and func is passed the copy. This saves the caller from allocating and freeing an
+        // argument block for every workload, and small arguments cost no allocation at all.
+        WorkHandle add_work_copy(void* (*func)(void*), const void* args, uint32_t nbytes, void** retval, uint32_t flags);
+        WorkHandle add_work_copy(void* (*func)(void*), const void* args, uint32_t nbytes, void** retval, uint64_t class_id, uint32_t flags);
+
+        // Add a non-interfering workload that should be started by the deadline, in
+        // nanoseconds on the same clock as now().
+        WorkHandle add_work_deadline(void* (*func)(void*), void* args, void** retval, uint64_t deadline, uint32_t flags);
+
+        // Guarantee an interference class a percentage of the worker time, for as long as it
+        // has work. A share of 0 puts it back to being scheduled like any other class.
+        void set_class_share(uint64_t class_id, uint32_t percent);
+
+        // Fill in the statistics for an interference class. Returns false if the class
+        // has never had any work added to it.
+        bool get_class_stats(uint64_t class_id, struct class_stats* stats);
+
+        // The number of deadline workloads that were started after their deadline.
+        uint64_t get_deadline_misses();
+
+        // Monotonic time, in nanoseconds.
+        static uint64_t now();
+
+        // Turn on timing of every workload, for the per-flag histograms and the workers'
+        // busy time. Interference class statistics are always kept.
+        void set_instrumented(bool instrumented);
+
+        // Take a snapshot of the statistics. The caller is responsible for deleting it.
+        struct snapshot* get_snapshot();
 
         // Attempt to change the number of worker threads.
         // Returns the number of threads in the pool, which can be used to check and
         // see if it was successful.
         uint32_t update_num_threads(uint32_t new_num_threads);
 
+        // Have the workers on the given NUMA node prefer the work in this interference
+        // class, for when the data it touches lives there.
+        void set_class_node(uint64_t class_id, uint32_t node);
+
         void block_until_done();
 
         void spin_until_done();
 
         uint64_t get_num_complete();
         uint64_t get_num_available();
+        uint32_t get_num_threads();
+
+        // Run func over each of the n args, spread across the worker threads, and
+        // block until all of them are complete. The calling thread claims and
+        // processes items alongside the workers, so this is safe to call with no
+        // worker threads, and from inside a workload.
+        void run_batch(void* (*func)(void*), void** args, uint32_t n);
 
     private:
         struct workload;
 
         struct queue_el
         {
-            void* link[2];
             LFQueue* queue;
-            bool in_tree;
-            uint32_t flags;
-            uint32_t num_hp;
+            //! QUEUE_IDLE, or QUEUE_ACTIVE while it is on a ready ring or held by a worker.
+            volatile uint32_t state;
+            volatile uint32_t num_hp;
+            uint32_t node;
+            uint32_t share;
+            uint64_t share_start;
+            volatile uint64_t started;
+            volatile uint64_t total_delay_ns;
+            volatile uint64_t max_delay_ns;
+            volatile uint64_t run_ns;
+            //! Run time counted against the share, which is trimmed to SCHED_SHARE_WINDOW.
+            volatile uint64_t share_ns;
+            uint64_t depth_hwm;
+            LatencyHistogram* latency;
+            LatencyHistogram* run_time;
+        };
+
+        //! Spent workload descriptors, kept apart from the Scheduler so that
+        //! handles that outlive it still have somewhere to give theirs back.
+        struct work_pool
+        {
+            //! Descriptors ready to be handed out again by new_work().
+            LFQueue* queue;
+            volatile uint32_t size;
+            //! One for the Scheduler until it is destroyed, and one per descriptor
+            //! handed out.
+            volatile uint32_t refs;
+            //! Set once the Scheduler is gone, after which spent descriptors are freed.
+            volatile bool closed;
         };
 
         struct workload
@@ -162,7 +419,29 @@ namespace libodb
             void** retval;
             uint64_t id;
             struct queue_el* q;
+            //! The interference class this was taken from, for its statistics.
+            struct queue_el* from;
             uint32_t flags;
+            //! When this was added, for interference class workloads, and when it has to
+            //! be started by, for deadline workloads, in nanoseconds.
+            uint64_t stamp;
+            uint64_t deadline;
+            //! One for the scheduler until the workload is complete, and one per WorkHandle.
+            volatile uint32_t refs;
+            volatile uint32_t done;
+            void* result;
+            //! Continuations waiting on this, or WORK_DONE once they've been added.
+            struct workload* volatile conts;
+            //! The next continuation hanging off of the same workload.
+            struct workload* next;
+            //! The interference class of a continuation, when classed is set.
+            uint64_t class_id;
+            bool classed;
+            //! Arguments copied in by add_work_copy() that didn't fit inline.
+            void* heap_args;
+            //! Where this goes back to once it is spent.
+            struct work_pool* pool;
+            uint64_t inline_args[(SCHEDULER_INLINE_ARGS + 7) / 8];
         };
 
         struct thread_args
@@ -170,10 +449,50 @@ namespace libodb
             Scheduler* scheduler;
             volatile uint64_t counter;
             volatile bool run;
+            uint32_t index;
+            uint32_t node;
+            //! The CPU to pin to, or -1 to leave it up to the OS.
+            int32_t cpu;
+            //! Counters only this worker writes, which get_snapshot() adds up.
+            uint64_t start_ns;
+            volatile uint64_t busy_ns;
+            volatile uint64_t parked_ns;
+            volatile uint64_t steals;
+            LatencyHistogram* latency;
+            LatencyHistogram* run_time;
         };
 
+        struct workload* new_work(void* (*func)(void*), void* args, void** retval, uint32_t flags);
+        void enqueue(struct workload* work);
+        void run_work(struct workload* work, struct thread_args* args);
+        void retire_thread(struct thread_args* args);
+        void note_available(uint64_t avail);
+        void help_work();
+        WorkHandle chain(struct workload* prev, struct workload* work);
+        void copy_args(struct workload* work, const void* args, uint32_t nbytes);
+        static void release_work(struct workload* work);
+        static void release_pool(struct work_pool* p);
+        static void backoff(uint32_t round);
+        void notify();
+
         struct queue_el* find_queue(uint64_t class_id);
-        struct workload* get_work();
+        void make_ready(struct queue_el* q);
+        void release_queue(struct queue_el* q);
+        static uint32_t queue_tier(struct queue_el* q);
+        struct workload* take_work(struct thread_args* args, uint32_t* burst);
+        struct workload* take_deadline(bool due_only);
+        struct queue_el* take_share(bool owed_only);
+        bool share_owed(struct queue_el* q);
+        static bool deadline_later(struct workload* a, struct workload* b);
+        struct workload* get_work(uint32_t node);
+        struct workload* pop_queue(struct queue_el* q);
+        struct workload* get_local_work(uint32_t index, bool steal);
+        void grow_deques(uint32_t n);
+
+        void init(uint32_t num_threads);
+        void start_thread(uint32_t index);
+        int32_t worker_cpu(uint32_t index);
+        uint32_t worker_node(uint32_t index);
 
         static void update_queue_push_flags(struct queue_el* q, uint32_t f);
         static void update_queue_pop_flags(struct queue_el* q, uint32_t f);
@@ -203,17 +522,61 @@ namespace libodb
 
         uint32_t num_threads;
         volatile uint32_t num_threads_parked;
+        //! Workers that are parked, or are about to check for work one last time before
+        //! they park. Producers only need to wake anyone up when this is non-zero.
+        volatile uint32_t num_threads_idle;
+        //! Event count, bumped every time a producer wakes a worker. A worker that is
+        //! parking sleeps until this has moved on from the value it saw beforehand.
+        volatile uint64_t wake_epoch;
 
         //! @todo convert this to not be a list of pointers
         struct thread_args** t_args;
 
-        struct RedBlackTreeI::e_tree_root* root;
-        volatile uint64_t tree_count;
+        //! Workqueues that are ready to be run, one ring per tier per node. The rings
+        //! of a node are together, and are served in tier order.
+        LFQueue** ready;
+        //! Total number of workqueues across the ready rings.
+        volatile uint64_t ready_count;
 
         //! Opaque pointer to a platform-dependant standard template hash-table-based lookup structure.
         void* queue_map;
 
         struct queue_el indep;
+
+        //! Per-worker queues of non-interfering workloads, indexed the same as the
+        //! threads. This only ever grows, so that producers never see it move out
+        //! from under them; the deques of stopped threads are drained by stealing.
+        LFQueue** volatile deques;
+        volatile uint32_t num_deques;
+        //! The deques arrays that have been grown out of, kept until destruction.
+        std::vector<LFQueue**>* old_deques;
+        //! Round-robin counter for handing out non-interfering workloads.
+        volatile uint32_t next_deque;
+
+        //! Deadline workloads, as a heap with the earliest deadline on top. Guarded by
+        //! the SpinLock, with the top's deadline mirrored outside of it.
+        std::vector<struct workload*>* deadlines;
+        volatile uint32_t num_deadlines;
+        volatile uint64_t next_deadline;
+        volatile uint64_t deadline_misses;
+
+        //! The ring that the workqueues of classes with a share of the worker time go on.
+        LFQueue* share_ring;
+        volatile uint32_t num_shares;
+
+        volatile bool instrumented;
+        volatile uint64_t available_hwm;
+        //! What stopped workers, and threads helping out in WorkHandle::wait(), recorded.
+        struct worker_snapshot retired;
+        LatencyHistogram* retired_latency;
+        LatencyHistogram* retired_run_time;
+
+        struct work_pool* pool;
+
+        //! The CPUs and nodes workers are placed on, in the order they are handed out.
+        std::vector<uint32_t>* slot_cpus;
+        std::vector<uint32_t>* slot_nodes;
+        uint32_t num_nodes;
     };
 
 }
@@ -227,3 +590,28 @@ namespace libodb
 ///asynchronous offloading and multithreaded execution of workloads.
 /// @bug Doesn't take ALL flags into account yet. Some work. See header file.
 ///Implement all of the priority flags.
+
+/// @class WorkHandle
+/// A reference counted handle on a workload added to a Scheduler.
+///
+/// Default constructed handles refer to nothing; valid() tells them apart, and
+///wait() and then() on them do nothing. Workload descriptors are recycled by the
+///Scheduler that made them, but the recycling outlives it as long as handles
+///are left, so a handle can still be copied, dropped, or asked valid() and
+///ready() after its Scheduler is destroyed. wait() and then() need the
+///Scheduler, and must not be called once it is gone.
+
+/// @fn void* WorkHandle::wait()
+/// Block until the workload is complete. The calling thread runs other outstanding
+///workloads while it waits, so this is safe to call with no worker threads, and
+///from inside a workload.
+/// @return The value returned by the workload.
+
+/// @fn WorkHandle WorkHandle::then(void* (*func)(void*), void** retval, uint32_t flags)
+/// Add a workload to the scheduler once this one is complete, with this one's
+///return value as its argument. If this one is already complete, it is added
+///right away.
+/// @param[in] func The function to run.
+/// @param[out] retval Where to store the return value of func, if not NULL.
+/// @param[in] flags Scheduler::WorkFlags for the new workload.
+/// @return A handle on the new workload, which can be chained onto in turn.
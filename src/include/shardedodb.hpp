@@ -0,0 +1,207 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for ShardedODB and ShardedIndex.
+/// @file shardedodb.hpp
+
+#ifndef SHARDEDODB_HPP
+#define SHARDEDODB_HPP
+
+#include "dll.hpp"
+#include "odb.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+namespace libodb
+{
+    class Index;
+    class Condition;
+    class Scheduler;
+    class ShardedODB;
+
+    class LIBODB_API ShardedIndex
+    {
+        /// Only a ShardedODB can create one, over the indexes in its shards.
+        friend class ShardedODB;
+
+    public:
+        std::vector<void*>* query_eq(void* rawdata);
+        std::vector<void*>* query_lt(void* rawdata);
+        std::vector<void*>* query_gt(void* rawdata);
+        std::vector<void*>* query_top_k(uint64_t k, int8_t dir = 1);
+        void* lookup(void* rawdata);
+        uint64_t size();
+        Index* get_shard(uint32_t i);
+
+    private:
+        ShardedIndex(ShardedODB* parent, int32_t (*compare)(void*, void*));
+        ~ShardedIndex();
+
+        std::vector<void*>* query_runs(int32_t op, void* rawdata, uint64_t k, int8_t dir);
+
+        /// The ShardedODB this indexes, whose scheduler the queries fan out on.
+        ShardedODB* parent;
+
+        /// One Index table in each shard, in shard order.
+        std::vector<Index*>* indices;
+
+        /// The comparison the Index tables were created with, to merge by.
+        int32_t (*compare)(void*, void*);
+    };
+
+    class LIBODB_API ShardedODB
+    {
+        /// Allows the index to fan its queries out on the shared scheduler.
+        friend class ShardedIndex;
+
+    public:
+        /// How rows are given out to shards by their key. HASH spreads keys
+        ///evenly. RANGE gives each shard a contiguous run of keys, split at the
+        ///points given to set_bounds().
+        typedef enum { HASH = 0, RANGE = 1 } PartitionType;
+
+        ShardedODB(uint32_t num_shards, uint64_t (*key)(void* rawdata), PartitionType partition, ODB::FixedDatastoreType dt, uint64_t datalen, bool (*prune)(void* rawdata) = NULL, Archive* archive = NULL, void(*freep)(void*) = NULL, uint32_t sleep_duration = 0, uint32_t flags = 0);
+        ShardedODB(uint32_t num_shards, uint64_t (*key)(void* rawdata), PartitionType partition, ODB::IndirectDatastoreType dt, bool (*prune)(void* rawdata) = NULL, Archive* archive = NULL, void(*freep)(void*) = NULL, uint32_t sleep_duration = 0, uint32_t flags = 0);
+        ShardedODB(uint32_t num_shards, uint64_t (*key)(void* rawdata), PartitionType partition, ODB::VariableDatastoreType dt, bool (*prune)(void* rawdata) = NULL, Archive* archive = NULL, void(*freep)(void*) = NULL, uint32_t(*len)(void*) = len_v, uint32_t sleep_duration = 0, uint32_t flags = 0);
+
+        virtual ~ShardedODB();
+
+        ShardedIndex* create_index(ODB::IndexType type, uint32_t flags, int32_t(*compare)(void*, void*), void* (*merge)(void*, void*) = NULL, void* (*keygen)(void*) = NULL, int32_t keylen = -1);
+
+        void set_bounds(std::vector<uint64_t>* bounds);
+        uint32_t shard_of(void* rawdata);
+
+        void add_data(void* rawdata);
+        void add_data(void* rawdata, uint32_t nbytes);
+        void remove_sweep();
+        void purge();
+        uint64_t size();
+        std::vector<ODB*>* query(bool (*condition)(void*));
+        std::vector<ODB*>* query(Condition* condition);
+
+        uint32_t start_scheduler(uint32_t num_threads);
+        Scheduler* get_scheduler();
+
+        uint32_t get_num_shards();
+        ODB* get_shard(uint32_t i);
+
+    private:
+        void init(uint32_t sleep_duration);
+        void fan_out(void* (*func)(void*), void** args, uint32_t n);
+
+        /// The shards, each a complete ODB of its own.
+        std::vector<ODB*>* shards;
+
+        /// Index tables created across all of the shards.
+        std::vector<ShardedIndex*>* indices;
+
+        /// Function that gives the key a row is partitioned on.
+        uint64_t (*key)(void* rawdata);
+
+        PartitionType partition;
+
+        /// For RANGE partitioning, the first key that belongs to each shard after
+        ///the first.
+        std::vector<uint64_t>* bounds;
+
+        /// Scheduler that queries fan out across. NULL if they run one shard after
+        ///another on the calling thread.
+        Scheduler* scheduler;
+    };
+}
+
+#endif
+
+/// @class ShardedODB
+/// A set of independent ODBs behind one interface, with rows partitioned
+///between them by a key taken from each row.
+///
+/// Each shard has its own DataStore, Index tables and locks, so insertions that
+///land in different shards never contend with each other, and a sweep only
+///holds up the one shard it is running on. When the ODB is created with a sleep
+///duration, each shard gets its own memory checker thread, and their sweeps are
+///spread evenly across that interval rather than all landing at once. The
+///Archive, if one is given, is shared, and so may be called from several
+///shards at the same time.
+///
+/// Queries go to every shard, in parallel once start_scheduler() has been
+///called, and results from Index tables are merged back into index order.
+
+/// @fn ShardedODB::ShardedODB(uint32_t num_shards, uint64_t (*key)(void* rawdata), PartitionType partition, ODB::FixedDatastoreType dt, uint64_t datalen, bool (*prune)(void* rawdata) = NULL, Archive* archive = NULL, void(*freep)(void*) = NULL, uint32_t sleep_duration = 0, uint32_t flags = 0)
+/// Create a ShardedODB over fixed-width DataStores. The rest of the parameters
+///are passed to each shard, as for ODB::ODB.
+/// @param[in] num_shards Number of shards to split the rows across.
+/// @param[in] key Function giving the key a row is partitioned on.
+/// @param[in] partition Whether keys are hashed or split into ranges.
+
+/// @fn ShardedIndex* ShardedODB::create_index(ODB::IndexType type, uint32_t flags, int32_t(*compare)(void*, void*), void* (*merge)(void*, void*) = NULL, void* (*keygen)(void*) = NULL, int32_t keylen = -1)
+/// Create an Index table in every shard. The parameters are as for
+///ODB::create_index.
+/// @return The ShardedIndex to query them all through. It belongs to the
+///ShardedODB, and is deleted with it.
+
+/// @fn void ShardedODB::set_bounds(std::vector<uint64_t>* bounds)
+/// Set where the key ranges are split for RANGE partitioning. This should be
+///done before any rows are added, since rows aren't moved between shards.
+///Without it, the whole range of keys is split evenly.
+/// @param[in] bounds Ascending list of one fewer keys than there are shards.
+///Shard i+1 holds keys from bounds[i] up to, but not including, bounds[i+1].
+///The list is copied.
+
+/// @fn uint32_t ShardedODB::shard_of(void* rawdata)
+/// @param[in] rawdata A row.
+/// @return The shard that the row belongs in.
+
+/// @fn void ShardedODB::remove_sweep()
+/// Sweep each shard in turn. Only the shard being swept is held up.
+
+/// @fn std::vector<ODB*>* ShardedODB::query(Condition* condition)
+/// Run a full-scan query on every shard.
+/// @param[in] condition Condition that items must pass to be included.
+/// @return A vector holding the results from each shard, in shard order. Each
+///is an ODB as returned from ODB::query, and the vector belongs to the caller.
+
+/// @fn uint32_t ShardedODB::start_scheduler(uint32_t num_threads)
+/// Start a scheduler for queries to fan out across the shards on. The shards
+///themselves don't get it, so insertions stay synchronous.
+/// @param[in] num_threads Number of worker threads.
+/// @return The number of worker threads.
+
+/// @class ShardedIndex
+/// An Index table in each shard of a ShardedODB, queried as one.
+///
+/// Each shard's Index table is walked with its own iterator, in parallel if
+///the ShardedODB has a scheduler, and the ordered runs are merged so that the
+///results come back in the same order a single Index table would give them.
+///Results are lists of the rows themselves, as with Index::query_top_k, and
+///belong to the caller. Since the rows live in the shards, they are only good
+///until the next sweep of the shard they came from.
+
+/// @fn std::vector<void*>* ShardedIndex::query_lt(void* rawdata)
+/// @param[in] rawdata The value to compare against.
+/// @return Every row less than rawdata, largest first.
+
+/// @fn std::vector<void*>* ShardedIndex::query_gt(void* rawdata)
+/// @param[in] rawdata The value to compare against.
+/// @return Every row greater than rawdata, smallest first.
+
+/// @fn std::vector<void*>* ShardedIndex::query_top_k(uint64_t k, int8_t dir = 1)
+/// @param[in] k Number of rows to return.
+/// @param[in] dir The k largest, largest first, if this is non-negative.
+///Otherwise the k smallest, smallest first.
+/// @return Up to k rows from across all of the shards.
+/// @see Index::query_top_k
+
+/// @fn void* ShardedIndex::lookup(void* rawdata)
+/// @param[in] rawdata The value to look up.
+/// @return A row that compares equal to rawdata from any shard, or NULL.
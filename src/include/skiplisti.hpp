@@ -21,20 +21,174 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 #include "index.hpp"
+#include "iterator.hpp"
+#include "redblacktreei.hpp"
 
 namespace libodb
 {
-
+    /// @class SkipListI
+    /// Ordered index table that lets insertions into different parts of the
+    ///order run at the same time.
+    ///
+    /// The RedBlackTreeI takes its write lock for every insertion, since a
+    ///rotation can reach all the way up to the root. A skip list has no
+    ///rebalancing to do: an insertion only changes the nodes immediately before
+    ///the new one, on each of the levels it is linked into. So insertions take
+    ///the index's lock shared, find their place without any locking, and then
+    ///lock just those predecessors, check that nothing was linked in between in
+    ///the meantime, and link the new node in from the bottom up. Two insertions
+    ///only wait on each other if they land next to each other. Queries and
+    ///iterators also hold the lock shared, and may or may not see an insertion
+    ///that is still in flight. Removals, sweeps and updates take the lock
+    ///exclusively, so nodes are never unlinked from under anyone.
+    ///
+    /// The height of a node is taken from a hash of its data's address, with
+    ///each level having a quarter as many nodes as the one below it, so there's
+    ///no shared random number generator for the writers to fight over.
+    ///
+    /// Duplicates are handled the way the RedBlackTreeI handles them: once a
+    ///second equal value arrives, the node gets an embedded red-black tree of
+    ///every equal value, ordered by address, and the skip list itself only ever
+    ///has one node per distinct value.
     class LIBODB_API SkipListI : public Index
     {
+        /// We override this method inherited from the base Index class.
+        /// @{
+        using Index::query;
+        using Index::query_lt;
+        using Index::query_eq;
+        using Index::query_gt;
+        using Index::remove;
+        /// @}
+
+        /// Since the constructor is protected, ODB needs to be able to create new
+        ///index tables.
+        friend class ODB;
+
+        /// Iterators need to walk the list, and find their way backwards in it.
+        friend class SLIterator;
+
+    public:
+        ~SkipListI();
+
+        virtual Iterator* it_first();
+        virtual Iterator* it_last();
+        virtual Iterator* it_lookup(void* rawdata, int8_t dir = 0);
+        virtual void* lookup(void* rawdata);
+        virtual uint64_t mem_size();
+
+    protected:
+        /// Standard constructor
+        /// @param[in] ident Identifier to maintain data integrity.
+        /// @param[in] compare Comparison function used to order the list.
+        /// @param[in] merge Merge function used when duplicates are encountered.
+        ///If NULL, equal values are kept in an embedded tree in their node.
+        /// @param[in] drop_duplicates Whether or not to drop equal values.
+        SkipListI(uint64_t ident, Comparator* compare, Merger* merge, bool drop_duplicates);
+
+        /// A node in the list. Nodes are allocated with room for as many next
+        ///pointers as their height.
+        struct node
+        {
+            /// The value this node represents. If the node holds duplicates, this
+            ///is one of them.
+            void* data;
+
+            /// Embedded tree of every equal value, or NULL if there is only one.
+            struct RedBlackTreeI::e_tree_root* volatile dups;
+
+            /// Spin lock taken by insertions linking a node in after this one, or
+            ///adding a duplicate to it.
+            volatile uint8_t lock;
+
+            /// Number of levels this node is linked into.
+            uint8_t height;
+
+            /// The next node on each level.
+            struct node* volatile next[1];
+        };
+
+        /// A node in an embedded tree of duplicates. The links have to come first
+        ///for RedBlackTreeI::e_add.
+        struct dup_node
+        {
+            void* link[2];
+            void* data;
+        };
+
+        virtual bool add_data_v2(void* rawdata);
+        virtual void purge();
+        void query(Condition* condition, DataStore* ds);
+        void query_eq(void* rawdata, DataStore* ds);
+        void query_lt(void* rawdata, DataStore* ds);
+        void query_gt(void* rawdata, DataStore* ds);
+        virtual void update(std::vector<void*>* old_addr, std::vector<void*>* new_addr, uint64_t datalen = -1);
+        virtual bool remove(void* rawdata);
+        virtual void remove_sweep(std::vector<void*>* marked);
+
+        /// Find where a value belongs on every level, without taking any locks.
+        /// @param[in] rawdata Prototypical piece of data to compare against.
+        /// @param[out] preds The last node before rawdata on each level.
+        /// @param[out] succs The node after preds on each level.
+        /// @return The node holding values equal to rawdata, or NULL.
+        struct node* seek(void* rawdata, struct node** preds, struct node** succs);
+
+        /// @param[in] rawdata Prototypical piece of data to compare against.
+        /// @return The last node that compares as less than rawdata, or NULL.
+        struct node* before(void* rawdata);
+
+        /// Add a value to the node already holding values equal to it.
+        /// @return Whether the value was added, rather than merged or dropped.
+        bool add_equal(struct node* n, void* rawdata);
+
+        /// Remove a value, with the write lock already held.
+        bool remove_n(void* rawdata);
+
+        static struct node* make_node(void* rawdata, uint8_t height);
+        static void free_node(struct node* n);
+        static uint8_t node_height(void* rawdata);
+        static struct dup_node* make_dup(void* rawdata);
+
+        /// Orders the values in an embedded tree of duplicates by their address.
+        static int32_t compare_dup(void* a, void* b);
+
+        /// Collect the values held in a node, in order.
+        /// @param[in] n The node.
+        /// @param[out] values List the values are appended to.
+        static void node_values(struct node* n, std::vector<void*>* values);
+
+        /// Sentinel node that comes before every other, on every level.
+        struct node* head;
+    };
+
+    class LIBODB_API SLIterator : public Iterator
+    {
+        friend class SkipListI;
+
     public:
-        SkipListI(int(*)(void*, void*), void* (*)(void*, void*), bool);
-        virtual void add(void*);
+        virtual ~SLIterator();
+        virtual DataObj* next();
+        virtual DataObj* prev();
+        virtual DataObj* data();
+
+    protected:
+        SLIterator();
+        SLIterator(uint64_t ident, uint64_t true_datalen, bool time_stamp, bool query_count);
+
+        /// Move onto a node, at either its first or last value.
+        /// @return The iterator's DataObj, or NULL if n is NULL.
+        DataObj* load(struct SkipListI::node* n, bool last);
 
-    private:
+        SkipListI* index;
+        struct SkipListI::node* cursor;
 
+        /// The values held in the current node, so that a duplicate added while
+        ///the iterator is there doesn't move anything under it.
+        std::vector<void*>* values;
+        size_t pos;
     };
 
 }
@@ -0,0 +1,94 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Header file for point-in-time read views of an ODB.
+/// @file snapshot.hpp
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include "dll.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+namespace libodb
+{
+    class ODB;
+    class Index;
+    class Condition;
+
+    class LIBODB_API Snapshot
+    {
+        /// Only an ODB can create or release a snapshot of itself.
+        friend class ODB;
+
+    public:
+        ODB* query(bool (*condition)(void*));
+        ODB* query(Condition* condition);
+        ODB* query_eq(Index* index, void* rawdata);
+        ODB* query_lt(Index* index, void* rawdata);
+        ODB* query_gt(Index* index, void* rawdata);
+        uint64_t size();
+        uint64_t get_seq();
+
+    private:
+        Snapshot(ODB* odb, uint64_t seq, uint64_t count);
+        ~Snapshot();
+
+        ODB* results(std::vector<void*>* rows);
+
+        /// The ODB this is a view of.
+        ODB* odb;
+
+        /// Rows recorded as added at or after this are not part of the view.
+        uint64_t seq;
+
+        /// Number of rows in the view, which can't change while it is open.
+        uint64_t count;
+    };
+}
+
+#endif
+
+/// @class Snapshot
+/// A read-only view of an ODB as it was when ODB::snapshot() was called.
+///
+/// A snapshot shares the ODB's DataStore and Index tables rather than copying
+///them, so taking one costs nothing in proportion to the size of the ODB.
+///While any snapshot is open, the ODB records the rows added to it, and its
+///sweeps are put off until the last snapshot is released, so nothing a
+///snapshot can see is moved or freed underneath it. Queries against a
+///snapshot run against the live tables and leave out the rows added since.
+///
+/// Ingest carries on as normal while snapshots are open. Rows added through
+///an Index table directly, rather than through the ODB, are not recorded, and
+///nor are rows removed from one directly. Rows that ODB::upsert() merges into
+///change in place, and the snapshot sees them change.
+
+/// @fn ODB* Snapshot::query(Condition* condition)
+/// Scan the rows in the view.
+/// @param [in] condition Condition that rows must pass to be included.
+/// @return A new ODB holding the results, the same as from ODB::query().
+
+/// @fn ODB* Snapshot::query_eq(Index* index, void* rawdata)
+/// Query one of the ODB's Index tables, limited to the rows in the view.
+/// @param [in] index An Index table belonging to the ODB the snapshot is of.
+/// @param [in] rawdata The value to compare against.
+/// @return A new ODB holding the results, the same as from Index::query_eq().
+
+/// @fn uint64_t Snapshot::size()
+/// @return The number of rows in the view.
+
+/// @fn uint64_t Snapshot::get_seq()
+/// @return The sequence number of this snapshot. Later snapshots of the same
+///ODB have larger ones.
@@ -47,6 +47,13 @@ namespace libodb
     /// @return The literal x*x
 #ifndef SQUARE
 #define SQUARE(x) ((x) * (x))
+#endif
+
+    /// Minimum number of items a Condition query has to cover before it is split
+    ///across the worker threads of a scheduler. Below this, handing the parts out
+    ///costs more than the scan itself.
+#ifndef PARALLEL_QUERY_MIN
+#define PARALLEL_QUERY_MIN 4096
 #endif
 
     inline bool search(std::vector<void*>* marked, void* addr)
@@ -19,14 +19,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <map>
+#include <string>
+
 #include "odb.hpp"
 #include "scheduler.hpp"
 #include "datastore.hpp"
 #include "comparator.hpp"
 #include "iterator.hpp"
+#include "bankds.hpp"
+#include "linkedlistds.hpp"
 
 #include "lock.hpp"
 
+/// Cached results are keyed on the operation followed by the raw bytes of the key.
+#define CACHE_T std::map<std::string, std::vector<void*>*>
+#define CACHE_KEY_OP(k) ((CacheOp)((k)[0]))
+#define CACHE_KEY_DATA(k) ((void*)((k).data() + 1))
+
+#define GET_QUERY_COUNT(x, dlen) (*reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(x) + dlen + time_stamp * sizeof(time_t)))
+#define UPDATE_QUERY_COUNT(x, dlen) (GET_QUERY_COUNT(x, dlen)++);
+
 namespace libodb
 {
 
@@ -147,7 +160,6 @@ namespace libodb
     {
         struct sched_args* args = (struct sched_args*)argsV;
         args->ig->add_data_v(args->rawdata);
-        free(args);
 
         return NULL;
     }
@@ -165,11 +177,10 @@ namespace libodb
             }
             else
             {
-                struct sched_args* args;
-                SAFE_MALLOC(struct sched_args*, args, sizeof(struct sched_args));
-                args->rawdata = data->data;
-                args->ig = this;
-                scheduler->add_work(ig_sched_workload, args, NULL, Scheduler::NONE);
+                struct sched_args args;
+                args.rawdata = data->data;
+                args.ig = this;
+                scheduler->add_work_copy(ig_sched_workload, &args, sizeof(struct sched_args), NULL, Scheduler::NONE);
             }
         }
     }
@@ -185,7 +196,7 @@ namespace libodb
     inline ODB* IndexGroup::query(Condition* condition)
     {
         // Clone the parent.
-        DataStore* ds = parent->clone_indirect();
+        DataStore* ds = parent->clone_indirect(parent->size());
 
         // Query
         query(condition, ds);
@@ -198,7 +209,7 @@ namespace libodb
 
     inline ODB* IndexGroup::query_eq(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        DataStore* ds = parent->clone_indirect(1);
         query_eq(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -208,7 +219,7 @@ namespace libodb
 
     inline ODB* IndexGroup::query_lt(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        DataStore* ds = parent->clone_indirect(parent->size());
         query_lt(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -218,7 +229,7 @@ namespace libodb
 
     inline ODB* IndexGroup::query_gt(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        DataStore* ds = parent->clone_indirect(parent->size());
         query_gt(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -353,6 +364,23 @@ namespace libodb
         luid_val = strtoull(buf, &end, 16);
 #endif
         scheduler = NULL;
+
+        cache = NULL;
+        RWLOCK_INIT(cache_lock);
+        cache_max = 0;
+        cache_gen = 0;
+        cache_hits = 0;
+        cache_misses = 0;
+
+        LOCK_INIT(upsert_lock);
+    }
+
+    Index::~Index()
+    {
+        cache_clear();
+        delete (CACHE_T*)cache;
+        RWLOCK_DESTROY(cache_lock);
+        LOCK_DESTROY(upsert_lock);
     }
 
     inline void Index::add_data(DataObj* data)
@@ -369,6 +397,12 @@ namespace libodb
         return count;
     }
 
+    uint64_t Index::mem_size()
+    {
+        // A link and a pointer to the data for each item, as in a LinkedListI.
+        return count * 2 * sizeof(void*);
+    }
+
     inline uint64_t Index::luid()
     {
         return luid_val;
@@ -395,6 +429,11 @@ namespace libodb
         //     if (scheduler == NULL)
         //     {
         add_data_v2(rawdata);
+
+        if (cache != NULL)
+        {
+            cache_invalidate(rawdata);
+        }
         //     }
         //     else
         //     {
@@ -426,7 +465,7 @@ namespace libodb
     inline ODB* Index::query(Condition* condition)
     {
         // Clone the parent.
-        DataStore* ds = parent->clone_indirect();
+        DataStore* ds = parent->clone_indirect(count);
 
         // Query
         query(condition, ds);
@@ -439,7 +478,12 @@ namespace libodb
 
     inline ODB* Index::query_eq(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        if (cache != NULL)
+        {
+            return cache_query(CACHE_EQ, rawdata);
+        }
+
+        DataStore* ds = parent->clone_indirect(1);
         query_eq(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -449,7 +493,12 @@ namespace libodb
 
     inline ODB* Index::query_lt(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        if (cache != NULL)
+        {
+            return cache_query(CACHE_LT, rawdata);
+        }
+
+        DataStore* ds = parent->clone_indirect(count);
         query_lt(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -459,7 +508,12 @@ namespace libodb
 
     inline ODB* Index::query_gt(void* rawdata)
     {
-        DataStore* ds = parent->clone_indirect();
+        if (cache != NULL)
+        {
+            return cache_query(CACHE_GT, rawdata);
+        }
+
+        DataStore* ds = parent->clone_indirect(count);
         query_gt(rawdata, ds);
 
         ODB* odb = new ODB(ds, ident, parent->datalen);
@@ -467,6 +521,84 @@ namespace libodb
         return odb;
     }
 
+    std::vector<void*>* Index::query_top_k(uint64_t k, int8_t dir)
+    {
+        return query_top_k(NULL, k, dir);
+    }
+
+    std::vector<void*>* Index::query_top_k(Condition* condition, uint64_t k, int8_t dir)
+    {
+        std::vector<void*>* results = new std::vector<void*>();
+
+        if (k == 0)
+        {
+            return results;
+        }
+
+        // Not every index can walk backwards, so the generic version only walks
+        // forwards. Going down from the end means keeping the last k passes in a
+        // ring, and reading it back newest first.
+        Iterator* it = it_first();
+
+        if (it == NULL)
+        {
+            return results;
+        }
+
+        uint64_t n = 0;
+        void* temp;
+
+        if (it->data() != NULL)
+        {
+            do
+            {
+                temp = it->get_data();
+
+                if ((condition == NULL) || condition->condition(temp))
+                {
+                    if (dir < 0)
+                    {
+                        results->push_back(temp);
+
+                        if (results->size() == k)
+                        {
+                            break;
+                        }
+                    }
+                    else if (n < k)
+                    {
+                        results->push_back(temp);
+                        n++;
+                    }
+                    else
+                    {
+                        results->at(n % k) = temp;
+                        n++;
+                    }
+                }
+            } while (it->next());
+        }
+
+        it_release(it);
+
+        if (dir >= 0)
+        {
+            std::vector<void*>* ring = results;
+            uint64_t m = ring->size();
+            results = new std::vector<void*>();
+            results->reserve(m);
+
+            for (uint64_t i = 0; i < m; i++)
+            {
+                results->push_back(ring->at((n - 1 - i) % m));
+            }
+
+            delete ring;
+        }
+
+        return results;
+    }
+
     inline void Index::query(Condition* condition, DataStore* ds)
     {
     }
@@ -489,7 +621,14 @@ namespace libodb
 
     inline bool Index::remove(DataObj* data)
     {
-        return remove(data->data);
+        bool ret = remove(data->data);
+
+        if (ret && (cache != NULL))
+        {
+            cache_invalidate(data->data);
+        }
+
+        return ret;
     }
 
     inline bool Index::remove(void* rawdata)
@@ -516,10 +655,382 @@ namespace libodb
         return NULL;
     }
 
+    void* Index::lookup(void* rawdata)
+    {
+        Iterator* it = it_lookup(rawdata, 0);
+
+        if (it == NULL)
+        {
+            return NULL;
+        }
+
+        void* ret = it->get_data();
+        it_release(it);
+        return ret;
+    }
+
     inline void Index::it_release(Iterator* it)
     {
         delete it;
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
+    }
+
+    uint64_t Index::join(Index* a, Index* b, Comparator* compare, void (*pair)(void* a, void* b, void* context), void* context)
+    {
+        if (compare == NULL)
+        {
+            compare = a->compare;
+        }
+
+        // A table joined with itself is walked once, under one read lock, since no
+        // kind of lock can be read twice by the same thread. Each run of equal
+        // items pairs up with itself.
+        if (a == b)
+        {
+            Iterator* it = a->it_first();
+
+            if (it == NULL)
+            {
+                return 0;
+            }
+
+            std::vector<void*> run;
+            bool more = (it->data() != NULL);
+            uint64_t num_pairs = 0;
+
+            while (more)
+            {
+                run.clear();
+
+                do
+                {
+                    run.push_back(it->get_data());
+                    more = (it->next() != NULL);
+                } while (more && (compare->compare(run[0], it->get_data()) == 0));
+
+                for (size_t i = 0; i < run.size(); i++)
+                {
+                    for (size_t j = 0; j < run.size(); j++)
+                    {
+                        pair(run[i], run[j], context);
+                    }
+                }
+
+                num_pairs += run.size() * run.size();
+            }
+
+            a->it_release(it);
+
+            return num_pairs;
+        }
+
+        // Lock the two tables in address order, so that join(a, b) and join(b, a)
+        // can't each end up holding one lock while queued behind a writer on the
+        // other.
+        Iterator* it_a;
+        Iterator* it_b;
+
+        if (reinterpret_cast<uintptr_t>(a) < reinterpret_cast<uintptr_t>(b))
+        {
+            it_a = a->it_first();
+            it_b = b->it_first();
+        }
+        else
+        {
+            it_b = b->it_first();
+            it_a = a->it_first();
+        }
+
+        if ((it_a == NULL) || (it_b == NULL))
+        {
+            if (it_a != NULL)
+            {
+                a->it_release(it_a);
+            }
+
+            if (it_b != NULL)
+            {
+                b->it_release(it_b);
+            }
+
+            return 0;
+        }
+
+        // The run of items in b that are all equal to the current item in a.
+        std::vector<void*> run;
+        bool more_a = (it_a->data() != NULL);
+        bool more_b = (it_b->data() != NULL);
+        uint64_t num_pairs = 0;
+        int32_t c;
+
+        while (more_a && more_b)
+        {
+            c = compare->compare(it_a->get_data(), it_b->get_data());
+
+            if (c < 0)
+            {
+                more_a = (it_a->next() != NULL);
+            }
+            else if (c > 0)
+            {
+                more_b = (it_b->next() != NULL);
+            }
+            else
+            {
+                run.clear();
+
+                do
+                {
+                    run.push_back(it_b->get_data());
+                    more_b = (it_b->next() != NULL);
+                } while (more_b && (compare->compare(it_a->get_data(), it_b->get_data()) == 0));
+
+                // Every item in a that matches the head of the run matches all of it.
+                do
+                {
+                    for (size_t i = 0; i < run.size(); i++)
+                    {
+                        pair(it_a->get_data(), run[i], context);
+                    }
+
+                    num_pairs += run.size();
+                    more_a = (it_a->next() != NULL);
+                } while (more_a && (compare->compare(it_a->get_data(), run[0]) == 0));
+            }
+        }
+
+        a->it_release(it_a);
+        b->it_release(it_b);
+
+        return num_pairs;
+    }
+
+    void join_collect(void* a, void* b, void* context)
+    {
+        reinterpret_cast<std::vector<std::pair<void*, void*> >*>(context)->push_back(std::pair<void*, void*>(a, b));
+    }
+
+    std::vector<std::pair<void*, void*> >* Index::join(Index* a, Index* b, Comparator* compare)
+    {
+        std::vector<std::pair<void*, void*> >* pairs = new std::vector<std::pair<void*, void*> >();
+        join(a, b, compare, join_collect, pairs);
+        return pairs;
+    }
+
+    void Index::set_cache(uint32_t max_entries)
+    {
+        // Probes are cached by their bytes, and only rows of a fixed width say how
+        // many bytes that is. Indirect and variable-width datastores, and results
+        // drawn from them, would cache every probe under the same few bytes.
+        DataStore* root = parent;
+
+        while (root->parent != NULL)
+        {
+            root = root->parent;
+        }
+
+        if ((max_entries > 0) &&
+            ((dynamic_cast<BankIDS*>(root) != NULL) ||
+             (dynamic_cast<LinkedListIDS*>(root) != NULL) ||
+             (dynamic_cast<LinkedListVDS*>(root) != NULL)))
+        {
+            THROW_ERROR("CACHE_UNSIZED", "Results can only be cached for index tables on fixed-width data.");
+        }
+
+        if (max_entries == 0)
+        {
+            cache_clear();
+        }
+
+        WRITE_LOCK(cache_lock);
+        cache_max = max_entries;
+
+        if ((max_entries > 0) && (cache == NULL))
+        {
+            cache = new CACHE_T();
+        }
+        else if (max_entries == 0)
+        {
+            delete (CACHE_T*)cache;
+            cache = NULL;
+        }
+        WRITE_UNLOCK(cache_lock);
+    }
+
+    uint64_t Index::get_cache_hits()
+    {
+        return cache_hits;
+    }
+
+    uint64_t Index::get_cache_misses()
+    {
+        return cache_misses;
+    }
+
+    void Index::set_lock(RWLock::LockType type, bool stats)
+    {
+        delete rwlock;
+        rwlock = RWLock::create(type, stats);
+    }
+
+    RWLock* Index::get_lock()
+    {
+        return rwlock;
+    }
+
+    ODB* Index::cache_query(CacheOp op, void* rawdata)
+    {
+        std::string key(1, (char)op);
+        key.append(reinterpret_cast<char*>(rawdata), parent->true_datalen);
+
+        DataStore* ds = parent->clone_indirect(((op == CACHE_EQ) ? 1 : count));
+        std::vector<void*>* results = NULL;
+        uint64_t gen;
+
+        // Hits only read the cache, so they share the lock, and only inserting and
+        // dropping entries takes it for writing. The counters are bumped by many
+        // readers at once.
+        READ_LOCK(cache_lock);
+        CACHE_T::iterator entry;
+
+        if ((cache != NULL) && ((entry = ((CACHE_T*)cache)->find(key)) != ((CACHE_T*)cache)->end()))
+        {
+            SEQ_ATOMIC_INC(cache_hits);
+
+            // Replay the cached result, counting it against each item the same
+            // way a walk of the index would have.
+            bool time_stamp = parent->time_stamp;
+
+            for (size_t i = 0; i < entry->second->size(); i++)
+            {
+                if (parent->query_count)
+                {
+                    UPDATE_QUERY_COUNT(entry->second->at(i), parent->true_datalen);
+                }
+
+                ds->add_data(entry->second->at(i));
+            }
+
+            READ_UNLOCK(cache_lock);
+        }
+        else
+        {
+            SEQ_ATOMIC_INC(cache_misses);
+            gen = cache_gen;
+            READ_UNLOCK(cache_lock);
+
+            switch (op)
+            {
+            case CACHE_EQ:
+                query_eq(rawdata, ds);
+                break;
+            case CACHE_LT:
+                query_lt(rawdata, ds);
+                break;
+            default:
+                query_gt(rawdata, ds);
+            }
+
+            results = new std::vector<void*>();
+        }
+
+        ODB* odb = new ODB(ds, ident, parent->datalen);
+        ds->update_parent(odb);
+
+        if (results != NULL)
+        {
+            Iterator* it = odb->it_first();
+
+            if (it->data() != NULL)
+            {
+                do
+                {
+                    results->push_back(it->get_data());
+                } while (it->next());
+            }
+
+            odb->it_release(it);
+
+            // Anything that changed the index while the query was running might
+            // not be reflected in the results, so only keep them if nothing did.
+            WRITE_LOCK(cache_lock);
+            if ((cache != NULL) && (gen == cache_gen) && (((CACHE_T*)cache)->size() < cache_max))
+            {
+                (*((CACHE_T*)cache))[key] = results;
+                results = NULL;
+            }
+            WRITE_UNLOCK(cache_lock);
+
+            delete results;
+        }
+
+        return odb;
+    }
+
+    void Index::cache_invalidate(void* rawdata)
+    {
+        WRITE_LOCK(cache_lock);
+        cache_gen++;
+
+        if (cache == NULL)
+        {
+            WRITE_UNLOCK(cache_lock);
+            return;
+        }
+
+        CACHE_T* c = (CACHE_T*)cache;
+        CACHE_T::iterator entry = c->begin();
+        int32_t cmp;
+        bool drop;
+
+        while (entry != c->end())
+        {
+            cmp = compare->compare(rawdata, CACHE_KEY_DATA(entry->first));
+
+            switch (CACHE_KEY_OP(entry->first))
+            {
+            case CACHE_EQ:
+                drop = (cmp == 0);
+                break;
+            case CACHE_LT:
+                drop = (cmp < 0);
+                break;
+            default:
+                drop = (cmp > 0);
+            }
+
+            if (drop)
+            {
+                delete entry->second;
+                c->erase(entry++);
+            }
+            else
+            {
+                entry++;
+            }
+        }
+
+        WRITE_UNLOCK(cache_lock);
+    }
+
+    void Index::cache_clear()
+    {
+        WRITE_LOCK(cache_lock);
+        cache_gen++;
+
+        if (cache != NULL)
+        {
+            CACHE_T* c = (CACHE_T*)cache;
+
+            for (CACHE_T::iterator entry = c->begin(); entry != c->end(); entry++)
+            {
+                delete entry->second;
+            }
+
+            c->clear();
+        }
+
+        WRITE_UNLOCK(cache_lock);
     }
 
 }
@@ -17,67 +17,267 @@
 
 #include <stdlib.h>
 
-#include "lock.hpp"
+#include "common.hpp"
+#include "epoch.hpp"
+
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define LFQ_CAS64(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define LFQ_CASPTR(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define LFQ_ADD64(p, v) __sync_add_and_fetch((p), (v))
+#define LFQ_BARRIER() __sync_synchronize()
+#elif defined(WIN32)
+#include <Windows.h>
+#define LFQ_CAS64(p, o, n) (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(n), (LONG64)(o)) == (LONG64)(o))
+#define LFQ_CASPTR(p, o, n) (InterlockedCompareExchangePointer((volatile PVOID*)(p), (PVOID)(n), (PVOID)(o)) == (PVOID)(o))
+#define LFQ_ADD64(p, v) InterlockedAdd64((volatile LONG64*)(p), (v))
+#define LFQ_BARRIER() MemoryBarrier()
+#elif (CMAKE_COMPILER_SUITE_SUN)
+#include <atomic.h>
+#define LFQ_CAS64(p, o, n) (atomic_cas_64((volatile uint64_t*)(p), (uint64_t)(o), (uint64_t)(n)) == (uint64_t)(o))
+#define LFQ_CASPTR(p, o, n) (atomic_cas_ptr((volatile void*)(p), (void*)(o), (void*)(n)) == (void*)(o))
+#define LFQ_ADD64(p, v) atomic_add_64_nv((volatile uint64_t*)(p), (v))
+#define LFQ_BARRIER() (membar_exit(), membar_enter())
+#else
+#error "Can't find a way to atomically compare-and-swap for the LFQueue."
+#endif
+
+/// Number of items in each segment of the queue.
+#define LFQUEUE_SEGMENT_SIZE 128
 
-//! @todo Actually implement a lock-free queue, don't just wrap std::deque
 namespace libodb
 {
 
-    /// Eventually this should implement a lockfree queue, but for now it can simply
-    /// wrap an STL deque as much as is needed to satisfy the Scheduler. All it really
-    /// needs is push, pop, size and peek I think.
+    struct LFQueue::segment
+    {
+        struct cell
+        {
+            //! Equal to the position of the item while the slot is waiting for it,
+            //! and one past that once the item has been written.
+            volatile uint64_t seq;
+            void* data;
+        } cells[LFQUEUE_SEGMENT_SIZE];
+
+        //! Position of the first slot in the segment.
+        uint64_t base;
+        struct segment* volatile next;
+    };
 
-    //! @todo Convert this to the scheduler's spinlocks.
     LFQueue::LFQueue()
     {
-        base = new std::deque<void*>();
-        RWLOCK_INIT(rwlock);
+        enq_pos = 0;
+        deq_pos = 0;
+        head = new_segment(0);
+        tail = head;
     }
 
     LFQueue::~LFQueue()
     {
-        delete base;
-        RWLOCK_DESTROY(rwlock);
+        struct segment* seg;
+
+        while (head != NULL)
+        {
+            seg = head;
+            head = head->next;
+            free(seg);
+        }
     }
 
-    void LFQueue::push_back(void* item)
+    struct LFQueue::segment* LFQueue::new_segment(uint64_t base)
     {
-        WRITE_LOCK(rwlock);
-        base->push_back(item);
-        WRITE_UNLOCK(rwlock);
+        struct segment* seg;
+        SAFE_MALLOC(struct segment*, seg, sizeof(struct segment));
+
+        for (uint64_t i = 0; i < LFQUEUE_SEGMENT_SIZE; i++)
+        {
+            seg->cells[i].seq = base + i;
+        }
+
+        seg->base = base;
+        seg->next = NULL;
+        return seg;
     }
 
-    void* LFQueue::peek()
+    void LFQueue::push_back(void* item)
     {
-        READ_LOCK(rwlock);
-        void* ret = base->front();
-        READ_UNLOCK(rwlock);
-        return ret;
+        struct segment* seg;
+        struct segment* next;
+        uint64_t pos;
+
+        // Segments that the consumers run off the end of are retired to the
+        // reclaimer, so nothing looked at in here is freed before leaving.
+        uint64_t e = EpochReclaimer::enter();
+
+        while (true)
+        {
+            // Read the segment before the position, so that the position can't be
+            // from before the segment.
+            seg = tail;
+            pos = enq_pos;
+
+            if (pos >= seg->base + LFQUEUE_SEGMENT_SIZE)
+            {
+                // This segment is full, so move on to the next one, making it if
+                // nobody else has yet.
+                next = seg->next;
+
+                if (next == NULL)
+                {
+                    next = new_segment(seg->base + LFQUEUE_SEGMENT_SIZE);
+
+                    if (!LFQ_CASPTR(&(seg->next), (struct segment*)NULL, next))
+                    {
+                        free(next);
+                        next = seg->next;
+                    }
+                }
+
+                LFQ_CASPTR(&tail, seg, next);
+                continue;
+            }
+
+            struct segment::cell* c = &(seg->cells[pos - seg->base]);
+
+            if ((c->seq == pos) && LFQ_CAS64(&enq_pos, pos, pos + 1))
+            {
+                c->data = item;
+                LFQ_BARRIER();
+                c->seq = pos + 1;
+                break;
+            }
+        }
+
+        EpochReclaimer::exit(e);
     }
 
     void* LFQueue::pop_front()
     {
-        WRITE_LOCK(rwlock);
-        if (base->size() == 0)
+        struct segment* seg;
+        struct segment* next;
+        uint64_t pos;
+        uint64_t seq;
+        void* ret = NULL;
+
+        uint64_t e = EpochReclaimer::enter();
+
+        while (true)
         {
-            WRITE_UNLOCK(rwlock);
-            return NULL;
+            seg = head;
+            pos = deq_pos;
+
+            if (pos >= seg->base + LFQUEUE_SEGMENT_SIZE)
+            {
+                next = seg->next;
+
+                // Nothing has been added past the end of this segment.
+                if (next == NULL)
+                {
+                    break;
+                }
+
+                if (LFQ_CASPTR(&head, seg, next))
+                {
+                    // The producers may not have moved off of the segment yet, and
+                    // they need to have before it can be retired.
+                    LFQ_CASPTR(&tail, seg, next);
+                    EpochReclaimer::retire(seg);
+                }
+
+                continue;
+            }
+
+            struct segment::cell* c = &(seg->cells[pos - seg->base]);
+            seq = c->seq;
+
+            if (seq == pos + 1)
+            {
+                if (LFQ_CAS64(&deq_pos, pos, pos + 1))
+                {
+                    LFQ_BARRIER();
+                    ret = c->data;
+                    break;
+                }
+            }
+            else if (seq == pos)
+            {
+                // The item for this position hasn't been written yet, which means
+                // the queue is empty, or about to not be.
+                break;
+            }
         }
-        else
+
+        EpochReclaimer::exit(e);
+        return ret;
+    }
+
+    void* LFQueue::peek()
+    {
+        struct segment* seg;
+        uint64_t pos;
+        uint64_t seq;
+        void* ret = NULL;
+
+        uint64_t e = EpochReclaimer::enter();
+
+        while (true)
         {
-            void* front = base->front();
-            base->pop_front();
-            WRITE_UNLOCK(rwlock);
-            return front;
+            seg = head;
+            pos = deq_pos;
+
+            if (pos >= seg->base + LFQUEUE_SEGMENT_SIZE)
+            {
+                if (seg->next == NULL)
+                {
+                    break;
+                }
+
+                // Leave moving the head on to the consumers.
+                if (head == seg)
+                {
+                    seg = seg->next;
+                }
+                else
+                {
+                    continue;
+                }
+
+                if ((pos < seg->base) || (pos >= seg->base + LFQUEUE_SEGMENT_SIZE))
+                {
+                    continue;
+                }
+            }
+
+            struct segment::cell* c = &(seg->cells[pos - seg->base]);
+            seq = c->seq;
+
+            if (seq == pos + 1)
+            {
+                LFQ_BARRIER();
+                ret = c->data;
+
+                if (deq_pos == pos)
+                {
+                    break;
+                }
+            }
+            else if ((seq == pos) && (deq_pos == pos))
+            {
+                ret = NULL;
+                break;
+            }
         }
+
+        EpochReclaimer::exit(e);
+        return ret;
     }
 
     uint64_t LFQueue::size()
     {
-        READ_LOCK(rwlock);
-        size_t s = base->size();
-        READ_UNLOCK(rwlock);
-        return s;
+        // Read the consumer position first so that it can't pass the producer's.
+        uint64_t d = deq_pos;
+        LFQ_BARRIER();
+        uint64_t e = enq_pos;
+
+        return ((e > d) ? (e - d) : 0);
     }
 
 }
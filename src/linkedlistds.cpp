@@ -23,6 +23,8 @@
 #include "archive.hpp"
 #include "common.hpp"
 #include "index.hpp"
+#include "comparator.hpp"
+#include "epoch.hpp"
 
 #include "lock.hpp"
 
@@ -60,6 +62,8 @@ namespace libodb
     LinkedListVDS::LinkedListVDS(DataStore* _parent, bool(*_prune)(void* rawdata), uint32_t(*_len)(void*), uint32_t _flags) : LinkedListDS(_parent, _prune, 0, _flags)
     {
         this->len = _len;
+        added_rows = 0;
+        added_bytes = 0;
     }
 
     //! @todo Since the only read case we (currently) have is trivial, might a
@@ -76,7 +80,7 @@ namespace libodb
 
     LinkedListDS::~LinkedListDS()
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         struct datanode * curr = bottom;
         struct datanode * prev;
 
@@ -87,7 +91,7 @@ namespace libodb
             free(prev);
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline void* LinkedListDS::add_data(void* rawdata)
@@ -114,11 +118,11 @@ namespace libodb
         struct datanode* new_element;
         SAFE_MALLOC(struct datanode*, new_element, (size_t)(datalen + sizeof(struct datanode*)));
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         new_element->next = bottom;
         bottom = new_element;
         data_count++;
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         return &(new_element->data);
     }
@@ -161,11 +165,13 @@ namespace libodb
         struct datas* ds = (struct datas*)(&new_element->data);
         ds->datalen = nbytes;
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         new_element->next = bottom;
         bottom = new_element;
         data_count++;
-        WRITE_UNLOCK(rwlock);
+        added_rows++;
+        added_bytes += nbytes;
+        rwlock->write_unlock();
 
         return &(ds->data);
     }
@@ -194,23 +200,23 @@ namespace libodb
 
         if (index == data_count - 1)
         {
-            WRITE_LOCK(rwlock);
+            rwlock->write_lock();
             void* old_bottom = bottom;
             bottom = bottom->next;
 
             if (old_bottom != NULL)
             {
-                free(old_bottom);
+                EpochReclaimer::retire(old_bottom);
             }
 
             data_count--;
-            WRITE_UNLOCK(rwlock);
+            rwlock->write_unlock();
 
             return true;
         }
         else
         {
-            WRITE_LOCK(rwlock);
+            rwlock->write_lock();
             void* temp;
 
             // Handle removing the first item differently, as we need to re-point the bottom pointer.
@@ -218,7 +224,7 @@ namespace libodb
             {
                 temp = bottom;
                 bottom = bottom->next;
-                free(temp);
+                EpochReclaimer::retire(temp);
             }
             else
             {
@@ -231,11 +237,11 @@ namespace libodb
 
                 temp = curr->next;
                 curr->next = curr->next->next;
-                free(temp);
+                EpochReclaimer::retire(temp);
             }
 
             data_count--;
-            WRITE_UNLOCK(rwlock);
+            rwlock->write_unlock();
 
             return true;
         }
@@ -243,7 +249,7 @@ namespace libodb
 
     inline bool LinkedListDS::remove_addr(void* addr)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         void* temp;
 
         // Handle removing the first item differently, as we need to re-point the bottom pointer.
@@ -263,7 +269,7 @@ namespace libodb
 
             if ((curr->next) == NULL)
             {
-                WRITE_UNLOCK(rwlock);
+                rwlock->write_unlock();
                 return false;
             }
 
@@ -272,9 +278,10 @@ namespace libodb
         }
 
         data_count--;
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
-        free(temp);
+        // Readers without the lock may still be on their way to it.
+        EpochReclaimer::retire(temp);
         return true;
     }
 
@@ -286,7 +293,7 @@ namespace libodb
         marked[1] = new std::vector<void*>();
         marked[2] = NULL;
 
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         if (bottom != NULL)
         {
             struct datanode* curr = bottom;
@@ -317,9 +324,10 @@ namespace libodb
 
                 curr = curr->next;
             }
-            READ_UNLOCK(rwlock);
+            rwlock->read_unlock();
 
             bool(*temp)(void*);
+            LOCK(clones_lock);
             for (uint32_t i = 0; i < clones->size(); i++)
             {
                 temp = clones->at(i)->get_prune();
@@ -327,12 +335,13 @@ namespace libodb
                 clones->at(i)->remove_sweep();
                 clones->at(i)->set_prune(temp);
             }
+            UNLOCK(clones_lock);
 
             sort(marked[0]->begin(), marked[0]->end());
         }
         else
         {
-            READ_UNLOCK(rwlock);
+            rwlock->read_unlock();
         }
 
         return marked;
@@ -346,7 +355,7 @@ namespace libodb
         marked[1] = new std::vector<void*>();
         marked[2] = NULL;
 
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         if (bottom != NULL)
         {
             struct datanode* curr = bottom;
@@ -374,9 +383,10 @@ namespace libodb
 
                 curr = curr->next;
             }
-            READ_UNLOCK(rwlock);
+            rwlock->read_unlock();
 
             bool(*temp)(void*);
+            LOCK(clones_lock);
             for (uint32_t i = 0; i < clones->size(); i++)
             {
                 temp = clones->at(i)->get_prune();
@@ -384,12 +394,13 @@ namespace libodb
                 clones->at(i)->remove_sweep();
                 clones->at(i)->set_prune(temp);
             }
+            UNLOCK(clones_lock);
 
             sort(marked[0]->begin(), marked[0]->end());
         }
         else
         {
-            READ_UNLOCK(rwlock);
+            rwlock->read_unlock();
         }
 
         return marked;
@@ -397,7 +408,7 @@ namespace libodb
 
     void LinkedListDS::remove_cleanup(std::vector<void*>** marked)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         // Remove all but the first item.
         // We need to traverse last to first so we don't unlink any 'parents'.
         struct datanode* curr;
@@ -407,10 +418,10 @@ namespace libodb
             curr = reinterpret_cast<struct datanode*>(marked[1]->at(i));
             temp = curr->next;
             curr->next = curr->next->next;
-            free(temp);
+            EpochReclaimer::retire(temp);
         }
         data_count -= marked[1]->size();
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         delete marked[0];
         delete marked[1];
@@ -419,12 +430,14 @@ namespace libodb
 
     void LinkedListDS::purge(void(*freep)(void*))
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
+        LOCK(clones_lock);
         size_t num_clones = clones->size();
         for (size_t i = 0; i < num_clones; i++)
         {
             clones->at(i)->purge();
         }
+        UNLOCK(clones_lock);
 
         struct datanode* curr = bottom;
         struct datanode* next = bottom->next;
@@ -436,7 +449,7 @@ namespace libodb
             {
                 freep(&(curr->data));
             }
-            free(curr);
+            EpochReclaimer::retire(curr);
             curr = next;
             next = next->next;
         }
@@ -446,32 +459,32 @@ namespace libodb
         {
             free(&(curr->data));
         }
-        free(curr);
+        EpochReclaimer::retire(curr);
 
         data_count = 0;
         bottom = NULL;
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline void LinkedListDS::populate(Index* index)
     {
+        rwlock->read_lock();
         struct datanode* curr = bottom;
 
-        READ_LOCK(rwlock);
         while (curr != NULL)
         {
             index->add_data_v(&(curr->data));
             curr = curr->next;
         }
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
     }
 
     inline void LinkedListIDS::populate(Index* index)
     {
+        rwlock->read_lock();
         struct datanode* curr = bottom;
 
-        READ_LOCK(rwlock);
         while (curr != NULL)
         {
             // Needed to avoid a "dereferencing type-punned pointer will break strict-aliasing rules" error.
@@ -480,23 +493,59 @@ namespace libodb
             index->add_data_v(b);
             curr = curr->next;
         }
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
+    }
+
+    inline void LinkedListDS::query(Condition* condition, DataStore* ds)
+    {
+        // The head can change under an add or a sweep, so it is only read under the lock.
+        rwlock->read_lock();
+        struct datanode* curr = bottom;
+
+        while (curr != NULL)
+        {
+            if (condition->condition(&(curr->data)))
+            {
+                ds->add_data(&(curr->data));
+            }
+            curr = curr->next;
+        }
+        rwlock->read_unlock();
+    }
+
+    inline void LinkedListIDS::query(Condition* condition, DataStore* ds)
+    {
+        rwlock->read_lock();
+        struct datanode* curr = bottom;
+
+        while (curr != NULL)
+        {
+            char** a = reinterpret_cast<char**>(&(curr->data));
+            void* b = reinterpret_cast<void*>(*a);
+
+            if (condition->condition(b))
+            {
+                ds->add_data(b);
+            }
+            curr = curr->next;
+        }
+        rwlock->read_unlock();
     }
 
     /// @attention O(n) complexity. Avoid if possilbe.
     inline void* LinkedListDS::get_at(uint64_t index)
     {
+        rwlock->read_lock();
         struct datanode * cur_item = bottom;
         uint32_t cur_index = 0;
 
-        READ_LOCK(rwlock);
         while (cur_index < index && cur_item != NULL)
         {
             cur_index++;
             cur_item = cur_item->next;
         }
 
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
         if (cur_item != NULL)
         {
             return &(cur_item->data);
@@ -517,32 +566,53 @@ namespace libodb
         return new LinkedListDS(this, prune, datalen, flags);
     }
 
-    inline DataStore* LinkedListDS::clone_indirect()
+    inline DataStore* LinkedListDS::clone_indirect(uint64_t hint)
     {
         return new LinkedListIDS(this, prune, flags);
     }
 
+    uint64_t LinkedListDS::mem_size()
+    {
+        return data_count * (datalen + sizeof(struct datanode*));
+    }
+
     inline DataStore* LinkedListVDS::clone()
     {
         // Return an indirect version of this datastore, with this datastore marked as its parent.
         return new LinkedListVDS(this, prune, len, flags);
     }
 
-    inline DataStore* LinkedListVDS::clone_indirect()
+    inline DataStore* LinkedListVDS::clone_indirect(uint64_t hint)
     {
         // Return an indirect version of this datastore, with this datastore marked as its parent.
         return new LinkedListIDS(this, prune, flags);
     }
 
+    uint64_t LinkedListVDS::mem_size()
+    {
+        uint64_t rows = data_count;
+        uint64_t fixed = rows * (datalen + sizeof(uint32_t) + sizeof(struct datanode*));
+
+        return (added_rows == 0 ? fixed : fixed + (rows * added_bytes) / added_rows);
+    }
+
     Iterator* LinkedListDS::it_first()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
 
         LinkedListDSIterator* it = new LinkedListDSIterator();
         it->dstore = this;
 
         it->cur = bottom;
-        it->dataobj->data = (void*)(&(it->cur->data));
+
+        if (bottom == NULL)
+        {
+            it->dataobj->data = NULL;
+        }
+        else
+        {
+            it->dataobj->data = (void*)(&(it->cur->data));
+        }
 
         return it;
     }
@@ -20,6 +20,7 @@
 #include "utility.hpp"
 #include "comparator.hpp"
 #include "common.hpp"
+#include "scheduler.hpp"
 
 #include "lock.hpp"
 
@@ -31,7 +32,7 @@ namespace libodb
 
     LinkedListI::LinkedListI(uint64_t _ident, Comparator* _compare, Merger* _merge, bool _drop_duplicates)
     {
-        RWLOCK_INIT(rwlock);
+        rwlock = RWLock::create();
         this->ident = _ident;
         first = NULL;
         this->compare = _compare;
@@ -51,12 +52,12 @@ namespace libodb
         }
 
         //! @todo Move the lock destroy/init into Index ctor and dtor
-        RWLOCK_DESTROY(rwlock);
+        delete rwlock;
     }
 
     inline bool LinkedListI::add_data_v2(void* rawdata)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         // When the list is empty, make a new node and set it as the head of the list.
         if (first == NULL)
@@ -81,14 +82,14 @@ namespace libodb
                     if (merge != NULL)
                     {
                         first->data = merge->merge(rawdata, first->data);
-                        WRITE_UNLOCK(rwlock);
+                        rwlock->write_unlock();
                         return false;
                     }
 
                     // If we don't allow duplicates, return now.
                     if (drop_duplicates)
                     {
-                        WRITE_UNLOCK(rwlock);
+                        rwlock->write_unlock();
                         return false;
                     }
                 }
@@ -116,13 +117,13 @@ namespace libodb
                     if (merge != NULL)
                     {
                         curr->next->data = merge->merge(rawdata, curr->next->data);
-                        WRITE_UNLOCK(rwlock);
+                        rwlock->write_unlock();
                         return false;
                     }
 
                     if (drop_duplicates)
                     {
-                        WRITE_UNLOCK(rwlock);
+                        rwlock->write_unlock();
                         return false;
                     }
                 }
@@ -137,28 +138,28 @@ namespace libodb
             count++;
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         return true;
     }
 
     void LinkedListI::purge()
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         free_list(first);
 
         count = 0;
         first = NULL;
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     bool LinkedListI::remove(void* data)
     {
         bool ret = false;
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         if (first != NULL)
         {
             if (compare->compare(data, first->data) == 0)
@@ -186,7 +187,7 @@ namespace libodb
                 }
             }
         }
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         return ret;
     }
@@ -205,26 +206,91 @@ namespace libodb
 
     void LinkedListI::query(Condition* condition, DataStore* ds)
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         struct node* curr = first;
 
-        while (curr != NULL)
+        if ((scheduler == NULL) || (scheduler->get_num_threads() == 0) || (count < PARALLEL_QUERY_MIN))
+        {
+            while (curr != NULL)
+            {
+                if (condition->condition(curr->data))
+                {
+                    ds->add_data(curr->data);
+                }
+
+                curr = curr->next;
+            }
+        }
+        else
+        {
+            // A list can't be split without walking it, but chasing the next pointers
+            // is cheap next to evaluating the condition, so do one pass here to
+            // cut it into runs and hand the runs out.
+            uint32_t num_parts = 4 * (scheduler->get_num_threads() + 1);
+            uint64_t run = count / num_parts + 1;
+            uint64_t i = 0;
+
+            std::vector<void*> parts;
+            struct query_part* part = NULL;
+
+            while (curr != NULL)
+            {
+                if ((i % run) == 0)
+                {
+                    SAFE_MALLOC(struct query_part*, part, sizeof(struct query_part));
+                    part->condition = condition;
+                    part->start = curr;
+                    part->len = 0;
+                    part->results = new std::vector<void*>();
+                    parts.push_back(part);
+                }
+
+                part->len++;
+                i++;
+                curr = curr->next;
+            }
+
+            scheduler->run_batch(query_part_workload, &parts[0], (uint32_t)parts.size());
+
+            for (size_t j = 0; j < parts.size(); j++)
+            {
+                part = (struct query_part*)parts[j];
+
+                for (size_t k = 0; k < part->results->size(); k++)
+                {
+                    ds->add_data(part->results->at(k));
+                }
+
+                delete part->results;
+                free(part);
+            }
+        }
+        rwlock->read_unlock();
+    }
+
+    void* LinkedListI::query_part_workload(void* partV)
+    {
+        struct query_part* part = (struct query_part*)partV;
+        struct node* curr = part->start;
+
+        for (uint64_t i = 0; i < part->len; i++)
         {
-            if (condition->condition(curr->data))
+            if (part->condition->condition(curr->data))
             {
-                ds->add_data(curr->data);
+                part->results->push_back(curr->data);
             }
 
             curr = curr->next;
         }
-        READ_UNLOCK(rwlock);
+
+        return NULL;
     }
 
     inline void LinkedListI::update(std::vector<void*>* old_addr, std::vector<void*>* new_addr, uint64_t datalen)
     {
         sort(old_addr->begin(), old_addr->end());
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         struct node* curr = first;
         uint32_t i = 0;
@@ -248,12 +314,12 @@ namespace libodb
             curr = curr->next;
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline void LinkedListI::remove_sweep(std::vector<void*>* marked)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         void* temp;
 
         while ((first != NULL) && (search(marked, first->data)))
@@ -278,12 +344,12 @@ namespace libodb
                 curr = curr->next;
             }
         }
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     inline Iterator* LinkedListI::it_first()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         LLIterator* it = new LLIterator(ident, parent->true_datalen, parent->time_stamp, parent->query_count);
         it->cursor = first;
         if (first != NULL)
@@ -300,7 +366,7 @@ namespace libodb
 
     inline Iterator* LinkedListI::it_middle(DataObj* data)
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         return NULL;
     }
 
@@ -347,7 +413,14 @@ namespace libodb
 
     inline DataObj* LLIterator::data()
     {
-        return dataobj;
+        if (dataobj->data == NULL)
+        {
+            return NULL;
+        }
+        else
+        {
+            return dataobj;
+        }
     }
 
 }
@@ -0,0 +1,351 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for the process-wide maintenance service that sweeps ODBs.
+/// @file maintenance.cpp
+
+#include "maintenance.hpp"
+#include "odb.hpp"
+#include "scheduler.hpp"
+
+#include <time.h>
+#include <vector>
+
+#include "common.hpp"
+#include "lock.hpp"
+
+#ifdef CPP11THREADS
+#include <chrono>
+#include <thread>
+
+#define THREAD_CREATE(t, f, a) (t) = new std::thread((f), (a))
+#else
+#include <pthread.h>
+
+#define THREAD_CREATE(t, f, a) \
+    SAFE_MALLOC(void*, t, sizeof(pthread_t));\
+    pthread_create((pthread_t*)(t), NULL, &(f), (a));
+#endif
+
+/// Number of slots, one per second, in the timer wheel. Periods longer than this
+///go round more than once.
+#define MAINT_SLOTS 256
+
+/// Number of worker threads sweeps run on, unless set_workers() says otherwise.
+#define MAINT_WORKERS 2
+
+namespace libodb
+{
+    struct maint_entry
+    {
+        ODB* odb;
+        uint32_t period;
+
+        /// The tick the next scheduled sweep is due on.
+        uint64_t due;
+
+        /// Whether a scheduled sweep is queued or running. Only one is allowed at
+        /// a time.
+        volatile bool sweep_busy;
+
+        /// Whether a soft watermark check is queued or running. These are kept
+        /// apart from sweep_busy so a check in flight never costs a scheduled
+        /// sweep its turn.
+        volatile bool check_busy;
+
+        /// The next entry in the same slot of the wheel.
+        struct maint_entry* next;
+    };
+
+    // Everything here is created on first use, since there's no telling what order
+    // the library's statics are set up in, and is covered by maint_lock.
+    static void* maint_lock = NULL;
+    static struct maint_entry* wheel[MAINT_SLOTS];
+    static uint32_t load[MAINT_SLOTS];
+    static std::vector<struct maint_entry*>* entries = NULL;
+    static Scheduler* workers = NULL;
+    static void* timer_thread = NULL;
+    static volatile uint64_t ticks = 0;
+    static volatile uint64_t sweeps = 0;
+
+    void MaintenanceService::init()
+    {
+        static volatile uint64_t initialized = 0;
+
+        if (initialized != 2)
+        {
+            if (SEQ_CAS64(initialized, (uint64_t)0, (uint64_t)1))
+            {
+                LOCK_INIT(maint_lock);
+
+                for (uint32_t i = 0; i < MAINT_SLOTS; i++)
+                {
+                    wheel[i] = NULL;
+                    load[i] = 0;
+                }
+
+                entries = new std::vector<struct maint_entry*>();
+                workers = new Scheduler(MAINT_WORKERS);
+                THREAD_CREATE(timer_thread, timer, NULL);
+                SEQ_BARRIER();
+                initialized = 2;
+            }
+            else
+            {
+                while (initialized != 2)
+                {
+                    SEQ_YIELD();
+                }
+            }
+        }
+    }
+
+    // The wheel is only touched with maint_lock held.
+    static void wheel_insert(struct maint_entry* e)
+    {
+        uint32_t slot = e->due % MAINT_SLOTS;
+        e->next = wheel[slot];
+        wheel[slot] = e;
+        load[slot]++;
+    }
+
+    static void wheel_remove(struct maint_entry* e)
+    {
+        uint32_t slot = e->due % MAINT_SLOTS;
+        struct maint_entry** curr = &(wheel[slot]);
+
+        while (*curr != e)
+        {
+            curr = &((*curr)->next);
+        }
+
+        *curr = e->next;
+        load[slot]--;
+    }
+
+    void MaintenanceService::queue_sweep(struct maint_entry* e)
+    {
+        e->sweep_busy = true;
+        workers->add_work(sweep_workload, e, NULL, Scheduler::BACKGROUND);
+    }
+
+    void MaintenanceService::add(ODB* odb, uint32_t period, uint32_t offset)
+    {
+        init();
+
+        struct maint_entry* e;
+        SAFE_MALLOC(struct maint_entry*, e, sizeof(struct maint_entry));
+        e->odb = odb;
+        e->period = (period == 0 ? 1 : period);
+        e->sweep_busy = false;
+        e->check_busy = false;
+
+        LOCK(maint_lock);
+
+        uint64_t now = ticks;
+
+        if (offset == STAGGER)
+        {
+            // Take the quietest second out of the first period. Only one lap of
+            // the wheel can be told apart, so longer periods make do with that.
+            uint32_t span = (e->period < MAINT_SLOTS ? e->period : MAINT_SLOTS);
+            e->due = now + 1;
+
+            for (uint32_t i = 2; i <= span; i++)
+            {
+                if (load[(now + i) % MAINT_SLOTS] < load[e->due % MAINT_SLOTS])
+                {
+                    e->due = now + i;
+                }
+            }
+        }
+        else
+        {
+            e->due = now + (offset < e->period ? e->period - offset : 1);
+        }
+
+        wheel_insert(e);
+        entries->push_back(e);
+
+        UNLOCK(maint_lock);
+    }
+
+    void MaintenanceService::remove(ODB* odb)
+    {
+        struct maint_entry* e = NULL;
+
+        init();
+        LOCK(maint_lock);
+
+        for (size_t i = 0; i < entries->size(); i++)
+        {
+            if (entries->at(i)->odb == odb)
+            {
+                e = entries->at(i);
+                entries->at(i) = entries->back();
+                entries->pop_back();
+                wheel_remove(e);
+                break;
+            }
+        }
+
+        UNLOCK(maint_lock);
+
+        if (e != NULL)
+        {
+            // It can't be queued again now, so once any sweep in flight is done,
+            // nothing refers to it.
+            while (e->sweep_busy || e->check_busy)
+            {
+                SEQ_YIELD();
+            }
+
+            free(e);
+        }
+    }
+
+    uint32_t MaintenanceService::set_workers(uint32_t num_threads)
+    {
+        init();
+        return workers->update_num_threads(num_threads);
+    }
+
+    uint32_t MaintenanceService::next_due(ODB* odb)
+    {
+        uint32_t ret = 0;
+
+        init();
+        LOCK(maint_lock);
+
+        for (size_t i = 0; i < entries->size(); i++)
+        {
+            if (entries->at(i)->odb == odb)
+            {
+                ret = (uint32_t)(entries->at(i)->due - ticks);
+                break;
+            }
+        }
+
+        UNLOCK(maint_lock);
+
+        return ret;
+    }
+
+    uint64_t MaintenanceService::get_sweeps()
+    {
+        return sweeps;
+    }
+
+    void* MaintenanceService::sweep_workload(void* arg)
+    {
+        struct maint_entry* e = (struct maint_entry*)arg;
+
+        e->odb->remove_sweep();
+        SEQ_ATOMIC_INC(sweeps);
+
+        SEQ_BARRIER();
+        e->sweep_busy = false;
+
+        return NULL;
+    }
+
+    void* MaintenanceService::check_workload(void* arg)
+    {
+        struct maint_entry* e = (struct maint_entry*)arg;
+
+        if (e->odb->mem_size() > e->odb->mem_soft)
+        {
+            e->odb->remove_sweep();
+            SEQ_ATOMIC_INC(sweeps);
+        }
+
+        SEQ_BARRIER();
+        e->check_busy = false;
+
+        return NULL;
+    }
+
+    void* MaintenanceService::timer(void* arg)
+    {
+#ifdef CPP11THREADS
+        std::chrono::seconds dura(1);
+#else
+        struct timespec ts;
+
+        ts.tv_sec = 1;
+        ts.tv_nsec = 0;
+#endif
+
+        while (true)
+        {
+#ifdef CPP11THREADS
+            std::this_thread::sleep_for(dura);
+#else
+            nanosleep(&ts, NULL);
+#endif
+
+            time_t cur = time(NULL);
+
+            LOCK(maint_lock);
+
+            ticks++;
+
+            // Everything in this slot is due now or some number of laps from now.
+            // Move the due ones on to their next sweep.
+            struct maint_entry* curr = wheel[ticks % MAINT_SLOTS];
+            struct maint_entry* next;
+
+            while (curr != NULL)
+            {
+                next = curr->next;
+
+                if (curr->due <= ticks)
+                {
+                    if (!curr->sweep_busy)
+                    {
+                        queue_sweep(curr);
+                    }
+
+                    wheel_remove(curr);
+                    curr->due = ticks + curr->period;
+                    wheel_insert(curr);
+                }
+
+                curr = next;
+            }
+
+            // Working out an ODB's size waits on its locks, which a long write
+            // can hold for a while, so that's left to the workers too rather
+            // than holding up the wheel and maint_lock.
+            for (size_t i = 0; i < entries->size(); i++)
+            {
+                struct maint_entry* e = entries->at(i);
+
+                if (e->odb->get_time() < cur)
+                {
+                    e->odb->update_time(cur);
+                }
+
+                // A sweep already in flight will bring the size down anyway.
+                if (!e->check_busy && !e->sweep_busy && (e->odb->mem_soft != 0))
+                {
+                    e->check_busy = true;
+                    workers->add_work(check_workload, e, NULL, Scheduler::BACKGROUND);
+                }
+            }
+
+            UNLOCK(maint_lock);
+        }
+
+        return NULL;
+    }
+}
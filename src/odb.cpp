@@ -15,30 +15,19 @@
 
 #include <string.h>
 #include <vector>
+#include <map>
 #include <time.h>
 
 #include "odb.hpp"
 #include "scheduler.hpp"
+#include "maintenance.hpp"
 
 #ifdef CPP11THREADS
-#include <chrono>
-#include <thread>
 #include <mutex>
-
-#define THREAD_CREATE(t, f, a) (t) = new std::thread((f), (a))
-#define THREAD_JOIN(t) if (((std::thread*)(t))->joinable()) ((std::thread*)(t))->join()
-#define THREAD_DESTROY(t) delete (std::thread*)(t);
 #else
 #include <unistd.h>
-#include <pthread.h>
 
 #include "common.hpp"
-
-#define THREAD_CREATE(t, f, a) \
-    SAFE_MALLOC(void*, t, sizeof(pthread_t));\
-    pthread_create((pthread_t*)(t), NULL, &(f), (a));
-#define THREAD_JOIN(t) pthread_join(*(pthread_t*)(t), NULL)
-#define THREAD_DESTROY(t) free(t)
 #endif
 
 /// Static variable that indicates the number of unique ODB instances
@@ -93,15 +82,46 @@ int temp[-1];
 // Include the 'main' type header files.
 #include "datastore.hpp"
 #include "index.hpp"
+#include "snapshot.hpp"
+#include "epoch.hpp"
 
 // Include the various types of index tables and datastores.
 #include "linkedlisti.hpp"
+#include "skiplisti.hpp"
 #include "redblacktreei.hpp"
 #include "bankds.hpp"
 #include "linkedlistds.hpp"
 
 #include "lock.hpp"
 
+/// Type of the map from rows added while snapshots were open to when.
+#define BIRTHS_T std::map<void*, uint64_t>
+
+/// Number of rows a snapshot checks each time it takes the lock, so that long
+///results don't hold up insertions.
+#define SNAPSHOT_FILTER_BATCH 1024
+
+/// Number of insertions between looks at how much memory the ODB is using, when
+///it has watermarks set.
+#define ODB_MEM_CHECK_ROWS 4096
+
+/// Time, in milliseconds, a writer holds off for when the ODB is past its hard
+///memory watermark and the sweep that should fix it has been put off.
+#define ODB_MEM_BACKOFF_MS 1
+
+#ifdef CPP11THREADS
+#include <chrono>
+#include <thread>
+
+#define MEM_BACKOFF() std::this_thread::sleep_for(std::chrono::milliseconds(ODB_MEM_BACKOFF_MS))
+#else
+#define MEM_BACKOFF() usleep(1000 * ODB_MEM_BACKOFF_MS)
+#endif
+
+/// Number of sets of containers, left by destroyed query results, kept for the
+///next results to use.
+#define ODB_SHELL_POOL 64
+
 namespace libodb
 {
     CompareCust* ODB::compare_addr = new CompareCust(compare_addr_f);
@@ -118,108 +138,46 @@ namespace libodb
     
 //     void* ODB::num_unique = ATOMIC_INIT(0);
 
-    /// The worker function in the memory checker thread
-    /// @param[in] arg The void pointer to arguments. This is actually a pair of
-    ///pointers, one to the parent ODB object, and another to a 32-bit integer
-    ///indicating how many seconds to sleep between sweeps.
-    //! @todo Have a way of starting and stopping the mem checker thread with more
-    ///than just at construction/destruction time.
-    void * mem_checker(void * arg)
+    /// Everything an ODB allocates for itself, apart from its DataStore.
+    struct odb_shell
     {
-        void** args = reinterpret_cast<void**>(arg);
-        ODB* parent = reinterpret_cast<ODB*>(args[0]);
-        uint32_t sleep_duration = *reinterpret_cast<uint32_t*>(&(args[1]));
-
-        uint32_t count = 0;
-
-#ifdef WIN32
-        //! @warning "WIN32PORT memory consumption checking"
-#else
-        uint64_t vsize;
-        uint64_t rsize = 0;
-        pid_t pid = getpid();
-
-        char path[50];
-        /// @bug This doesn't work on Solaris.
-        /// Find a cross platform way of determining the runtime resident memory
-        ///consumption of a process.
-        sprintf(path, "/proc/%d/statm", pid);
-
-        FILE* stat_file = fopen(path, "r");
-#endif
+        std::vector<Index*>* tables;
+        std::vector<IndexGroup*>* groups;
+        IndexGroup* all;
+        DataObj* dataobj;
+        RWLock* rwlock;
+        std::vector<Snapshot*>* snapshots;
+        void* births;
+        void* snapshot_lock;
+        void* sweep_lock;
+    };
 
-#ifdef CPP11THREADS
-        std::chrono::seconds dura(sleep_duration);
-#else
-        struct timespec ts;
+    // Created on first use, and covered by shell_lock.
+    static void* shell_lock = NULL;
+    static std::vector<struct odb_shell>* shells = NULL;
 
-        ts.tv_sec = sleep_duration;
-        ts.tv_nsec = 0;
-#endif
+    static void shell_init()
+    {
+        static volatile uint64_t initialized = 0;
 
-        while (parent->is_running())
+        if (initialized != 2)
         {
-#ifdef WIN32
-            //! @warning "WIN32PORT memory consumption checking"
-#else
-            if (stat_file != NULL)
+            if (SEQ_CAS64(initialized, (uint64_t)0, (uint64_t)1))
             {
-                stat_file = freopen(path, "r", stat_file);
-
-                if (stat_file == NULL)
-                {
-                    THROW_ERROR("FOPEN_FAIL", "Unable to (re)open file");
-                }
-
-                if (fscanf(stat_file, "%lu %ld", &vsize, &rsize) < 2)
-                {
-                    THROW_ERROR("RSS_GET_FAIL", "Failed retrieving rss");
-                }
-
-                //             printf("Rsize: %ld mem_limit: %lu\n", rsize, mem_limit);
-
-                if (rsize > parent->mem_limit)
-                {
-                    THROW_ERROR_M("MEM_OVFLW", "Memory usage exceeds limit: %ld > %lu", rsize, parent->mem_limit);
-                }
+                LOCK_INIT(shell_lock);
+                shells = new std::vector<struct odb_shell>();
+                shells->reserve(ODB_SHELL_POOL);
+                SEQ_BARRIER();
+                initialized = 2;
             }
-
-            time_t cur = time(NULL);
-
-            // Since time(NULL) has a resolution of one second, this will execute every second (approximately).
-            if (parent->get_time() < cur)
+            else
             {
-                parent->update_time(cur);
-                count++;
-
-                if (count > sleep_duration)
+                while (initialized != 2)
                 {
-                    printf("Time: %lu - ODB instance: %p - Rsize: %ld - mem_limit: %lu...", cur, parent, rsize, parent->mem_limit);
-                    fflush(stdout);
-                    parent->remove_sweep();
-                    printf("Done\n");
-                    count = 0;
+                    SEQ_YIELD();
                 }
             }
-#endif
-
-#ifdef CPP11THREADS
-            std::this_thread::sleep_for(dura);
-#else
-            nanosleep(&ts, NULL);
-#endif
-        }
-
-#ifdef WIN32
-        //! @warning "WIN32PORT memory consumption checking"
-#else
-        if (stat_file != NULL)
-        {
-            fclose(stat_file);
         }
-#endif
-
-        return NULL;
     }
 
     ODB::ODB()
@@ -413,19 +371,29 @@ namespace libodb
 
     ODB::ODB(DataStore* _data, uint64_t _ident, uint64_t _datalen)
     {
-        init(_data, _ident, _datalen, NULL, NULL, 0);
+        init(_data, _ident, _datalen, NULL, NULL, 0, true);
     }
 
-    void ODB::init(DataStore* _data, uint64_t _ident, uint64_t _datalen, Archive* _archive, void(*_freep)(void*), uint32_t _sleep_duration)
+    void ODB::init(DataStore* _data, uint64_t _ident, uint64_t _datalen, Archive* _archive, void(*_freep)(void*), uint32_t _sleep_duration, bool _pooled)
     {
-        tables = new std::vector<Index*>();
-        groups = new std::vector<IndexGroup*>();
-
         this->ident = _ident;
         this->datalen = _datalen;
-        all = new IndexGroup(_ident, _data);
-        dataobj = new DataObj(_ident);
         this->data = _data;
+        this->pooled = _pooled;
+
+        if (!(pooled && shell_take()))
+        {
+            tables = new std::vector<Index*>();
+            groups = new std::vector<IndexGroup*>();
+            all = new IndexGroup(_ident, _data);
+            dataobj = new DataObj(_ident);
+            rwlock = RWLock::create();
+            snapshots = new std::vector<Snapshot*>();
+            births = new BIRTHS_T();
+            LOCK_INIT(snapshot_lock);
+            LOCK_INIT(sweep_lock);
+        }
+
         this->archive = _archive;
         scheduler = NULL;
         sleep_duration = _sleep_duration;
@@ -442,48 +410,71 @@ namespace libodb
 
         data->cur_time = time(NULL);
 
-        RWLOCK_INIT(rwlock);
+        snapshots_open = 0;
+        snapshot_seq = 0;
+        sweep_deferred = false;
+
+        mem_soft = 0;
+        mem_hard = 0;
+        mem_adds = 0;
+        mem_overruns = 0;
+        mem_overrun = NULL;
 
-        mem_limit = 700000;
+        running = 0;
 
         if (_sleep_duration > 0)
         {
-            running = 1;
+            start_mem_checker(_sleep_duration, MaintenanceService::STAGGER);
+        }
+    }
 
-            void** args;
-            SAFE_MALLOC(void**, args, sizeof(ODB*) + sizeof(uint32_t));
-            args[0] = this;
-            *reinterpret_cast<uint32_t*>(&(args[1])) = _sleep_duration;
+    void ODB::start_mem_checker(uint32_t _sleep_duration, uint32_t offset)
+    {
+        sleep_duration = _sleep_duration;
+        running = 1;
 
-            //! @todo extern "C" is disappearing here in argument 3 (the function pointer) to pthread_create()
-            THREAD_CREATE(mem_thread, mem_checker, args);
-        }
-        else
-        {
-            running = 0;
-            mem_thread = NULL;
-        }
+        MaintenanceService::add(this, _sleep_duration, offset);
     }
 
     ODB::~ODB()
     {
-        //the join() introduces a delay of up to one second to the destructor while it waits for it to exit sleep.
+        // This waits out a sweep that is in progress, so has to come before taking
+        // the lock.
         if (running)
         {
             running = 0;
-            THREAD_JOIN(mem_thread);
+            MaintenanceService::remove(this);
         }
 
-        WRITE_LOCK(rwlock);
+        // A query result comes off its parent's list, or the parent would destroy
+        // it again along with itself. The parent holds its clones_lock while it
+        // sweeps its results, which takes their locks, so this has to come
+        // before taking our own.
+        if (data->parent != NULL)
+        {
+            LOCK(data->parent->clones_lock);
+            std::vector<ODB*>* clones = data->parent->clones;
+
+            for (size_t i = 0; i < clones->size(); i++)
+            {
+                if (clones->at(i) == this)
+                {
+                    clones->erase(clones->begin() + i);
+                    break;
+                }
+            }
+
+            UNLOCK(data->parent->clones_lock);
+        }
+
+        rwlock->write_lock();
 
         if (scheduler != NULL)
         {
             delete scheduler;
         }
 
-        delete all;
         delete data;
-        delete dataobj;
 
         IndexGroup* curr;
 
@@ -493,7 +484,6 @@ namespace libodb
             groups->pop_back();
             delete curr;
         }
-        delete groups;
 
         while (!tables->empty())
         {
@@ -501,7 +491,6 @@ namespace libodb
             tables->pop_back();
             delete curr;
         }
-        delete tables;
 
         //! @todo There's potential for leaks here if it is unclear who is allocating the archiver.
         //if (archive != NULL)
@@ -509,13 +498,105 @@ namespace libodb
         //    delete archive;
         //}
 
-        if (mem_thread != NULL)
+        while (!snapshots->empty())
+        {
+            delete snapshots->back();
+            snapshots->pop_back();
+        }
+
+        rwlock->write_unlock();
+
+        if (!(pooled && shell_put()))
+        {
+            delete all;
+            delete dataobj;
+            delete groups;
+            delete tables;
+            delete snapshots;
+            delete (BIRTHS_T*)births;
+            LOCK_DESTROY(snapshot_lock);
+            LOCK_DESTROY(sweep_lock);
+            delete rwlock;
+        }
+    }
+
+    bool ODB::shell_take()
+    {
+        struct odb_shell shell;
+
+        shell_init();
+        LOCK(shell_lock);
+
+        if (shells->empty())
+        {
+            UNLOCK(shell_lock);
+            return false;
+        }
+
+        shell = shells->back();
+        shells->pop_back();
+
+        UNLOCK(shell_lock);
+
+        tables = shell.tables;
+        groups = shell.groups;
+        all = shell.all;
+        dataobj = shell.dataobj;
+        rwlock = shell.rwlock;
+        snapshots = shell.snapshots;
+        births = shell.births;
+        snapshot_lock = shell.snapshot_lock;
+        sweep_lock = shell.sweep_lock;
+
+        all->ident = ident;
+        all->parent = data;
+        all->scheduler = NULL;
+        dataobj->ident = ident;
+
+        return true;
+    }
+
+    bool ODB::shell_put()
+    {
+        struct RWLock::lock_stats stats;
+
+        // A lock that was swapped for another kind, or counts, isn't what the next
+        // result would have made for itself.
+        if ((rwlock->get_type() != RWLock::DEFAULT) || rwlock->get_stats(&stats))
         {
-            THREAD_DESTROY(mem_thread);
+            delete rwlock;
+            rwlock = RWLock::create();
         }
 
-        WRITE_UNLOCK(rwlock);
-        RWLOCK_DESTROY(rwlock);
+        // The tables, groups and snapshots have been emptied already.
+        all->indices->clear();
+        ((BIRTHS_T*)births)->clear();
+
+        struct odb_shell shell;
+        shell.tables = tables;
+        shell.groups = groups;
+        shell.all = all;
+        shell.dataobj = dataobj;
+        shell.rwlock = rwlock;
+        shell.snapshots = snapshots;
+        shell.births = births;
+        shell.snapshot_lock = snapshot_lock;
+        shell.sweep_lock = sweep_lock;
+
+        shell_init();
+        LOCK(shell_lock);
+
+        if (shells->size() >= ODB_SHELL_POOL)
+        {
+            UNLOCK(shell_lock);
+            return false;
+        }
+
+        shells->push_back(shell);
+
+        UNLOCK(shell_lock);
+
+        return true;
     }
 
     ODBFixed::~ODBFixed()
@@ -540,11 +621,36 @@ namespace libodb
     {
         struct sched_args* args = (struct sched_args*)argsV;
         args->odb->all->add_data_v(args->rawdata);
-        free(args);
 
         return NULL;
     }
 
+    inline void* ODB::add_row(void* rawdata, uint32_t nbytes, bool sized)
+    {
+        void* ret;
+
+        // The caller is inside an epoch, so a snapshot being taken either shows up
+        // here or waits for this insertion to finish before it counts the rows.
+        if (snapshots_open == 0)
+        {
+            return (sized ? data->add_data(rawdata, nbytes) : data->add_data(rawdata));
+        }
+
+        // Adding and recording have to happen together, so that a snapshot being
+        // taken counts the row either as one it can see or as one it can't.
+        LOCK(snapshot_lock);
+        ret = (sized ? data->add_data(rawdata, nbytes) : data->add_data(rawdata));
+
+        if (snapshots_open > 0)
+        {
+            (*(BIRTHS_T*)births)[ret] = snapshot_seq;
+        }
+
+        UNLOCK(snapshot_lock);
+
+        return ret;
+    }
+
     /// @bug Failed insertions aren't handled properly.
     /// Make sure the datastores handle failed insertions properly.
     /// The commented out code in the add_data functions would handle the process of
@@ -552,43 +658,53 @@ namespace libodb
     /// What does it mean to fail an insertion into an index group?
     void ODB::add_data(void* rawdata)
     {
+        mem_check();
+        uint64_t e = EpochReclaimer::enter();
+
         if (scheduler == NULL)
         {
-            all->add_data_v(data->add_data(rawdata));
+            all->add_data_v(add_row(rawdata, 0, false));
         }
         else
         {
-            struct sched_args* args;
-            SAFE_MALLOC(struct sched_args*, args, sizeof(struct sched_args));
-            args->rawdata = data->add_data(rawdata);
-            args->odb = this;
-            scheduler->add_work(odb_sched_workload, args, NULL, Scheduler::NONE);
+            struct sched_args args;
+            args.rawdata = add_row(rawdata, 0, false);
+            args.odb = this;
+            scheduler->add_work_copy(odb_sched_workload, &args, sizeof(struct sched_args), NULL, Scheduler::NONE);
         }
+
+        EpochReclaimer::exit(e);
         //    if ((all->add_data_v(data->add_data(rawdata))) == false)
         //        data->remove_at(data->data_count - 1);
     }
 
     void ODB::add_data(void* rawdata, uint32_t nbytes)
     {
+        mem_check();
+        uint64_t e = EpochReclaimer::enter();
+
         if (scheduler == NULL)
         {
-            all->add_data_v(data->add_data(rawdata, nbytes));
+            all->add_data_v(add_row(rawdata, nbytes, true));
         }
         else
         {
-            struct sched_args* args;
-            SAFE_MALLOC(struct sched_args*, args, sizeof(struct sched_args));
-            args->rawdata = data->add_data(rawdata, nbytes);
-            args->odb = this;
-            scheduler->add_work(odb_sched_workload, args, NULL, Scheduler::NONE);
+            struct sched_args args;
+            args.rawdata = add_row(rawdata, nbytes, true);
+            args.odb = this;
+            scheduler->add_work_copy(odb_sched_workload, &args, sizeof(struct sched_args), NULL, Scheduler::NONE);
         }
+
+        EpochReclaimer::exit(e);
         //     if ((all->add_data_v(data->add_data(rawdata, nbytes))) == false)
         //         data->remove_at(data->data_count - 1);
     }
 
     DataObj* ODB::add_data(void* rawdata, bool add_to_all)
     {
-        dataobj->data = data->add_data(rawdata);
+        mem_check();
+        uint64_t e = EpochReclaimer::enter();
+        dataobj->data = add_row(rawdata, 0, false);
 
         if (add_to_all)
         {
@@ -598,20 +714,22 @@ namespace libodb
             }
             else
             {
-                struct sched_args* args;
-                SAFE_MALLOC(struct sched_args*, args, sizeof(struct sched_args));
-                args->rawdata = dataobj->data;
-                args->odb = this;
-                scheduler->add_work(odb_sched_workload, args, NULL, Scheduler::NONE);
+                struct sched_args args;
+                args.rawdata = dataobj->data;
+                args.odb = this;
+                scheduler->add_work_copy(odb_sched_workload, &args, sizeof(struct sched_args), NULL, Scheduler::NONE);
             }
         }
 
+        EpochReclaimer::exit(e);
         return dataobj;
     }
 
     DataObj* ODB::add_data(void* rawdata, uint32_t nbytes, bool add_to_all)
     {
-        dataobj->data = data->add_data(rawdata, nbytes);
+        mem_check();
+        uint64_t e = EpochReclaimer::enter();
+        dataobj->data = add_row(rawdata, nbytes, true);
 
         if (add_to_all)
         {
@@ -621,17 +739,69 @@ namespace libodb
             }
             else
             {
-                struct sched_args* args;
-                SAFE_MALLOC(struct sched_args*, args, sizeof(struct sched_args));
-                args->rawdata = dataobj->data;
-                args->odb = this;
-                scheduler->add_work(odb_sched_workload, args, NULL, Scheduler::NONE);
+                struct sched_args args;
+                args.rawdata = dataobj->data;
+                args.odb = this;
+                scheduler->add_work_copy(odb_sched_workload, &args, sizeof(struct sched_args), NULL, Scheduler::NONE);
             }
         }
 
+        EpochReclaimer::exit(e);
         return dataobj;
     }
 
+    bool ODB::upsert(void* rawdata, Index* key_index)
+    {
+        if (key_index->ident != ident)
+        {
+            THROW_ERROR("IDENT_MISMATCH", "Index table does not belong to this ODB.");
+        }
+
+        if (!key_index->drop_duplicates)
+        {
+            THROW_ERROR("NO_DROP_DUPS", "Upserts need an index table that drops duplicates.");
+        }
+
+        // The row found can't be reclaimed out from under the merge while inside
+        // the epoch, though a sweep may still retire it first.
+        uint64_t e = EpochReclaimer::enter();
+        void* row = key_index->lookup(rawdata);
+        bool missed = (row == NULL);
+
+        // Misses on the same key index take turns and look again, so upserts
+        // racing on a new key add one row between them. That row goes into the
+        // index tables here rather than through the scheduler, or the next look
+        // would miss it as well.
+        if (missed)
+        {
+            EpochReclaimer::exit(e);
+            mem_check();
+            LOCK(key_index->upsert_lock);
+            e = EpochReclaimer::enter();
+            row = key_index->lookup(rawdata);
+        }
+
+        if (row == NULL)
+        {
+            all->add_data_v(add_row(rawdata, 0, false));
+        }
+        else if (key_index->merge != NULL)
+        {
+            key_index->rwlock->write_lock();
+            key_index->merge->merge(rawdata, row);
+            key_index->rwlock->write_unlock();
+        }
+
+        EpochReclaimer::exit(e);
+
+        if (missed)
+        {
+            UNLOCK(key_index->upsert_lock);
+        }
+
+        return (row != NULL);
+    }
+
     Index* ODB::create_index(IndexType type, uint32_t flags, int32_t(*compare)(void*, void*), void* (*merge)(void*, void*), void* (*keygen)(void*), int32_t keylen)
     {
         CompareCust* c = new CompareCust(compare);
@@ -642,7 +812,7 @@ namespace libodb
 
     Index* ODB::create_index(IndexType type, uint32_t flags, Comparator* compare, Merger* merge, Keygen* keygen, int32_t keylen)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
         if (compare == NULL)
         {
@@ -676,6 +846,11 @@ namespace libodb
             new_index = new RedBlackTreeI(ident, compare, merge, drop_duplicates);
             break;
         }
+        case SKIP_LIST:
+        {
+            new_index = new SkipListI(ident, compare, merge, drop_duplicates);
+            break;
+        }
         default:
         {
             THROW_ERROR("INV_IND_TYPE", "Invalid index type.");
@@ -696,7 +871,7 @@ namespace libodb
             data->populate(new_index);
         }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
         return new_index;
     }
 
@@ -711,9 +886,9 @@ namespace libodb
         IndexGroup* g = new IndexGroup(ident, data);
         g->scheduler = scheduler;
 
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         groups->push_back(g);
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
 
         return g;
     }
@@ -725,11 +900,34 @@ namespace libodb
 
     //! @todo Change this to use shorter lived locks and the scheduler so as to
     ///not be as disruptive in a real-time situations.
+    //! @todo Inserts and iterators still wait on a sweep, since a BankDS
+    ///compacts in place. It, and everything that walks it, would need to tell
+    ///vacated slots apart from live ones before those could be left for the
+    ///EpochReclaimer to hand back instead.
     void ODB::remove_sweep()
     {
         if (data->prune != NULL)
         {
-            WRITE_LOCK(rwlock);
+            // The read lock is enough to keep snapshots, purges and new index
+            // tables out, and the DataStore and index tables lock themselves. The
+            // read lock comes first, so a writer waiting on it can't wedge two
+            // sweeps against each other.
+            rwlock->read_lock();
+            LOCK(sweep_lock);
+
+            // Nothing a snapshot can see may be moved or freed, so leave it all
+            // for when the last one is released.
+            LOCK(snapshot_lock);
+            if (snapshots_open > 0)
+            {
+                sweep_deferred = true;
+                UNLOCK(snapshot_lock);
+                UNLOCK(sweep_lock);
+                rwlock->read_unlock();
+                return;
+            }
+            UNLOCK(snapshot_lock);
+
             std::vector<void*>** marked = data->remove_sweep(archive);
 
             size_t n = tables->size();
@@ -748,14 +946,28 @@ namespace libodb
                     }
                 }
 
-                if (marked[2] != NULL)
+                // A sweep usually takes out enough to touch most cached ranges,
+                // so it isn't worth checking each item against each of them.
+                if (!(marked[0]->empty()))
+                {
+                    for (size_t i = 0; i < n; i++)
+                    {
+                        if (tables->at(i)->cache != NULL)
+                        {
+                            tables->at(i)->cache_clear();
+                        }
+                    }
+                }
+
+                if ((marked[2] != NULL) && !(marked[2]->empty()))
                 {
                     update_tables(marked[2], marked[3]);
                 }
             }
 
             data->remove_cleanup(marked);
-            WRITE_UNLOCK(rwlock);
+            UNLOCK(sweep_lock);
+            rwlock->read_unlock();
         }
     }
 
@@ -768,6 +980,7 @@ namespace libodb
             if (n == 0)
             {
                 tables->at(0)->update(old_addr, new_addr, datalen);
+                tables->at(0)->cache_clear();
             }
             else
             {
@@ -775,44 +988,57 @@ namespace libodb
                 for (size_t i = 0; i < n; i++)
                 {
                     tables->at(i)->update(old_addr, new_addr, datalen);
+                    tables->at(i)->cache_clear();
                 }
             }
         }
 
+        LOCK(data->clones_lock);
         n = data->clones->size();
 
         for (size_t i = 0; i < n; i++)
         {
             data->clones->at(i)->update_tables(old_addr, new_addr);
         }
+
+        UNLOCK(data->clones_lock);
     }
 
     void ODB::purge()
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
+
+        if (snapshots_open > 0)
+        {
+            rwlock->write_unlock();
+            THROW_ERROR("SNAP_OPEN", "Cannot purge while snapshots are open.");
+        }
 
         for (size_t i = 0; i < tables->size(); i++)
         {
             tables->at(i)->purge();
+            tables->at(i)->cache_clear();
         }
 
         data->purge(freep);
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     void ODB::set_prune(bool(*prune)(void*))
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
         data->prune = prune;
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     bool(*ODB::get_prune())(void*)
     {
-        READ_LOCK(rwlock);
-        return data->prune;
-        READ_UNLOCK(rwlock);
+        rwlock->read_lock();
+        bool (*ret)(void*) = data->prune;
+        rwlock->read_unlock();
+
+        return ret;
     }
 
     uint64_t ODB::size()
@@ -820,16 +1046,142 @@ namespace libodb
         return data->size();
     }
 
-    inline void ODB::update_time(time_t n_time)
+    ODB* ODB::query(bool (*condition)(void*))
+    {
+        ConditionCust* c = new ConditionCust(condition);
+        ODB* ret = query(c);
+        delete c;
+        return ret;
+    }
+
+    ODB* ODB::query(Condition* condition)
+    {
+        DataStore* ds = data->clone_indirect(data->size());
+        data->query(condition, ds);
+
+        ODB* odb = new ODB(ds, ident, datalen);
+        ds->update_parent(odb);
+        return odb;
+    }
+
+    void ODB::update_time(time_t n_time)
     {
         data->cur_time = n_time;
     }
 
-    inline time_t ODB::get_time()
+    time_t ODB::get_time()
     {
         return data->cur_time;
     }
 
+    Scheduler* ODB::get_scheduler()
+    {
+        return scheduler;
+    }
+
+    void ODB::set_lock(RWLock::LockType type, bool stats)
+    {
+        delete rwlock;
+        rwlock = RWLock::create(type, stats);
+    }
+
+    void ODB::set_datastore_lock(RWLock::LockType type, bool stats)
+    {
+        delete data->rwlock;
+        data->rwlock = RWLock::create(type, stats);
+    }
+
+    RWLock* ODB::get_lock()
+    {
+        return rwlock;
+    }
+
+    RWLock* ODB::get_datastore_lock()
+    {
+        return data->rwlock;
+    }
+
+    void ODB::set_mem_limits(uint64_t soft, uint64_t hard)
+    {
+        mem_soft = soft;
+        mem_hard = hard;
+    }
+
+    void ODB::set_mem_overrun(void (*overrun)(ODB* odb, uint64_t used))
+    {
+        mem_overrun = overrun;
+    }
+
+    uint64_t ODB::get_mem_overruns()
+    {
+        return mem_overruns;
+    }
+
+    uint64_t ODB::mem_size()
+    {
+        uint64_t ret = data->mem_size();
+
+        rwlock->read_lock();
+        for (size_t i = 0; i < tables->size(); i++)
+        {
+            ret += tables->at(i)->mem_size();
+        }
+        rwlock->read_unlock();
+
+        LOCK(data->clones_lock);
+        for (size_t i = 0; i < data->clones->size(); i++)
+        {
+            ret += data->clones->at(i)->mem_size();
+        }
+        UNLOCK(data->clones_lock);
+
+        return ret;
+    }
+
+    // This has to be called before the insertion enters its epoch, since a sweep
+    // may wait for the epoch to move on.
+    inline void ODB::mem_check()
+    {
+        if (((mem_soft | mem_hard) != 0) && ((++mem_adds % ODB_MEM_CHECK_ROWS) == 0))
+        {
+            mem_govern();
+        }
+    }
+
+    void ODB::mem_govern()
+    {
+        uint64_t used = mem_size();
+
+        // Past the hard mark the writer pays for the sweep itself. Past the soft
+        // mark it only does if there's no memory checker thread to do it.
+        if (((mem_hard != 0) && (used > mem_hard)) || ((mem_soft != 0) && (used > mem_soft) && !running))
+        {
+            remove_sweep();
+
+            // A sweep can't always help, so say when it didn't. If it was put off
+            // for a snapshot, more rows now would only add to what it has to do
+            // once it runs, so hold off a little.
+            if ((mem_hard != 0) && (used > mem_hard) && ((used = mem_size()) > mem_hard))
+            {
+                SEQ_ATOMIC_INC(mem_overruns);
+
+                if (mem_overrun != NULL)
+                {
+                    mem_overrun(this, used);
+                }
+
+                LOCK(snapshot_lock);
+                bool deferred = sweep_deferred;
+                UNLOCK(snapshot_lock);
+
+                if (deferred)
+                {
+                    MEM_BACKOFF();
+                }
+            }
+        }
+    }
+
     uint32_t ODB::start_scheduler(uint32_t num_threads)
     {
         if (num_threads == 0)
@@ -841,7 +1193,9 @@ namespace libodb
         {
             scheduler = new Scheduler(num_threads);
 
-            WRITE_LOCK(rwlock);
+            rwlock->write_lock();
+
+            data->scheduler = scheduler;
 
             for (uint32_t i = 0; i < tables->size(); i++)
             {
@@ -853,7 +1207,7 @@ namespace libodb
                 groups->at(i)->scheduler = scheduler;
             }
 
-            WRITE_UNLOCK(rwlock);
+            rwlock->write_unlock();
 
             return num_threads;
         }
@@ -886,4 +1240,130 @@ namespace libodb
         data->it_release(it);
     }
 
+    Snapshot* ODB::snapshot()
+    {
+        if (data->parent != NULL)
+        {
+            THROW_ERROR("SNAP_CLONE", "Cannot snapshot the results of a query.");
+        }
+
+        // Taking the ODB's lock waits out any sweep already under way.
+        rwlock->write_lock();
+        LOCK(snapshot_lock);
+        Snapshot* snap = new Snapshot(this, ++snapshot_seq, 0);
+        snapshots->push_back(snap);
+        snapshots_open++;
+        UNLOCK(snapshot_lock);
+        rwlock->write_unlock();
+
+        // Any insertion that didn't see the snapshot open is done once this
+        // returns, and every one after it records its row.
+        EpochReclaimer::synchronize();
+
+        // Rows can't be removed while the snapshot is open, so the number it can
+        // see is fixed from here on.
+        LOCK(snapshot_lock);
+        uint64_t young = 0;
+        BIRTHS_T* b = (BIRTHS_T*)births;
+
+        for (BIRTHS_T::iterator it = b->begin(); it != b->end(); it++)
+        {
+            if (it->second >= snap->seq)
+            {
+                young++;
+            }
+        }
+
+        snap->count = data->size() - young;
+        UNLOCK(snapshot_lock);
+
+        return snap;
+    }
+
+    void ODB::snapshot_release(Snapshot* snap)
+    {
+        bool sweep = false;
+
+        LOCK(snapshot_lock);
+
+        for (size_t i = 0; i < snapshots->size(); i++)
+        {
+            if (snapshots->at(i) == snap)
+            {
+                snapshots->erase(snapshots->begin() + i);
+                snapshots_open--;
+                break;
+            }
+        }
+
+        BIRTHS_T* b = (BIRTHS_T*)births;
+
+        if (snapshots_open == 0)
+        {
+            b->clear();
+            sweep = sweep_deferred;
+            sweep_deferred = false;
+        }
+        else
+        {
+            // Rows added before the oldest snapshot still open are seen by all of
+            // them, and don't need to be remembered any more.
+            uint64_t oldest = snapshots->at(0)->seq;
+
+            for (size_t i = 1; i < snapshots->size(); i++)
+            {
+                if (snapshots->at(i)->seq < oldest)
+                {
+                    oldest = snapshots->at(i)->seq;
+                }
+            }
+
+            for (BIRTHS_T::iterator it = b->begin(); it != b->end();)
+            {
+                if (it->second < oldest)
+                {
+                    b->erase(it++);
+                }
+                else
+                {
+                    it++;
+                }
+            }
+        }
+
+        UNLOCK(snapshot_lock);
+
+        delete snap;
+
+        if (sweep)
+        {
+            remove_sweep();
+        }
+    }
+
+    void ODB::snapshot_filter(uint64_t seq, std::vector<void*>* rows)
+    {
+        BIRTHS_T* b = (BIRTHS_T*)births;
+        size_t n = rows->size();
+
+        for (size_t i = 0; i < n; i += SNAPSHOT_FILTER_BATCH)
+        {
+            size_t end = ((i + SNAPSHOT_FILTER_BATCH < n) ? (i + SNAPSHOT_FILTER_BATCH) : n);
+
+            LOCK(snapshot_lock);
+
+            for (size_t j = i; j < end; j++)
+            {
+                BIRTHS_T::iterator it = b->find(rows->at(j));
+
+                if ((it != b->end()) && (it->second >= seq))
+                {
+                    rows->at(j) = NULL;
+                }
+            }
+
+            UNLOCK(snapshot_lock);
+        }
+    }
+
 }
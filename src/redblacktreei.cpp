@@ -19,6 +19,8 @@
 #include "common.hpp"
 #include "utility.hpp"
 #include "comparator.hpp"
+#include "scheduler.hpp"
+#include "epoch.hpp"
 
 #include "lock.hpp"
 
@@ -119,15 +121,19 @@ namespace libodb
 #define UNTAINT(x) (reinterpret_cast<struct RedBlackTreeI::tree_node*>((reinterpret_cast<uintptr_t>(x)) & META_MASK))
 #define TAINTED(x) ((reinterpret_cast<uintptr_t>(x)) & RED_BLACK_BIT)
 
+    /// How many times an optimistic read starts over before it takes the read lock.
+#define RBT_OPTIMISTIC_RETRIES 4
+
     RedBlackTreeI::RedBlackTreeI(uint64_t _ident, Comparator* _compare, Merger* _merge, bool _drop_duplicates)
     {
-        RWLOCK_INIT(rwlock);
+        rwlock = RWLock::create();
         this->ident = _ident;
         root = NULL;
         this->compare = _compare;
         this->merge = _merge;
         this->drop_duplicates = _drop_duplicates;
         count = 0;
+        version = 0;
 
         // Initialize the false root
         SAFE_CALLOC(struct tree_node*, false_root, 1, sizeof(struct tree_node));
@@ -150,7 +156,7 @@ namespace libodb
             delete merge;
         }
 
-        RWLOCK_DESTROY(rwlock);
+        delete rwlock;
     }
 
     int RedBlackTreeI::rbt_verify()
@@ -158,9 +164,9 @@ namespace libodb
 #ifdef VERBOSE_RBT_VERIFY
         printf("TreePlot[{");
 #endif
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         int ret = rbt_verify_n(root, compare, false);
-        READ_UNLOCK(rwlock);
+        rwlock->read_unlock();
 #ifdef VERBOSE_RBT_VERIFY
         printf("\b},Automatic,\"%ld%c%c\",DirectedEdges -> True, VertexRenderingFunction -> ({If[StringMatchQ[#2, RegularExpression[\".*R\"]], Darker[Darker[Red]], Black], EdgeForm[{Thick, If[StringMatchQ[#2, RegularExpression[\".*L.\"]], Blue, Black]}], Disk[#, {0.2, 0.1}], Lighter[Gray], Text[StringTake[#2, StringLength[#2] - 2], #1]} &)]\n", *(long*)GET_DATA(root), (IS_TREE(root) ? 'L' : 'V'), (IS_RED(root) ? 'R' : 'B'));
 #endif
@@ -238,7 +244,8 @@ namespace libodb
 
     bool RedBlackTreeI::add_data_v2(void* rawdata)
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
+        SEQ_WRITE_BEGIN(version);
         bool something_added = false;
         root = add_data_n(root, false_root, sub_false_root, compare, merge, drop_duplicates, rawdata);
 
@@ -253,7 +260,8 @@ namespace libodb
             root = UNTAINT(root);
             something_added = true;
         }
-        WRITE_UNLOCK(rwlock);
+        SEQ_WRITE_END(version);
+        rwlock->write_unlock();
 
         return something_added;
     }
@@ -365,13 +373,22 @@ namespace libodb
 
     void RedBlackTreeI::purge()
     {
-        WRITE_LOCK(rwlock);
+        rwlock->write_lock();
 
-        free_n(root, drop_duplicates);
+        // Take the tree out from under the optimistic readers, and leave it to be
+        // freed once they're done with it.
+        struct tree_node* old_root = root;
+        SEQ_WRITE_BEGIN(version);
         count = 0;
         root = NULL;
+        SEQ_WRITE_END(version);
+
+        if (old_root != NULL)
+        {
+            EpochReclaimer::retire(old_root, (drop_duplicates ? free_tree_drop : free_tree));
+        }
 
-        WRITE_UNLOCK(rwlock);
+        rwlock->write_unlock();
     }
 
     struct RedBlackTreeI::tree_node* RedBlackTreeI::e_add_data_n(struct tree_node* root, struct tree_node* false_root, struct tree_node* sub_false_root, Comparator* compare, Merger* merge, bool drop_duplicates, void* rawdata)
@@ -822,7 +839,110 @@ namespace libodb
 
     void RedBlackTreeI::query(Condition* condition, DataStore* ds)
     {
-        Iterator* it = it_first();
+        if ((scheduler == NULL) || (scheduler->get_num_threads() == 0) || (count < PARALLEL_QUERY_MIN))
+        {
+            Iterator* it = it_first();
+            void* temp;
+
+            if (it->data() != NULL)
+            {
+                do
+                {
+                    temp = it->get_data();
+
+                    if (condition->condition(temp))
+                    {
+                        it->update_query_count();
+                        ds->add_data(temp);
+                    }
+                } while (it->next());
+            }
+            it_release(it);
+        }
+        else
+        {
+            // Aim for a handful of parts per thread (counting this one) so that an
+            // unlucky split doesn't leave a single thread doing most of the work.
+            // The tree is balanced, so subtrees at the same depth are of similar size.
+            uint32_t num_parts = 4 * (scheduler->get_num_threads() + 1);
+            uint32_t depth = 0;
+
+            while ((1U << depth) < num_parts)
+            {
+                depth++;
+            }
+
+            std::vector<void*> parts;
+
+            // Hold the read lock across the whole scan; the workers walk the tree
+            // under this thread's lock.
+            rwlock->read_lock();
+            query_partition(root, depth, condition, &parts);
+
+            scheduler->run_batch(query_part_workload, &parts[0], (uint32_t)parts.size());
+
+            // Merging the buffers in part order gives the same result order as a
+            // serial scan.
+            for (size_t i = 0; i < parts.size(); i++)
+            {
+                struct query_part* part = (struct query_part*)parts[i];
+
+                for (size_t j = 0; j < part->results->size(); j++)
+                {
+                    ds->add_data(part->results->at(j));
+                }
+
+                delete part->results;
+                free(part);
+            }
+            rwlock->read_unlock();
+        }
+    }
+
+    void RedBlackTreeI::query_partition(struct RedBlackTreeI::tree_node* n, uint32_t depth, Condition* condition, std::vector<void*>* parts)
+    {
+        if (n == NULL)
+        {
+            return;
+        }
+
+        struct query_part* part;
+
+        if (depth == 0)
+        {
+            SAFE_MALLOC(struct query_part*, part, sizeof(struct query_part));
+            part->index = this;
+            part->condition = condition;
+            part->node = n;
+            part->results = new std::vector<void*>();
+            parts->push_back(part);
+            return;
+        }
+
+        query_partition(STRIP(n->link[0]), depth - 1, condition, parts);
+
+        // Copy the node without its children, but keep the meta-data bits so that
+        //embedded duplicate trees are still walked.
+        SAFE_MALLOC(struct query_part*, part, sizeof(struct query_part));
+        part->index = this;
+        part->condition = condition;
+        part->single.link[0] = reinterpret_cast<struct tree_node*>(reinterpret_cast<uintptr_t>(n->link[0]) & META_BIT);
+        part->single.link[1] = NULL;
+        part->single.data = n->data;
+        part->node = &(part->single);
+        part->results = new std::vector<void*>();
+        parts->push_back(part);
+
+        query_partition(STRIP(n->link[1]), depth - 1, condition, parts);
+    }
+
+    void* RedBlackTreeI::query_part_workload(void* partV)
+    {
+        struct query_part* part = (struct query_part*)partV;
+        RedBlackTreeI* index = part->index;
+
+        // Go straight to the static iterator so as not to take the lock again.
+        Iterator* it = it_first(index->parent, part->node, index->ident, index->drop_duplicates);
         void* temp;
 
         if (it->data() != NULL)
@@ -831,18 +951,251 @@ namespace libodb
             {
                 temp = it->get_data();
 
-                if (condition->condition(temp))
+                if (part->condition->condition(temp))
                 {
                     it->update_query_count();
-                    ds->add_data(temp);
+                    part->results->push_back(temp);
                 }
             } while (it->next());
         }
-        it_release(it);
+
+        delete it;
+        return NULL;
+    }
+
+    std::vector<void*>* RedBlackTreeI::query_top_k(Condition* condition, uint64_t k, int8_t dir)
+    {
+        std::vector<void*>* results = new std::vector<void*>();
+
+        if (k > 0)
+        {
+            rwlock->read_lock();
+            top_k_n(root, ((dir < 0) ? 0 : 1), condition, k, results);
+            rwlock->read_unlock();
+        }
+
+        return results;
+    }
+
+    bool RedBlackTreeI::top_k_n(struct tree_node* n, uint8_t dir, Condition* condition, uint64_t k, std::vector<void*>* results)
+    {
+        if (n == NULL)
+        {
+            return false;
+        }
+
+        if (top_k_n(STRIP(n->link[dir]), dir, condition, k, results))
+        {
+            return true;
+        }
+
+        if (IS_TREE(n))
+        {
+            // Duplicates live in an embedded tree of their own, which is walked
+            // in the same direction.
+            if (top_k_n(reinterpret_cast<struct tree_node*>(n->data), dir, condition, k, results))
+            {
+                return true;
+            }
+        }
+        else if ((condition == NULL) || condition->condition(n->data))
+        {
+            results->push_back(n->data);
+
+            if (results->size() == k)
+            {
+                return true;
+            }
+        }
+
+        return top_k_n(STRIP(n->link[1 - dir]), dir, condition, k, results);
+    }
+
+    void* RedBlackTreeI::lookup(void* rawdata)
+    {
+        void* data;
+        void* value = NULL;
+        bool tree;
+        bool valid = false;
+
+        uint64_t epoch = EpochReclaimer::enter();
+
+        for (uint32_t i = 0; (i < RBT_OPTIMISTIC_RETRIES) && !valid; i++)
+        {
+            valid = lookup_n(rawdata, SEQ_READ_BEGIN(version), &data, &value, &tree);
+        }
+
+        EpochReclaimer::exit(epoch);
+
+        // Too many writes got in the way, so wait for them properly. This has to
+        // happen after leaving the epoch, since a writer holding the lock may be
+        // waiting for it to move on.
+        if (!valid)
+        {
+            Iterator* it = it_lookup(rawdata, 0);
+            value = it->get_data();
+            it_release(it);
+        }
+
+        return value;
+    }
+
+    uint64_t RedBlackTreeI::mem_size()
+    {
+        // Duplicates live in embedded trees whose nodes are the same size.
+        return count * sizeof(struct tree_node);
+    }
+
+    bool RedBlackTreeI::lookup_n(void* rawdata, uint64_t s, void** data, void** value, bool* tree)
+    {
+        struct tree_node* i = STRIP(root);
+        struct tree_node* left;
+        struct tree_node* right;
+        void* d;
+        void* v;
+        int32_t c;
+
+        *data = NULL;
+        *value = NULL;
+        *tree = false;
+
+        while (i != NULL)
+        {
+            // Read everything needed from the node, then make sure it all came from
+            // the same version of the tree before using any of it.
+            left = i->link[0];
+            right = i->link[1];
+            d = i->data;
+
+            if (!SEQ_READ_VALID(version, s))
+            {
+                return false;
+            }
+
+            if ((reinterpret_cast<uintptr_t>(left)) & TREE_BIT)
+            {
+                v = (reinterpret_cast<struct tree_node*>(d))->data;
+
+                if (!SEQ_READ_VALID(version, s))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                v = d;
+            }
+
+            c = compare->compare(rawdata, v);
+
+            if (c == 0)
+            {
+                *data = d;
+                *value = v;
+                *tree = (((reinterpret_cast<uintptr_t>(left)) & TREE_BIT) != 0);
+                return true;
+            }
+
+            i = STRIP(c > 0 ? right : left);
+        }
+
+        return SEQ_READ_VALID(version, s);
+    }
+
+    bool RedBlackTreeI::collect_n(struct tree_node* n, uint64_t s, std::vector<void*>* results)
+    {
+        if (n == NULL)
+        {
+            return true;
+        }
+
+        struct tree_node* left = n->link[0];
+        struct tree_node* right = n->link[1];
+        void* d = n->data;
+
+        if (!SEQ_READ_VALID(version, s))
+        {
+            return false;
+        }
+
+        if (!collect_n(STRIP(left), s, results))
+        {
+            return false;
+        }
+
+        results->push_back(d);
+
+        return collect_n(STRIP(right), s, results);
+    }
+
+    void RedBlackTreeI::free_retired(std::vector<void*>* retired)
+    {
+        for (size_t i = 0; i < retired->size(); i++)
+        {
+            EpochReclaimer::retire(retired->at(i));
+        }
+    }
+
+    void RedBlackTreeI::free_tree(void* root)
+    {
+        free_n(reinterpret_cast<struct tree_node*>(root), false);
+    }
+
+    void RedBlackTreeI::free_tree_drop(void* root)
+    {
+        free_n(reinterpret_cast<struct tree_node*>(root), true);
     }
 
     void RedBlackTreeI::query_eq(void* rawdata, DataStore* ds)
     {
+        // Datastores that count queries need the iterator to do the counting, so
+        // they keep to the locked path.
+        if (!parent->query_count)
+        {
+            std::vector<void*> results;
+            void* data;
+            void* value;
+            bool tree;
+            bool valid = false;
+
+            uint64_t epoch = EpochReclaimer::enter();
+
+            for (uint32_t i = 0; (i < RBT_OPTIMISTIC_RETRIES) && !valid; i++)
+            {
+                uint64_t s = SEQ_READ_BEGIN(version);
+                results.clear();
+
+                if (lookup_n(rawdata, s, &data, &value, &tree))
+                {
+                    if (tree)
+                    {
+                        valid = collect_n(reinterpret_cast<struct tree_node*>(data), s, &results);
+                    }
+                    else
+                    {
+                        if (value != NULL)
+                        {
+                            results.push_back(value);
+                        }
+
+                        valid = true;
+                    }
+                }
+            }
+
+            EpochReclaimer::exit(epoch);
+
+            if (valid)
+            {
+                for (size_t i = 0; i < results.size(); i++)
+                {
+                    ds->add_data(results[i]);
+                }
+
+                return;
+            }
+        }
+
         Iterator* it = it_lookup(rawdata, 0);
         void* temp;
 
@@ -898,8 +1251,11 @@ namespace libodb
 
     inline bool RedBlackTreeI::remove(void* rawdata)
     {
-        WRITE_LOCK(rwlock);
-        root = remove_n(root, false_root, sub_false_root, compare, merge, drop_duplicates, rawdata);
+        std::vector<void*> retired;
+
+        rwlock->write_lock();
+        SEQ_WRITE_BEGIN(version);
+        root = remove_n(root, false_root, sub_false_root, compare, merge, drop_duplicates, rawdata, &retired);
 
         uint8_t ret = TAINTED(root);
         if (ret)
@@ -908,11 +1264,14 @@ namespace libodb
         }
 
         count -= ret;
-        WRITE_UNLOCK(rwlock);
+        SEQ_WRITE_END(version);
+
+        free_retired(&retired);
+        rwlock->write_unlock();
         return (ret != 0);
     }
 
-    struct RedBlackTreeI::tree_node* RedBlackTreeI::remove_n(struct tree_node* root, struct tree_node* false_root, struct tree_node* sub_false_root, Comparator* compare, Merger* merge, bool drop_duplicates, void* rawdata)
+    struct RedBlackTreeI::tree_node* RedBlackTreeI::remove_n(struct tree_node* root, struct tree_node* false_root, struct tree_node* sub_false_root, Comparator* compare, Merger* merge, bool drop_duplicates, void* rawdata, std::vector<void*>* retired)
     {
         uint8_t ret = 0;
 
@@ -960,7 +1319,7 @@ namespace libodb
                 {
                     if (IS_TREE(i))
                     {
-                        struct tree_node* new_sub_root = remove_n(reinterpret_cast<struct tree_node*>(i->data), sub_false_root, NULL, compare_addr, NULL, true, rawdata);
+                        struct tree_node* new_sub_root = remove_n(reinterpret_cast<struct tree_node*>(i->data), sub_false_root, NULL, compare_addr, NULL, true, rawdata, retired);
 
                         if (TAINTED(new_sub_root))
                         {
@@ -1080,7 +1439,16 @@ namespace libodb
                 // points 'down' to the child that points 'up' in the parent of i.
                 //             SET_LINK(p->link[STRIP(p->link[1]) == i], i->link[STRIP(i->link[0]) == NULL]);
                 SET_LINK(p->link[prev_dir], i->link[1]);
-                free(i);
+
+                // Optimistic readers may still be on their way through i.
+                if (retired != NULL)
+                {
+                    retired->push_back(i);
+                }
+                else
+                {
+                    free(i);
+                }
             }
 
             // Update the tree root and make it black.
@@ -1348,15 +1716,38 @@ namespace libodb
 
     inline void RedBlackTreeI::remove_sweep(std::vector<void*>* marked)
     {
+        std::vector<void*> retired;
+        uint8_t ret;
+
+        // Do the whole sweep as one write, so that the optimistic readers only have
+        // to start over once.
+        rwlock->write_lock();
+        SEQ_WRITE_BEGIN(version);
+
         for (uint32_t i = 0; i < marked->size(); i++)
         {
-            remove(marked->at(i));
+            root = remove_n(root, false_root, sub_false_root, compare, merge, drop_duplicates, marked->at(i), &retired);
+
+            ret = TAINTED(root);
+            if (ret)
+            {
+                root = UNTAINT(root);
+            }
+
+            count -= ret;
         }
+
+        SEQ_WRITE_END(version);
+        free_retired(&retired);
+        rwlock->write_unlock();
     }
 
     inline void RedBlackTreeI::update(std::vector<void*>* old_addr, std::vector<void*>* new_addr, uint32_t datalen)
     {
-        WRITE_LOCK(rwlock);
+        std::vector<void*> retired;
+
+        rwlock->write_lock();
+        SEQ_WRITE_BEGIN(version);
 
         struct tree_node* curr;
         int32_t c;
@@ -1376,7 +1767,7 @@ namespace libodb
                 {
                     if (IS_TREE(curr))
                     {
-                        curr->data = remove_n(reinterpret_cast<struct tree_node*>(curr->data), sub_false_root, NULL, compare_addr, NULL, true, addr);
+                        curr->data = remove_n(reinterpret_cast<struct tree_node*>(curr->data), sub_false_root, NULL, compare_addr, NULL, true, addr, &retired);
 
                         if (TAINTED(curr->data))
                         {
@@ -1401,7 +1792,9 @@ namespace libodb
             }
         }
 
-        WRITE_UNLOCK(rwlock);
+        SEQ_WRITE_END(version);
+        free_retired(&retired);
+        rwlock->write_unlock();
     }
 
     void RedBlackTreeI::free_n(struct tree_node* root, bool drop_duplicates)
@@ -1467,7 +1860,7 @@ namespace libodb
 
     inline Iterator* RedBlackTreeI::it_first()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         return it_first(parent, root, ident, drop_duplicates);
     }
 
@@ -1744,7 +2137,7 @@ namespace libodb
 
     inline Iterator* RedBlackTreeI::it_last()
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         return it_last(parent, root, ident, drop_duplicates);
     }
 
@@ -1848,7 +2241,7 @@ namespace libodb
 
     inline Iterator* RedBlackTreeI::it_lookup(void* rawdata, int8_t dir)
     {
-        READ_LOCK(rwlock);
+        rwlock->read_lock();
         return it_lookup(parent, root, ident, drop_duplicates, compare, rawdata, dir);
     }
 
@@ -0,0 +1,460 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for RWLock and the kinds of lock behind it.
+/// @file rwlock.cpp
+
+#include "rwlock.hpp"
+#include "scheduler.hpp"
+
+#include <string.h>
+
+#include "common.hpp"
+#include "lock.hpp"
+
+/// Number of slots a READER_BIASED lock counts readers in. Threads past this
+///many share slots.
+#define RWLOCK_SLOTS 32
+
+/// How many times a waiting thread spins before it starts yielding.
+#define RWLOCK_SPINS 64
+
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define RWLOCK_CAS32(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define RWLOCK_ADD32(p, v) __sync_add_and_fetch((p), (v))
+#define RWLOCK_ADD64(p, v) __sync_add_and_fetch((p), (v))
+#define RWLOCK_TAS(p) __sync_lock_test_and_set((p), 1)
+#define RWLOCK_RELEASE(p) __sync_lock_release((p))
+#elif defined(WIN32)
+#define RWLOCK_CAS32(p, o, n) (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#define RWLOCK_ADD32(p, v) InterlockedAdd((volatile LONG*)(p), (v))
+#define RWLOCK_ADD64(p, v) InterlockedAdd64((volatile LONG64*)(p), (v))
+#define RWLOCK_TAS(p) InterlockedExchange((volatile LONG*)(p), 1)
+#define RWLOCK_RELEASE(p) InterlockedExchange((volatile LONG*)(p), 0)
+#elif (CMAKE_COMPILER_SUITE_SUN)
+#include <atomic.h>
+#define RWLOCK_CAS32(p, o, n) (atomic_cas_32((volatile uint32_t*)(p), (uint32_t)(o), (uint32_t)(n)) == (uint32_t)(o))
+#define RWLOCK_ADD32(p, v) atomic_add_32_nv((volatile uint32_t*)(p), (v))
+#define RWLOCK_ADD64(p, v) atomic_add_64_nv((volatile uint64_t*)(p), (v))
+#define RWLOCK_TAS(p) atomic_swap_32((volatile uint32_t*)(p), 1)
+#define RWLOCK_RELEASE(p) { membar_exit(); *(p) = 0; } (void)0
+#else
+#error "Can't find a way to do atomic operations for RWLock."
+#endif
+
+namespace libodb
+{
+    /// Wait politely: spin for a while, then give up the CPU on every pass.
+    static inline void rwlock_backoff(uint32_t* spins)
+    {
+        if (*spins < RWLOCK_SPINS)
+        {
+            (*spins)++;
+        }
+        else
+        {
+            SEQ_YIELD();
+        }
+    }
+
+    /// Whichever lock family lock.hpp was configured with.
+    class DefaultLock : public RWLock
+    {
+    public:
+        DefaultLock(bool _stats) : RWLock(RWLock::DEFAULT, _stats)
+        {
+            RWLOCK_INIT(l);
+        }
+
+        ~DefaultLock()
+        {
+            RWLOCK_DESTROY(l);
+        }
+
+    protected:
+        void rd_lock()
+        {
+            READ_LOCK(l);
+        }
+
+        bool rd_trylock()
+        {
+            return READ_TRYLOCK(l);
+        }
+
+        void rd_unlock()
+        {
+            READ_UNLOCK(l);
+        }
+
+        void wr_lock()
+        {
+            WRITE_LOCK(l);
+        }
+
+        bool wr_trylock()
+        {
+            return WRITE_TRYLOCK(l);
+        }
+
+        void wr_unlock()
+        {
+            WRITE_UNLOCK(l);
+        }
+
+        void* l;
+    };
+
+    class TTASLock : public RWLock
+    {
+    public:
+        TTASLock(bool _stats) : RWLock(RWLock::SPIN, _stats)
+        {
+            held = 0;
+        }
+
+    protected:
+        void rd_lock()
+        {
+            wr_lock();
+        }
+
+        bool rd_trylock()
+        {
+            return wr_trylock();
+        }
+
+        void rd_unlock()
+        {
+            wr_unlock();
+        }
+
+        void wr_lock()
+        {
+            uint32_t spins = 0;
+
+            // Only go for the line once it looks free, so that waiters aren't all
+            // bouncing it between them.
+            while (RWLOCK_TAS(&held))
+            {
+                while (held)
+                {
+                    rwlock_backoff(&spins);
+                }
+            }
+        }
+
+        bool wr_trylock()
+        {
+            return ((held == 0) && (RWLOCK_TAS(&held) == 0));
+        }
+
+        void wr_unlock()
+        {
+            RWLOCK_RELEASE(&held);
+        }
+
+        volatile uint32_t held;
+    };
+
+    class TicketLock : public RWLock
+    {
+    public:
+        TicketLock(bool _stats) : RWLock(RWLock::TICKET, _stats)
+        {
+            next = 0;
+            serving = 0;
+        }
+
+    protected:
+        void rd_lock()
+        {
+            wr_lock();
+        }
+
+        bool rd_trylock()
+        {
+            return wr_trylock();
+        }
+
+        void rd_unlock()
+        {
+            wr_unlock();
+        }
+
+        void wr_lock()
+        {
+            uint32_t ticket = RWLOCK_ADD32(&next, 1) - 1;
+            uint32_t spins = 0;
+
+            while (serving != ticket)
+            {
+                rwlock_backoff(&spins);
+            }
+
+            SEQ_BARRIER();
+        }
+
+        bool wr_trylock()
+        {
+            uint32_t s = serving;
+            return RWLOCK_CAS32(&next, s, s + 1);
+        }
+
+        void wr_unlock()
+        {
+            SEQ_BARRIER();
+            serving++;
+        }
+
+        volatile uint32_t next;
+        volatile uint32_t serving;
+    };
+
+    /// A slot readers are counted in, padded out to a cache line of its own.
+    struct rwlock_slot
+    {
+        volatile uint64_t readers;
+        char pad[56];
+    };
+
+    static volatile uint32_t next_slot = 0;
+    static SEQ_THREAD_LOCAL uint32_t thread_slot = 0;
+
+    class ReaderBiasedLock : public RWLock
+    {
+    public:
+        ReaderBiasedLock(bool _stats) : RWLock(RWLock::READER_BIASED, _stats)
+        {
+            SAFE_MALLOC(struct rwlock_slot*, slots, RWLOCK_SLOTS * sizeof(struct rwlock_slot));
+            memset(slots, 0, RWLOCK_SLOTS * sizeof(struct rwlock_slot));
+            writer = 0;
+        }
+
+        ~ReaderBiasedLock()
+        {
+            free(slots);
+        }
+
+    protected:
+        inline struct rwlock_slot* my_slot()
+        {
+            // Slots are numbered from one here, so that zero means this thread
+            // hasn't got one yet. The numbering is shared by every lock.
+            if (thread_slot == 0)
+            {
+                thread_slot = (RWLOCK_ADD32(&next_slot, 1) % RWLOCK_SLOTS) + 1;
+            }
+
+            return &(slots[thread_slot - 1]);
+        }
+
+        void rd_lock()
+        {
+            uint32_t spins = 0;
+
+            while (!rd_trylock())
+            {
+                while (writer)
+                {
+                    rwlock_backoff(&spins);
+                }
+            }
+        }
+
+        bool rd_trylock()
+        {
+            struct rwlock_slot* slot = my_slot();
+
+            // Being counted has to be visible before the writer flag is looked at,
+            // so that a writer either sees this reader or this reader sees it.
+            RWLOCK_ADD64(&(slot->readers), 1);
+
+            if (writer == 0)
+            {
+                return true;
+            }
+
+            RWLOCK_ADD64(&(slot->readers), -1);
+            return false;
+        }
+
+        void rd_unlock()
+        {
+            RWLOCK_ADD64(&(my_slot()->readers), -1);
+        }
+
+        void wr_lock()
+        {
+            uint32_t spins = 0;
+
+            while (!RWLOCK_CAS32(&writer, 0, 1))
+            {
+                rwlock_backoff(&spins);
+            }
+
+            // New readers back off now, so just wait for the ones already in.
+            for (uint32_t i = 0; i < RWLOCK_SLOTS; i++)
+            {
+                while (slots[i].readers != 0)
+                {
+                    rwlock_backoff(&spins);
+                }
+            }
+
+            SEQ_BARRIER();
+        }
+
+        bool wr_trylock()
+        {
+            if (!RWLOCK_CAS32(&writer, 0, 1))
+            {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < RWLOCK_SLOTS; i++)
+            {
+                if (slots[i].readers != 0)
+                {
+                    wr_unlock();
+                    return false;
+                }
+            }
+
+            SEQ_BARRIER();
+            return true;
+        }
+
+        void wr_unlock()
+        {
+            SEQ_BARRIER();
+            writer = 0;
+        }
+
+        struct rwlock_slot* slots;
+        volatile uint32_t writer;
+    };
+
+    RWLock* RWLock::create(LockType type, bool stats)
+    {
+        switch (type)
+        {
+            case DEFAULT:
+                return new DefaultLock(stats);
+            case SPIN:
+                return new TTASLock(stats);
+            case TICKET:
+                return new TicketLock(stats);
+            case READER_BIASED:
+                return new ReaderBiasedLock(stats);
+            default:
+                THROW_ERROR("BAD_LOCK_TYPE", "Unknown lock type.");
+        }
+    }
+
+    RWLock::RWLock(LockType _type, bool _stats)
+    {
+        type = _type;
+
+        if (_stats)
+        {
+            SAFE_MALLOC(struct lock_stats*, stats, sizeof(struct lock_stats));
+            memset(stats, 0, sizeof(struct lock_stats));
+        }
+        else
+        {
+            stats = NULL;
+        }
+    }
+
+    RWLock::~RWLock()
+    {
+        if (stats != NULL)
+        {
+            free(stats);
+        }
+    }
+
+    void RWLock::read_lock()
+    {
+        if (stats == NULL)
+        {
+            rd_lock();
+        }
+        else
+        {
+            if (!rd_trylock())
+            {
+                uint64_t start = Scheduler::now();
+                rd_lock();
+                RWLOCK_ADD64(&(stats->read_wait_ns), Scheduler::now() - start);
+                RWLOCK_ADD64(&(stats->read_contended), 1);
+            }
+
+            RWLOCK_ADD64(&(stats->read_acquisitions), 1);
+        }
+    }
+
+    void RWLock::read_unlock()
+    {
+        rd_unlock();
+    }
+
+    void RWLock::write_lock()
+    {
+        if (stats == NULL)
+        {
+            wr_lock();
+        }
+        else
+        {
+            if (!wr_trylock())
+            {
+                uint64_t start = Scheduler::now();
+                wr_lock();
+                RWLOCK_ADD64(&(stats->write_wait_ns), Scheduler::now() - start);
+                RWLOCK_ADD64(&(stats->write_contended), 1);
+            }
+
+            RWLOCK_ADD64(&(stats->write_acquisitions), 1);
+        }
+    }
+
+    void RWLock::write_unlock()
+    {
+        wr_unlock();
+    }
+
+    RWLock::LockType RWLock::get_type()
+    {
+        return type;
+    }
+
+    bool RWLock::get_stats(struct lock_stats* _stats)
+    {
+        if (stats == NULL)
+        {
+            return false;
+        }
+
+        memcpy(_stats, stats, sizeof(struct lock_stats));
+        return true;
+    }
+
+    void RWLock::reset_stats()
+    {
+        if (stats != NULL)
+        {
+            memset(stats, 0, sizeof(struct lock_stats));
+        }
+    }
+}
@@ -18,6 +18,14 @@
 
 #include "lock.hpp"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
 // Includes, types, and macros to retrieve from the hash mapping we're using, platform dependant.
 #ifdef WIN32
 #include <unordered_map>
@@ -46,8 +54,12 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic> // If we're using C++11 threads, we're going to force the SpinLock class to use atomic<bool>
+#ifdef __linux__
+#include <pthread.h> // For pinning threads, since std::thread has no way to.
+#endif
 #else
 #include <pthread.h> // Otherwise, if we are using pthreads, it will just wrap the pthreads spinlock.
+#include <sched.h>
 #endif
 
 namespace libodb
@@ -77,6 +89,8 @@ namespace libodb
 #define SCHED_MUNLOCK(l) (((SCHED_MLOCK_T*)(l))->unlock())
     /// @}
 
+#define THREAD_YIELD() std::this_thread::yield()
+
 #else
     typedef pthread_t THREAD_T;
     typedef pthread_cond_t CONDVAR_T;
@@ -108,6 +122,104 @@ namespace libodb
 #define SCHED_MLOCK(l) pthread_mutex_lock((SCHED_MLOCK_T*)(l))
 #define SCHED_MUNLOCK(l) pthread_mutex_unlock((SCHED_MLOCK_T*)(l))
     /// @}
+
+#define THREAD_YIELD() sched_yield()
+#endif
+
+    /// Pin the calling thread to a single CPU, where the platform allows it.
+#if defined(WIN32)
+#define THREAD_PIN_SELF(cpu) SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR)1) << (cpu))
+#elif defined(__linux__)
+#define THREAD_PIN_SELF(cpu) \
+    {\
+        cpu_set_t ___set;\
+        CPU_ZERO(&___set);\
+        CPU_SET((cpu), &___set);\
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &___set);\
+    }
+#else
+#define THREAD_PIN_SELF(cpu)
+#endif
+
+    /// Counters that are touched outside of the scheduler's SpinLock.
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define SCHED_ATOMIC_ADD(v, d) __sync_add_and_fetch(&(v), (d))
+#define SCHED_ATOMIC_ADD32(v, d) __sync_add_and_fetch(&(v), (d))
+#define SCHED_CAS32(v, o, n) __sync_bool_compare_and_swap(&(v), (o), (n))
+#define SCHED_CASPTR(v, o, n) __sync_bool_compare_and_swap(&(v), (o), (n))
+#define SCHED_SWAPPTR(v, n) __sync_lock_test_and_set(&(v), (n))
+#define SCHED_BARRIER() __sync_synchronize()
+#elif defined(WIN32)
+#define SCHED_ATOMIC_ADD(v, d) InterlockedAdd64((volatile LONG64*)&(v), (d))
+#define SCHED_ATOMIC_ADD32(v, d) InterlockedAdd((volatile LONG*)&(v), (d))
+#define SCHED_CAS32(v, o, n) (InterlockedCompareExchange((volatile LONG*)&(v), (n), (o)) == (LONG)(o))
+#define SCHED_CASPTR(v, o, n) (InterlockedCompareExchangePointer((PVOID volatile*)&(v), (n), (o)) == (PVOID)(o))
+#define SCHED_SWAPPTR(v, n) InterlockedExchangePointer((PVOID volatile*)&(v), (n))
+#define SCHED_BARRIER() MemoryBarrier()
+#endif
+
+    /// Position of the highest set bit of a non-zero value.
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define SCHED_HIGH_BIT(v) (63 - __builtin_clzll((v)))
+#elif defined(WIN32)
+    static inline uint32_t sched_high_bit(uint64_t v)
+    {
+        unsigned long b;
+        _BitScanReverse64(&b, v);
+        return (uint32_t)b;
+    }
+#define SCHED_HIGH_BIT(v) sched_high_bit((v))
+#endif
+
+    /// States of a workqueue. An active workqueue is either on one of the ready
+    /// rings, or held by the worker running its head workload, and only whoever
+    /// moved it from idle to active may put it on a ring.
+    /// @{
+#define QUEUE_IDLE 0
+#define QUEUE_ACTIVE 1
+    /// @}
+
+    /// The ready rings, in the order they are served.
+    /// @{
+#define TIER_HIGH_PRIORITY 0
+#define TIER_NORMAL 1
+#define TIER_BACKGROUND 2
+#define NUM_TIERS 3
+    /// @}
+
+    /// Marks the continuation list of a workload that has completed, so that
+    /// anything chained on afterwards is added to the scheduler right away.
+#define WORK_DONE ((struct Scheduler::workload*)0x1)
+
+    /// Number of workloads a worker will take from its own deque in a row before
+    /// it checks the interference classes, so that they aren't starved.
+#define SCHED_LOCAL_BURST 32
+
+    /// How many times an idle worker looks for work before it parks, and how many of
+    /// those rounds are spent pausing the core before it starts yielding instead.
+    /// With the pause doubling each round, the pausing rounds add up to a few
+    /// microseconds.
+    /// @{
+#define SCHED_SPIN_LIMIT 64
+#define SCHED_SPIN_PAUSE_ROUNDS 10
+    /// @}
+
+    /// How close to its deadline a deadline workload has to be before it is taken
+    /// ahead of everything else, in nanoseconds.
+#define SCHED_DEADLINE_LEAD 1000000
+
+    /// How much unused time a class with a share of the worker time can bank while
+    /// it has no work, in nanoseconds. Without a cap, a class that sat idle for an
+    /// hour would then be owed the workers for minutes.
+#define SCHED_SHARE_WINDOW 100000000
+
+    /// Hint to the core that this is a spin-wait loop.
+#if defined(WIN32)
+#define SCHED_PAUSE() YieldProcessor()
+#elif (CMAKE_COMPILER_SUITE_GCC) && (defined(__i386__) || defined(__x86_64__))
+#define SCHED_PAUSE() __builtin_ia32_pause()
+#else
+#define SCHED_PAUSE() SCHED_BARRIER()
 #endif
 
 #ifdef CPP11THREADS
@@ -215,163 +327,379 @@ defined(GOOGLE_SPIN_LOCKS)
     {
         struct Scheduler::workload* work;
         struct Scheduler::thread_args* args = (struct Scheduler::thread_args*)args_v;
+        Scheduler* sched = args->scheduler;
+        uint32_t burst = 0;
+        uint32_t idle = 0;
+        uint64_t key;
+
+        if (args->cpu >= 0)
+        {
+            THREAD_PIN_SELF(args->cpu);
+        }
 
         // The general flow is like this:
-        // - If we bounce back to the top of the loop, and break out if we're told to
-        //   stop before we reacquire the lock
-        // - If we're still running, lock the scheduler's mutex, and check for work.
-        // - If there's no work, park this thread, signal the block_until_done condvar
-        //   and wait on the work_cond condvar, to reacquire the scheduler's mutex on wakeup
-        //   NOTE: block_until_done() waits on block_cond, to hold the mlock.
+        // - Try to get work, see take_work(), and if there is some, do it, see run_work().
+        //   Then increment how much work this thread did, and repeat.
+        // - If there's no work, spin for a little while, backing off as we go, and keep
+        //   trying. Work tends to come in bursts, and this saves a sleep and a wakeup
+        //   every time the gap between workloads is short.
+        // - If there's still no work, get ready to park. Take the current wake_epoch as
+        //   the key, announce that this thread is idle, and then look for work one last
+        //   time. Producers publish their work before checking for idle threads, and we
+        //   announce ourselves before looking, so either we see the work or they see us.
+        // - If they see us, they bump wake_epoch and signal work_cond under the mlock, so
+        //   sleeping until the epoch moves on from the key can't miss the wakeup. If they
+        //   don't see any idle threads, they don't touch the mutex or the condvar at all.
+        // - Before we sleep, signal the block_until_done condvar, which waits on the
+        //   parked threads counter.
         //   NOTE: Signalling a condvar with no waiters is OK
         //         http://stackoverflow.com/questions/9598034/what-happens-if-no-threads-are-waiting-and-condition-signal-was-sent
-        // - On wakeup, decrement the parked threads counter while we still have the mutex.
-        // - All of the above is done in a loop to prevent spurious wakeups.
-        //   NOTE: Because this thread holds the lock when it wakes up, we always hold the lock
-        //   at the beginning of that spurious wake-up ignoring loop.
+        // - All of the sleeping is done in a loop to prevent spurious wakeups.
         // - We may have been woken up just to exit, so bail if that's the case.
-        // - Try to get work, and take NULL if there is nothing to do.
-        //   NOTE: get_work() acquires the lock (fast lock)
-        // - If there's work, do the work, and if it wasn't in the indep queue, put the
-        //   queue back into the tree for the next worker. Use the fast lock for this.
-        // - Then free the work item, increment how much work this thread did, and repeat.
         while (args->run)
         {
-            // Break out if we're told to stop before we re-acquire the lock.
+            work = sched->take_work(args, &burst);
 
-            SCHED_MLOCK(args->scheduler->mlock);
-
-            while ((args->scheduler->tree_count == 0) && (args->scheduler->work_avail == 0) && (args->run))
+            if (work == NULL)
             {
-                // Before we sleep, we should wake up anything waiting on the block
-                args->scheduler->num_threads_parked++;
-                //! @bug According to https://computing.llnl.gov/tutorials/pthreads/#ConVarSignal this is probably done wrong.
-                THREAD_COND_SIGNAL(args->scheduler->block_cond);
+                if (idle < SCHED_SPIN_LIMIT)
+                {
+                    idle++;
+                    Scheduler::backoff(idle);
+                    continue;
+                }
 
-                // cond_wait releases the lock when it starts waiting, and is guaranteed
-                // to hold it when it returns.
-                THREAD_COND_WAIT(args->scheduler->work_cond, args->scheduler->mlock);
+                key = sched->wake_epoch;
+                SCHED_ATOMIC_ADD32(sched->num_threads_idle, 1);
 
-                args->scheduler->num_threads_parked--;
-            }
+                work = sched->take_work(args, &burst);
 
-            SCHED_MUNLOCK(args->scheduler->mlock);
+                if (work == NULL)
+                {
+                    uint64_t parked = Scheduler::now();
+                    SCHED_MLOCK(sched->mlock);
 
-            // Break out if we're told to wake up because we were stopping.
-            if (!args->run)
-            {
-                break;
-            }
+                    while ((sched->wake_epoch == key) && (args->run))
+                    {
+                        sched->num_threads_parked++;
+                        //! @bug According to https://computing.llnl.gov/tutorials/pthreads/#ConVarSignal this is probably done wrong.
+                        THREAD_COND_SIGNAL(sched->block_cond);
 
-            // get_work() grabs the fast lock on its own.
-            work = ((args->scheduler->tree_count > 0) ? args->scheduler->get_work() : NULL);
+                        // cond_wait releases the lock when it starts waiting, and is guaranteed
+                        // to hold it when it returns.
+                        THREAD_COND_WAIT(sched->work_cond, sched->mlock);
 
-            if (work != NULL)
-            {
-                if (work->retval == NULL)
-                {
-                    (work->func)(work->args);
-                }
-                else
-                {
-                    *(work->retval) = (work->func)(work->args);
+                        sched->num_threads_parked--;
+                    }
+
+                    SCHED_MUNLOCK(sched->mlock);
+                    args->parked_ns += Scheduler::now() - parked;
                 }
 
-                // We need to add the queue that this came from, as long as it wasn't the independent
-                // queue, back into the queue management structures here. The indep queue is
-                // different because it is handled in the get_work function. The work is taken
-                // from it, and then it is relocated in the RBT based on the next piece of work
-                // in it. Every other queue must have the work taken from it, then the queue be
-                // removed from the tree, then the work processed, and then the queue added back
-                // to the tree.
-                //
-                // We add the queue back to the tree here. Might have to add it into the arguments
-                // that come in along with the workload itself.
-                if (work->q != NULL)
+                SCHED_ATOMIC_ADD32(sched->num_threads_idle, -1);
+                idle = 0;
+
+                if (work == NULL)
                 {
-                    if (work->q->queue->size() > 0)
-                    {
-                        args->scheduler->lock.lock();
-                        RedBlackTreeI::e_add(args->scheduler->root, work->q);
-                        args->scheduler->tree_count++;
-                        work->q->in_tree = true;
-                        args->scheduler->lock.unlock();
-                    }
-                    else
-                    {
-                        work->q->in_tree = false;
-                    }
+                    continue;
                 }
-
-                free(work);
-                args->counter++;
             }
+
+            sched->run_work(work, args);
+            args->counter++;
+            idle = 0;
         }
 
         return NULL;
     }
 
-    /// This is the comparison function that compares two work queues, and will be used
-    /// to sort the queues in the RBT. It should consider the ID of the workload at the
-    /// head of each queue (by using peek()), as well as the flags of the head workload
-    /// and the queue itself.
-    int32_t compare_workqueue(void* aV, void* bV)
+    /// Find a workload for a worker.
+    /// Prefer the worker's own deque, but don't let a steady stream of non-interfering
+    /// work starve the interference classes. Steal from the other workers only when
+    /// there's nothing else to do.
+    struct Scheduler::workload* Scheduler::take_work(struct Scheduler::thread_args* args, uint32_t* burst)
     {
-        struct Scheduler::queue_el* aN = reinterpret_cast<struct Scheduler::queue_el*>(aV);
-        struct Scheduler::queue_el* bN = reinterpret_cast<struct Scheduler::queue_el*>(bV);
+        struct workload* work = NULL;
+
+        // Deadlines that are coming up, and classes that are behind on their share of
+        // the worker time, go ahead of everything else.
+        if ((num_deadlines > 0) && (next_deadline <= now() + SCHED_DEADLINE_LEAD))
+        {
+            work = take_deadline(true);
+
+            if (work != NULL)
+            {
+                return work;
+            }
+        }
 
-        LFQueue* a = aN->queue;
-        LFQueue* b = aN->queue;
+        if (num_shares > 0)
+        {
+            struct queue_el* q = take_share(true);
 
-        int32_t ret = 0;
+            if ((q != NULL) && ((work = pop_queue(q)) != NULL))
+            {
+                return work;
+            }
+        }
 
-        // First compare the flags; if they are equal then we can move onto checking the head workload.
-        // Are they equally high-important?
-        if ((aN->flags & Scheduler::HIGH_PRIORITY) && !(aN->flags & Scheduler::HIGH_PRIORITY))
+        if ((ready_count > 0) && (*burst >= SCHED_LOCAL_BURST))
         {
-            return -1;
+            work = get_work(args->node);
+            *burst = 0;
+        }
+
+        if (work == NULL)
+        {
+            work = get_local_work(args->index, false);
+            (*burst)++;
+        }
+
+        if ((work == NULL) && (ready_count > 0))
+        {
+            work = get_work(args->node);
+            *burst = 0;
+        }
+
+        if (work == NULL)
+        {
+            work = get_local_work(args->index, true);
+
+            if (work != NULL)
+            {
+                args->steals++;
+            }
         }
-        else if ((bN->flags & Scheduler::HIGH_PRIORITY) && !(aN->flags & Scheduler::HIGH_PRIORITY))
+
+        if ((work == NULL) && (num_deadlines > 0))
         {
-            return 1;
+            work = take_deadline(false);
         }
 
-        if (ret != 0) // If either is high priority, and the other is not...
+        return work;
+    }
+
+    /// Wait a little before looking for work again. The first few rounds only pause
+    /// the core, for longer each time, so that a workload that shows up right away is
+    /// picked up within a few hundred cycles. After that, give the core up to any
+    /// other thread that can use it, which matters when there are more threads than
+    /// cores, and the producer is the one that needs it.
+    void Scheduler::backoff(uint32_t round)
+    {
+        if (round <= SCHED_SPIN_PAUSE_ROUNDS)
         {
-            return ret;
+            for (uint32_t i = 0; i < (1U << round); i++)
+            {
+                SCHED_PAUSE();
+            }
         }
         else
         {
-            ret = (aN->flags & Scheduler::BACKGROUND) - (bN->flags & Scheduler::BACKGROUND);
+            THREAD_YIELD();
+        }
+    }
+
+    /// Wake up a parked worker, if there are any, after work has been published.
+    /// Every path that makes work available has to come through here, since the
+    /// workers park without a timeout. The caller's publishing has to end in an
+    /// atomic operation, which orders it before the check of num_threads_idle.
+    void Scheduler::notify()
+    {
+        if (num_threads_idle > 0)
+        {
+            SCHED_ATOMIC_ADD(wake_epoch, 1);
+
+            SCHED_MLOCK(mlock);
+            THREAD_COND_SIGNAL(work_cond);
+            SCHED_MUNLOCK(mlock);
+        }
+    }
+
+    SchedulerConfig::SchedulerConfig()
+    {
+        num_threads = 0;
+    }
+
+    SchedulerConfig::SchedulerConfig(uint32_t _num_threads)
+    {
+        num_threads = _num_threads;
+    }
+
+    void SchedulerConfig::set_num_threads(uint32_t _num_threads)
+    {
+        num_threads = _num_threads;
+    }
+
+    uint32_t SchedulerConfig::get_num_threads()
+    {
+        return num_threads;
+    }
+
+    void SchedulerConfig::add_cpu(uint32_t cpu, uint32_t node)
+    {
+        cpus.push_back(cpu);
+        nodes.push_back(node);
+    }
+
+    /// Add every CPU this process is allowed to run on, along with the NUMA node it
+    /// belongs to. Where the nodes can't be found, every CPU is put on node 0.
+    /// @return Whether any CPUs were found.
+    bool SchedulerConfig::add_topology()
+    {
+        size_t start = cpus.size();
+
+#if defined(WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+
+        for (uint32_t i = 0; i < info.dwNumberOfProcessors; i++)
+        {
+            add_cpu(i, 0);
+        }
+#elif defined(__linux__)
+        cpu_set_t allowed;
+        bool have_allowed = (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0);
+        char path[64];
+        char list[4096];
+        bool found = false;
+
+        // Each node lists its CPUs as comma separated ranges, like 0-3,8-11. Nodes can
+        // be sparse, so give up only after a run of missing ones.
+        for (uint32_t node = 0, missing = 0; missing < 64; node++)
+        {
+            sprintf(path, "/sys/devices/system/node/node%u/cpulist", node);
+            FILE* f = fopen(path, "r");
 
-            if (ret != 0) // If either is background, and the other is not.
+            if (f == NULL)
             {
-                return ret;
+                missing++;
+                continue;
             }
-            else
+
+            missing = 0;
+            found = true;
+
+            if (fgets(list, sizeof(list), f) != NULL)
             {
-                uint64_t aid = ((struct Scheduler::workload*)(a->peek()))->id;
-                uint64_t bid = ((struct Scheduler::workload*)(b->peek()))->id;
+                char* p = list;
 
-                // Now we're stuck comparing the IDs of the head workloads.
-                if (aid > bid) // If existing ID is lower than this one.
+                while ((*p >= '0') && (*p <= '9'))
                 {
-                    // Then this one one is a higher priority;
-                    return 1;
+                    uint32_t lo = (uint32_t)strtoul(p, &p, 10);
+                    uint32_t hi = lo;
+
+                    if (*p == '-')
+                    {
+                        hi = (uint32_t)strtoul(p + 1, &p, 10);
+                    }
+
+                    for (uint32_t cpu = lo; cpu <= hi; cpu++)
+                    {
+                        if (!have_allowed || ((cpu < CPU_SETSIZE) && CPU_ISSET(cpu, &allowed)))
+                        {
+                            add_cpu(cpu, node);
+                        }
+                    }
+
+                    if (*p == ',')
+                    {
+                        p++;
+                    }
                 }
-                else if (aid < bid)
+            }
+
+            fclose(f);
+        }
+
+        if (!found)
+        {
+            for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (have_allowed ? CPU_ISSET(cpu, &allowed) : (cpu < (uint32_t)sysconf(_SC_NPROCESSORS_ONLN)))
                 {
-                    return -1;
+                    add_cpu(cpu, 0);
                 }
-                else
+            }
+        }
+#else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (long i = 0; i < n; i++)
+        {
+            add_cpu((uint32_t)i, 0);
+        }
+#endif
+
+        return (cpus.size() > start);
+    }
+
+    uint32_t SchedulerConfig::get_num_cpus()
+    {
+        return (uint32_t)(cpus.size());
+    }
+
+    uint32_t SchedulerConfig::get_num_nodes()
+    {
+        uint32_t n = 0;
+
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            n = ((nodes[i] + 1 > n) ? nodes[i] + 1 : n);
+        }
+
+        return n;
+    }
+
+    uint32_t SchedulerConfig::get_cpu(uint32_t i)
+    {
+        return cpus.at(i);
+    }
+
+    uint32_t SchedulerConfig::get_node(uint32_t i)
+    {
+        return nodes.at(i);
+    }
+
+    Scheduler::Scheduler(uint32_t _num_threads)
+    {
+        slot_cpus = new std::vector<uint32_t>();
+        slot_nodes = new std::vector<uint32_t>();
+        num_nodes = 1;
+
+        init(_num_threads);
+    }
+
+    Scheduler::Scheduler(SchedulerConfig& config)
+    {
+        slot_cpus = new std::vector<uint32_t>();
+        slot_nodes = new std::vector<uint32_t>();
+        num_nodes = ((config.get_num_nodes() > 0) ? config.get_num_nodes() : 1);
+
+        // Deal the CPUs out one node at a time, so that however many workers there
+        // are, they're spread evenly across the nodes.
+        std::vector<std::vector<uint32_t> > by_node(num_nodes);
+
+        for (size_t i = 0; i < config.cpus.size(); i++)
+        {
+            by_node[config.nodes[i]].push_back(config.cpus[i]);
+        }
+
+        for (size_t r = 0; slot_cpus->size() < config.cpus.size(); r++)
+        {
+            for (uint32_t n = 0; n < num_nodes; n++)
+            {
+                if (r < by_node[n].size())
                 {
-                    return 0;
+                    slot_cpus->push_back(by_node[n][r]);
+                    slot_nodes->push_back(n);
                 }
             }
         }
+
+        init(config.num_threads);
     }
 
-    Scheduler::Scheduler(uint32_t _num_threads)
+    void Scheduler::init(uint32_t _num_threads)
     {
         queue_map = new MAP_T();
 
@@ -380,33 +708,106 @@ defined(GOOGLE_SPIN_LOCKS)
         historical_work_completed = 0;
         this->num_threads = _num_threads;
         num_threads_parked = 0;
+        num_threads_idle = 0;
+        wake_epoch = 0;
+        instrumented = false;
+        available_hwm = 0;
+        memset(&retired, 0, sizeof(struct worker_snapshot));
+        retired_latency = new LatencyHistogram[SCHEDULER_FLAG_KINDS];
+        retired_run_time = new LatencyHistogram[SCHEDULER_FLAG_KINDS];
         THREAD_COND_INIT(work_cond);
         THREAD_COND_INIT(block_cond);
 
         indep.queue = new LFQueue();
-        indep.flags = Scheduler::NONE;
-        indep.in_tree = false;
+        indep.state = QUEUE_IDLE;
         indep.num_hp = 0;
+        indep.node = 0;
+        indep.share = 0;
+        indep.depth_hwm = 0;
+        indep.latency = NULL;
+        indep.run_time = NULL;
 
         SAFE_MALLOC(void**, threads, num_threads * sizeof(THREAD_T));
         SAFE_MALLOC(struct thread_args**, t_args, num_threads * sizeof(struct thread_args*));
 
-        root = RedBlackTreeI::e_init_tree(true, compare_workqueue);
-        tree_count = 0;
-        
+        SAFE_MALLOC(LFQueue**, ready, num_nodes * NUM_TIERS * sizeof(LFQueue*));
+
+        for (uint32_t i = 0; i < num_nodes * NUM_TIERS; i++)
+        {
+            ready[i] = new LFQueue();
+        }
+
+        ready_count = 0;
+
+        SAFE_MALLOC(struct work_pool*, pool, sizeof(struct work_pool));
+        pool->queue = new LFQueue();
+        pool->size = 0;
+        pool->refs = 1;
+        pool->closed = false;
+
+        deadlines = new std::vector<struct workload*>();
+        num_deadlines = 0;
+        next_deadline = (uint64_t)(-1);
+        deadline_misses = 0;
+
+        share_ring = new LFQueue();
+        num_shares = 0;
+
         SCHED_MLOCK_INIT(mlock);
 
+        deques = NULL;
+        num_deques = 0;
+        next_deque = 0;
+        old_deques = new std::vector<LFQueue**>();
+        grow_deques(num_threads);
+
         for (uint32_t i = 0; i < num_threads; i++)
         {
-            SAFE_MALLOC(struct thread_args*, t_args[i], sizeof(struct thread_args));
+            start_thread(i);
+        }
+    }
+
+    void Scheduler::start_thread(uint32_t i)
+    {
+        SAFE_MALLOC(struct thread_args*, t_args[i], sizeof(struct thread_args));
+
+        t_args[i]->run = true;
+        t_args[i]->scheduler = this;
+        t_args[i]->counter = 0;
+        t_args[i]->index = i;
+        t_args[i]->node = worker_node(i);
+        t_args[i]->cpu = worker_cpu(i);
+        t_args[i]->start_ns = now();
+        t_args[i]->busy_ns = 0;
+        t_args[i]->parked_ns = 0;
+        t_args[i]->steals = 0;
+        t_args[i]->latency = new LatencyHistogram[SCHEDULER_FLAG_KINDS];
+        t_args[i]->run_time = new LatencyHistogram[SCHEDULER_FLAG_KINDS];
+
+        //! @todo extern "C"
+        THREAD_CREATE(threads[i], scheduler_worker_thread, t_args[i]);
+    }
+
+    /// Workers past the number of CPUs wrap around, so growing the pool keeps the
+    /// same spread across the nodes.
+    int32_t Scheduler::worker_cpu(uint32_t index)
+    {
+        if (slot_cpus->size() == 0)
+        {
+            return -1;
+        }
 
-            t_args[i]->run = true;
-            t_args[i]->scheduler = this;
-            t_args[i]->counter = 0;
+        return (int32_t)(slot_cpus->at(index % slot_cpus->size()));
+    }
 
-            //! @todo extern "C"
-            THREAD_CREATE(threads[i], scheduler_worker_thread, t_args[i]);
+    uint32_t Scheduler::worker_node(uint32_t index)
+    {
+        if (slot_nodes->size() == 0)
+        {
+            return 0;
         }
+
+        return slot_nodes->at(index % slot_nodes->size());
     }
 
     Scheduler::~Scheduler()
@@ -418,11 +819,58 @@ defined(GOOGLE_SPIN_LOCKS)
         free(threads);
         delete indep.queue;
 
-        /// @bug The data used by the workqueues and their un-processed workloads is not freed.
-        /// Need to free the data used by the workqueues and their unprocessed wokloads here.
-        RedBlackTreeI::e_destroy_tree(root, free);
+        for (uint32_t i = 0; i < num_deques; i++)
+        {
+            delete deques[i];
+        }
+
+        free(deques);
+
+        for (size_t i = 0; i < old_deques->size(); i++)
+        {
+            free(old_deques->at(i));
+        }
+
+        delete old_deques;
+
+        for (uint32_t i = 0; i < num_nodes * NUM_TIERS; i++)
+        {
+            delete ready[i];
+        }
+
+        free(ready);
+
+        // Handles that are still around give their descriptors back to the pool
+        // after this, so it stays until the last of them is gone, but nothing is
+        // kept in it for reuse from here on.
+        pool->closed = true;
+        SCHED_BARRIER();
+
+        void* spent;
+
+        while ((spent = pool->queue->pop_front()) != NULL)
+        {
+            free(spent);
+        }
+
+        release_pool(pool);
+        delete deadlines;
+        delete share_ring;
+        delete slot_cpus;
+        delete slot_nodes;
+
+        /// @bug The un-processed workloads in the workqueues are not freed.
+        for (MAP_T::iterator it = ((MAP_T*)queue_map)->begin(); it != ((MAP_T*)queue_map)->end(); it++)
+        {
+            delete it->second->queue;
+            delete it->second->latency;
+            delete it->second->run_time;
+            free(it->second);
+        }
 
         delete (MAP_T*)queue_map;
+        delete[] retired_latency;
+        delete[] retired_run_time;
         SCHED_MLOCK_DESTROY(mlock);
         THREAD_COND_DESTROY(work_cond);
         THREAD_COND_DESTROY(block_cond);
@@ -430,288 +878,1220 @@ defined(GOOGLE_SPIN_LOCKS)
 
     void Scheduler::update_queue_push_flags(struct Scheduler::queue_el* q, uint32_t f)
     {
-        // If the new item is high priority, then so is the queue
+        // If the new item is high priority, then so is the queue, until it is popped.
+        // Whether the queue is background is decided by its head workload, when the
+        // queue is put on a ring, so there's nothing to track for that here.
+        //! @todo Other priority types?
         if (f & Scheduler::HIGH_PRIORITY)
         {
-            q->flags = Scheduler::HIGH_PRIORITY;
-            q->num_hp++;
+            SCHED_ATOMIC_ADD32(q->num_hp, 1);
         }
-        // If this is the only item in the queue, and it is a background item
-        // then the whole queue can go background.
-        else if ((q->queue->size() == 1) && (f & Scheduler::BACKGROUND))
-        {
-            q->flags = Scheduler::BACKGROUND;
-        }
-        // If we're adding a non-BACKGROUND workload to a BACKGROUND queue, it isn't
-        // background anymore.
-        else if ((q->flags & Scheduler::BACKGROUND) && !(f & Scheduler::BACKGROUND))
-        {
-            q->flags &= ~Scheduler::BACKGROUND;
-        }
-        // If the new workload isn't high priority, or background, then the priority
-        // doesn't change when adding a new item.
-        //! @todo Other priority types?
     }
 
-    void Scheduler::add_work(void* (*func)(void*), void* args, void** retval, uint32_t flags)
+    struct Scheduler::workload* Scheduler::new_work(void* (*func)(void*), void* args, void** retval, uint32_t flags)
     {
         if ((flags & Scheduler::BACKGROUND) && (flags & Scheduler::HIGH_PRIORITY))
         {
+            //! @todo Turn this into a return value, not a throw.
             throw "A workload cannot be both background and high priority. Workload not added to scheduler.\n";
         }
 
-        lock.lock();
+        // Reuse a spent descriptor if there is one, since these come and go at the
+        // rate of the workloads, and are usually freed on a different thread than
+        // the one that allocated them, which is the allocator's worst case.
+        struct workload* work = (struct workload*)(pool->queue->pop_front());
+
+        if (work == NULL)
+        {
+            SAFE_MALLOC(struct workload*, work, sizeof(struct workload));
+        }
+        else
+        {
+            SCHED_ATOMIC_ADD32(pool->size, -1);
+        }
 
-        uint64_t workload_id = work_counter;
-        work_counter++;
+        SCHED_ATOMIC_ADD32(pool->refs, 1);
+        work->pool = pool;
 
-        struct workload* work;
-        SAFE_MALLOC(struct workload*, work, sizeof(struct workload));
         work->func = func;
         work->args = args;
         work->retval = retval;
-        work->id = workload_id;
+        work->id = SCHED_ATOMIC_ADD(work_counter, 1) - 1;
         work->flags = flags;
+        work->q = NULL;
+        work->from = NULL;
+        work->stamp = 0;
+        work->deadline = 0;
+        // One for the scheduler, and one for the handle that is handed back.
+        work->refs = 2;
+        work->done = 0;
+        work->result = NULL;
+        work->conts = NULL;
+        work->next = NULL;
+        work->class_id = 0;
+        work->classed = false;
+        work->heap_args = NULL;
+
+        return work;
+    }
 
-        // We need to consider the flags here.
-        indep.queue->push_back(work);
-        Scheduler::update_queue_push_flags(&indep, flags);
-
-        work->q = &indep;
-
-        if (!indep.in_tree)
+    void Scheduler::copy_args(struct Scheduler::workload* work, const void* args, uint32_t nbytes)
+    {
+        if (nbytes <= sizeof(work->inline_args))
         {
-            RedBlackTreeI::e_add(root, &indep);
-            tree_count++;
-            indep.in_tree = true;
+            work->args = work->inline_args;
+        }
+        else
+        {
+            SAFE_MALLOC(void*, work->heap_args, nbytes);
+            work->args = work->heap_args;
         }
 
-        work_avail++;
-
-        // Now we need to notify at least one thread that there is work available.
-        THREAD_COND_SIGNAL(work_cond);
-
-        lock.unlock();
+        memcpy(work->args, args, nbytes);
     }
 
-    void Scheduler::add_work(void* (*func)(void*), void* args, void** retval, uint64_t class_id, uint32_t flags)
+    void Scheduler::enqueue(struct Scheduler::workload* work)
     {
-        if ((flags & Scheduler::BACKGROUND) && (flags & Scheduler::HIGH_PRIORITY))
+        struct queue_el* q;
+
+        if (work->classed || instrumented)
         {
-            //! @todo Turn this into a return value, not a throw.
-            throw "A workload cannot be both background and high priority. Workload not added to scheduler.\n";
+            work->stamp = now();
         }
 
-        lock.lock();
-
-        uint64_t workload_id = work_counter;
-        work_counter++;
-
-        struct workload* work;
-        SAFE_MALLOC(struct workload*, work, sizeof(struct workload));
-        work->func = func;
-        work->args = args;
-        work->retval = retval;
-        work->id = workload_id;
-        work->flags = flags;
+        if (work->classed)
+        {
+            // Here we need to identify the interference class and add this to it. The
+            // lock only covers the map, since the workqueues themselves are lock-free.
+            lock.lock();
+            q = find_queue(work->class_id);
+            lock.unlock();
+        }
+        // Plain non-interfering work goes straight onto one of the worker's deques.
+        // Anything with a flag on it still goes through the ready rings to be
+        // ordered against the rest of the work.
+        else if ((num_threads > 0) && !(work->flags & (Scheduler::HIGH_PRIORITY | Scheduler::BACKGROUND | Scheduler::BARRIER | Scheduler::URGENT)))
+        {
+            // Read the count before the array; see grow_deques().
+            uint32_t n = num_deques;
+            SCHED_BARRIER();
+            uint32_t target = SCHED_ATOMIC_ADD32(next_deque, 1) % ((num_threads < n) ? num_threads : n);
+            deques[target]->push_back(work);
+
+            note_available(SCHED_ATOMIC_ADD(work_avail, 1));
+            notify();
+            return;
+        }
+        else
+        {
+            q = &indep;
+        }
 
-        // Here we need to identify the interference class and add this to it.
-        struct queue_el* q = find_queue(class_id);
+        // The flags have to be accounted for before the queue can be put on a ring.
         q->queue->push_back(work);
-        Scheduler::update_queue_push_flags(q, flags);
+        Scheduler::update_queue_push_flags(q, work->flags);
+
+        // Not atomic, like the other high-water marks, since it's only a statistic.
+        uint64_t depth = q->queue->size();
+
+        if (depth > q->depth_hwm)
+        {
+            q->depth_hwm = depth;
+        }
+
+        note_available(SCHED_ATOMIC_ADD(work_avail, 1));
+        make_ready(q);
+
+        // Now we need to notify at least one thread that there is work available.
+        notify();
+    }
+
+    WorkHandle Scheduler::add_work(void* (*func)(void*), void* args, void** retval, uint32_t flags)
+    {
+        struct workload* work = new_work(func, args, retval, flags);
+        enqueue(work);
+
+        return WorkHandle(this, work);
+    }
+
+    WorkHandle Scheduler::add_work(void* (*func)(void*), void* args, void** retval, uint64_t class_id, uint32_t flags)
+    {
+        struct workload* work = new_work(func, args, retval, flags);
+        work->class_id = class_id;
+        work->classed = true;
+        enqueue(work);
+
+        return WorkHandle(this, work);
+    }
+
+    WorkHandle Scheduler::add_work_copy(void* (*func)(void*), const void* args, uint32_t nbytes, void** retval, uint32_t flags)
+    {
+        struct workload* work = new_work(func, NULL, retval, flags);
+        copy_args(work, args, nbytes);
+        enqueue(work);
+
+        return WorkHandle(this, work);
+    }
+
+    WorkHandle Scheduler::add_work_copy(void* (*func)(void*), const void* args, uint32_t nbytes, void** retval, uint64_t class_id, uint32_t flags)
+    {
+        struct workload* work = new_work(func, NULL, retval, flags);
+        copy_args(work, args, nbytes);
+        work->class_id = class_id;
+        work->classed = true;
+        enqueue(work);
+
+        return WorkHandle(this, work);
+    }
+
+    /// Run a workload that was taken off of the scheduler, and then hand everything
+    /// that was waiting on it back to the scheduler.
+    void Scheduler::run_work(struct Scheduler::workload* work, struct Scheduler::thread_args* args)
+    {
+        bool timed = (instrumented || (work->from != NULL));
+        uint64_t start = (timed ? now() : 0);
+
+        work->result = (work->func)(work->args);
+
+        if (timed)
+        {
+            uint64_t ran = now() - start;
+
+            if (work->from != NULL)
+            {
+                SCHED_ATOMIC_ADD(work->from->run_ns, ran);
+                SCHED_ATOMIC_ADD(work->from->share_ns, ran);
+                work->from->run_time->record_atomic(ran);
+            }
+
+            // Workers record into their own histograms, which get_snapshot() merges.
+            // Anyone else shares the retired ones.
+            if (instrumented)
+            {
+                for (uint32_t i = 0; i < SCHEDULER_FLAG_KINDS; i++)
+                {
+                    if (!((i == SCHEDULER_FLAG_KINDS - 1) ? (work->flags == 0) : ((work->flags >> i) & 1)))
+                    {
+                        continue;
+                    }
+
+                    if (args != NULL)
+                    {
+                        if (work->stamp != 0)
+                        {
+                            args->latency[i].record(start - work->stamp);
+                        }
+
+                        args->run_time[i].record(ran);
+                    }
+                    else
+                    {
+                        if (work->stamp != 0)
+                        {
+                            retired_latency[i].record_atomic(start - work->stamp);
+                        }
+
+                        retired_run_time[i].record_atomic(ran);
+                    }
+                }
+
+                if (args != NULL)
+                {
+                    args->busy_ns += ran;
+                }
+            }
+        }
+
+        if (work->retval != NULL)
+        {
+            *(work->retval) = work->result;
+        }
+
+        // If get_work() handed us the workqueue along with the workload, then nothing
+        // else in its interference class could run while this did. Now that it's done,
+        // let the workqueue go so it is put back on a ready ring if it has more work.
+        // The indep queue and READ_ONLY workloads never come with their queue, since
+        // get_work() releases those right away.
+        if (work->q != NULL)
+        {
+            release_queue(work->q);
+        }
+
+        SCHED_BARRIER();
+        work->done = 1;
+
+        // Once the list is swapped out, anything chained on later sees WORK_DONE and
+        // adds itself. The list was built by pushing onto the front, so turn it around
+        // to add the continuations in the order they were chained on.
+        struct workload* c = SCHED_SWAPPTR(work->conts, WORK_DONE);
+        struct workload* r = NULL;
+        struct workload* n;
+
+        while (c != NULL)
+        {
+            n = c->next;
+            c->next = r;
+            r = c;
+            c = n;
+        }
+
+        while (r != NULL)
+        {
+            n = r->next;
+            r->args = work->result;
+            enqueue(r);
+            r = n;
+        }
+
+        release_work(work);
+    }
+
+    /// Take and run one outstanding workload, if there is one, on behalf of a thread
+    /// that is waiting on something. This is what keeps WorkHandle::wait() from
+    /// deadlocking when there are no worker threads, or when it's called from inside
+    /// a workload and every worker is busy waiting as well.
+    void Scheduler::help_work()
+    {
+        struct workload* work = get_work(0);
+        uint32_t n = num_deques;
+
+        for (uint32_t i = 0; (i < n) && (work == NULL); i++)
+        {
+            work = get_local_work(i, false);
+        }
+
+        if ((work == NULL) && (num_deadlines > 0))
+        {
+            work = take_deadline(false);
+        }
+
+        if (work != NULL)
+        {
+            run_work(work, NULL);
+            SCHED_ATOMIC_ADD(historical_work_completed, 1);
+        }
+        else
+        {
+            THREAD_YIELD();
+        }
+    }
+
+    WorkHandle Scheduler::chain(struct Scheduler::workload* prev, struct Scheduler::workload* work)
+    {
+        struct workload* head;
+
+        while (true)
+        {
+            head = prev->conts;
+
+            if (head == WORK_DONE)
+            {
+                SCHED_BARRIER();
+                work->args = prev->result;
+                enqueue(work);
+                break;
+            }
+
+            work->next = head;
+
+            if (SCHED_CASPTR(prev->conts, head, work))
+            {
+                break;
+            }
+        }
+
+        return WorkHandle(this, work);
+    }
+
+    void Scheduler::release_work(struct Scheduler::workload* work)
+    {
+        if (SCHED_ATOMIC_ADD32(work->refs, -1) == 0)
+        {
+            if (work->heap_args != NULL)
+            {
+                free(work->heap_args);
+            }
+
+            struct work_pool* p = work->pool;
+
+            // The pool can run a little over, since the check and the add aren't one
+            // step, but that only matters for bounding the memory kept around. One
+            // that lands just after the Scheduler has emptied it for the last time is
+            // freed along with the pool.
+            if (!(p->closed) && (p->size < SCHEDULER_POOL_MAX))
+            {
+                SCHED_ATOMIC_ADD32(p->size, 1);
+                p->queue->push_back(work);
+            }
+            else
+            {
+                free(work);
+            }
+
+            release_pool(p);
+        }
+    }
+
+    void Scheduler::release_pool(struct Scheduler::work_pool* p)
+    {
+        if (SCHED_ATOMIC_ADD32(p->refs, -1) == 0)
+        {
+            void* spent;
+
+            while ((spent = p->queue->pop_front()) != NULL)
+            {
+                free(spent);
+            }
+
+            delete p->queue;
+            free(p);
+        }
+    }
+
+    LatencyHistogram::LatencyHistogram()
+    {
+        clear();
+    }
+
+    void LatencyHistogram::clear()
+    {
+        memset(counts, 0, sizeof(counts));
+        count = 0;
+        sum = 0;
+        max = 0;
+    }
+
+    /// The first four values get a bucket each, and after that every power of two is
+    /// split into four buckets by the two bits below the highest one.
+    uint32_t LatencyHistogram::bucket(uint64_t ns)
+    {
+        if (ns < 4)
+        {
+            return (uint32_t)ns;
+        }
+
+        uint32_t e = SCHED_HIGH_BIT(ns);
+        return (e - 1) * 4 + (uint32_t)((ns >> (e - 2)) & 3);
+    }
+
+    uint64_t LatencyHistogram::bucket_high(uint32_t b)
+    {
+        if (b < 4)
+        {
+            return b;
+        }
+
+        uint32_t e = b / 4 + 1;
+        return ((((uint64_t)(4 + b % 4)) << (e - 2)) + (((uint64_t)1) << (e - 2)) - 1);
+    }
+
+    void LatencyHistogram::record(uint64_t ns)
+    {
+        counts[bucket(ns)]++;
+        count++;
+        sum += ns;
+
+        if (ns > max)
+        {
+            max = ns;
+        }
+    }
+
+    void LatencyHistogram::record_atomic(uint64_t ns)
+    {
+        SCHED_ATOMIC_ADD(counts[bucket(ns)], 1);
+        SCHED_ATOMIC_ADD(count, 1);
+        SCHED_ATOMIC_ADD(sum, ns);
+
+        // Not atomic, since it's only a statistic.
+        if (ns > max)
+        {
+            max = ns;
+        }
+    }
+
+    void LatencyHistogram::merge(LatencyHistogram* other)
+    {
+        for (uint32_t i = 0; i < SCHEDULER_HIST_BUCKETS; i++)
+        {
+            counts[i] += other->counts[i];
+        }
+
+        count += other->count;
+        sum += other->sum;
+
+        if (other->max > max)
+        {
+            max = other->max;
+        }
+    }
+
+    uint64_t LatencyHistogram::get_count()
+    {
+        return count;
+    }
+
+    uint64_t LatencyHistogram::get_max()
+    {
+        return max;
+    }
+
+    uint64_t LatencyHistogram::get_mean()
+    {
+        return ((count > 0) ? (sum / count) : 0);
+    }
+
+    /// Returns the top of the bucket the percentile falls in, so it never understates
+    /// the latency, but never goes past the largest value recorded either.
+    uint64_t LatencyHistogram::get_percentile(double percent)
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        uint64_t target = (uint64_t)(count * percent / 100.0 + 0.5);
+        uint64_t seen = 0;
+
+        if (target == 0)
+        {
+            target = 1;
+        }
+
+        for (uint32_t i = 0; i < SCHEDULER_HIST_BUCKETS; i++)
+        {
+            seen += counts[i];
+
+            if (seen >= target)
+            {
+                uint64_t high = bucket_high(i);
+                return ((high < max) ? high : max);
+            }
+        }
+
+        return max;
+    }
+
+    WorkHandle::WorkHandle()
+    {
+        scheduler = NULL;
+        work = NULL;
+    }
+
+    // Takes over a reference that the scheduler has already counted.
+    WorkHandle::WorkHandle(Scheduler* _scheduler, void* _work)
+    {
+        scheduler = _scheduler;
+        work = _work;
+    }
+
+    WorkHandle::WorkHandle(const WorkHandle& other)
+    {
+        scheduler = other.scheduler;
+        work = other.work;
+
+        if (work != NULL)
+        {
+            SCHED_ATOMIC_ADD32(((struct Scheduler::workload*)work)->refs, 1);
+        }
+    }
+
+    WorkHandle::~WorkHandle()
+    {
+        if (work != NULL)
+        {
+            Scheduler::release_work((struct Scheduler::workload*)work);
+        }
+    }
+
+    WorkHandle& WorkHandle::operator=(const WorkHandle& other)
+    {
+        // Take the new reference first, in case this is self-assignment.
+        if (other.work != NULL)
+        {
+            SCHED_ATOMIC_ADD32(((struct Scheduler::workload*)(other.work))->refs, 1);
+        }
+
+        if (work != NULL)
+        {
+            Scheduler::release_work((struct Scheduler::workload*)work);
+        }
+
+        scheduler = other.scheduler;
+        work = other.work;
+
+        return *this;
+    }
+
+    bool WorkHandle::valid()
+    {
+        return (work != NULL);
+    }
+
+    bool WorkHandle::ready()
+    {
+        return ((work != NULL) && (((struct Scheduler::workload*)work)->done != 0));
+    }
+
+    void* WorkHandle::wait()
+    {
+        if (work == NULL)
+        {
+            return NULL;
+        }
+
+        struct Scheduler::workload* w = (struct Scheduler::workload*)work;
+
+        while (w->done == 0)
+        {
+            scheduler->help_work();
+        }
+
+        SCHED_BARRIER();
+        return w->result;
+    }
+
+    WorkHandle WorkHandle::then(void* (*func)(void*), void** retval, uint32_t flags)
+    {
+        if (work == NULL)
+        {
+            return WorkHandle();
+        }
+
+        return scheduler->chain((struct Scheduler::workload*)work, scheduler->new_work(func, NULL, retval, flags));
+    }
+
+    WorkHandle WorkHandle::then(void* (*func)(void*), void** retval, uint64_t class_id, uint32_t flags)
+    {
+        if (work == NULL)
+        {
+            return WorkHandle();
+        }
+
+        struct Scheduler::workload* next = scheduler->new_work(func, NULL, retval, flags);
+        next->class_id = class_id;
+        next->classed = true;
+
+        return scheduler->chain((struct Scheduler::workload*)work, next);
+    }
+
+    // This is not an asynchronous call. It will block until the requested operation
+    // is complete. Increasing the number of threads is typically going to be fast,
+    // but decreasing the number of threads involves gracefully stopping each thread
+    // one at a time which means that each thread will complete its workload.
+    uint32_t Scheduler::update_num_threads(uint32_t new_num_threads)
+    {
+        if (new_num_threads == num_threads)
+        {
+            return num_threads;
+        }
+        else if (new_num_threads > num_threads)
+        {
+            grow_deques(new_num_threads);
+
+            void** new_threads;
+            SAFE_REALLOC(void**, threads, new_threads, new_num_threads * sizeof(THREAD_T));
+
+            struct thread_args** new_t_args;
+            SAFE_REALLOC(struct thread_args**, t_args, new_t_args, new_num_threads * sizeof(struct thread_args*));
+            threads = new_threads;
+            t_args = new_t_args;
+
+            // New workers pick up where the placement left off, so they land on the
+            // nodes that have the fewest workers.
+            for (uint32_t i = num_threads; i < new_num_threads; i++)
+            {
+                start_thread(i);
+            }
+        }
+        else
+        {
+            // In order to avoid an indefinite block, the order here is important.
+
+            // Try to stop all of the threads, but some may be waiting for work, and
+            // others may be processing a workload.
+            for (uint32_t i = new_num_threads; i < num_threads; i++)
+            {
+                t_args[i]->run = false;
+            }
+
+            // In order to kill the ones that are waiting, we need to wake up all of
+            // the threads so they check their run condition. Most will go right back
+            // to waiting, but the ones we're killing will die after this call. This
+            // has to be under the mlock, since the workers check their run condition
+            // under it right before they sleep.
+            SCHED_MLOCK(mlock);
+            THREAD_COND_BROADCAST(work_cond);
+            SCHED_MUNLOCK(mlock);
+
+            // Now we can join and kill in sequence. This process will take slightly
+            // longer than the remainder of the latest-ending running workload in the
+            // threads we don't want anymore.
+            for (uint32_t i = new_num_threads; i < num_threads; i++)
+            {
+                THREAD_COND_BROADCAST(work_cond);
+                THREAD_JOIN(threads[i]);
+                THREAD_DESTROY(threads[i]);
+                retire_thread(t_args[i]);
+                free(t_args[i]);
+            }
+        }
+
+        num_threads = new_num_threads;
+
+        return num_threads;
+    }
+
+    /// QUEUE MANAGEMENT STRUCTURES
+    /// Every workqueue with work in it, that isn't held by a worker, is on exactly one
+    /// of the ready rings. Which ring is decided when it goes on, by queue_tier(), and
+    /// get_work() serves the rings in tier order. Since a workqueue goes on the back of
+    /// a ring when it becomes ready, the rings are roughly in order of the oldest
+    /// workload in each, which is the order the old red-black tree sorted them by,
+    /// without having to be re-sorted every time a workload is taken.
+    ///
+    /// With more than one NUMA node, each node has its own set of rings, and a workqueue
+    /// goes on the rings of the node its class was placed on with set_class_node().
+    ///
+    /// The map of class IDs to workqueues is the only structure that needs a lock.
+
+    /// This function should be able to, given a class ID, locate an appropriate queue
+    /// to add the workload into. This function should always succeed. If an existing
+    /// queue cannot be found, one should be created, added to the map, and then
+    /// returned. Destroying a queue when it becomes empty is not wise since in some
+    /// cases a queue may often run dry as the producer produces work slower than
+    /// consumers consume it. Must be called with the SpinLock held.
+    struct Scheduler::queue_el* Scheduler::find_queue(uint64_t class_id)
+    {
+        //! @bug Do all of the map implementations reutrn null when looking up an ID that isn't in them?
+        struct queue_el* retval = MAP_GET(queue_map, class_id);
+
+        if (retval == NULL)
+        {
+            //             retval = new LFQueue();
+            SAFE_MALLOC(struct queue_el*, retval, sizeof(struct queue_el));
+            retval->queue = new LFQueue();
+            retval->state = QUEUE_IDLE;
+            retval->num_hp = 0;
+            retval->node = 0;
+            retval->share = 0;
+            retval->share_start = 0;
+            retval->started = 0;
+            retval->total_delay_ns = 0;
+            retval->max_delay_ns = 0;
+            retval->run_ns = 0;
+            retval->share_ns = 0;
+            retval->depth_hwm = 0;
+            retval->latency = new LatencyHistogram();
+            retval->run_time = new LatencyHistogram();
+
+            MAP_GET(queue_map, class_id) = retval;
+        }
+
+        return retval;
+    }
+
+    void Scheduler::set_class_node(uint64_t class_id, uint32_t node)
+    {
+        lock.lock();
+        struct queue_el* q = find_queue(class_id);
+        // If the queue is on a ring right now, this takes effect the next time around.
+        q->node = node % num_nodes;
+        lock.unlock();
+    }
+
+    void Scheduler::update_queue_pop_flags(struct Scheduler::queue_el* q, uint32_t f)
+    {
+        // If we popped a high-priority workload, decrement that. When the counter hits
+        // zero, the queue goes back to its normal tier the next time it's put on a ring.
+        if (f & HIGH_PRIORITY)
+        {
+            SCHED_ATOMIC_ADD32(q->num_hp, -1);
+        }
+    }
+
+    /// Which ready ring a workqueue belongs on. A queue with any high priority work
+    /// in it goes first, and a queue whose head workload is background goes last.
+    /// Only the holder of an active queue may call this, since it peeks at the head.
+    uint32_t Scheduler::queue_tier(struct Scheduler::queue_el* q)
+    {
+        if (q->num_hp > 0)
+        {
+            return TIER_HIGH_PRIORITY;
+        }
+
+        struct workload* head = (struct workload*)(q->queue->peek());
+
+        if ((head != NULL) && (head->flags & Scheduler::BACKGROUND))
+        {
+            return TIER_BACKGROUND;
+        }
+
+        return TIER_NORMAL;
+    }
+
+    /// Put a workqueue on a ready ring, unless it is already on one or is held by a
+    /// worker, in which case whoever has it will see the new work when they let go.
+    void Scheduler::make_ready(struct Scheduler::queue_el* q)
+    {
+        if (SCHED_CAS32(q->state, QUEUE_IDLE, QUEUE_ACTIVE))
+        {
+            if (q->share > 0)
+            {
+                share_ring->push_back(q);
+            }
+            else
+            {
+                ready[q->node * NUM_TIERS + queue_tier(q)]->push_back(q);
+            }
+
+            SCHED_ATOMIC_ADD(ready_count, 1);
+        }
+    }
+
+    /// Let go of a workqueue taken off of a ready ring. The state has to be dropped
+    /// before the size is checked, otherwise a workload added in between would see
+    /// the queue as active, and nobody would put it back on a ring.
+    void Scheduler::release_queue(struct Scheduler::queue_el* q)
+    {
+        q->state = QUEUE_IDLE;
+        SCHED_BARRIER();
+
+        if (q->queue->size() > 0)
+        {
+            make_ready(q);
+            notify();
+        }
+    }
 
-        work->q = q;
+    struct Scheduler::workload* Scheduler::get_work(uint32_t node)
+    {
+        struct queue_el* q = NULL;
 
-        if (!q->in_tree)
+        // Go through the tiers in order, and within each, start with this node's ring.
+        for (uint32_t i = 0; (i < NUM_TIERS) && (q == NULL); i++)
         {
-            RedBlackTreeI::e_add(root, q);
-            tree_count++;
-            q->in_tree = true;
+            for (uint32_t j = 0; (j < num_nodes) && (q == NULL); j++)
+            {
+                q = (struct queue_el*)(ready[((node + j) % num_nodes) * NUM_TIERS + i]->pop_front());
+            }
         }
 
-        work_avail++;
+        // Classes with a share that are ahead of it still get to go when nothing else can.
+        if ((q == NULL) && (num_shares > 0))
+        {
+            q = take_share(false);
+        }
 
-        // Now we need to notify at least one thread that there is work available.
-        THREAD_COND_SIGNAL(work_cond);
+        if (q == NULL)
+        {
+            return NULL;
+        }
 
-        lock.unlock();
+        return pop_queue(q);
     }
 
-    // This is not an asynchronous call. It will block until the requested operation
-    // is complete. Increasing the number of threads is typically going to be fast,
-    // but decreasing the number of threads involves gracefully stopping each thread
-    // one at a time which means that each thread will complete its workload.
-    uint32_t Scheduler::update_num_threads(uint32_t new_num_threads)
+    /// Take the head workload of a workqueue that was just taken off of a ready ring.
+    struct Scheduler::workload* Scheduler::pop_queue(struct Scheduler::queue_el* q)
     {
-        if (new_num_threads == num_threads)
+        SCHED_ATOMIC_ADD(ready_count, -1);
+
+        // A queue is only ever on a ring when it has work in it, and only the worker
+        // that took it off of the ring pops from it. The push might not have finished
+        // landing yet though, in which case hand the queue back and try again later.
+        struct workload* first_work = (struct workload*)(q->queue->pop_front());
+
+        if (first_work == NULL)
         {
-            return num_threads;
+            release_queue(q);
+            return NULL;
         }
-        else if (new_num_threads > num_threads)
+
+        Scheduler::update_queue_pop_flags(q, first_work->flags);
+        SCHED_ATOMIC_ADD(work_avail, -1);
+
+        if (q != &indep)
         {
-            void** new_threads;
-            SAFE_REALLOC(void**, threads, new_threads, new_num_threads * sizeof(THREAD_T));
+            uint64_t delay = now() - first_work->stamp;
 
-            struct thread_args** new_t_args;
-            SAFE_REALLOC(struct thread_args**, t_args, new_t_args, new_num_threads * sizeof(struct thread_args*));
-            threads = new_threads;
-            t_args = new_t_args;
+            first_work->from = q;
+            SCHED_ATOMIC_ADD(q->started, 1);
+            SCHED_ATOMIC_ADD(q->total_delay_ns, delay);
 
-            for (uint32_t i = num_threads; i < new_num_threads; i++)
+            // Not atomic, but this is only a statistic, and only ever loses out to
+            // another delay that was nearly as long.
+            if (delay > q->max_delay_ns)
             {
-                SAFE_MALLOC(struct thread_args*, t_args[i], sizeof(struct thread_args));
+                q->max_delay_ns = delay;
+            }
 
-                t_args[i]->run = true;
-                t_args[i]->scheduler = this;
-                t_args[i]->counter = 0;
+            q->latency->record_atomic(delay);
+        }
 
-                //! @todo extern "C"
-                THREAD_CREATE(threads[i], scheduler_worker_thread, t_args[i]);
-            }
+        // If the queue is the indep queue, or the workload is marked as READ_ONLY, then
+        // the rest of the queue can go ahead while this runs, so let it go right away.
+        // Otherwise the worker holds onto the queue until the workload is complete, so
+        // that no conflicting workloads are processed concurrently.
+        if ((q == &indep) || (first_work->flags & Scheduler::READ_ONLY))
+        {
+            first_work->q = NULL;
+            release_queue(q);
         }
         else
         {
-            // In order to avoid an indefinite block, the order here is important.
+            first_work->q = q;
+        }
 
-            // Try to stop all of the threads, but some may be waiting for work, and
-            // others may be processing a workload.
-            for (uint32_t i = new_num_threads; i < num_threads; i++)
+        return first_work;
+    }
+
+    bool Scheduler::deadline_later(struct Scheduler::workload* a, struct Scheduler::workload* b)
+    {
+        return (a->deadline > b->deadline);
+    }
+
+    /// Take the deadline workload with the earliest deadline, or, with due_only, only if
+    /// that deadline is coming up.
+    struct Scheduler::workload* Scheduler::take_deadline(bool due_only)
+    {
+        struct workload* work;
+        uint64_t t = now();
+
+        lock.lock();
+
+        if ((deadlines->size() == 0) || (due_only && (deadlines->front()->deadline > t + SCHED_DEADLINE_LEAD)))
+        {
+            lock.unlock();
+            return NULL;
+        }
+
+        std::pop_heap(deadlines->begin(), deadlines->end(), Scheduler::deadline_later);
+        work = deadlines->back();
+        deadlines->pop_back();
+
+        next_deadline = ((deadlines->size() > 0) ? deadlines->front()->deadline : (uint64_t)(-1));
+        num_deadlines--;
+
+        lock.unlock();
+
+        SCHED_ATOMIC_ADD(work_avail, -1);
+
+        if (t > work->deadline)
+        {
+            SCHED_ATOMIC_ADD(deadline_misses, 1);
+        }
+
+        return work;
+    }
+
+    /// Take a workqueue off of the share ring, or, with owed_only, only one that has
+    /// had less than its share of the worker time. The ones passed over go around to
+    /// the back, so each class gets a look in turn.
+    struct Scheduler::queue_el* Scheduler::take_share(bool owed_only)
+    {
+        uint32_t n = num_shares;
+        struct queue_el* q;
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            q = (struct queue_el*)(share_ring->pop_front());
+
+            if (q == NULL)
             {
-                t_args[i]->run = false;
+                break;
             }
 
-            // In order to kill the ones that are waiting, we need to wake up all of
-            // the threads so they check their run condition. Most will go right back
-            // to waiting, but the ones we're killing will die after this call.
-            THREAD_COND_BROADCAST(work_cond);
-
-            // Now we can join and kill in sequence. This process will take slightly
-            // longer than the remainder of the latest-ending running workload in the
-            // threads we don't want anymore.
-            for (uint32_t i = new_num_threads; i < num_threads; i++)
+            // A class whose share has been taken away only has to get off of the ring.
+            if (!owed_only || (q->share == 0) || share_owed(q))
             {
-                THREAD_COND_BROADCAST(work_cond);
-                THREAD_JOIN(threads[i]);
-                THREAD_DESTROY(threads[i]);
-                historical_work_completed += t_args[i]->counter;
-                free(t_args[i]);
+                return q;
             }
-        }
 
-        num_threads = new_num_threads;
+            share_ring->push_back(q);
+        }
 
-        return num_threads;
+        return NULL;
     }
 
-    /// QUEUE MANAGEMENT STRUCTURES
-    /// There should be a Red-black tree that keeps track of all of the workqueues
-    /// and sorts based on the oldest workload, and any applicable flags in applied
-    /// to the queue and to the workloads in it. See the header for notes on the flags.
-    /// This RBT is used when get_work is called in order to get the first piece of
-    /// that is eligible to be completed. Empty queues should always come last.
-    ///
-    /// There may also be a different parallel structure that is used for find_work.
-    /// This structure would be optimized for read-only operations, to quickly identify
-    /// the right queue for a new workload to be added to.
-
-    /// This function should be able to, given a class ID, locate an appropriate queue
-    /// to add the workload into. This function should always succeed. If an existing
-    /// queue cannot be found, one should be created, added to the queue management
-    /// structures, and then returned. Care should be taken that when adding work to
-    /// an empty queue, that queue must be rearranged in the RBT. However, destroying
-    /// a queue when it becomes empty is not wise either since in some cases a queue
-    /// may often run dry as the producer produces work slower than consumers consume it.
-    struct Scheduler::queue_el* Scheduler::find_queue(uint64_t class_id)
+    /// Whether a class has had less than its share of the worker time since its share
+    /// was set. Only the holder of its workqueue may call this.
+    bool Scheduler::share_owed(struct Scheduler::queue_el* q)
     {
-        //! @bug Do all of the map implementations reutrn null when looking up an ID that isn't in them?
-        struct queue_el* retval = MAP_GET(queue_map, class_id);
+        uint64_t threads = ((num_threads > 0) ? num_threads : 1);
+        uint64_t allowed = ((now() - q->share_start) / 100) * q->share * threads;
 
-        if (retval == NULL)
+        if (allowed > q->share_ns + SCHED_SHARE_WINDOW)
         {
-            //             retval = new LFQueue();
-            SAFE_MALLOC(struct queue_el*, retval, sizeof(struct queue_el));
-            retval->link[0] = NULL;
-            retval->link[1] = NULL;
-            retval->queue = new LFQueue();
-            retval->flags = Scheduler::NONE;
-            retval->in_tree = false;
-            retval->num_hp = 0;
-
-            MAP_GET(queue_map, class_id) = retval;
+            q->share_ns = allowed - SCHED_SHARE_WINDOW;
         }
 
-        return retval;
+        return (q->share_ns < allowed);
     }
 
-    void Scheduler::update_queue_pop_flags(struct Scheduler::queue_el* q, uint32_t f)
+    WorkHandle Scheduler::add_work_deadline(void* (*func)(void*), void* args, void** retval, uint64_t deadline, uint32_t flags)
     {
-        // If we popped a high-priority workload, decrement that.
-        // If that counter hits zero, then discard the HIGH_PRIORITY flag
-        if (f & HIGH_PRIORITY)
+        struct workload* work = new_work(func, args, retval, flags);
+        work->deadline = deadline;
+
+        if (instrumented)
         {
-            q->num_hp--;
+            work->stamp = now();
+        }
 
-            if (q->num_hp == 0)
-            {
-                q->flags &= ~Scheduler::HIGH_PRIORITY;
-            }
+        lock.lock();
+        deadlines->push_back(work);
+        std::push_heap(deadlines->begin(), deadlines->end(), Scheduler::deadline_later);
+        next_deadline = deadlines->front()->deadline;
+        num_deadlines++;
+        lock.unlock();
+
+        note_available(SCHED_ATOMIC_ADD(work_avail, 1));
+        notify();
+
+        return WorkHandle(this, work);
+    }
+
+    void Scheduler::set_class_share(uint64_t class_id, uint32_t percent)
+    {
+        lock.lock();
+        struct queue_el* q = find_queue(class_id);
+
+        if ((q->share == 0) && (percent > 0))
+        {
+            num_shares++;
         }
-        // If we're back to the last item, and it is BACKGROUND, then the queue is
-        // BACKGROUND
-        else if ((q->queue->size() == 1) && (((struct workload*)(q->queue->peek()))->flags & Scheduler::BACKGROUND))
+        else if ((q->share > 0) && (percent == 0))
         {
-            q->flags &= BACKGROUND;
+            num_shares--;
         }
+
+        // If the queue is on a ring right now, this takes effect the next time around.
+        q->share = ((percent > 100) ? 100 : percent);
+        q->share_start = now();
+        q->share_ns = 0;
+        lock.unlock();
     }
 
-    struct Scheduler::workload* Scheduler::get_work()
+    bool Scheduler::get_class_stats(uint64_t class_id, struct Scheduler::class_stats* stats)
     {
         lock.lock();
+        MAP_T::iterator it = ((MAP_T*)queue_map)->find(class_id);
 
-        if (tree_count == 0)
+        if ((it == ((MAP_T*)queue_map)->end()) || (it->second == NULL))
         {
             lock.unlock();
-            return NULL;
+            return false;
+        }
+
+        struct queue_el* q = it->second;
+        stats->started = q->started;
+        stats->total_delay_ns = q->total_delay_ns;
+        stats->max_delay_ns = q->max_delay_ns;
+        stats->run_ns = q->run_ns;
+        stats->share = q->share;
+        lock.unlock();
+
+        return true;
+    }
+
+    uint64_t Scheduler::get_deadline_misses()
+    {
+        return deadline_misses;
+    }
+
+    void Scheduler::set_instrumented(bool _instrumented)
+    {
+        instrumented = _instrumented;
+    }
+
+    void Scheduler::note_available(uint64_t avail)
+    {
+        if (avail > available_hwm)
+        {
+            available_hwm = avail;
+        }
+    }
+
+    /// Fold the counters of a worker that is being stopped into the retired totals, so
+    /// that they still show up in snapshots. Only update_num_threads() calls this.
+    void Scheduler::retire_thread(struct Scheduler::thread_args* args)
+    {
+        historical_work_completed += args->counter;
+
+        retired.uptime_ns += now() - args->start_ns;
+        retired.busy_ns += args->busy_ns;
+        retired.parked_ns += args->parked_ns;
+        retired.steals += args->steals;
+
+        for (uint32_t i = 0; i < SCHEDULER_FLAG_KINDS; i++)
+        {
+            retired_latency[i].merge(&(args->latency[i]));
+            retired_run_time[i].merge(&(args->run_time[i]));
         }
 
-        struct workload* first_work = NULL;
-        void* first_queue = RedBlackTreeI::e_pop_first(root);
-        tree_count--;
+        delete[] args->latency;
+        delete[] args->run_time;
+    }
+
+    /// Nothing is stopped to take the snapshot. Every counter is read as it stands, so
+    /// the totals can be a few workloads apart from each other, but none of them ever
+    /// go backwards. Like get_num_complete(), it isn't safe to call while the number of
+    /// threads is being changed.
+    struct Scheduler::snapshot* Scheduler::get_snapshot()
+    {
+        struct snapshot* snap = new struct snapshot();
+        uint64_t t = now();
 
-        struct queue_el* q = (struct queue_el*)first_queue;
-        LFQueue* queue = q->queue;
+        snap->completed = get_num_complete();
+        snap->available = work_avail;
+        snap->available_hwm = available_hwm;
 
-        // This is more of a sanity check than anything.
-        // This shouldn't ever fail.
-        if (queue->size() > 0)
+        for (uint32_t i = 0; i < SCHEDULER_FLAG_KINDS; i++)
         {
-            first_work = (struct workload*)queue->pop_front();
-            Scheduler::update_queue_pop_flags(q, first_work->flags);
+            snap->latency[i].merge(&(retired_latency[i]));
+            snap->run_time[i].merge(&(retired_run_time[i]));
+        }
 
-            // At this point, if the queue isn't the independent queue, or the workload isn't
-            // marked as READ_ONLY, the queue should be removed from the RBT, so that no
-            // conflicting workloads are processed concurrently. (the 'else', that is we
-            // just don't add it back, and let the worker thread do that.)
-            //
-            // If the queue is the indep queue, or the workload is marked as READ_ONLY, then
-            // the queue should be relocated in the tree to a position appropriate for the
-            // new workload at the head of the queue. This will likely involve a 'remove'
-            // and an 'add' operation, so two RBT operations consecutively. Not sure if there
-            // is a faster way of doing this. (the 'if')
-            if ((queue->size() > 0) && ((queue == indep.queue) || (first_work->flags & Scheduler::READ_ONLY)))
+        for (uint32_t i = 0; i < num_threads; i++)
+        {
+            struct thread_args* args = t_args[i];
+            struct worker_snapshot w;
+
+            w.completed = args->counter;
+            w.uptime_ns = t - args->start_ns;
+            w.busy_ns = args->busy_ns;
+            w.parked_ns = args->parked_ns;
+            w.idle_ns = ((w.uptime_ns > w.busy_ns + w.parked_ns) ? (w.uptime_ns - w.busy_ns - w.parked_ns) : 0);
+            w.steals = args->steals;
+            snap->workers.push_back(w);
+
+            for (uint32_t j = 0; j < SCHEDULER_FLAG_KINDS; j++)
             {
-                RedBlackTreeI::e_add(root, q);
-                tree_count++;
-                q->in_tree = true;
-                first_work->q = NULL;
+                snap->latency[j].merge(&(args->latency[j]));
+                snap->run_time[j].merge(&(args->run_time[j]));
             }
+        }
+
+        lock.lock();
 
-            work_avail--;
+        for (MAP_T::iterator it = ((MAP_T*)queue_map)->begin(); it != ((MAP_T*)queue_map)->end(); it++)
+        {
+            struct queue_el* q = it->second;
+            struct class_snapshot c;
+
+            c.class_id = it->first;
+            c.stats.started = q->started;
+            c.stats.total_delay_ns = q->total_delay_ns;
+            c.stats.max_delay_ns = q->max_delay_ns;
+            c.stats.run_ns = q->run_ns;
+            c.stats.share = q->share;
+            c.depth = q->queue->size();
+            c.depth_hwm = q->depth_hwm;
+            c.latency.merge(q->latency);
+            c.run_time.merge(q->run_time);
+            snap->classes.push_back(c);
         }
 
         lock.unlock();
 
-        return first_work;
+        return snap;
+    }
+
+    uint64_t Scheduler::now()
+    {
+#ifdef WIN32
+        LARGE_INTEGER count, freq;
+        QueryPerformanceCounter(&count);
+        QueryPerformanceFrequency(&freq);
+
+        return (uint64_t)((count.QuadPart / freq.QuadPart) * 1000000000 + ((count.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+
+        return ((uint64_t)(t.tv_sec) * 1000000000 + (uint64_t)(t.tv_nsec));
+#endif
+    }
+
+    struct Scheduler::workload* Scheduler::get_local_work(uint32_t index, bool steal)
+    {
+        // Read the count before the array; see grow_deques().
+        uint32_t n = num_deques;
+        SCHED_BARRIER();
+        LFQueue** d = deques;
+        struct workload* work = NULL;
+
+        if (!steal)
+        {
+            if (index < n)
+            {
+                work = (struct workload*)(d[index]->pop_front());
+            }
+        }
+        else
+        {
+            // Go around the other deques, starting with the next one along so that
+            // the thieves don't all pile onto the same victim. This includes any
+            // deques left over from threads that have since been stopped. Victims
+            // on the same node go first, the rest only if that turns up nothing.
+            uint32_t node = worker_node(index);
+
+            for (uint32_t pass = 0; (pass < 2) && (work == NULL); pass++)
+            {
+                for (uint32_t i = 1; (i < n) && (work == NULL); i++)
+                {
+                    if ((worker_node((index + i) % n) == node) == (pass == 0))
+                    {
+                        work = (struct workload*)(d[(index + i) % n]->pop_front());
+                    }
+                }
+
+                if (num_nodes == 1)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (work != NULL)
+        {
+            SCHED_ATOMIC_ADD(work_avail, -1);
+        }
+
+        return work;
+    }
+
+    void Scheduler::grow_deques(uint32_t n)
+    {
+        if (n <= num_deques)
+        {
+            return;
+        }
+
+        LFQueue** new_deques;
+        SAFE_MALLOC(LFQueue**, new_deques, n * sizeof(LFQueue*));
+
+        for (uint32_t i = 0; i < num_deques; i++)
+        {
+            new_deques[i] = deques[i];
+        }
+
+        for (uint32_t i = num_deques; i < n; i++)
+        {
+            new_deques[i] = new LFQueue();
+        }
+
+        // Readers load the count, then the array, so publishing the array first
+        // means nobody can pair the new count with the old array. The old array
+        // may still be being read, so it is kept around.
+        if (deques != NULL)
+        {
+            old_deques->push_back((LFQueue**)deques);
+        }
+
+        deques = new_deques;
+        SCHED_BARRIER();
+        num_deques = n;
     }
 
     // Be careful about using this: This will wake up if all queues are momentarily exhausted, even though
@@ -723,7 +2103,7 @@ defined(GOOGLE_SPIN_LOCKS)
         SCHED_MLOCK(mlock);
 
         // If there are any unparked threads, we need to wait on them
-        while ((work_avail > 0) || (tree_count > 0) || (num_threads_parked != num_threads))
+        while ((work_avail > 0) || (ready_count > 0) || (num_threads_parked != num_threads))
         {
             // When worker threads park themselves, they signal this condvar. The only thing
             // that waits on this is this function. 
@@ -731,7 +2111,7 @@ defined(GOOGLE_SPIN_LOCKS)
 
             // If we still pass the looping condition, we can skip the trylock.
             // If we don't pass the looping condition, that is it looks like we might be out of work
-            if (!((work_avail > 0) || (tree_count > 0) || (num_threads_parked != num_threads)))
+            if (!((work_avail > 0) || (ready_count > 0) || (num_threads_parked != num_threads)))
             {
                 // Try to spinlock to see if anything is contending for spinlock access, which means we might
                 // be adding work.
@@ -751,7 +2131,7 @@ defined(GOOGLE_SPIN_LOCKS)
 
     void Scheduler::spin_until_done()
     {
-        while ((work_avail > 0) || (tree_count > 0) || (num_threads_parked != num_threads))
+        while ((work_avail > 0) || (ready_count > 0) || (num_threads_parked != num_threads))
         {
         }
     }
@@ -773,4 +2153,112 @@ defined(GOOGLE_SPIN_LOCKS)
         // This does not atomically fetch this value, but again that doesn't really matter.
         return work_avail;
     }
+
+    uint32_t Scheduler::get_num_threads()
+    {
+        return num_threads;
+    }
+
+    /// Shared state for a batch handed to run_batch().
+    /// Items are claimed one at a time off of next, so the workers and the calling
+    ///thread balance among themselves regardless of how uneven the items are. The
+    ///batch is reference counted because a worker may only get around to its
+    ///workload after the caller has already seen every item complete and returned.
+    struct batch_state
+    {
+        void* (*func)(void*);
+        void** args;
+        uint32_t n;
+        uint32_t next;
+        volatile uint32_t done;
+        uint32_t refs;
+        SpinLock lock;
+    };
+
+    void run_batch_items(struct batch_state* b)
+    {
+        uint32_t i;
+
+        while (true)
+        {
+            b->lock.lock();
+            i = b->next;
+
+            if (i < b->n)
+            {
+                b->next++;
+            }
+
+            b->lock.unlock();
+
+            if (i >= b->n)
+            {
+                break;
+            }
+
+            (b->func)(b->args[i]);
+
+            b->lock.lock();
+            b->done++;
+            b->lock.unlock();
+        }
+    }
+
+    void release_batch(struct batch_state* b)
+    {
+        b->lock.lock();
+        bool last = (--(b->refs) == 0);
+        b->lock.unlock();
+
+        if (last)
+        {
+            delete b;
+        }
+    }
+
+    void* batch_workload(void* argsV)
+    {
+        struct batch_state* b = (struct batch_state*)argsV;
+
+        run_batch_items(b);
+        release_batch(b);
+
+        return NULL;
+    }
+
+    void Scheduler::run_batch(void* (*func)(void*), void** args, uint32_t n)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+
+        // There's no point in waking up more helpers than there are items for
+        // them, since this thread takes one as well.
+        uint32_t helpers = ((num_threads < (n - 1)) ? num_threads : (n - 1));
+
+        struct batch_state* b = new struct batch_state;
+        b->func = func;
+        b->args = args;
+        b->n = n;
+        b->next = 0;
+        b->done = 0;
+        b->refs = helpers + 1;
+
+        for (uint32_t i = 0; i < helpers; i++)
+        {
+            add_work(batch_workload, b, NULL, Scheduler::NONE);
+        }
+
+        run_batch_items(b);
+
+        // Anything that is still outstanding at this point has been claimed by a
+        // worker and is actively running, so this wait is short.
+        while (b->done < n)
+        {
+            THREAD_YIELD();
+        }
+
+        release_batch(b);
+    }
 }
@@ -0,0 +1,521 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for implementations of ShardedODB and ShardedIndex.
+/// @file shardedodb.cpp
+
+#include "shardedodb.hpp"
+#include "index.hpp"
+#include "iterator.hpp"
+#include "scheduler.hpp"
+#include "comparator.hpp"
+
+#include "common.hpp"
+
+#include <algorithm>
+
+namespace libodb
+{
+    /// Operations a ShardedIndex query can run on each shard's Index table.
+    typedef enum { SHARD_EQ = 0, SHARD_LT = 1, SHARD_GT = 2, SHARD_TOP_K = 3 } ShardOp;
+
+    /// One shard's part of a query that is fanned out across all of them.
+    struct shard_query
+    {
+        ODB* odb;
+        Condition* condition;
+        ODB* result;
+
+        Index* index;
+        int32_t (*compare)(void*, void*);
+        int32_t op;
+        void* rawdata;
+        uint64_t k;
+        int8_t dir;
+        std::vector<void*>* run;
+    };
+
+    void* shard_query_workload(void* argsV)
+    {
+        struct shard_query* args = (struct shard_query*)argsV;
+        args->result = args->odb->query(args->condition);
+        return NULL;
+    }
+
+    /// Walks one shard's Index table the same way the tree's own queries do, but
+    ///keeps the rows in order instead of putting them into a DataStore.
+    void* shard_index_workload(void* argsV)
+    {
+        struct shard_query* args = (struct shard_query*)argsV;
+
+        if (args->op == SHARD_TOP_K)
+        {
+            args->run = args->index->query_top_k(args->k, args->dir);
+            return NULL;
+        }
+
+        args->run = new std::vector<void*>();
+
+        int8_t dir = ((args->op == SHARD_EQ) ? 0 : args->dir);
+        Iterator* it = args->index->it_lookup(args->rawdata, dir);
+        void* temp;
+
+        if (it->data() != NULL)
+        {
+            do
+            {
+                temp = it->get_data();
+
+                if ((args->op == SHARD_EQ) && (args->compare(args->rawdata, temp) != 0))
+                {
+                    break;
+                }
+
+                it->update_query_count();
+                args->run->push_back(temp);
+            } while ((dir < 0) ? (it->prev() != NULL) : (it->next() != NULL));
+        }
+
+        args->index->it_release(it);
+        return NULL;
+    }
+
+    /// Orders the heads of the runs being merged, so that the one that should
+    ///come out next is at the top of the heap.
+    struct shard_head_order
+    {
+        int32_t (*compare)(void*, void*);
+        bool descending;
+        std::vector<std::vector<void*>*>* runs;
+        std::vector<size_t>* pos;
+
+        bool operator()(uint32_t a, uint32_t b)
+        {
+            int32_t c = compare(runs->at(a)->at(pos->at(a)), runs->at(b)->at(pos->at(b)));
+            return (descending ? (c < 0) : (c > 0));
+        }
+    };
+
+    ShardedIndex::ShardedIndex(ShardedODB* _parent, int32_t (*_compare)(void*, void*))
+    {
+        parent = _parent;
+        compare = _compare;
+        indices = new std::vector<Index*>();
+    }
+
+    ShardedIndex::~ShardedIndex()
+    {
+        // The Index tables themselves belong to the shards.
+        delete indices;
+    }
+
+    std::vector<void*>* ShardedIndex::query_eq(void* rawdata)
+    {
+        return query_runs(SHARD_EQ, rawdata, 0, 1);
+    }
+
+    std::vector<void*>* ShardedIndex::query_lt(void* rawdata)
+    {
+        return query_runs(SHARD_LT, rawdata, 0, -1);
+    }
+
+    std::vector<void*>* ShardedIndex::query_gt(void* rawdata)
+    {
+        return query_runs(SHARD_GT, rawdata, 0, 1);
+    }
+
+    std::vector<void*>* ShardedIndex::query_top_k(uint64_t k, int8_t dir)
+    {
+        return query_runs(SHARD_TOP_K, NULL, k, dir);
+    }
+
+    std::vector<void*>* ShardedIndex::query_runs(int32_t op, void* rawdata, uint64_t k, int8_t dir)
+    {
+        uint32_t n = (uint32_t)indices->size();
+        std::vector<struct shard_query> parts(n);
+        std::vector<void*> args(n);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            parts[i].index = indices->at(i);
+            parts[i].compare = compare;
+            parts[i].op = op;
+            parts[i].rawdata = rawdata;
+            parts[i].k = k;
+            parts[i].dir = dir;
+            parts[i].run = NULL;
+            args[i] = &(parts[i]);
+        }
+
+        parent->fan_out(shard_index_workload, &args[0], n);
+
+        // Every shard's run is already in order, so a k-way merge over the heads
+        // of the runs puts them together. Anything walked downwards comes out
+        // largest first, and so does the top k from the top.
+        std::vector<std::vector<void*>*> runs(n);
+        std::vector<size_t> pos(n, 0);
+        std::vector<uint32_t> heap;
+        size_t total = 0;
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            runs[i] = parts[i].run;
+            total += runs[i]->size();
+
+            if (!runs[i]->empty())
+            {
+                heap.push_back(i);
+            }
+        }
+
+        if ((op == SHARD_TOP_K) && (total > k))
+        {
+            total = (size_t)k;
+        }
+
+        struct shard_head_order order;
+        order.compare = compare;
+        order.descending = ((op == SHARD_TOP_K) ? (dir >= 0) : (dir < 0));
+        order.runs = &runs;
+        order.pos = &pos;
+
+        std::make_heap(heap.begin(), heap.end(), order);
+
+        std::vector<void*>* results = new std::vector<void*>();
+        results->reserve(total);
+
+        while (!heap.empty() && (results->size() < total))
+        {
+            std::pop_heap(heap.begin(), heap.end(), order);
+            uint32_t i = heap.back();
+
+            results->push_back(runs[i]->at(pos[i]));
+            pos[i]++;
+
+            if (pos[i] < runs[i]->size())
+            {
+                std::push_heap(heap.begin(), heap.end(), order);
+            }
+            else
+            {
+                heap.pop_back();
+            }
+        }
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            delete runs[i];
+        }
+
+        return results;
+    }
+
+    void* ShardedIndex::lookup(void* rawdata)
+    {
+        void* ret;
+
+        for (size_t i = 0; i < indices->size(); i++)
+        {
+            ret = indices->at(i)->lookup(rawdata);
+
+            if (ret != NULL)
+            {
+                return ret;
+            }
+        }
+
+        return NULL;
+    }
+
+    uint64_t ShardedIndex::size()
+    {
+        uint64_t ret = 0;
+
+        for (size_t i = 0; i < indices->size(); i++)
+        {
+            ret += indices->at(i)->size();
+        }
+
+        return ret;
+    }
+
+    Index* ShardedIndex::get_shard(uint32_t i)
+    {
+        return indices->at(i);
+    }
+
+    ShardedODB::ShardedODB(uint32_t num_shards, uint64_t (*_key)(void* rawdata), PartitionType _partition, ODB::FixedDatastoreType dt, uint64_t datalen, bool (*prune)(void* rawdata), Archive* archive, void(*freep)(void*), uint32_t sleep_duration, uint32_t flags)
+    {
+        shards = new std::vector<ODB*>();
+        key = _key;
+        partition = _partition;
+
+        for (uint32_t i = 0; i < num_shards; i++)
+        {
+            shards->push_back(new ODB(dt, datalen, prune, archive, freep, 0, flags));
+        }
+
+        init(sleep_duration);
+    }
+
+    ShardedODB::ShardedODB(uint32_t num_shards, uint64_t (*_key)(void* rawdata), PartitionType _partition, ODB::IndirectDatastoreType dt, bool (*prune)(void* rawdata), Archive* archive, void(*freep)(void*), uint32_t sleep_duration, uint32_t flags)
+    {
+        shards = new std::vector<ODB*>();
+        key = _key;
+        partition = _partition;
+
+        for (uint32_t i = 0; i < num_shards; i++)
+        {
+            shards->push_back(new ODB(dt, prune, archive, freep, 0, flags));
+        }
+
+        init(sleep_duration);
+    }
+
+    ShardedODB::ShardedODB(uint32_t num_shards, uint64_t (*_key)(void* rawdata), PartitionType _partition, ODB::VariableDatastoreType dt, bool (*prune)(void* rawdata), Archive* archive, void(*freep)(void*), uint32_t(*len)(void*), uint32_t sleep_duration, uint32_t flags)
+    {
+        shards = new std::vector<ODB*>();
+        key = _key;
+        partition = _partition;
+
+        for (uint32_t i = 0; i < num_shards; i++)
+        {
+            shards->push_back(new ODB(dt, prune, archive, freep, len, 0, flags));
+        }
+
+        init(sleep_duration);
+    }
+
+    void ShardedODB::init(uint32_t sleep_duration)
+    {
+        if (shards->empty())
+        {
+            THROW_ERROR("NO_SHARDS", "A ShardedODB needs at least one shard.");
+        }
+
+        if (key == NULL)
+        {
+            THROW_ERROR("NULL_KEY", "Key function cannot be NULL.");
+        }
+
+        indices = new std::vector<ShardedIndex*>();
+        bounds = new std::vector<uint64_t>();
+        scheduler = NULL;
+
+        // Without anything better to go on, split the key space evenly.
+        uint32_t n = (uint32_t)shards->size();
+
+        for (uint32_t i = 1; i < n; i++)
+        {
+            bounds->push_back(((~(uint64_t)0) / n) * i);
+        }
+
+        // Each shard starts a little further into the interval than the one
+        // before it, so that the sweeps are spread out across it.
+        if (sleep_duration > 0)
+        {
+            for (uint32_t i = 0; i < n; i++)
+            {
+                shards->at(i)->start_mem_checker(sleep_duration, (uint32_t)(((uint64_t)sleep_duration * i) / n));
+            }
+        }
+    }
+
+    ShardedODB::~ShardedODB()
+    {
+        if (scheduler != NULL)
+        {
+            delete scheduler;
+        }
+
+        while (!indices->empty())
+        {
+            delete indices->back();
+            indices->pop_back();
+        }
+        delete indices;
+
+        while (!shards->empty())
+        {
+            delete shards->back();
+            shards->pop_back();
+        }
+        delete shards;
+
+        delete bounds;
+    }
+
+    ShardedIndex* ShardedODB::create_index(ODB::IndexType type, uint32_t flags, int32_t(*compare)(void*, void*), void* (*merge)(void*, void*), void* (*keygen)(void*), int32_t keylen)
+    {
+        ShardedIndex* ret = new ShardedIndex(this, compare);
+
+        // The function pointer flavour is used so that each shard gets its own
+        // Comparator, since each Index table deletes its own.
+        for (size_t i = 0; i < shards->size(); i++)
+        {
+            ret->indices->push_back(shards->at(i)->create_index(type, flags, compare, merge, keygen, keylen));
+        }
+
+        indices->push_back(ret);
+        return ret;
+    }
+
+    void ShardedODB::set_bounds(std::vector<uint64_t>* _bounds)
+    {
+        if (_bounds->size() != shards->size() - 1)
+        {
+            THROW_ERROR("INV_BOUNDS", "Number of bounds must be one less than the number of shards.");
+        }
+
+        bounds->assign(_bounds->begin(), _bounds->end());
+    }
+
+    uint32_t ShardedODB::shard_of(void* rawdata)
+    {
+        uint64_t k = key(rawdata);
+
+        if (partition == RANGE)
+        {
+            return (uint32_t)(std::upper_bound(bounds->begin(), bounds->end(), k) - bounds->begin());
+        }
+
+        // Mix the key first, since keys that are close together, or share low
+        // bits, are common and shouldn't all end up in the same place.
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+
+        return (uint32_t)(k % shards->size());
+    }
+
+    void ShardedODB::add_data(void* rawdata)
+    {
+        shards->at(shard_of(rawdata))->add_data(rawdata);
+    }
+
+    void ShardedODB::add_data(void* rawdata, uint32_t nbytes)
+    {
+        shards->at(shard_of(rawdata))->add_data(rawdata, nbytes);
+    }
+
+    void ShardedODB::remove_sweep()
+    {
+        for (size_t i = 0; i < shards->size(); i++)
+        {
+            shards->at(i)->remove_sweep();
+        }
+    }
+
+    void ShardedODB::purge()
+    {
+        for (size_t i = 0; i < shards->size(); i++)
+        {
+            shards->at(i)->purge();
+        }
+    }
+
+    uint64_t ShardedODB::size()
+    {
+        uint64_t ret = 0;
+
+        for (size_t i = 0; i < shards->size(); i++)
+        {
+            ret += shards->at(i)->size();
+        }
+
+        return ret;
+    }
+
+    std::vector<ODB*>* ShardedODB::query(bool (*condition)(void*))
+    {
+        ConditionCust* c = new ConditionCust(condition);
+        std::vector<ODB*>* ret = query(c);
+        delete c;
+        return ret;
+    }
+
+    std::vector<ODB*>* ShardedODB::query(Condition* condition)
+    {
+        uint32_t n = (uint32_t)shards->size();
+        std::vector<struct shard_query> parts(n);
+        std::vector<void*> args(n);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            parts[i].odb = shards->at(i);
+            parts[i].condition = condition;
+            parts[i].result = NULL;
+            args[i] = &(parts[i]);
+        }
+
+        fan_out(shard_query_workload, &args[0], n);
+
+        std::vector<ODB*>* ret = new std::vector<ODB*>();
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            ret->push_back(parts[i].result);
+        }
+
+        return ret;
+    }
+
+    void ShardedODB::fan_out(void* (*func)(void*), void** args, uint32_t n)
+    {
+        if (scheduler != NULL)
+        {
+            scheduler->run_batch(func, args, n);
+        }
+        else
+        {
+            for (uint32_t i = 0; i < n; i++)
+            {
+                func(args[i]);
+            }
+        }
+    }
+
+    uint32_t ShardedODB::start_scheduler(uint32_t num_threads)
+    {
+        if (num_threads == 0)
+        {
+            return 0;
+        }
+
+        if (scheduler == NULL)
+        {
+            scheduler = new Scheduler(num_threads);
+            return num_threads;
+        }
+        else
+        {
+            return scheduler->update_num_threads(num_threads);
+        }
+    }
+
+    Scheduler* ShardedODB::get_scheduler()
+    {
+        return scheduler;
+    }
+
+    uint32_t ShardedODB::get_num_shards()
+    {
+        return (uint32_t)shards->size();
+    }
+
+    ODB* ShardedODB::get_shard(uint32_t i)
+    {
+        return shards->at(i);
+    }
+}
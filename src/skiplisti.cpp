@@ -0,0 +1,761 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for implementations of SkipListI index type as well as its iterators.
+/// @file skiplisti.cpp
+
+#include <algorithm>
+
+#include "skiplisti.hpp"
+#include "datastore.hpp"
+#include "utility.hpp"
+#include "comparator.hpp"
+#include "common.hpp"
+
+#include "lock.hpp"
+
+namespace libodb
+{
+    /// Most levels a node can be linked into. With a quarter of the nodes on
+    ///each level going up to the next, this is plenty for 2^32 distinct values.
+#define SKIP_MAX_HEIGHT 16
+
+#if (CMAKE_COMPILER_SUITE_GCC)
+#define SKIP_LOCK(n) while (__sync_lock_test_and_set(&((n)->lock), 1)) {}
+#define SKIP_UNLOCK(n) __sync_lock_release(&((n)->lock))
+#define SKIP_BARRIER() __sync_synchronize()
+#define SKIP_ADD64(v, d) __sync_add_and_fetch(&(v), (d))
+#elif defined(WIN32)
+#include <Windows.h>
+#define SKIP_LOCK(n) while (InterlockedExchange8((volatile CHAR*)&((n)->lock), 1)) {}
+#define SKIP_UNLOCK(n) InterlockedExchange8((volatile CHAR*)&((n)->lock), 0)
+#define SKIP_BARRIER() MemoryBarrier()
+#define SKIP_ADD64(v, d) InterlockedAdd64((volatile LONG64*)&(v), (d))
+#elif (CMAKE_COMPILER_SUITE_SUN)
+#include <atomic.h>
+#define SKIP_LOCK(n) while (atomic_swap_8(&((n)->lock), 1)) {}
+#define SKIP_UNLOCK(n) { membar_exit(); (n)->lock = 0; } (void)0
+#define SKIP_BARRIER() (membar_exit(), membar_enter())
+#define SKIP_ADD64(v, d) atomic_add_64_nv((volatile uint64_t*)&(v), (d))
+#else
+#error "Can't find a way to do atomic operations for SkipListI."
+#endif
+
+    SkipListI::SkipListI(uint64_t _ident, Comparator* _compare, Merger* _merge, bool _drop_duplicates)
+    {
+        rwlock = RWLock::create();
+        this->ident = _ident;
+        this->compare = _compare;
+        this->merge = _merge;
+        this->drop_duplicates = _drop_duplicates;
+        count = 0;
+
+        head = make_node(NULL, SKIP_MAX_HEIGHT);
+    }
+
+    SkipListI::~SkipListI()
+    {
+        struct node* curr = head;
+        struct node* next;
+
+        while (curr != NULL)
+        {
+            next = curr->next[0];
+            free_node(curr);
+            curr = next;
+        }
+
+        delete compare;
+        if (merge != NULL)
+        {
+            delete merge;
+        }
+
+        delete rwlock;
+    }
+
+    inline struct SkipListI::node* SkipListI::make_node(void* rawdata, uint8_t height)
+    {
+        struct node* n;
+        SAFE_MALLOC(struct node*, n, sizeof(struct node) + (height - 1) * sizeof(struct node*));
+
+        n->data = rawdata;
+        n->dups = NULL;
+        n->lock = 0;
+        n->height = height;
+
+        for (uint8_t i = 0; i < height; i++)
+        {
+            n->next[i] = NULL;
+        }
+
+        return n;
+    }
+
+    inline void SkipListI::free_node(struct node* n)
+    {
+        if (n->dups != NULL)
+        {
+            RedBlackTreeI::e_destroy_tree(n->dups, free);
+        }
+
+        free(n);
+    }
+
+    inline uint8_t SkipListI::node_height(void* rawdata)
+    {
+        // The finalizer from MurmurHash3, so that rows that sit next to each other
+        // in memory don't get heights that follow a pattern.
+        uint64_t h = reinterpret_cast<uintptr_t>(rawdata);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        uint8_t height = 1;
+
+        while (((h & 3) == 0) && (height < SKIP_MAX_HEIGHT))
+        {
+            height++;
+            h >>= 2;
+        }
+
+        return height;
+    }
+
+    int32_t SkipListI::compare_dup(void* a, void* b)
+    {
+        return compare_addr_f(reinterpret_cast<struct dup_node*>(a)->data, reinterpret_cast<struct dup_node*>(b)->data);
+    }
+
+    inline struct SkipListI::dup_node* SkipListI::make_dup(void* rawdata)
+    {
+        struct dup_node* d;
+        SAFE_MALLOC(struct dup_node*, d, sizeof(struct dup_node));
+        d->data = rawdata;
+        return d;
+    }
+
+    void SkipListI::node_values(struct node* n, std::vector<void*>* values)
+    {
+        // Duplicates are added under the node's lock while readers hold only the
+        // table's read lock, so the dup tree can't be walked without it.
+        SKIP_LOCK(n);
+
+        struct RedBlackTreeI::e_tree_root* dups = n->dups;
+
+        if (dups == NULL)
+        {
+            values->push_back(n->data);
+        }
+        else
+        {
+            Iterator* it = RedBlackTreeI::e_it_first(dups);
+
+            if (it->data() != NULL)
+            {
+                do
+                {
+                    values->push_back(reinterpret_cast<struct dup_node*>(it->get_data())->data);
+                } while (it->next());
+            }
+
+            RedBlackTreeI::e_it_release(dups, it);
+        }
+
+        SKIP_UNLOCK(n);
+    }
+
+    struct SkipListI::node* SkipListI::seek(void* rawdata, struct node** preds, struct node** succs)
+    {
+        struct node* pred = head;
+        struct node* curr;
+        struct node* found = NULL;
+        int32_t c = 1;
+
+        for (int32_t level = SKIP_MAX_HEIGHT - 1; level >= 0; level--)
+        {
+            curr = pred->next[level];
+
+            while ((curr != NULL) && ((c = compare->compare(rawdata, curr->data)) > 0))
+            {
+                pred = curr;
+                curr = pred->next[level];
+            }
+
+            if ((found == NULL) && (curr != NULL) && (c == 0))
+            {
+                found = curr;
+            }
+
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+
+        return found;
+    }
+
+    struct SkipListI::node* SkipListI::before(void* rawdata)
+    {
+        struct node* pred = head;
+        struct node* curr;
+
+        for (int32_t level = SKIP_MAX_HEIGHT - 1; level >= 0; level--)
+        {
+            curr = pred->next[level];
+
+            while ((curr != NULL) && (compare->compare(rawdata, curr->data) > 0))
+            {
+                pred = curr;
+                curr = pred->next[level];
+            }
+        }
+
+        return (pred == head ? NULL : pred);
+    }
+
+    bool SkipListI::add_data_v2(void* rawdata)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+        uint8_t height = node_height(rawdata);
+        bool ret;
+
+        // Shared, since the per-node locks keep insertions off of each other.
+        rwlock->read_lock();
+
+        while (true)
+        {
+            struct node* found = seek(rawdata, preds, succs);
+
+            if (found != NULL)
+            {
+                ret = add_equal(found, rawdata);
+                break;
+            }
+
+            // Lock each distinct predecessor from the bottom up. Predecessors only
+            // move towards the head going up, so every insertion takes its locks
+            // in the same order, and they can't deadlock. Stop as soon as one of
+            // them has had something linked in after it since the seek.
+            struct node* last = NULL;
+            bool valid = true;
+            uint8_t level;
+
+            for (level = 0; valid && (level < height); level++)
+            {
+                if (preds[level] != last)
+                {
+                    SKIP_LOCK(preds[level]);
+                    last = preds[level];
+                }
+
+                valid = (preds[level]->next[level] == succs[level]);
+            }
+
+            if (valid)
+            {
+                struct node* n = make_node(rawdata, height);
+
+                for (level = 0; level < height; level++)
+                {
+                    n->next[level] = succs[level];
+                }
+
+                // The node has to be complete before anyone can reach it, and it has
+                // to be on the bottom level before it is on any of the others.
+                SKIP_BARRIER();
+
+                for (level = 0; level < height; level++)
+                {
+                    preds[level]->next[level] = n;
+                }
+            }
+
+            for (uint8_t i = 0; i < level; i++)
+            {
+                if ((i == 0) || (preds[i] != preds[i - 1]))
+                {
+                    SKIP_UNLOCK(preds[i]);
+                }
+            }
+
+            if (valid)
+            {
+                SKIP_ADD64(count, 1);
+                ret = true;
+                break;
+            }
+        }
+
+        rwlock->read_unlock();
+
+        return ret;
+    }
+
+    bool SkipListI::add_equal(struct node* n, void* rawdata)
+    {
+        if (merge != NULL)
+        {
+            SKIP_LOCK(n);
+            n->data = merge->merge(rawdata, n->data);
+            SKIP_UNLOCK(n);
+            return false;
+        }
+
+        if (drop_duplicates)
+        {
+            return false;
+        }
+
+        struct dup_node* d = make_dup(rawdata);
+        bool ret;
+
+        SKIP_LOCK(n);
+
+        if (n->dups == NULL)
+        {
+            // Build the tree off to the side and swap it in whole, so readers see
+            // either the single value or both of them.
+            struct RedBlackTreeI::e_tree_root* dups = RedBlackTreeI::e_init_tree(true, compare_dup);
+            RedBlackTreeI::e_add(dups, make_dup(n->data));
+            ret = RedBlackTreeI::e_add(dups, d);
+
+            SKIP_BARRIER();
+            n->dups = dups;
+        }
+        else
+        {
+            ret = RedBlackTreeI::e_add(n->dups, d);
+        }
+
+        SKIP_UNLOCK(n);
+
+        if (ret)
+        {
+            SKIP_ADD64(count, 1);
+        }
+        else
+        {
+            free(d);
+        }
+
+        return ret;
+    }
+
+    void SkipListI::purge()
+    {
+        rwlock->write_lock();
+
+        struct node* curr = head->next[0];
+        struct node* next;
+
+        while (curr != NULL)
+        {
+            next = curr->next[0];
+            free_node(curr);
+            curr = next;
+        }
+
+        for (uint8_t i = 0; i < SKIP_MAX_HEIGHT; i++)
+        {
+            head->next[i] = NULL;
+        }
+
+        count = 0;
+
+        rwlock->write_unlock();
+    }
+
+    bool SkipListI::remove(void* rawdata)
+    {
+        rwlock->write_lock();
+        bool ret = remove_n(rawdata);
+        rwlock->write_unlock();
+
+        return ret;
+    }
+
+    bool SkipListI::remove_n(void* rawdata)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+        struct node* n = seek(rawdata, preds, succs);
+
+        if (n == NULL)
+        {
+            return false;
+        }
+
+        if (n->dups != NULL)
+        {
+            struct dup_node proto;
+            proto.data = rawdata;
+            void* del_node;
+
+            if (!RedBlackTreeI::e_remove(n->dups, &proto, &del_node))
+            {
+                return false;
+            }
+
+            free(del_node);
+            count--;
+
+            if (n->dups->count > 0)
+            {
+                // The node's value has to stay one that is still in the table.
+                if (n->data == rawdata)
+                {
+                    std::vector<void*> values;
+                    node_values(n, &values);
+                    n->data = values[0];
+                }
+
+                return true;
+            }
+        }
+        else if ((n->data == rawdata) || drop_duplicates)
+        {
+            count--;
+        }
+        else
+        {
+            return false;
+        }
+
+        for (uint8_t level = 0; level < n->height; level++)
+        {
+            preds[level]->next[level] = n->next[level];
+        }
+
+        free_node(n);
+
+        return true;
+    }
+
+    void SkipListI::remove_sweep(std::vector<void*>* marked)
+    {
+        rwlock->write_lock();
+
+        for (size_t i = 0; i < marked->size(); i++)
+        {
+            remove_n(marked->at(i));
+        }
+
+        rwlock->write_unlock();
+    }
+
+    void SkipListI::update(std::vector<void*>* old_addr, std::vector<void*>* new_addr, uint64_t datalen)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+        struct node* n;
+        void* addr;
+
+        rwlock->write_lock();
+
+        for (size_t i = 0; i < old_addr->size(); i++)
+        {
+            addr = old_addr->at(i);
+            n = seek(addr, preds, succs);
+
+            if (n == NULL)
+            {
+                continue;
+            }
+
+            if (n->dups != NULL)
+            {
+                struct dup_node proto;
+                proto.data = addr;
+                void* del_node;
+
+                if (RedBlackTreeI::e_remove(n->dups, &proto, &del_node))
+                {
+                    reinterpret_cast<struct dup_node*>(del_node)->data = new_addr->at(i);
+                    RedBlackTreeI::e_add(n->dups, del_node);
+                }
+            }
+
+            if (n->data == addr)
+            {
+                n->data = new_addr->at(i);
+            }
+
+            if ((datalen > 0) && (datalen != (uint64_t)(-1)))
+            {
+                memcpy(new_addr->at(i), addr, (size_t)datalen);
+            }
+        }
+
+        rwlock->write_unlock();
+    }
+
+    void SkipListI::query(Condition* condition, DataStore* ds)
+    {
+        std::vector<void*> values;
+
+        rwlock->read_lock();
+
+        for (struct node* curr = head->next[0]; curr != NULL; curr = curr->next[0])
+        {
+            if (curr->dups == NULL)
+            {
+                if (condition->condition(curr->data))
+                {
+                    ds->add_data(curr->data);
+                }
+            }
+            else
+            {
+                values.clear();
+                node_values(curr, &values);
+
+                for (size_t i = 0; i < values.size(); i++)
+                {
+                    if (condition->condition(values[i]))
+                    {
+                        ds->add_data(values[i]);
+                    }
+                }
+            }
+        }
+
+        rwlock->read_unlock();
+    }
+
+    void SkipListI::query_eq(void* rawdata, DataStore* ds)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+        std::vector<void*> values;
+
+        rwlock->read_lock();
+        struct node* n = seek(rawdata, preds, succs);
+
+        if (n != NULL)
+        {
+            node_values(n, &values);
+        }
+
+        rwlock->read_unlock();
+
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            ds->add_data(values[i]);
+        }
+    }
+
+    void SkipListI::query_lt(void* rawdata, DataStore* ds)
+    {
+        std::vector<void*> values;
+
+        rwlock->read_lock();
+
+        for (struct node* curr = head->next[0]; (curr != NULL) && (compare->compare(rawdata, curr->data) > 0); curr = curr->next[0])
+        {
+            values.clear();
+            node_values(curr, &values);
+
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                ds->add_data(values[i]);
+            }
+        }
+
+        rwlock->read_unlock();
+    }
+
+    void SkipListI::query_gt(void* rawdata, DataStore* ds)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+        std::vector<void*> values;
+
+        rwlock->read_lock();
+        struct node* curr = seek(rawdata, preds, succs);
+        curr = (curr == NULL ? succs[0] : curr->next[0]);
+
+        for (; curr != NULL; curr = curr->next[0])
+        {
+            values.clear();
+            node_values(curr, &values);
+
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                ds->add_data(values[i]);
+            }
+        }
+
+        rwlock->read_unlock();
+    }
+
+    void* SkipListI::lookup(void* rawdata)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+
+        rwlock->read_lock();
+        struct node* n = seek(rawdata, preds, succs);
+        void* ret = (n == NULL ? NULL : n->data);
+        rwlock->read_unlock();
+
+        return ret;
+    }
+
+    uint64_t SkipListI::mem_size()
+    {
+        // A node is linked into a third of a level more than its first, on
+        // average. Duplicates only cost a dup_node, but most values are distinct.
+        return count * (sizeof(struct node) + sizeof(struct node*) / 3);
+    }
+
+    Iterator* SkipListI::it_first()
+    {
+        rwlock->read_lock();
+        SLIterator* it = new SLIterator(ident, parent->true_datalen, parent->time_stamp, parent->query_count);
+        it->parent = parent;
+        it->index = this;
+        it->load(head->next[0], false);
+        return it;
+    }
+
+    Iterator* SkipListI::it_last()
+    {
+        rwlock->read_lock();
+        SLIterator* it = new SLIterator(ident, parent->true_datalen, parent->time_stamp, parent->query_count);
+        it->parent = parent;
+        it->index = this;
+
+        struct node* curr = head;
+
+        for (int32_t level = SKIP_MAX_HEIGHT - 1; level >= 0; level--)
+        {
+            while (curr->next[level] != NULL)
+            {
+                curr = curr->next[level];
+            }
+        }
+
+        it->load((curr == head ? NULL : curr), true);
+        return it;
+    }
+
+    Iterator* SkipListI::it_lookup(void* rawdata, int8_t dir)
+    {
+        struct node* preds[SKIP_MAX_HEIGHT];
+        struct node* succs[SKIP_MAX_HEIGHT];
+
+        rwlock->read_lock();
+        SLIterator* it = new SLIterator(ident, parent->true_datalen, parent->time_stamp, parent->query_count);
+        it->parent = parent;
+        it->index = this;
+
+        struct node* n = seek(rawdata, preds, succs);
+
+        if (dir == 0)
+        {
+            it->load(n, false);
+        }
+        else if (dir > 0)
+        {
+            it->load((n == NULL ? succs[0] : n->next[0]), false);
+        }
+        else
+        {
+            it->load((preds[0] == head ? NULL : preds[0]), true);
+        }
+
+        return it;
+    }
+
+    SLIterator::SLIterator()
+    {
+        values = new std::vector<void*>();
+    }
+
+    SLIterator::SLIterator(uint64_t ident, uint64_t _true_datalen, bool _time_stamp, bool _query_count)
+    {
+        dataobj->ident = ident;
+        this->time_stamp = _time_stamp;
+        this->query_count = _query_count;
+        this->true_datalen = _true_datalen;
+        it = NULL;
+        cursor = NULL;
+        pos = 0;
+        values = new std::vector<void*>();
+    }
+
+    SLIterator::~SLIterator()
+    {
+        delete values;
+    }
+
+    DataObj* SLIterator::load(struct SkipListI::node* n, bool last)
+    {
+        cursor = n;
+        values->clear();
+
+        if (n == NULL)
+        {
+            dataobj->data = NULL;
+            return NULL;
+        }
+
+        SkipListI::node_values(n, values);
+        pos = (last ? values->size() - 1 : 0);
+        dataobj->data = values->at(pos);
+        return dataobj;
+    }
+
+    DataObj* SLIterator::next()
+    {
+        if (cursor == NULL)
+        {
+            return NULL;
+        }
+
+        if ((pos + 1) < values->size())
+        {
+            pos++;
+            dataobj->data = values->at(pos);
+            return dataobj;
+        }
+
+        return load(cursor->next[0], false);
+    }
+
+    DataObj* SLIterator::prev()
+    {
+        if (cursor == NULL)
+        {
+            return NULL;
+        }
+
+        if (pos > 0)
+        {
+            pos--;
+            dataobj->data = values->at(pos);
+            return dataobj;
+        }
+
+        // There are no back links, so find the node before this one from the top.
+        return load(index->before(cursor->data), true);
+    }
+
+    DataObj* SLIterator::data()
+    {
+        return (cursor == NULL ? NULL : dataobj);
+    }
+
+}
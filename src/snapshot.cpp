@@ -0,0 +1,116 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+/// Source file for point-in-time read views of an ODB.
+/// @file snapshot.cpp
+
+#include "snapshot.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "datastore.hpp"
+#include "comparator.hpp"
+
+namespace libodb
+{
+    /// Stands in for the results DataStore of a query, and just keeps the rows
+    ///it is handed so they can be checked against the snapshot before any
+    ///real results are built.
+    class SnapshotRows : public DataStore
+    {
+    public:
+        std::vector<void*> rows;
+
+    protected:
+        virtual void* add_data(void* rawdata)
+        {
+            rows.push_back(rawdata);
+            return rawdata;
+        }
+    };
+
+    Snapshot::Snapshot(ODB* _odb, uint64_t _seq, uint64_t _count)
+    {
+        odb = _odb;
+        seq = _seq;
+        count = _count;
+    }
+
+    Snapshot::~Snapshot()
+    {
+    }
+
+    ODB* Snapshot::query(bool (*condition)(void*))
+    {
+        ConditionCust* c = new ConditionCust(condition);
+        ODB* ret = query(c);
+        delete c;
+        return ret;
+    }
+
+    ODB* Snapshot::query(Condition* condition)
+    {
+        SnapshotRows rows;
+        odb->data->query(condition, &rows);
+        return results(&(rows.rows));
+    }
+
+    ODB* Snapshot::query_eq(Index* index, void* rawdata)
+    {
+        SnapshotRows rows;
+        index->query_eq(rawdata, &rows);
+        return results(&(rows.rows));
+    }
+
+    ODB* Snapshot::query_lt(Index* index, void* rawdata)
+    {
+        SnapshotRows rows;
+        index->query_lt(rawdata, &rows);
+        return results(&(rows.rows));
+    }
+
+    ODB* Snapshot::query_gt(Index* index, void* rawdata)
+    {
+        SnapshotRows rows;
+        index->query_gt(rawdata, &rows);
+        return results(&(rows.rows));
+    }
+
+    uint64_t Snapshot::size()
+    {
+        return count;
+    }
+
+    uint64_t Snapshot::get_seq()
+    {
+        return seq;
+    }
+
+    ODB* Snapshot::results(std::vector<void*>* rows)
+    {
+        odb->snapshot_filter(seq, rows);
+
+        // Wrap what's left the same way a query on the ODB itself would.
+        DataStore* ds = odb->data->clone_indirect(rows->size());
+
+        for (size_t i = 0; i < rows->size(); i++)
+        {
+            if (rows->at(i) != NULL)
+            {
+                ds->add_data(rows->at(i));
+            }
+        }
+
+        ODB* ret = new ODB(ds, odb->ident, odb->datalen);
+        ds->update_parent(ret);
+        return ret;
+    }
+}
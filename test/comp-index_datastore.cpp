@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "odb.hpp"
 #include "index.hpp"
@@ -88,14 +89,16 @@ int compare(void* a, void* b)
 void usage()
 {
     printf("\
-Usage test -[ntTiehm]\n\
+Usage test -[ntTiehms]\n\
 \t-h\tPrint this help message\n\
 \t-n\tNumber of elements (default=10000)\n\
 \t-t\tNumber of tests (default=1)\n\
 \t-T\tTest type (default=0)\n\
 \t-i\tIndex types (default=0)\n\
 \t-e\tElement size, in bytes (default=8)\n\
-\t-m\tMemory limit, in pages (default=1000000, ie, a lot)\n\n\
+\t-m\tMemory limit, in pages (default=1000000, ie, a lot)\n\
+\t-s\tScheduler threads to run the queries with (default=0)\n\
+\t-w\tWriter threads to insert with (default=0, insert on this thread)\n\n\
 Where: \n\
     test type (T): 0 = BANK_DS, \n\
                    1 = LINKED_LIST_DS, \n\
@@ -105,21 +108,62 @@ Where: \n\
 \n\
     index type (i): 1-bit: on = DROP_DUPLICATES, \n\
                            off = NONE, \n\
-                    2-bit: on = LINKED_LIST, \n\
-                           off = RED_BLACK_TREE\n\
+                    rest:  0 = RED_BLACK_TREE, \n\
+                           1 = LINKED_LIST, \n\
+                           2 = SKIP_LIST\n\
     ");
 }
 
+/// One writer thread's share of the insertions.
+struct writer_args
+{
+    ODB* odb;
+    long* values;
+    uint64_t start;
+    uint64_t end;
+    uint64_t element_size;
+    bool use_indirect;
+};
+
+/// Insert a run of pre-generated values, through the ODB so that they reach
+///the index tables as well.
+void* writer(void* argsV)
+{
+    struct writer_args* args = (struct writer_args*)argsV;
+    long* vp;
+
+    for (uint64_t i = args->start ; i < args->end ; i++)
+    {
+        if (args->use_indirect)
+        {
+            vp = (long*)malloc(args->element_size);
+            memcpy(vp, &(args->values[i]), args->element_size);
+            args->odb->add_data(vp);
+        }
+        else
+        {
+            args->odb->add_data(&(args->values[i]));
+        }
+    }
+
+    return NULL;
+}
+
 /// Function for testing the database.
 /// @param [in] element_size The size of the elements to be inserted
 /// @param [in] test_size The number of elements to be inserted
 /// @param [in] test_type The type of test to be done. As of now, a 0 indicates
 ///that the test should run against the BankDS, a 1 against the LinkedListDS
+/// @param [in] sched_threads Number of scheduler threads to start before the
+///queries are run. Zero leaves the queries on the calling thread.
+/// @param [in] writers Number of threads to split the insertions across. The
+///values are generated up front, so the results are the same as with zero,
+///which does the insertions on the calling thread.
 /// @return Some duration obtained during the test. Could be the duration for
 ///insertion, query, deletion, or any combination (perhaps all of them). This
 ///gives flexibility for determining which events count towards the timing when
 ///muiltiple actions are performed each run.
-double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, uint8_t index_type, uint32_t max_mem)
+double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, uint8_t index_type, uint32_t max_mem, uint32_t sched_threads, uint32_t writers)
 {
     ODB::IndexType itype;
     ODB::IndexFlags iopts;
@@ -203,11 +247,16 @@ double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, ui
         itype = ODB::LINKED_LIST;
         break;
     }
+    case 2:
+    {
+        itype = ODB::SKIP_LIST;
+        break;
+    }
     default:
         FAIL("Incorrect index type.");
     }
 
-    odb->mem_limit = max_mem;
+    odb->set_mem_limits(0, (uint64_t)max_mem * 4096);
 
     struct timeb start;
     struct timeb end;
@@ -230,33 +279,70 @@ double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, ui
     int test_str_len = strlen(test_str);
     strncpy(temp_str, test_str, test_str_len);
 
-    ftime(&start);
-
-    for (uint64_t i = 0 ; i < test_size ; i++)
+    if ((writers > 0) && (test_type != 4))
     {
-        v = (i + ((RAND() % (2 * SPREAD + 1)) - SPREAD));
-        //v = 117;
-        //v = i;
+        long* values = (long*)malloc(test_size * sizeof(long));
+        struct writer_args* args = (struct writer_args*)malloc(writers * sizeof(struct writer_args));
+        pthread_t* threads = (pthread_t*)malloc(writers * sizeof(pthread_t));
 
-#warning "TODO: Free the memory when running indirect datastore tests."
-        if (use_indirect)
+        for (uint64_t i = 0 ; i < test_size ; i++)
+        {
+            values[i] = (i + ((RAND() % (2 * SPREAD + 1)) - SPREAD));
+        }
+
+        ftime(&start);
+
+        for (uint32_t w = 0 ; w < writers ; w++)
+        {
+            args[w].odb = odb;
+            args[w].values = values;
+            args[w].start = (test_size * w) / writers;
+            args[w].end = (test_size * (w + 1)) / writers;
+            args[w].element_size = element_size;
+            args[w].use_indirect = use_indirect;
+            pthread_create(&(threads[w]), NULL, writer, &(args[w]));
+        }
+
+        for (uint32_t w = 0 ; w < writers ; w++)
         {
-            vp = (long*)malloc(element_size);
-            memcpy(vp, &v, element_size);
-            dn = odb->add_data(vp, false);
+            pthread_join(threads[w], NULL);
         }
-        else if (test_type == 4)
+
+        ftime(&end);
+
+        free(values);
+        free(args);
+        free(threads);
+    }
+    else
+    {
+        ftime(&start);
+
+        for (uint64_t i = 0 ; i < test_size ; i++)
         {
-            uint32_t str_index = RAND();
-            str_index %= test_str_len;
-            str_index++;
+            v = (i + ((RAND() % (2 * SPREAD + 1)) - SPREAD));
+            //v = 117;
+            //v = i;
+
+#warning "TODO: Free the memory when running indirect datastore tests."
+            if (use_indirect)
+            {
+                vp = (long*)malloc(element_size);
+                memcpy(vp, &v, element_size);
+                dn = odb->add_data(vp, false);
+            }
+            else if (test_type == 4)
+            {
+                uint32_t str_index = RAND();
+                str_index %= test_str_len;
+                str_index++;
 
 //             strncpy(temp_str, test_str, test_str_len);
 
-            //NULL terminate the string
-            char tmp = temp_str[str_index];
-            temp_str[0] = 'A' + (26 * (test_size - i)) / test_size;
-            temp_str[str_index] = 0;
+                //NULL terminate the string
+                char tmp = temp_str[str_index];
+                temp_str[0] = 'A' + (26 * (test_size - i)) / test_size;
+                temp_str[str_index] = 0;
 
 //             // Create a random string, to reduce the number of collisions.
 //             for (int i = 0 ; i < str_index ; i++)
@@ -265,29 +351,30 @@ double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, ui
 //                 temp_str[i] = 'A' + r;
 //             }
 
-            dn = odb->add_data(temp_str, str_index+1, false);
+                dn = odb->add_data(temp_str, str_index+1, false);
 
-            temp_str[str_index] = tmp;
-        }
-        else
-        {
-            dn = odb->add_data(&v, false);
-        }
+                temp_str[str_index] = tmp;
+            }
+            else
+            {
+                dn = odb->add_data(&v, false);
+            }
 
-        for (int j = 0 ; j < NUM_TABLES ; j++)
-        {
-            ind[j]->add_data(dn);
-        }
+            for (int j = 0 ; j < NUM_TABLES ; j++)
+            {
+                ind[j]->add_data(dn);
+            }
 
-        if (i == (test_size/2))
-        {
+            if (i == (test_size/2))
+            {
 //            printf("ODB size (before): %lu\n", odb->size());
 //            odb->purge(free);
 //            printf("ODB size (after): %lu\n", odb->size());
+            }
         }
-    }
 
-    ftime(&end);
+        ftime(&end);
+    }
 
     if (test_type != 4)
     {
@@ -307,6 +394,11 @@ double odb_test(uint64_t element_size, uint64_t test_size, uint8_t test_type, ui
         }
     }
 
+    if (sched_threads > 0)
+    {
+        odb->start_scheduler(sched_threads);
+    }
+
     printf(":");
     if (test_type == 4)
     {
@@ -365,6 +457,8 @@ int main (int argc, char* argv[])
     uint32_t test_type = 0;
     uint32_t index_type = 0;
     uint32_t max_mem = 700000;
+    uint32_t sched_threads = 0;
+    uint32_t writers = 0;
     extern char* optarg;
 
     int ch;
@@ -373,7 +467,7 @@ int main (int argc, char* argv[])
     SRAND();
 
 #warning "TODO: Validity checks on the options"
-    while ( (ch = getopt(argc, argv, "e:t:n:T:i:hm:")) != -1)
+    while ( (ch = getopt(argc, argv, "e:t:n:T:i:hm:s:w:")) != -1)
     {
         switch (ch)
         {
@@ -395,6 +489,12 @@ int main (int argc, char* argv[])
         case 'm':
             sscanf(optarg, "%u", &max_mem);
             break;
+        case 's':
+            sscanf(optarg, "%u", &sched_threads);
+            break;
+        case 'w':
+            sscanf(optarg, "%u", &writers);
+            break;
         case 'h':
         default:
             usage();
@@ -464,17 +564,28 @@ int main (int argc, char* argv[])
         printf("Linked list");
         break;
     }
+    case 2:
+    {
+        printf("Skip list");
+        break;
+    }
     default:
         FAIL("Incorrect index type.");
     }
 
     printf("\nMax memory: %d\n", max_mem);
+
+    if (writers > 0)
+    {
+        printf("Writer threads: %u\n", writers);
+    }
+
     printf("\n");
 
     double duration = 0, min = 100, max = -1, cur;
     for (uint64_t i = 0 ; i < test_num ; i++)
     {
-        cur = odb_test(element_size, test_size, test_type, index_type, max_mem);
+        cur = odb_test(element_size, test_size, test_type, index_type, max_mem, sched_threads, writers);
 
         if (cur > max)
         {
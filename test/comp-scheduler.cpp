@@ -18,6 +18,7 @@
 #endif
 
 #include <time.h>
+#include <sched.h>
 
 #include "odb.hpp"
 #include "scheduler.hpp"
@@ -79,6 +80,16 @@ void* spin_work_v(void* args)
     return spin_work(num_cycles);
 }
 
+volatile int woken;
+
+void* wake_stamp(void* args)
+{
+    clock_gettime(CLOCK_MONOTONIC, (struct timespec*)args);
+    __sync_synchronize();
+    woken = 1;
+    return NULL;
+}
+
 int32_t compare_test4(void* aV, void* bV)
 {
     uint64_t a = *(uint64_t*)aV;
@@ -96,6 +107,7 @@ TEST_OPT("Scheduled, synchronous, no-op multi-threaded performance.")
 TEST_OPT("Scheduled, deferred, no-op multi-threaded performance.")
 TEST_OPT("Unscheduled, single-threaded ODB insertions.")
 TEST_OPT("Scheduled, multit-threaded ODB insertions.")
+TEST_OPT("Wake-up latency of idle worker threads.")
 TEST_OPT_END()
 
 TEST_CASES_BEGIN()
@@ -331,4 +343,61 @@ TEST_BEGIN(4)
     printf("done\n\n");
 }
 
+TEST_BEGIN(5)
+{
+    // How long it takes from adding a workload to a worker starting on it, depending
+    // on how long the workers have been idle. Short gaps catch them spinning, and
+    // long gaps catch them parked.
+    num_consumers = 2;
+    int gaps[4] = { 0, 20000, 1000000, 10000000 };
+    int rounds[4] = { 10000, 5000, 1000, 200 };
+
+    struct timespec start, end, gap;
+    Scheduler* sched = new Scheduler(num_consumers);
+
+    printf("= Wake-up Latency (%d threads) =\n", num_consumers);
+
+    for (int g = 0 ; g < 4 ; g++)
+    {
+        double lat, total = 0, lo = 1e9, hi = 0;
+
+        gap.tv_sec = 0;
+        gap.tv_nsec = gaps[g];
+
+        for (int i = 0 ; i < rounds[g] ; i++)
+        {
+            if (gaps[g] > 0)
+            {
+                nanosleep(&gap, NULL);
+            }
+
+            woken = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            sched->add_work(wake_stamp, &end, NULL, Scheduler::NONE);
+
+            while (!woken)
+            {
+                sched_yield();
+            }
+
+            __sync_synchronize();
+            lat = TIME_DIFF() * 1000000;
+            total += lat;
+            lo = (lat < lo ? lat : lo);
+            hi = (lat > hi ? lat : hi);
+        }
+
+        printf("%8d ns idle: avg %g us, min %g us, max %g us (%d rounds)\n",
+               gaps[g],
+               total / rounds[g],
+               lo,
+               hi,
+               rounds[g]);
+    }
+
+    printf("\n");
+
+    delete sched;
+}
+
 TEST_CASES_END()
@@ -1,4 +1,5 @@
 #include "scheduler.hpp"
+#include "async.hpp"
 
 using namespace libodb;
 
@@ -385,6 +386,95 @@ void load_lock(char* name, void* (*f)(void*), void* args, int n)
 	TEST_CLASS_END();
 }
 
+void lfqueue_stress(int producers, int consumers, uint64_t n)
+{
+	LFQueue* q = new LFQueue();
+	uint64_t consumed = 0;
+	uint64_t out_of_order = 0;
+	uint64_t total = producers * n;
+
+	// Every item is tagged with its producer in the top bits and its sequence
+	// number, counting from one, in the rest.
+	std::vector<uint8_t> seen(total, 0);
+
+	// Producers come first, so that if OpenMP hands out fewer threads than asked
+	// for, no thread sits consuming before its own producers have run.
+	omp_set_dynamic(0);
+#pragma omp parallel for num_threads(producers + consumers) schedule(static, 1)
+	for (int r = 0; r < producers + consumers; r++)
+	{
+		if (r < producers)
+		{
+			for (uint64_t i = 1; i <= n; i++)
+			{
+				q->push_back((void*)(((uint64_t)r << 40) | i));
+			}
+		}
+		else
+		{
+			std::vector<uint64_t> last(producers, 0);
+			uint64_t item, p, s;
+
+			while (__sync_fetch_and_add(&consumed, 0) < total)
+			{
+				item = (uint64_t)(q->pop_front());
+
+				if (item == 0)
+				{
+					continue;
+				}
+
+				p = item >> 40;
+				s = item & ((1ULL << 40) - 1);
+
+				// Items from a single producer have to come out in the order they
+				// went in.
+				if (s <= last[p])
+				{
+					__sync_fetch_and_add(&out_of_order, 1);
+				}
+
+				last[p] = s;
+				seen[p * n + s - 1]++;
+				__sync_fetch_and_add(&consumed, 1);
+			}
+		}
+	}
+
+	uint64_t missing = 0;
+
+	for (uint64_t i = 0; i < total; i++)
+	{
+		missing += (seen[i] != 1);
+	}
+
+	ASSERT_UU((uint32_t)out_of_order, 0U);
+	ASSERT_UU((uint32_t)missing, 0U);
+	ASSERT_UU((uint32_t)(q->size()), 0U);
+	assert(q->pop_front() == NULL);
+
+	delete q;
+}
+
+void test_lfqueue()
+{
+	TEST_CLASS_BEGIN("LFQueue MPMC stress");
+
+	char buf[128];
+	int nt = omp_get_max_threads();
+	int runs[5][3] = { { 1, 1, 1000000 }, { 4, 4, 250000 }, { nt + 1, nt + 1, 100000 }, { 1, 2 * nt + 2, 500000 }, { 2 * nt + 2, 1, 100000 } };
+
+	for (int i = 0; i < 5; i++)
+	{
+		sprintf_s(buf, "%d producers, %d consumers, %d items each", runs[i][0], runs[i][1], runs[i][2]);
+		TEST_CASE(buf);
+		lfqueue_stress(runs[i][0], runs[i][1], runs[i][2]);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+
 // struct class_workload_args
 // {
 //     uint64_t id;
@@ -406,6 +496,485 @@ void test_interference_class_correctness()
     delete sched;
 }
 
+void* inc_workload(void* v)
+{
+	return (void*)((uintptr_t)v + 1);
+}
+
+void* wait_workload(void* h)
+{
+	// Waiting from inside a workload has to make progress even if every worker is doing the same.
+	return ((WorkHandle*)h)->then(inc_workload).wait();
+}
+
+struct small_args
+{
+	uintptr_t a;
+	uintptr_t b;
+};
+
+struct big_args
+{
+	uintptr_t v[16];
+};
+
+void* small_workload(void* v)
+{
+	return (void*)(((struct small_args*)v)->a + ((struct small_args*)v)->b);
+}
+
+void* big_workload(void* v)
+{
+	uintptr_t sum = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		sum += ((struct big_args*)v)->v[i];
+	}
+
+	return (void*)sum;
+}
+
+void futures(int threads, int n)
+{
+	Scheduler sched(threads);
+	std::vector<WorkHandle> handles(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 2)
+		{
+			handles[i] = sched.add_work(inc_workload, (void*)(uintptr_t)i, NULL, Scheduler::NONE).then(inc_workload).then(inc_workload);
+		}
+		else
+		{
+			handles[i] = sched.add_work(inc_workload, (void*)(uintptr_t)i, NULL, (uint64_t)(i % 7), Scheduler::NONE).then(inc_workload, NULL, (uint64_t)(i % 5), Scheduler::NONE).then(inc_workload, NULL, Scheduler::HIGH_PRIORITY);
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		assert((uintptr_t)(handles[i].wait()) == (uintptr_t)(i + 3));
+		assert(handles[i].ready());
+
+		// Chaining onto a completed workload runs right away.
+		assert((uintptr_t)(handles[i].then(inc_workload).wait()) == (uintptr_t)(i + 4));
+	}
+
+	// Copied arguments, both inline and not, can be reused by the caller right away.
+	struct small_args sa;
+	struct big_args ba;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 2)
+		{
+			sa.a = i;
+			sa.b = 1;
+			handles[i] = sched.add_work_copy(small_workload, &sa, sizeof(struct small_args), NULL, Scheduler::NONE);
+		}
+		else
+		{
+			for (int j = 0; j < 16; j++)
+			{
+				ba.v[j] = i;
+			}
+
+			handles[i] = sched.add_work_copy(big_workload, &ba, sizeof(struct big_args), NULL, (uint64_t)(i % 7), Scheduler::NONE);
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		assert((uintptr_t)(handles[i].wait()) == (uintptr_t)((i % 2) ? (i + 1) : (16 * i)));
+	}
+
+	std::vector<WorkHandle> inner(threads + 1);
+	std::vector<WorkHandle> outer(threads + 1);
+
+	for (int i = 0; i <= threads; i++)
+	{
+		inner[i] = sched.add_work(inc_workload, (void*)(uintptr_t)i, NULL, Scheduler::NONE);
+		outer[i] = sched.add_work(wait_workload, &inner[i], NULL, Scheduler::NONE);
+	}
+
+	for (int i = 0; i <= threads; i++)
+	{
+		assert((uintptr_t)(outer[i].wait()) == (uintptr_t)(i + 2));
+	}
+
+	sched.block_until_done();
+
+	// Handles can be kept, copied and dropped after their scheduler is gone.
+	WorkHandle kept;
+
+	{
+		Scheduler gone(threads);
+		kept = gone.add_work(inc_workload, (void*)(uintptr_t)1, NULL, Scheduler::NONE);
+		WorkHandle chained = kept.then(inc_workload);
+		assert((uintptr_t)(chained.wait()) == (uintptr_t)3);
+	}
+
+	WorkHandle copy = kept;
+	assert(copy.valid() && copy.ready());
+	kept = WorkHandle();
+}
+
+std::set<int> placed_cpus;
+volatile int placed_bad = 0;
+
+void* placed_workload(void* v)
+{
+#ifdef __linux__
+	if (placed_cpus.count(sched_getcpu()) == 0)
+	{
+		placed_bad = 1;
+	}
+#endif
+	return v;
+}
+
+void placement(int threads, int n)
+{
+	SchedulerConfig config(threads);
+	assert(config.add_topology());
+
+	// Put every other CPU on a second node, so there are two even with one real node.
+	SchedulerConfig split(threads);
+	placed_cpus.clear();
+
+	for (uint32_t i = 0; i < config.get_num_cpus(); i++)
+	{
+		split.add_cpu(config.get_cpu(i), i % 2);
+		placed_cpus.insert(config.get_cpu(i));
+	}
+
+	Scheduler sched(split);
+
+	for (uint64_t c = 0; c < 16; c++)
+	{
+		sched.set_class_node(c, (uint32_t)c);
+	}
+
+	std::vector<WorkHandle> handles(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 2)
+		{
+			handles[i] = sched.add_work(placed_workload, (void*)(uintptr_t)i, NULL, Scheduler::NONE);
+		}
+		else
+		{
+			handles[i] = sched.add_work(placed_workload, (void*)(uintptr_t)i, NULL, (uint64_t)(i % 16), Scheduler::NONE);
+		}
+	}
+
+	sched.update_num_threads(2 * threads);
+
+	for (int i = 0; i < n; i++)
+	{
+		assert((uintptr_t)(handles[i].wait()) == (uintptr_t)i);
+	}
+
+	sched.block_until_done();
+	assert(sched.get_num_complete() == (uint64_t)n);
+	assert(placed_bad == 0);
+}
+
+void test_placement()
+{
+	TEST_CLASS_BEGIN("SchedulerConfig worker placement");
+
+	char buf[128];
+	int runs[3] = { 1, 2, 4 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		sprintf_s(buf, "%d threads growing to %d, 100000 workloads", runs[i], 2 * runs[i]);
+		TEST_CASE(buf);
+		placement(runs[i], 100000);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+
+volatile uint64_t backlog_done;
+
+void* backlog_workload(void* v)
+{
+	uint64_t end = Scheduler::now() + 20000;
+
+	while (Scheduler::now() < end)
+	{
+	}
+
+	__sync_add_and_fetch(&backlog_done, 1);
+	return NULL;
+}
+
+void* mark_workload(void* v)
+{
+	*(uint64_t*)v = backlog_done;
+	return NULL;
+}
+
+void policies(int threads, int n)
+{
+	Scheduler sched(threads);
+	Scheduler::class_stats stats;
+	uint64_t seen_deadline;
+	uint64_t seen_share[10];
+
+	backlog_done = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		sched.add_work(backlog_workload, NULL, NULL, Scheduler::NONE);
+	}
+
+	// Neither of these should have to wait for the backlog to clear.
+	sched.set_class_share(42, 20);
+
+	for (int i = 0; i < 10; i++)
+	{
+		sched.add_work(mark_workload, &seen_share[i], NULL, (uint64_t)42, Scheduler::BACKGROUND);
+	}
+
+	sched.add_work_deadline(mark_workload, &seen_deadline, NULL, Scheduler::now() + 5000000, Scheduler::NONE);
+
+	sched.block_until_done();
+
+	assert(backlog_done == (uint64_t)n);
+	// Whether the deadline was actually met depends on how busy the machine is,
+	// so only check that it jumped the queue.
+	assert(seen_deadline < (uint64_t)n);
+	assert(seen_share[9] < (uint64_t)n);
+	assert(sched.get_deadline_misses() <= 1);
+
+	assert(sched.get_class_stats(42, &stats));
+	assert(stats.started == 10);
+	assert(stats.share == 20);
+	assert(stats.max_delay_ns <= stats.total_delay_ns);
+	assert(!sched.get_class_stats(43, &stats));
+}
+
+void test_policies()
+{
+	TEST_CLASS_BEGIN("Deadline and CPU share scheduling");
+
+	char buf[128];
+	int runs[2] = { 1, 4 };
+
+	for (int i = 0; i < 2; i++)
+	{
+		sprintf_s(buf, "%d threads, 20000 20us workloads of backlog", runs[i]);
+		TEST_CASE(buf);
+		policies(runs[i], 20000);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+
+void instrumentation(int threads, int n)
+{
+	Scheduler sched(threads);
+	LatencyHistogram h;
+
+	for (uint64_t i = 1; i <= 1000; i++)
+	{
+		h.record(i * 1000);
+	}
+
+	// The buckets are a quarter of a power of two wide, at most.
+	assert(h.get_count() == 1000);
+	assert(h.get_max() == 1000000);
+	assert(h.get_mean() == 500500);
+	assert((h.get_percentile(50) >= 500000) && (h.get_percentile(50) <= 625000));
+	assert(h.get_percentile(100) == 1000000);
+
+	sched.set_instrumented(true);
+
+	for (int i = 0; i < n / 2; i++)
+	{
+		sched.add_work(nop_workload, NULL, NULL, Scheduler::NONE);
+		sched.add_work(nop_workload, NULL, NULL, (uint64_t)7, Scheduler::BACKGROUND);
+	}
+
+	sched.block_until_done();
+
+	// Stopped workers still count.
+	sched.update_num_threads(threads / 2);
+	Scheduler::snapshot* snap = sched.get_snapshot();
+
+	assert(snap->completed == (uint64_t)n);
+	assert(snap->available == 0);
+	assert(snap->available_hwm >= 1);
+	assert(snap->workers.size() == (size_t)(threads / 2));
+	assert(snap->latency[SCHEDULER_FLAG_KINDS - 1].get_count() == (uint64_t)(n / 2));
+	assert(snap->run_time[SCHEDULER_FLAG_KINDS - 1].get_count() == (uint64_t)(n / 2));
+	assert(snap->run_time[2].get_count() == (uint64_t)(n / 2));
+	assert(snap->run_time[0].get_count() == 0);
+	assert(snap->latency[2].get_percentile(50) <= snap->latency[2].get_percentile(99));
+	assert(snap->latency[2].get_percentile(99) <= snap->latency[2].get_max());
+
+	for (size_t i = 0; i < snap->workers.size(); i++)
+	{
+		assert(snap->workers[i].busy_ns + snap->workers[i].parked_ns + snap->workers[i].idle_ns >= snap->workers[i].uptime_ns);
+	}
+
+	assert(snap->classes.size() == 1);
+	assert(snap->classes[0].class_id == 7);
+	assert(snap->classes[0].stats.started == (uint64_t)(n / 2));
+	assert(snap->classes[0].latency.get_count() == (uint64_t)(n / 2));
+	assert(snap->classes[0].run_time.get_count() == (uint64_t)(n / 2));
+	assert(snap->classes[0].depth == 0);
+	assert(snap->classes[0].depth_hwm >= 1);
+
+	delete snap;
+}
+
+void test_instrumentation()
+{
+	TEST_CLASS_BEGIN("Scheduler instrumentation snapshots");
+
+	char buf[128];
+	int runs[3] = { 1, 2, 4 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		sprintf_s(buf, "%d threads, 100000 workloads", runs[i]);
+		TEST_CASE(buf);
+		instrumentation(runs[i], 100000);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+
+#ifdef __cpp_impl_coroutine
+volatile uint32_t coro_in_class[4];
+volatile uint64_t coro_bad;
+
+void* coro_double(void* v)
+{
+	return (void*)((uintptr_t)v * 2);
+}
+
+bool coro_even(void* v)
+{
+	return ((*(uint64_t*)v % 2) == 0);
+}
+
+Task coro_step(Scheduler* sched, uint64_t i)
+{
+	// Nothing else in the class should get to run until the next co_await.
+	co_await schedule_class(sched, i % 4);
+
+	if (__sync_add_and_fetch(&coro_in_class[i % 4], 1) != 1)
+	{
+		__sync_add_and_fetch(&coro_bad, 1);
+	}
+
+	__sync_add_and_fetch(&coro_in_class[i % 4], -1);
+
+	void* r = co_await ((i % 2) ? async(sched, coro_double, (void*)i) : async_class(sched, coro_double, (void*)i, i % 4));
+	co_return r;
+}
+
+Task coro_request(Scheduler* sched, uint64_t i)
+{
+	void* a = co_await coro_step(sched, i);
+	void* b = co_await coro_step(sched, i + 1);
+	co_return (void*)((uintptr_t)a + (uintptr_t)b);
+}
+
+Task coro_query(ODB* odb)
+{
+	ODB* res = co_await query_async(odb, coro_even);
+	co_return (void*)(res->size());
+}
+
+void coroutines(int threads, int n)
+{
+	Scheduler sched(threads);
+	std::vector<Task> tasks;
+	uint64_t sum = 0;
+
+	coro_bad = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		tasks.push_back(coro_request(&sched, i));
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		sum += (uintptr_t)(tasks[i].wait());
+	}
+
+	assert(sum == 2 * (uint64_t)n * (uint64_t)n);
+	assert(coro_bad == 0);
+
+	// Ones that nobody waits on clean up after themselves.
+	for (int i = 0; i < n; i++)
+	{
+		coro_request(&sched, i);
+	}
+
+	sched.block_until_done();
+
+	ODB odb(ODB::BANK_DS, sizeof(uint64_t), NULL);
+	odb.start_scheduler(threads);
+
+	for (uint64_t i = 0; i < 1000; i++)
+	{
+		odb.add_data(&i);
+	}
+
+	odb.block_until_done();
+	assert((uintptr_t)(coro_query(&odb).wait()) == 500);
+}
+
+void test_coroutines()
+{
+	TEST_CLASS_BEGIN("Coroutines over the scheduler");
+
+	char buf[128];
+	int runs[3] = { 1, 2, 4 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		sprintf_s(buf, "%d threads, 100000 two-step requests", runs[i]);
+		TEST_CASE(buf);
+		coroutines(runs[i], 100000);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+#endif
+
+void test_futures()
+{
+	TEST_CLASS_BEGIN("WorkHandle waits and continuations");
+
+	char buf[128];
+	int runs[3] = { 0, 1, 4 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		sprintf_s(buf, "%d threads, 100000 three-stage chains", runs[i]);
+		TEST_CASE(buf);
+		futures(runs[i], 100000);
+		TEST_CASE_END();
+	}
+
+	TEST_CLASS_END();
+}
+
 int main(int argc, char** argv)
 {
 #ifdef CPP11THREADS
@@ -415,6 +984,15 @@ int main(int argc, char** argv)
    pthread_mutex_init(&mlock, NULL);
 #endif
 
+	test_lfqueue();
+	test_futures();
+	test_placement();
+	test_policies();
+	test_instrumentation();
+#ifdef __cpp_impl_coroutine
+	test_coroutines();
+#endif
+
 	create_destroy();
 	thread_start_stop();
 
@@ -0,0 +1,412 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define N 100
+#define READERS 4
+#define ROUNDS 2000
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+bool prune_high(void* rawdata)
+{
+    return (*(long*)rawdata >= N - 10);
+}
+
+bool prune_none(void* rawdata)
+{
+    return false;
+}
+
+// Run a query_lt and check both its size and which of the counters it moved.
+bool lt(Index* ind, long v, uint64_t expect, bool hit)
+{
+    uint64_t hits = ind->get_cache_hits();
+    uint64_t misses = ind->get_cache_misses();
+
+    ODB* res = ind->query_lt(&v);
+    bool ret = (res->size() == expect);
+    delete res;
+
+    if (hit)
+    {
+        ret = (ret && (ind->get_cache_hits() == hits + 1) && (ind->get_cache_misses() == misses));
+    }
+    else
+    {
+        ret = (ret && (ind->get_cache_hits() == hits) && (ind->get_cache_misses() == misses + 1));
+    }
+
+    if (!ret)
+    {
+        fprintf(stderr, "query_lt(%ld) expected %lu rows and a %s\n", v, expect, (hit ? "hit" : "miss"));
+    }
+
+    return ret;
+}
+
+bool gt(Index* ind, long v, uint64_t expect, bool hit)
+{
+    uint64_t hits = ind->get_cache_hits();
+
+    ODB* res = ind->query_gt(&v);
+    bool ret = ((res->size() == expect) && ((ind->get_cache_hits() == hits + 1) == hit));
+    delete res;
+
+    if (!ret)
+    {
+        fprintf(stderr, "query_gt(%ld) expected %lu rows and a %s\n", v, expect, (hit ? "hit" : "miss"));
+    }
+
+    return ret;
+}
+
+bool eq(Index* ind, long v, uint64_t expect, bool hit)
+{
+    uint64_t hits = ind->get_cache_hits();
+
+    ODB* res = ind->query_eq(&v);
+    bool ret = ((res->size() == expect) && ((ind->get_cache_hits() == hits + 1) == hit));
+    delete res;
+
+    if (!ret)
+    {
+        fprintf(stderr, "query_eq(%ld) expected %lu rows and a %s\n", v, expect, (hit ? "hit" : "miss"));
+    }
+
+    return ret;
+}
+
+uint32_t len_long(void* rawdata)
+{
+    return sizeof(long);
+}
+
+// Caching has to be refused, and queries for different keys still have to
+// find different rows.
+bool refused(Index* ind)
+{
+    bool ret = false;
+
+    try
+    {
+        ind->set_cache(16);
+    }
+    catch (const char* e)
+    {
+        ret = (strcmp(e, "CACHE_UNSIZED") == 0);
+    }
+
+    long three = 3;
+    long seven = 7;
+    ODB* a = ind->query_lt(&three);
+    ODB* b = ind->query_lt(&seven);
+
+    ret = (ret && (a->size() == 3) && (b->size() == 7) &&
+           (ind->get_cache_hits() == 0) && (ind->get_cache_misses() == 0));
+
+    // Nor can results drawn from them cache.
+    Index* sub = a->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    try
+    {
+        sub->set_cache(16);
+        ret = false;
+    }
+    catch (const char* e)
+    {
+        ret = (ret && (strcmp(e, "CACHE_UNSIZED") == 0));
+    }
+
+    delete a;
+    delete b;
+
+    return ret;
+}
+
+Index* shared;
+volatile uint64_t wrong = 0;
+
+void* reader(void* arg)
+{
+    for (long i = 0; i < ROUNDS; i++)
+    {
+        long v = 10;
+        ODB* res = shared->query_lt(&v);
+
+        if (res->size() != 10)
+        {
+            __sync_add_and_fetch(&wrong, 1);
+        }
+
+        delete res;
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-cache")
+TEST_OPT("Repeated queries are served from the cache")
+TEST_OPT("Adds only drop the cached results they fall into")
+TEST_OPT("Sweeps drop the cache")
+TEST_OPT("The cache holds no more than the requested number of results")
+TEST_OPT("Indirect datastores refuse to cache")
+TEST_OPT("Variable-width datastores refuse to cache")
+TEST_OPT("Concurrent hits are all served and all counted")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    ODB* odb = new ODB(ODB::LINKED_LIST_DS, sizeof(long));
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    // Nothing is cached, or counted, until asked for.
+    long v = 10;
+    ODB* res = ind->query_lt(&v);
+    bool success = ((res->size() == 10) && (ind->get_cache_hits() == 0) && (ind->get_cache_misses() == 0));
+    delete res;
+
+    ind->set_cache(16);
+
+    success = (success &&
+               lt(ind, 10, 10, false) && lt(ind, 10, 10, true) && lt(ind, 10, 10, true) &&
+               gt(ind, 10, N - 11, false) && gt(ind, 10, N - 11, true) &&
+               eq(ind, 10, 1, false) && eq(ind, 10, 1, true) &&
+               eq(ind, N, 0, false) && eq(ind, N, 0, true));
+
+    // Turning it off throws everything away.
+    uint64_t hits = ind->get_cache_hits();
+    ind->set_cache(0);
+    res = ind->query_lt(&v);
+    success = (success && (res->size() == 10) && (ind->get_cache_hits() == hits));
+    delete res;
+    ind->set_cache(16);
+    success = (success && lt(ind, 10, 10, false) && lt(ind, 10, 10, true));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    ODB* odb = new ODB(ODB::LINKED_LIST_DS, sizeof(long));
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i += 2)
+    {
+        odb->add_data(&i);
+    }
+
+    ind->set_cache(16);
+
+    bool success = (lt(ind, 20, 10, false) && gt(ind, 80, 9, false) && eq(ind, 51, 0, false) &&
+                    lt(ind, 20, 10, true) && gt(ind, 80, 9, true) && eq(ind, 51, 0, true));
+
+    // Below 20, so only the query_lt result is out of date.
+    long v = 5;
+    odb->add_data(&v);
+    success = (success && lt(ind, 20, 11, false) && gt(ind, 80, 9, true) && eq(ind, 51, 0, true));
+
+    // Exactly 51 isn't less or greater than either end, so only the query_eq
+    // result goes.
+    v = 51;
+    odb->add_data(&v);
+    success = (success && lt(ind, 20, 11, true) && gt(ind, 80, 9, true) && eq(ind, 51, 1, false));
+
+    v = 99;
+    odb->add_data(&v);
+    success = (success && lt(ind, 20, 11, true) && gt(ind, 80, 10, false) && eq(ind, 51, 1, true));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_high);
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    ind->set_cache(16);
+
+    bool success = (lt(ind, 10, 10, false) && gt(ind, N - 20, 19, false) &&
+                    lt(ind, 10, 10, true) && gt(ind, N - 20, 19, true));
+
+    odb->remove_sweep();
+
+    // Everything goes, whether or not the sweep touched its range.
+    success = (success && (ind->size() == N - 10) &&
+               lt(ind, 10, 10, false) && gt(ind, N - 20, 9, false) &&
+               lt(ind, 10, 10, true) && gt(ind, N - 20, 9, true));
+
+    // A sweep that finds nothing leaves the cache alone.
+    odb->set_prune(prune_none);
+    odb->remove_sweep();
+    success = (success && lt(ind, 10, 10, true) && gt(ind, N - 20, 9, true));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    ODB* odb = new ODB(ODB::LINKED_LIST_DS, sizeof(long));
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        long v = 10 * i;
+        odb->add_data(&v);
+    }
+
+    ind->set_cache(4);
+
+    bool success = true;
+
+    for (long i = 0; i < 6; i++)
+    {
+        success = (success && lt(ind, 10 * i, i, false));
+    }
+
+    // Only the first four made it in.
+    for (long i = 0; i < 6; i++)
+    {
+        success = (success && lt(ind, 10 * i, i, (i < 4)));
+    }
+
+    // Dropping one makes room for one more, but only one.
+    long v = 25;
+    odb->add_data(&v);
+    success = (success && lt(ind, 50, 6, false) && lt(ind, 50, 6, true) &&
+               lt(ind, 0, 0, true) && lt(ind, 30, 4, false) && lt(ind, 40, 5, false));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(4)
+{
+    ODB* odb = new ODB(ODB::BANK_I_DS);
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+    long* values = new long[N];
+
+    for (long i = 0; i < N; i++)
+    {
+        values[i] = i;
+        odb->add_data(&(values[i]));
+    }
+
+    bool success = refused(ind);
+
+    // Results drawn from fixed-width data still can.
+    long v = 50;
+    ODB* fixed = new ODB(ODB::BANK_DS, sizeof(long));
+
+    for (long i = 0; i < N; i++)
+    {
+        fixed->add_data(&i);
+    }
+
+    ODB* res = fixed->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long)->query_lt(&v);
+    Index* sub = res->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+    sub->set_cache(16);
+    success = (success && lt(sub, 10, 10, false) && lt(sub, 10, 10, true) && lt(sub, 20, 20, false));
+
+    delete res;
+    delete fixed;
+    delete odb;
+    delete [] values;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(5)
+{
+    ODB* odb = new ODB(ODB::LINKED_LIST_V_DS, NULL, NULL, NULL, len_long);
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool success = refused(ind);
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(6)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long));
+    shared = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    shared->set_cache(16);
+    bool success = lt(shared, 10, 10, false);
+
+    pthread_t threads[READERS];
+
+    for (long i = 0; i < READERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, reader, NULL);
+    }
+
+    for (long i = 0; i < READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    success = (success && (wrong == 0) &&
+               (shared->get_cache_hits() == READERS * ROUNDS) &&
+               (shared->get_cache_misses() == 1));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,296 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "epoch.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "lfqueue.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace libodb;
+
+#define N 2000
+#define ROUNDS 50
+#define READERS 3
+#define ITEMS 200000
+
+volatile uint64_t freed = 0;
+
+void count_free(void* p)
+{
+    __sync_add_and_fetch(&freed, 1);
+    free(p);
+}
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+Index* index_table;
+volatile bool done = false;
+volatile uint64_t wrong = 0;
+
+// Look up the even items, which are never removed, while the odd ones come and go.
+void* reader(void* arg)
+{
+    while (!done)
+    {
+        for (long k = 0; k < N; k += 2)
+        {
+            void* r = index_table->lookup(&k);
+
+            if ((r == NULL) || (*(long*)r != k))
+            {
+                __sync_add_and_fetch(&wrong, 1);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+LFQueue* queue;
+volatile uint64_t popped_sum = 0;
+volatile uint64_t popped_count = 0;
+
+// Every thread both adds and removes, so the queue is never idle while its
+// segments are retired.
+void* churn(void* arg)
+{
+    uint64_t base = (uint64_t)arg * ITEMS;
+    uint64_t sum = 0;
+    uint64_t count = 0;
+
+    for (uint64_t i = 1; i <= ITEMS; i++)
+    {
+        queue->push_back((void*)(base + i));
+        void* p = queue->pop_front();
+
+        if (p != NULL)
+        {
+            sum += (uint64_t)p;
+            count++;
+        }
+    }
+
+    __sync_add_and_fetch(&popped_sum, sum);
+    __sync_add_and_fetch(&popped_count, count);
+
+    return NULL;
+}
+
+ODB* stall_odb;
+volatile bool stalled = false;
+volatile bool unstall = false;
+
+// Hold the sweep up at its first row until told to go on.
+bool prune_stall(void* rawdata)
+{
+    if (!stalled)
+    {
+        stalled = true;
+
+        while (!unstall)
+        {
+            usleep(1000);
+        }
+    }
+
+    return prune_odd(rawdata);
+}
+
+void* stall_sweep(void* arg)
+{
+    stall_odb->remove_sweep();
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-epoch")
+TEST_OPT("Retired memory is freed by synchronize()")
+TEST_OPT("Retired memory outlives a reader that entered before it was retired")
+TEST_OPT("Lookups run against a tree and bank being filled and swept")
+TEST_OPT("Queue items all come out once while its segments are retired")
+TEST_OPT("Size checks and lookups carry on while a sweep is under way")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        EpochReclaimer::retire(malloc(16), count_free);
+    }
+
+    EpochReclaimer::synchronize();
+    return ((freed == 100) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    uint64_t e = EpochReclaimer::enter();
+    EpochReclaimer::retire(malloc(16), count_free);
+
+    uint64_t at = EpochReclaimer::get_epoch();
+
+    // However hard it's pushed, nothing can be freed while the reader is in.
+    for (int i = 0; i < 10; i++)
+    {
+        EpochReclaimer::reclaim();
+    }
+
+    bool held = ((freed == 0) && !EpochReclaimer::is_safe(at));
+
+    EpochReclaimer::exit(e);
+    EpochReclaimer::synchronize();
+
+    return ((held && (freed == 1) && EpochReclaimer::is_safe(at)) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+    index_table = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    // Twice over, so that every key has duplicates, and lookups go through the
+    // embedded trees too.
+    for (long i = 0; i < 2 * N; i += 2)
+    {
+        long v = i % N;
+        odb->add_data(&v);
+    }
+
+    pthread_t threads[READERS];
+
+    for (int i = 0; i < READERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, reader, NULL);
+    }
+
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        for (long i = 1; i < N; i += 2)
+        {
+            odb->add_data(&i);
+        }
+
+        odb->remove_sweep();
+    }
+
+    done = true;
+
+    for (int i = 0; i < READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool success = ((wrong == 0) && (odb->size() == N));
+
+    delete odb;
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    queue = new LFQueue();
+    pthread_t threads[READERS];
+    uint64_t expect = 0;
+
+    for (uint64_t i = 0; i < READERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, churn, (void*)i);
+    }
+
+    for (int i = 0; i < READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // A pop can miss an item that is partway through being added, which leaves
+    // it behind for here.
+    void* p;
+
+    while ((p = queue->pop_front()) != NULL)
+    {
+        popped_sum += (uint64_t)p;
+        popped_count++;
+    }
+
+    for (uint64_t i = 1; i <= READERS * ITEMS; i++)
+    {
+        expect += i;
+    }
+
+    bool success = ((popped_count == READERS * ITEMS) && (popped_sum == expect) && (queue->size() == 0));
+
+    delete queue;
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(4)
+{
+    stall_odb = new ODB(ODB::BANK_DS, sizeof(long), prune_stall);
+    index_table = stall_odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        stall_odb->add_data(&i);
+    }
+
+    // A sweep that held the ODB's write lock would leave this hanging.
+    alarm(60);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, stall_sweep, NULL);
+
+    while (!stalled)
+    {
+        usleep(1000);
+    }
+
+    bool success = (stall_odb->mem_size() > 0);
+    success = (success && (stall_odb->get_prune() == prune_stall));
+
+    for (long k = 0; k < N; k += 2)
+    {
+        void* r = index_table->lookup(&k);
+        success = (success && (r != NULL) && (*(long*)r == k));
+    }
+
+    unstall = true;
+    pthread_join(thread, NULL);
+
+    success = (success && (stall_odb->size() == N / 2));
+
+    delete stall_odb;
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,264 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "rwlock.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+using namespace libodb;
+
+#define N 300
+#define JOINS 2000
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+// A table and, in no particular order, every value that was added to it.
+struct table
+{
+    ODB* odb;
+    Index* ind;
+    std::vector<long> values;
+};
+
+void fill(struct table* t, int type, long mult, long mod, long dups)
+{
+    t->odb = new ODB(ODB::BANK_DS, sizeof(long));
+    t->ind = t->odb->create_index((ODB::IndexType)type, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        long v = (i * mult) % mod;
+
+        // Only some values are repeated, so runs of every length meet.
+        for (long d = 0; d < ((v % 3) == 0 ? dups : 1); d++)
+        {
+            t->odb->add_data(&v);
+            t->values.push_back(v);
+        }
+    }
+}
+
+void count_pair(void* a, void* b, void* context)
+{
+    (*(uint64_t*)context)++;
+}
+
+// Compare join(a, b) against every pair a nested loop finds.
+bool check(struct table* a, struct table* b)
+{
+    std::vector<long> expect;
+    std::vector<long> got;
+
+    for (size_t i = 0; i < a->values.size(); i++)
+    {
+        for (size_t j = 0; j < b->values.size(); j++)
+        {
+            if (a->values[i] == b->values[j])
+            {
+                expect.push_back(a->values[i]);
+            }
+        }
+    }
+
+    std::vector<std::pair<void*, void*> >* pairs = Index::join(a->ind, b->ind);
+    bool ret = true;
+    long last = -1;
+
+    for (size_t i = 0; i < pairs->size(); i++)
+    {
+        long x = *(long*)(pairs->at(i).first);
+        long y = *(long*)(pairs->at(i).second);
+
+        // Pairs come out in index order.
+        ret = (ret && (x == y) && (x >= last));
+        last = x;
+        got.push_back(x);
+    }
+
+    delete pairs;
+
+    uint64_t counted = 0;
+    uint64_t num_pairs = Index::join(a->ind, b->ind, NULL, count_pair, &counted);
+
+    std::sort(expect.begin(), expect.end());
+    ret = (ret && (got == expect) && (num_pairs == expect.size()) && (counted == num_pairs));
+
+    if (!ret)
+    {
+        fprintf(stderr, "Joined %lu pairs, expected %lu\n", got.size(), expect.size());
+    }
+
+    return ret;
+}
+
+struct table ta;
+struct table tb;
+volatile bool stop = false;
+
+void* joiner(void* arg)
+{
+    bool flip = (arg != NULL);
+
+    for (long i = 0; i < JOINS; i++)
+    {
+        std::vector<std::pair<void*, void*> >* pairs = (flip ? Index::join(tb.ind, ta.ind) : Index::join(ta.ind, tb.ind));
+        delete pairs;
+    }
+
+    return NULL;
+}
+
+// Keeps both tables' write locks busy, with values that never pair up so the
+// joins don't grow.
+void* writer(void* arg)
+{
+    for (long i = 0; (i < 10 * JOINS) && !stop; i++)
+    {
+        long v = 2 * (N + i);
+        ta.odb->add_data(&v);
+        v++;
+        tb.odb->add_data(&v);
+    }
+
+    return NULL;
+}
+
+// Self-joins, while the writer has the table's write lock queued up behind them.
+void* self_joiner(void* arg)
+{
+    for (long i = 0; i < JOINS / 10; i++)
+    {
+        std::vector<std::pair<void*, void*> >* pairs = Index::join(ta.ind, ta.ind);
+        delete pairs;
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-join")
+TEST_OPT("Joins find every pair of equal items across index types")
+TEST_OPT("Joins of the same two tables in opposite orders don't deadlock")
+TEST_OPT("Self-joins find every pair and don't deadlock with any kind of lock")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    int types[] = { ODB::RED_BLACK_TREE, ODB::LINKED_LIST, ODB::SKIP_LIST };
+    bool success = true;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            struct table a, b, none;
+
+            // b only covers half of a's range, and none is empty.
+            fill(&a, types[i], 7, N, 3);
+            fill(&b, types[j], 11, N / 2, 2);
+            none.odb = new ODB(ODB::BANK_DS, sizeof(long));
+            none.ind = none.odb->create_index((ODB::IndexType)types[j], ODB::NONE, compare_long);
+
+            success = (success && check(&a, &b) && check(&b, &a) && check(&a, &a) &&
+                       check(&a, &none) && check(&none, &a));
+
+            delete a.odb;
+            delete b.odb;
+            delete none.odb;
+        }
+    }
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    fill(&ta, ODB::RED_BLACK_TREE, 7, N, 2);
+    fill(&tb, ODB::RED_BLACK_TREE, 11, N, 2);
+
+    // Ticket locks hand reads out one at a time, so two joins that took the
+    // locks in the order they were given would deadlock almost at once.
+    ta.ind->set_lock(RWLock::TICKET);
+    tb.ind->set_lock(RWLock::TICKET);
+
+    // Hung threads can't be cancelled, so give up on the whole process.
+    alarm(60);
+
+    pthread_t threads[3];
+    pthread_create(&(threads[0]), NULL, joiner, NULL);
+    pthread_create(&(threads[1]), NULL, joiner, (void*)1);
+    pthread_create(&(threads[2]), NULL, writer, NULL);
+
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    stop = true;
+    pthread_join(threads[2], NULL);
+
+    delete ta.odb;
+    delete tb.odb;
+
+    return EXIT_SUCCESS;
+}
+
+TEST_BEGIN(2)
+{
+    RWLock::LockType locks[] = { RWLock::DEFAULT, RWLock::SPIN, RWLock::TICKET, RWLock::READER_BIASED };
+    int types[] = { ODB::RED_BLACK_TREE, ODB::LINKED_LIST, ODB::SKIP_LIST };
+    bool success = true;
+
+    // Hung threads can't be cancelled, so give up on the whole process.
+    alarm(60);
+
+    for (int l = 0; l < 4; l++)
+    {
+        for (int t = 0; t < 3; t++)
+        {
+            ta.values.clear();
+            tb.values.clear();
+            fill(&ta, types[t], 7, N, 3);
+            fill(&tb, types[t], 11, N, 1);
+            ta.ind->set_lock(locks[l]);
+
+            success = (success && check(&ta, &ta));
+
+            stop = false;
+            pthread_t threads[2];
+            pthread_create(&(threads[0]), NULL, self_joiner, NULL);
+            pthread_create(&(threads[1]), NULL, writer, NULL);
+
+            pthread_join(threads[0], NULL);
+            stop = true;
+            pthread_join(threads[1], NULL);
+
+            delete ta.odb;
+            delete tb.odb;
+        }
+    }
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
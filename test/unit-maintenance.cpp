@@ -0,0 +1,274 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "maintenance.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace libodb;
+
+#define N_ODBS 200
+#define ROWS 50
+#define PERIOD 8
+
+bool prune_all(void* rawdata)
+{
+    return true;
+}
+
+// The number of threads in this process, from /proc.
+long num_threads()
+{
+    FILE* fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long ret = -1;
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (strncmp(line, "Threads:", 8) == 0)
+        {
+            ret = atol(line + 8);
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return ret;
+}
+
+// Milliseconds since some fixed point.
+long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TEST_OPT_PREAMBLE("unit-maintenance")
+TEST_OPT("Many ODBs are all swept without a thread each")
+TEST_OPT("ODBs started together have their sweeps spread out")
+TEST_OPT("ODBs can come and go while the service is running")
+TEST_OPT("An ODB that is held locked doesn't hold up the service")
+TEST_OPT("A watermark check in flight doesn't cost a scheduled sweep its turn")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    ODB* odbs[N_ODBS];
+
+    for (int i = 0; i < N_ODBS; i++)
+    {
+        odbs[i] = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 2);
+
+        for (long j = 0; j < ROWS; j++)
+        {
+            odbs[i]->add_data(&j);
+        }
+    }
+
+    long threads = num_threads();
+    uint64_t before = MaintenanceService::get_sweeps();
+
+    sleep(4);
+
+    // A BankDS sweep keeps one row back, so anything under the number added
+    // means the ODB was swept.
+    int unswept = 0;
+
+    for (int i = 0; i < N_ODBS; i++)
+    {
+        if (odbs[i]->size() >= ROWS)
+        {
+            unswept++;
+        }
+    }
+
+    bool success = ((unswept == 0) && (threads < 10) &&
+                    (MaintenanceService::get_sweeps() >= before + N_ODBS));
+
+    if (!success)
+    {
+        fprintf(stderr, "unswept=%d threads=%ld sweeps=%lu\n", unswept, threads, MaintenanceService::get_sweeps() - before);
+    }
+
+    for (int i = 0; i < N_ODBS; i++)
+    {
+        delete odbs[i];
+    }
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    ODB* odbs[PERIOD];
+    bool seen[PERIOD + 1];
+    bool success = true;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (int i = 0; i < PERIOD; i++)
+    {
+        odbs[i] = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, PERIOD);
+    }
+
+    // Nothing else is registered, and this runs well inside a second, so each
+    // ODB should have had a second of the period to itself.
+    for (int i = 0; i < PERIOD; i++)
+    {
+        uint32_t due = MaintenanceService::next_due(odbs[i]);
+
+        if ((due == 0) || (due > PERIOD) || seen[due])
+        {
+            fprintf(stderr, "ODB %d is due in %u\n", i, due);
+            success = false;
+        }
+        else
+        {
+            seen[due] = true;
+        }
+    }
+
+    for (int i = 0; i < PERIOD; i++)
+    {
+        delete odbs[i];
+    }
+
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all);
+    success = (success && (MaintenanceService::next_due(odb) == 0));
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    ODB* keep = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 1);
+    uint64_t before = MaintenanceService::get_sweeps();
+    time_t start = time(NULL);
+
+    // Keep adding and deleting ODBs that sweep every second, for long enough
+    // that some of them are deleted in the middle of being swept.
+    while (time(NULL) < start + 3)
+    {
+        ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 1);
+
+        for (long j = 0; j < ROWS; j++)
+        {
+            odb->add_data(&j);
+            keep->add_data(&j);
+        }
+
+        delete odb;
+    }
+
+    bool success = (MaintenanceService::get_sweeps() > before);
+
+    delete keep;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    // The service has to work out this one's size every second, and can't
+    // while the lock is held.
+    ODB* stuck = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 3600);
+    stuck->set_mem_limits(1, 0);
+    stuck->get_lock()->write_lock();
+
+    long start = now_ms();
+    long slowest = 0;
+    uint64_t before = MaintenanceService::get_sweeps();
+
+    // Meanwhile, other ODBs come and go, and get swept.
+    ODB* keep = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 1);
+
+    while (now_ms() < start + 3000)
+    {
+        long t = now_ms();
+        ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 1);
+        delete odb;
+
+        if (now_ms() - t > slowest)
+        {
+            slowest = now_ms() - t;
+        }
+
+        usleep(10000);
+    }
+
+    bool success = ((slowest < 500) && (MaintenanceService::get_sweeps() > before));
+
+    if (!success)
+    {
+        fprintf(stderr, "slowest=%ldms sweeps=%lu\n", slowest, MaintenanceService::get_sweeps() - before);
+    }
+
+    delete keep;
+    stuck->get_lock()->write_unlock();
+    delete stuck;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(4)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all);
+    odb->set_mem_limits(1, 0);
+
+    for (long j = 0; j < ROWS; j++)
+    {
+        odb->add_data(&j);
+    }
+
+    // The next tick queues a watermark check, which waits on the lock, and the
+    // one after that has the scheduled sweep due while the check is still stuck.
+    MaintenanceService::add(odb, 3600, 3598);
+    odb->get_lock()->write_lock();
+
+    // The service starts ticking when the ODB is added, so let go halfway
+    // between the second tick and the third, which would queue another check.
+    usleep(2500000);
+
+    uint64_t before = MaintenanceService::get_sweeps();
+    odb->get_lock()->write_unlock();
+
+    // Both the check and the scheduled sweep should now get through.
+    usleep(300000);
+
+    bool success = (MaintenanceService::get_sweeps() >= before + 2);
+
+    if (!success)
+    {
+        fprintf(stderr, "sweeps=%lu\n", MaintenanceService::get_sweeps() - before);
+    }
+
+    MaintenanceService::remove(odb);
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,219 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "snapshot.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace libodb;
+
+#define N 20000
+
+// Bytes each row costs in a BankDS of longs with one RedBlackTreeI over it.
+#define ROW_BYTES (sizeof(long) + 3 * sizeof(void*))
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+bool prune_all(void* rawdata)
+{
+    return true;
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+uint64_t told = 0;
+uint64_t last_used = 0;
+
+void overrun(ODB* odb, uint64_t used)
+{
+    told++;
+    last_used = used;
+}
+
+TEST_OPT_PREAMBLE("unit-memory")
+TEST_OPT("Rows, index nodes and query results are all accounted for")
+TEST_OPT("Insertions past the hard watermark sweep before going ahead")
+TEST_OPT("The memory checker sweeps early past the soft watermark")
+TEST_OPT("Sweeps that can't get back under the hard watermark are reported")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    uint64_t rows = odb->mem_size();
+
+    Index* index = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+    uint64_t indexed = odb->mem_size();
+
+    long mid = N / 2;
+    index->query_lt(&mid);
+    uint64_t queried = odb->mem_size();
+
+    odb->remove_sweep();
+    uint64_t swept = odb->mem_size();
+
+    ODB* vodb = new ODB(ODB::LINKED_LIST_V_DS);
+    uint64_t empty = vodb->mem_size();
+    char* s = (char*)"a string that is longer than any of the overhead";
+
+    for (long i = 0; i < N; i++)
+    {
+        vodb->add_data(s);
+    }
+
+    bool success = ((rows == N * sizeof(long)) &&
+                    (indexed == N * ROW_BYTES) &&
+                    (queried > indexed) &&
+                    (swept < queried) &&
+                    (swept > (N / 2) * ROW_BYTES) &&
+                    (empty == 0) &&
+                    (vodb->mem_size() > N * strlen(s)));
+
+    if (!success)
+    {
+        fprintf(stderr, "rows=%lu indexed=%lu queried=%lu swept=%lu empty=%lu variable=%lu\n", rows, indexed, queried, swept, empty, vodb->mem_size());
+    }
+
+    delete vodb;
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all);
+    odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+    // Without watermarks nothing is swept.
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool kept = (odb->size() == N);
+    odb->purge();
+
+    // With a hard mark of a tenth of that, the writer keeps sweeping. It only
+    // looks every so often, so allow for the rows it adds in between.
+    odb->set_mem_limits(0, (N / 10) * ROW_BYTES);
+
+    for (long i = 0; i < 5 * N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool success = (kept &&
+                    (odb->size() < 5 * N) &&
+                    (odb->mem_size() < (N / 10 + 4096) * ROW_BYTES));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    // Scheduled sweeps are an hour apart, so any sweep in the next few seconds
+    // is down to the soft mark.
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all, NULL, NULL, 3600);
+    odb->set_mem_limits(N * sizeof(long) / 2, 0);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    uint64_t before = odb->size();
+    sleep(3);
+
+    bool success = ((before > N / 2) && (odb->size() < N / 2));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    uint64_t hard = (N / 10) * ROW_BYTES;
+
+    // With nothing to prune, every look past the hard mark is an overrun.
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long));
+    odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+    odb->set_mem_limits(0, hard);
+    odb->set_mem_overrun(overrun);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool unpruned = ((odb->size() == N) &&
+                     (odb->get_mem_overruns() > 0) &&
+                     (told == odb->get_mem_overruns()) &&
+                     (last_used > hard));
+
+    delete odb;
+
+    // An open snapshot puts the sweeps off, which counts too, until it's let go.
+    odb = new ODB(ODB::BANK_DS, sizeof(long), prune_all);
+    odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+    odb->set_mem_limits(0, hard);
+
+    Snapshot* snap = odb->snapshot();
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool deferred = ((odb->size() == N) && (odb->get_mem_overruns() > 0));
+    uint64_t overruns = odb->get_mem_overruns();
+
+    odb->snapshot_release(snap);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    bool success = (unpruned && deferred &&
+                    (odb->size() < N) &&
+                    (odb->get_mem_overruns() == overruns));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
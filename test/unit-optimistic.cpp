@@ -0,0 +1,218 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "rwlock.hpp"
+#include "epoch.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define N 1000
+#define ROUNDS 200
+#define READERS 3
+#define COPIES 3
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+Index* index_table;
+volatile bool done = false;
+volatile uint64_t wrong = 0;
+volatile uint64_t passes = 0;
+
+// The even keys are never removed, so they must always be found. The odd ones
+// come and go, so may or may not be, but mustn't turn up as anything else.
+void* looker(void* arg)
+{
+    while (!done)
+    {
+        for (long k = 0; k < N; k++)
+        {
+            void* r = index_table->lookup(&k);
+
+            if (((r == NULL) && !(k & 1)) || ((r != NULL) && (*(long*)r != k)))
+            {
+                __sync_add_and_fetch(&wrong, 1);
+            }
+        }
+
+        __sync_add_and_fetch(&passes, 1);
+    }
+
+    return NULL;
+}
+
+// Every even key has COPIES rows, none of which are ever removed.
+void* querier(void* arg)
+{
+    while (!done)
+    {
+        for (long k = 0; k < N; k += 2)
+        {
+            ODB* res = index_table->query_eq(&k);
+
+            if (res->size() != COPIES)
+            {
+                __sync_add_and_fetch(&wrong, 1);
+            }
+
+            delete res;
+        }
+
+        __sync_add_and_fetch(&passes, 1);
+    }
+
+    return NULL;
+}
+
+// Refill the odd keys and sweep them back out, so the tree is rebalanced and
+// its nodes freed under the readers' feet.
+bool churn(ODB* odb, Index* ind, RWLock::LockType lock, uint32_t copies, void* (*reader)(void*))
+{
+    index_table = ind;
+    index_table->set_lock(lock);
+    done = false;
+    wrong = 0;
+    passes = 0;
+
+    for (uint32_t c = 0; c < copies; c++)
+    {
+        for (long i = 0; i < N; i += 2)
+        {
+            odb->add_data(&i);
+        }
+    }
+
+    pthread_t threads[READERS];
+
+    for (int i = 0; i < READERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, reader, NULL);
+    }
+
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        for (long i = 1; i < N; i += 2)
+        {
+            odb->add_data(&i);
+        }
+
+        odb->remove_sweep();
+    }
+
+    done = true;
+
+    for (int i = 0; i < READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool success = ((wrong == 0) && (passes >= READERS));
+
+    if (!success)
+    {
+        fprintf(stderr, "lock=%d wrong=%lu passes=%lu\n", lock, wrong, passes);
+    }
+
+    return success;
+}
+
+RWLock::LockType locks[] = { RWLock::DEFAULT, RWLock::SPIN, RWLock::TICKET, RWLock::READER_BIASED };
+
+TEST_OPT_PREAMBLE("unit-optimistic")
+TEST_OPT("Lookups run against a tree being refilled and swept")
+TEST_OPT("Lookups run against a tree that drops duplicates")
+TEST_OPT("Equality queries run against a tree being refilled and swept")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    bool success = true;
+
+    // Hung threads can't be cancelled, so give up on the whole process.
+    alarm(60);
+
+    for (int l = 0; l < 4; l++)
+    {
+        ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+        Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+        success = (churn(odb, ind, locks[l], 1, looker) && success);
+
+        delete odb;
+    }
+
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    bool success = true;
+
+    alarm(60);
+
+    for (int l = 0; l < 4; l++)
+    {
+        ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+        Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+
+        success = (churn(odb, ind, locks[l], COPIES, looker) && success);
+
+        delete odb;
+    }
+
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    bool success = true;
+
+    alarm(60);
+
+    for (int l = 0; l < 4; l++)
+    {
+        ODB* odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+        Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+        success = (churn(odb, ind, locks[l], COPIES, querier) && success);
+
+        delete odb;
+    }
+
+    EpochReclaimer::synchronize();
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,214 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "comparator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+using namespace libodb;
+
+#define ROWS 1000
+#define BANK_ROWS 5000
+
+struct row
+{
+    char pad;
+    int32_t small;
+    long big;
+    double real;
+};
+
+struct row rows[ROWS];
+
+uint64_t sizes[] = { 1, 63, 64, 65, 130, ROWS };
+#define NUM_SIZES (sizeof(sizes) / sizeof(uint64_t))
+
+void fill_rows()
+{
+    srand(12345);
+
+    for (long i = 0; i < ROWS; i++)
+    {
+        rows[i].pad = 'x';
+        rows[i].small = (int32_t)((rand() % 21) - 10);
+        rows[i].big = (rand() % 201) - 100;
+        rows[i].real = ((rand() % 41) - 20) / 4.0;
+    }
+}
+
+// Match the first n rows, and check each bit against the per-row condition, and
+// that nothing past the last row is set.
+bool check(Predicate* p, uint64_t n)
+{
+    uint64_t words = PREDICATE_BITMAP_WORDS(n);
+    uint64_t* bitmap = new uint64_t[words * (1 + p->scratch_bitmaps())];
+    bool ret = true;
+
+    p->match((char*)rows, sizeof(struct row), n, bitmap, bitmap + words);
+
+    for (uint64_t i = 0; i < words * 64; i++)
+    {
+        bool bit = ((bitmap[i / 64] >> (i % 64)) & 1);
+
+        if (bit != ((i < n) && p->condition(&(rows[i]))))
+        {
+            fprintf(stderr, "Bit %lu of %lu is wrong\n", i, n);
+            ret = false;
+            break;
+        }
+    }
+
+    delete [] bitmap;
+
+    return ret;
+}
+
+bool check_sizes(Predicate* p)
+{
+    bool ret = true;
+
+    for (uint32_t s = 0; s < NUM_SIZES; s++)
+    {
+        ret = (ret && check(p, sizes[s]));
+    }
+
+    return ret;
+}
+
+template <typename T> bool check_ops(uint32_t offset, T low, T high)
+{
+    bool ret = true;
+
+    for (int op = Predicate::EQ; op <= Predicate::RANGE; op++)
+    {
+        PredicateField<T> p(offset, (Predicate::PredicateOp)op, low, high);
+        ret = (ret && check_sizes(&p));
+    }
+
+    return ret;
+}
+
+bool check_fields()
+{
+    return (check_ops<int32_t>(offsetof(struct row, small), 0, 5) &&
+            check_ops<long>(offsetof(struct row, big), -3, 40) &&
+            check_ops<double>(offsetof(struct row, real), 1.25, 3.5));
+}
+
+bool check_combined()
+{
+    PredicateField<int32_t> a(offsetof(struct row, small), Predicate::GE, 0);
+    PredicateField<long> b(offsetof(struct row, big), Predicate::LT, 10);
+    PredicateField<double> c(offsetof(struct row, real), Predicate::RANGE, -2.0, 2.0);
+    PredicateField<long> d(offsetof(struct row, big), Predicate::EQ, 50);
+
+    PredicateAnd ab(&a, &b);
+    PredicateOr cd(&c, &d);
+    PredicateAnd left(&ab, &cd);
+    PredicateOr right(&cd, &ab);
+    PredicateOr both(&left, &right);
+
+    return ((ab.scratch_bitmaps() == 1) &&
+            (right.scratch_bitmaps() == 2) &&
+            (both.scratch_bitmaps() == 3) &&
+            check_sizes(&ab) && check_sizes(&cd) &&
+            check_sizes(&left) && check_sizes(&right) &&
+            check_sizes(&both));
+}
+
+bool by_hand(void* rawdata)
+{
+    struct row* r = (struct row*)rawdata;
+    return (((r->small >= 0) && (r->big < 10)) || (r->big == 50));
+}
+
+bool check_query(ODB* odb)
+{
+    PredicateField<int32_t> a(offsetof(struct row, small), Predicate::GE, 0);
+    PredicateField<long> b(offsetof(struct row, big), Predicate::LT, 10);
+    PredicateField<long> c(offsetof(struct row, big), Predicate::EQ, 50);
+    PredicateAnd ab(&a, &b);
+    PredicateOr p(&ab, &c);
+    ConditionCust cond(by_hand);
+
+    ODB* fast = odb->query(&p);
+    ODB* slow = odb->query(&cond);
+    bool ret = ((fast->size() == slow->size()) && (fast->size() > 0));
+
+    delete fast;
+    delete slow;
+
+    return ret;
+}
+
+TEST_OPT_PREAMBLE("unit-predicate")
+TEST_OPT("Field predicates agree with their per-item condition, with and without AVX2")
+TEST_OPT("Combined predicates agree with their per-item condition, with and without AVX2")
+TEST_OPT("Bank queries with predicates find the same rows as plain conditions")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    fill_rows();
+
+    predicate_set_avx2(false);
+    bool success = check_fields();
+    predicate_set_avx2(true);
+    success = (success && check_fields());
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    fill_rows();
+
+    predicate_set_avx2(false);
+    bool success = check_combined();
+    predicate_set_avx2(true);
+    success = (success && check_combined());
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(struct row));
+
+    srand(54321);
+
+    for (long i = 0; i < BANK_ROWS; i++)
+    {
+        struct row r;
+        r.pad = 'x';
+        r.small = (int32_t)((rand() % 21) - 10);
+        r.big = (rand() % 201) - 100;
+        r.real = 0.0;
+        odb->add_data(&r);
+    }
+
+    // Once serially, then split up over a scheduler.
+    bool success = check_query(odb);
+    odb->start_scheduler(3);
+    success = (success && check_query(odb));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,227 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "iterator.hpp"
+#include "rwlock.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define N 20000
+#define DUPS 1000
+#define SWEEPS 2000
+#define QUERIERS 3
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+bool everything(void* rawdata)
+{
+    return true;
+}
+
+// Walk the result through an index on it, and check that it holds exactly the
+// values lo to hi - 1, each dups times.
+bool check(ODB* res, long lo, long hi, long dups)
+{
+    Index* ind = res->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+    Iterator* it = ind->it_first();
+    long expect = lo;
+    long seen = 0;
+    bool ret = true;
+
+    if (it->data() != NULL)
+    {
+        do
+        {
+            ret = (ret && (*(long*)(it->get_data()) == expect));
+            seen++;
+
+            if ((seen % dups) == 0)
+            {
+                expect++;
+            }
+        }
+        while (it->next());
+    }
+
+    ind->it_release(it);
+
+    return (ret && (seen == (hi - lo) * dups) && (res->size() == (uint64_t)seen));
+}
+
+bool negative(void* rawdata)
+{
+    return (*(long*)rawdata < 0);
+}
+
+ODB* parent;
+Index* parent_ind;
+volatile bool stop = false;
+
+// Results come and go while the parent sweeps them.
+void* querier(void* arg)
+{
+    long v = 100;
+
+    while (!stop)
+    {
+        ODB* res = parent_ind->query_lt(&v);
+        delete res;
+    }
+
+    return NULL;
+}
+
+// Each sweep removes a row, which moves another and so has every result
+// update its pointers too.
+void* sweeper(void* arg)
+{
+    for (long i = 0; i < SWEEPS; i++)
+    {
+        long v = -1;
+        parent->add_data(&v);
+        parent->remove_sweep();
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-results")
+TEST_OPT("Results larger and smaller than their size hint hold all their rows")
+TEST_OPT("Results made from what earlier results left behind start out clean")
+TEST_OPT("Results can be deleted while their parent is being swept")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    // Every value is in there DUPS times, so an equality query outgrows the
+    // bank it is given many times over.
+    for (long i = 0; i < N; i++)
+    {
+        long v = i / DUPS;
+        odb->add_data(&v);
+    }
+
+    long v = 3;
+    ODB* eq = ind->query_eq(&v);
+    long missing = N + 1;
+    ODB* none = ind->query_eq(&missing);
+    ODB* all = odb->query(everything);
+
+    bool success = (check(eq, 3, 4, DUPS) &&
+                    check(none, 0, 0, 1) &&
+                    (all->size() == N));
+
+    delete eq;
+    delete none;
+    delete all;
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* ind = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long);
+    bool success = true;
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    for (long i = 0; i < 200; i++)
+    {
+        ODB* res = ind->query_lt(&i);
+
+        // Each result must look brand new, whatever was done to the one that
+        // was destroyed before it. Any index tables it had would count here.
+        success = (success &&
+                   (res->get_lock()->get_type() == RWLock::DEFAULT) &&
+                   (res->mem_size() == i * sizeof(void*)) &&
+                   check(res, 0, i, 1));
+
+        if ((i % 3) == 0)
+        {
+            res->set_lock(RWLock::TICKET, true);
+        }
+
+        if ((i % 5) == 0)
+        {
+            res->create_group();
+        }
+
+        delete res;
+    }
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    parent = new ODB(ODB::BANK_DS, sizeof(long), negative);
+    parent_ind = parent->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < 1000; i++)
+    {
+        parent->add_data(&i);
+    }
+
+    // Hung threads can't be cancelled, so give up on the whole process.
+    alarm(60);
+
+    pthread_t threads[QUERIERS + 1];
+
+    for (long i = 0; i < QUERIERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, querier, NULL);
+    }
+
+    pthread_create(&(threads[QUERIERS]), NULL, sweeper, NULL);
+    pthread_join(threads[QUERIERS], NULL);
+    stop = true;
+
+    for (long i = 0; i < QUERIERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every row the sweeper added went again.
+    ODB* all = parent->query(everything);
+    bool success = ((parent->size() == 1000) && (all->size() == 1000));
+
+    delete all;
+    delete parent;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,360 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "rwlock.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "iterator.hpp"
+#include "comparator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace libodb;
+
+#define N 20000
+#define THREADS 4
+#define TYPES 4
+
+RWLock::LockType types[TYPES] = { RWLock::DEFAULT, RWLock::SPIN, RWLock::TICKET, RWLock::READER_BIASED };
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+RWLock* lock;
+
+// Writers keep these two equal, and go through a state where they aren't, so a
+// reader that gets in alongside a writer has a chance to see it.
+volatile long a;
+volatile long b;
+volatile bool torn;
+
+void* worker(void* arg)
+{
+    for (long i = 0; i < N; i++)
+    {
+        if ((i % 4) == 0)
+        {
+            lock->read_lock();
+
+            if (a != b)
+            {
+                torn = true;
+            }
+
+            lock->read_unlock();
+        }
+        else
+        {
+            lock->write_lock();
+            a = a + 1;
+
+            if ((i % 64) == 1)
+            {
+                sched_yield();
+            }
+
+            b = b + 1;
+            lock->write_unlock();
+        }
+    }
+
+    return NULL;
+}
+
+void* waiter(void* arg)
+{
+    if ((long)arg)
+    {
+        lock->write_lock();
+        lock->write_unlock();
+    }
+    else
+    {
+        lock->read_lock();
+        lock->read_unlock();
+    }
+
+    return NULL;
+}
+
+ODB* odb;
+
+void* adder(void* arg)
+{
+    for (long i = (long)arg; i < N; i += THREADS)
+    {
+        odb->add_data(&i);
+    }
+
+    return NULL;
+}
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+bool small(void* rawdata)
+{
+    return (*(long*)rawdata < 100);
+}
+
+void* keep_new(void* new_data, void* old_data)
+{
+    return old_data;
+}
+
+// Run everything the library does that takes a lock, on structures whose locks
+// all block a thread that already holds them. Any path that took one of its
+// locks twice would spin here for good.
+void exercise(int dt, RWLock::LockType type)
+{
+    ODB* odb = new ODB((ODB::FixedDatastoreType)dt, sizeof(long), prune_odd);
+    odb->set_lock(type);
+    odb->set_datastore_lock(type);
+
+    Index* tables[3];
+    tables[0] = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+    tables[1] = odb->create_index(ODB::LINKED_LIST, ODB::NONE, compare_long);
+    tables[2] = odb->create_index(ODB::SKIP_LIST, ODB::DROP_DUPLICATES, compare_long, keep_new);
+
+    for (int t = 0; t < 3; t++)
+    {
+        tables[t]->set_lock(type);
+    }
+
+    for (long i = 0; i < 1000; i++)
+    {
+        long v = i % 300;
+        odb->add_data(&v);
+        odb->upsert(&v, tables[2]);
+    }
+
+    ConditionCust cond(small);
+    long mid = 150;
+
+    delete odb->query(&cond);
+    delete odb->query(small);
+
+    for (int t = 0; t < 3; t++)
+    {
+        Index* ind = tables[t];
+
+        ind->set_cache((t == 0) ? 8 : 0);
+
+        for (int r = 0; r < 2; r++)
+        {
+            delete ind->query(&cond);
+            delete ind->query_eq(&mid);
+            delete ind->query_lt(&mid);
+            delete ind->query_gt(&mid);
+        }
+
+        delete ind->query_top_k(10);
+        delete ind->query_top_k(&cond, 10, -1);
+        delete Index::join(ind, tables[(t + 1) % 3]);
+        ind->lookup(&mid);
+
+        Iterator* it = ind->it_first();
+        ind->it_release(it);
+    }
+
+    Iterator* it = odb->it_first();
+    odb->it_release(it);
+
+    odb->mem_size();
+    delete odb;
+
+    // Linked list index tables can't be swept, so sweeps get an ODB without one.
+    odb = new ODB((ODB::FixedDatastoreType)dt, sizeof(long), prune_odd);
+    odb->set_lock(type);
+    odb->set_datastore_lock(type);
+    odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_long)->set_lock(type);
+    odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long)->set_lock(type);
+
+    for (long i = 0; i < 1000; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    odb->remove_sweep();
+    odb->add_data(&mid);
+
+    delete odb;
+}
+
+TEST_OPT_PREAMBLE("unit-rwlock")
+TEST_OPT("Every kind of lock keeps writers out of each other and away from readers")
+TEST_OPT("Counters see acquisitions, contention and waiting")
+TEST_OPT("Each structure can have a different kind of lock")
+TEST_OPT("The library never takes a lock it already holds")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    bool success = true;
+
+    for (int t = 0; t < TYPES; t++)
+    {
+        lock = RWLock::create(types[t]);
+        a = 0;
+        b = 0;
+        torn = false;
+
+        pthread_t threads[THREADS];
+
+        for (long i = 0; i < THREADS; i++)
+        {
+            pthread_create(&(threads[i]), NULL, worker, NULL);
+        }
+
+        for (long i = 0; i < THREADS; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        long expect = THREADS * (N - N / 4);
+
+        if (torn || (a != expect) || (b != expect) || (lock->get_type() != types[t]))
+        {
+            fprintf(stderr, "Lock type %d: a=%ld b=%ld expected %ld, torn=%d\n", types[t], a, b, expect, torn);
+            success = false;
+        }
+
+        delete lock;
+    }
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    bool success = true;
+
+    for (int t = 0; t < TYPES; t++)
+    {
+        struct RWLock::lock_stats stats;
+        pthread_t thread;
+
+        lock = RWLock::create(types[t]);
+        success = (success && !lock->get_stats(&stats));
+        delete lock;
+
+        lock = RWLock::create(types[t], true);
+
+        // One uncontended read, then a write and a read that each have to wait for
+        // a write lock held here.
+        lock->read_lock();
+        lock->read_unlock();
+
+        for (long w = 1; w >= 0; w--)
+        {
+            lock->write_lock();
+            pthread_create(&thread, NULL, waiter, (void*)w);
+            usleep(20000);
+            lock->write_unlock();
+            pthread_join(thread, NULL);
+        }
+
+        lock->get_stats(&stats);
+
+        if ((stats.read_acquisitions != 2) || (stats.read_contended != 1) || (stats.read_wait_ns == 0) ||
+            (stats.write_acquisitions != 3) || (stats.write_contended != 1) || (stats.write_wait_ns == 0))
+        {
+            fprintf(stderr, "Lock type %d: reads %lu/%lu/%lu writes %lu/%lu/%lu\n", types[t],
+                    stats.read_acquisitions, stats.read_contended, stats.read_wait_ns,
+                    stats.write_acquisitions, stats.write_contended, stats.write_wait_ns);
+            success = false;
+        }
+
+        lock->reset_stats();
+        lock->get_stats(&stats);
+        success = (success && (stats.read_acquisitions == 0) && (stats.write_acquisitions == 0));
+
+        delete lock;
+    }
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    odb->set_lock(RWLock::SPIN);
+    odb->set_datastore_lock(RWLock::READER_BIASED, true);
+
+    Index* tree = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+    Index* list = odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long);
+    tree->set_lock(RWLock::TICKET, true);
+
+    pthread_t threads[THREADS];
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, adder, (void*)i);
+    }
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    long mid = N / 2;
+    ODB* res = tree->query_lt(&mid);
+    uint64_t n_lt = res->size();
+
+    struct RWLock::lock_stats ds_stats;
+    struct RWLock::lock_stats tree_stats;
+    struct RWLock::lock_stats unused;
+
+    bool success = ((odb->size() == N) &&
+                    (tree->size() == N) &&
+                    (list->size() == N) &&
+                    (n_lt == N / 2) &&
+                    (odb->get_lock()->get_type() == RWLock::SPIN) &&
+                    (list->get_lock()->get_type() == RWLock::DEFAULT) &&
+                    !list->get_lock()->get_stats(&unused) &&
+                    odb->get_datastore_lock()->get_stats(&ds_stats) &&
+                    (ds_stats.write_acquisitions >= N) &&
+                    tree->get_lock()->get_stats(&tree_stats) &&
+                    (tree_stats.write_acquisitions >= N) &&
+                    (tree_stats.read_acquisitions >= 1));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    // A path that re-enters a lock hangs rather than failing, so give up on the
+    // whole process if this takes too long.
+    alarm(60);
+
+    exercise(ODB::BANK_DS, RWLock::SPIN);
+    exercise(ODB::BANK_DS, RWLock::TICKET);
+    exercise(ODB::LINKED_LIST_DS, RWLock::SPIN);
+    exercise(ODB::LINKED_LIST_DS, RWLock::TICKET);
+
+    return EXIT_SUCCESS;
+}
+
+TEST_CASES_END()
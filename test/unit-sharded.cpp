@@ -0,0 +1,248 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "shardedodb.hpp"
+#include "index.hpp"
+#include "datastore.hpp"
+#include "iterator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+using namespace libodb;
+
+#define N 4000
+#define SHARDS 4
+#define WRITERS 4
+
+uint64_t key_long(void* rawdata)
+{
+    return (uint64_t)(*(long*)rawdata);
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+bool even(void* rawdata)
+{
+    return (((*(long*)rawdata) & 1) == 0);
+}
+
+// Check that a result is the run of consecutive values from first, in steps of
+// step, and has n of them.
+bool is_run(std::vector<void*>* r, long first, long step, size_t n)
+{
+    if (r->size() != n)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (*(long*)(r->at(i)) != first + (long)i * step)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+ShardedODB* sodb;
+
+void* writer(void* arg)
+{
+    long w = (long)arg;
+
+    for (long i = w; i < N; i += WRITERS)
+    {
+        sodb->add_data(&i);
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-sharded")
+TEST_OPT("Hash partitioned queries merge back into index order")
+TEST_OPT("Range partitioning puts rows in the shard their key falls in")
+TEST_OPT("Parallel writers and fanned out queries")
+TEST_OPT("Fanned out queries count against the rows they return")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    sodb = new ShardedODB(SHARDS, key_long, ShardedODB::HASH, ODB::BANK_DS, sizeof(long));
+    ShardedIndex* index = sodb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        sodb->add_data(&i);
+    }
+
+    bool spread = true;
+
+    for (uint32_t i = 0; i < SHARDS; i++)
+    {
+        spread = (spread && (sodb->get_shard(i)->size() > 0) && (sodb->get_shard(i)->size() < N));
+    }
+
+    long mid = N / 2;
+    std::vector<void*>* eq = index->query_eq(&mid);
+    std::vector<void*>* lt = index->query_lt(&mid);
+    std::vector<void*>* gt = index->query_gt(&mid);
+    std::vector<void*>* top = index->query_top_k(10);
+    std::vector<void*>* bottom = index->query_top_k(10, -1);
+
+    std::vector<ODB*>* evens = sodb->query(even);
+    uint64_t n_evens = 0;
+
+    for (size_t i = 0; i < evens->size(); i++)
+    {
+        n_evens += evens->at(i)->size();
+    }
+
+    bool success = (spread &&
+                    (sodb->size() == N) &&
+                    (index->size() == N) &&
+                    is_run(eq, mid, 1, 1) &&
+                    is_run(lt, mid - 1, -1, N / 2) &&
+                    is_run(gt, mid + 1, 1, N / 2 - 1) &&
+                    is_run(top, N - 1, -1, 10) &&
+                    is_run(bottom, 0, 1, 10) &&
+                    (n_evens == N / 2) &&
+                    (index->lookup(&mid) != NULL));
+
+    delete eq;
+    delete lt;
+    delete gt;
+    delete top;
+    delete bottom;
+    delete evens;
+    delete sodb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    sodb = new ShardedODB(SHARDS, key_long, ShardedODB::RANGE, ODB::BANK_DS, sizeof(long));
+
+    std::vector<uint64_t> bounds;
+
+    for (uint32_t i = 1; i < SHARDS; i++)
+    {
+        bounds.push_back(i * (N / SHARDS));
+    }
+
+    sodb->set_bounds(&bounds);
+
+    for (long i = 0; i < N; i++)
+    {
+        sodb->add_data(&i);
+    }
+
+    bool success = true;
+
+    for (uint32_t i = 0; i < SHARDS; i++)
+    {
+        long first = i * (N / SHARDS);
+        long last = first + (N / SHARDS) - 1;
+        success = (success &&
+                   (sodb->get_shard(i)->size() == N / SHARDS) &&
+                   (sodb->shard_of(&first) == i) &&
+                   (sodb->shard_of(&last) == i));
+    }
+
+    delete sodb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    sodb = new ShardedODB(SHARDS, key_long, ShardedODB::HASH, ODB::BANK_DS, sizeof(long));
+    ShardedIndex* index = sodb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+    sodb->start_scheduler(2);
+
+    pthread_t threads[WRITERS];
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, writer, (void*)i);
+    }
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    long low = -1;
+    std::vector<void*>* all = index->query_gt(&low);
+    bool success = ((sodb->size() == N) && is_run(all, 0, 1, N));
+
+    delete all;
+    delete sodb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    sodb = new ShardedODB(SHARDS, key_long, ShardedODB::HASH, ODB::BANK_DS, sizeof(long), NULL, NULL, NULL, 0, DataStore::QUERY_COUNT);
+    ShardedIndex* index = sodb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        sodb->add_data(&i);
+    }
+
+    long mid = N / 2;
+    delete index->query_lt(&mid);
+    delete index->query_eq(&mid);
+
+    // Everything below mid came back once, and so did mid itself.
+    bool success = true;
+    uint64_t seen = 0;
+
+    for (uint32_t s = 0; s < SHARDS; s++)
+    {
+        Iterator* it = index->get_shard(s)->it_first();
+
+        if (it->data() != NULL)
+        {
+            do
+            {
+                long v = *(long*)(it->get_data());
+                success = (success && (it->get_query_count() == ((v <= mid) ? 1U : 0U)));
+                seen++;
+            } while (it->next());
+        }
+
+        index->get_shard(s)->it_release(it);
+    }
+
+    success = (success && (seen == N));
+
+    delete sodb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
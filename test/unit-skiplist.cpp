@@ -0,0 +1,274 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "iterator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define N 2000
+#define WRITERS 4
+#define DUP_KEYS 4
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+// Walk an index table from one end and check that every value from 0 to n-1 in
+// steps of step shows up exactly copies times, in order.
+bool check_order(Index* index, long n, long step, long copies, bool backwards)
+{
+    Iterator* it = (backwards ? index->it_last() : index->it_first());
+    long expect = (backwards ? n - step : 0);
+    long seen = 0;
+    bool ok = true;
+
+    if (it->data() != NULL)
+    {
+        do
+        {
+            ok = (ok && (*(long*)(it->get_data()) == expect));
+            seen++;
+
+            if ((seen % copies) == 0)
+            {
+                expect += (backwards ? -step : step);
+            }
+        } while (backwards ? it->prev() : it->next());
+    }
+
+    index->it_release(it);
+
+    return (ok && (seen == (n / step) * copies));
+}
+
+ODB* odb;
+
+void* writer(void* arg)
+{
+    long w = (long)arg;
+
+    // Every writer adds every value, starting from a different place, so they
+    // land on the same nodes as well as next to each other.
+    for (long i = 0; i < N; i++)
+    {
+        long v = (i + w * (N / WRITERS)) % N;
+        odb->add_data(&v);
+    }
+
+    return NULL;
+}
+
+// Keep asking for each of the few keys the writers are piling duplicates onto,
+// and check every answer holds only that key, and never fewer than last time.
+void* dup_reader(void* arg)
+{
+    Index* index = (Index*)arg;
+    uint64_t last[DUP_KEYS] = { 0 };
+    bool ok = true;
+
+    while (ok && (index->size() < WRITERS * N))
+    {
+        for (long k = 0; k < DUP_KEYS; k++)
+        {
+            ODB* res = index->query_eq(&k);
+            Iterator* it = res->it_first();
+
+            // Results hold pointers to the rows, and iterate over those.
+            if (it->data() != NULL)
+            {
+                do
+                {
+                    ok = (ok && (**(long**)(it->get_data()) == k));
+                } while (it->next());
+            }
+
+            res->it_release(it);
+
+            ok = (ok && (res->size() >= last[k]));
+            last[k] = res->size();
+            delete res;
+        }
+    }
+
+    return (ok ? arg : NULL);
+}
+
+void* dup_writer(void* arg)
+{
+    for (long i = 0; i < N; i++)
+    {
+        long v = i % DUP_KEYS;
+        odb->add_data(&v);
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-skiplist")
+TEST_OPT("Ordering, duplicates and iterators")
+TEST_OPT("Parallel writers")
+TEST_OPT("Sweeps and dropped duplicates")
+TEST_OPT("Equality queries while duplicates are being added")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* index = odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long);
+
+    // Add everything twice, in an order that's neither ascending nor descending.
+    for (long r = 0; r < 2; r++)
+    {
+        for (long i = 0; i < N; i++)
+        {
+            long v = (i * 7919) % N;
+            odb->add_data(&v);
+        }
+    }
+
+    long mid = N / 2;
+    long missing = N;
+    long low = -1;
+
+    Iterator* it = index->it_lookup(&mid, 1);
+    bool after = ((it->data() != NULL) && (*(long*)(it->get_data()) == mid + 1));
+    index->it_release(it);
+
+    it = index->it_lookup(&mid, -1);
+    bool before = ((it->data() != NULL) && (*(long*)(it->get_data()) == mid - 1) && (it->prev() != NULL) && (*(long*)(it->get_data()) == mid - 1));
+    index->it_release(it);
+
+    bool success = ((index->size() == 2 * N) &&
+                    check_order(index, N, 1, 2, false) &&
+                    check_order(index, N, 1, 2, true) &&
+                    after && before &&
+                    (index->query_eq(&mid)->size() == 2) &&
+                    (index->query_lt(&mid)->size() == N) &&
+                    (index->query_gt(&low)->size() == 2 * N) &&
+                    (index->lookup(&missing) == NULL) &&
+                    (*(long*)(index->lookup(&mid)) == mid));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* index = odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long);
+    Index* drop = odb->create_index(ODB::SKIP_LIST, ODB::DROP_DUPLICATES, compare_long);
+
+    pthread_t threads[WRITERS];
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, writer, (void*)i);
+    }
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool success = ((odb->size() == WRITERS * N) &&
+                    (index->size() == WRITERS * N) &&
+                    check_order(index, N, 1, WRITERS, false) &&
+                    check_order(index, N, 1, WRITERS, true) &&
+                    (drop->size() == N) &&
+                    check_order(drop, N, 1, 1, false));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+    Index* index = odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long);
+    Index* drop = odb->create_index(ODB::SKIP_LIST, ODB::DROP_DUPLICATES, compare_long);
+
+    for (long r = 0; r < 2; r++)
+    {
+        for (long i = 0; i < N; i++)
+        {
+            odb->add_data(&i);
+        }
+    }
+
+    bool dropped = (drop->size() == N);
+    odb->remove_sweep();
+
+    bool success = (dropped &&
+                    (odb->size() == N) &&
+                    (index->size() == N) &&
+                    check_order(index, N, 2, 2, false) &&
+                    check_order(drop, N, 2, 1, false));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* index = odb->create_index(ODB::SKIP_LIST, ODB::NONE, compare_long);
+
+    pthread_t threads[WRITERS];
+    pthread_t reader;
+    void* read_ok;
+
+    pthread_create(&reader, NULL, dup_reader, index);
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, dup_writer, NULL);
+    }
+
+    for (long i = 0; i < WRITERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_join(reader, &read_ok);
+
+    long k = 0;
+    ODB* res = index->query_eq(&k);
+    bool success = ((read_ok != NULL) &&
+                    (index->size() == WRITERS * N) &&
+                    (res->size() == WRITERS * N / DUP_KEYS));
+
+    delete res;
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
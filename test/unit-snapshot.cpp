@@ -0,0 +1,171 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "snapshot.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define N 1000
+#define ROUNDS 20
+
+bool prune_odd(void* rawdata)
+{
+    return ((*(long*)rawdata) & 1);
+}
+
+bool all(void* rawdata)
+{
+    return true;
+}
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+ODB* odb;
+volatile bool done = false;
+
+void* writer(void* arg)
+{
+    for (long i = N; (i < 20 * N) && !done; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-snapshot")
+TEST_OPT("A snapshot doesn't see rows added after it was taken")
+TEST_OPT("Sweeps wait until the last snapshot is released")
+TEST_OPT("Snapshots are consistent across the DataStore and indexes during ingest")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* index = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    Snapshot* snap = odb->snapshot();
+
+    for (long i = N; i < 2 * N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    long old_key = N / 2;
+    long new_key = N + N / 2;
+    long low = -1;
+
+    bool success = ((snap->size() == N) &&
+                    (odb->size() == 2 * N) &&
+                    (snap->query(all)->size() == N) &&
+                    (snap->query_eq(index, &old_key)->size() == 1) &&
+                    (snap->query_eq(index, &new_key)->size() == 0) &&
+                    (snap->query_gt(index, &low)->size() == N) &&
+                    (index->query_gt(&low)->size() == 2 * N));
+
+    odb->snapshot_release(snap);
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long), prune_odd);
+    Index* index = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    Snapshot* a = odb->snapshot();
+    Snapshot* b = odb->snapshot();
+    odb->remove_sweep();
+
+    long key = 1;
+    bool held = ((odb->size() == N) && (b->query_eq(index, &key)->size() == 1));
+
+    odb->snapshot_release(a);
+    held = (held && (odb->size() == N));
+
+    odb->snapshot_release(b);
+    bool swept = (odb->size() == N / 2);
+
+    delete odb;
+
+    return ((held && swept) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* index = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_long);
+
+    for (long i = 0; i < N; i++)
+    {
+        odb->add_data(&i);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, writer, NULL);
+
+    uint64_t wrong = 0;
+    uint64_t last = N;
+    long low = -1;
+
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        Snapshot* snap = odb->snapshot();
+        uint64_t n = snap->size();
+
+        // Whatever the writer is up to, the view has to agree with itself, and
+        // with the snapshots before it.
+        if ((n < last) ||
+            (snap->query(all)->size() != n) ||
+            (snap->query_gt(index, &low)->size() != n) ||
+            (snap->query(all)->size() != n))
+        {
+            wrong++;
+        }
+
+        last = n;
+        odb->snapshot_release(snap);
+    }
+
+    done = true;
+    pthread_join(thread, NULL);
+
+    delete odb;
+
+    return ((wrong == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,153 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+#include "comparator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <set>
+
+using namespace libodb;
+
+#define N 200
+#define DUPS 3
+
+int32_t compare_long(void* a, void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return ((x < y) ? -1 : (x > y));
+}
+
+bool even(void* rawdata)
+{
+    return ((*(long*)rawdata % 2) == 0);
+}
+
+// Check a top-k list against the values it should hold, in order, and that no
+// item turns up in it twice.
+bool check(std::vector<void*>* res, std::vector<long>& expect, uint64_t k)
+{
+    uint64_t want = (k < expect.size() ? k : expect.size());
+    std::set<void*> seen;
+    bool ret = (res->size() == want);
+
+    for (uint64_t i = 0; ret && (i < want); i++)
+    {
+        ret = ((*(long*)(res->at(i)) == expect[i]) && seen.insert(res->at(i)).second);
+    }
+
+    if (!ret)
+    {
+        fprintf(stderr, "Wrong top %lu of %lu (got %lu)\n", k, expect.size(), res->size());
+    }
+
+    delete res;
+
+    return ret;
+}
+
+// Both directions, with and without a condition, from nothing to more than
+// the whole table.
+bool check_index(Index* ind, uint64_t dups)
+{
+    ConditionCust cond(even);
+    std::vector<long> up, down, up_even, down_even;
+    uint64_t ks[] = { 0, 1, 2, dups, dups + 1, N / 2, N * dups - 1, N * dups, N * dups + 1, 10 * N * dups };
+    bool ret = true;
+
+    for (long v = 0; v < N; v++)
+    {
+        for (uint64_t d = 0; d < dups; d++)
+        {
+            up.push_back(v);
+            down.push_back(N - 1 - v);
+
+            if ((v % 2) == 0)
+            {
+                up_even.push_back(v);
+            }
+
+            if (((N - 1 - v) % 2) == 0)
+            {
+                down_even.push_back(N - 1 - v);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < sizeof(ks) / sizeof(uint64_t); i++)
+    {
+        ret = (ret &&
+               check(ind->query_top_k(ks[i]), down, ks[i]) &&
+               check(ind->query_top_k(ks[i], 1), down, ks[i]) &&
+               check(ind->query_top_k(ks[i], -1), up, ks[i]) &&
+               check(ind->query_top_k(&cond, ks[i], 1), down_even, ks[i]) &&
+               check(ind->query_top_k(&cond, ks[i], -1), up_even, ks[i]));
+    }
+
+    return ret;
+}
+
+bool run(int type)
+{
+    ODB* odb = new ODB(ODB::BANK_DS, sizeof(long));
+    Index* unique = odb->create_index((ODB::IndexType)type, ODB::DROP_DUPLICATES, compare_long);
+    Index* dups = odb->create_index((ODB::IndexType)type, ODB::NONE, compare_long);
+    Index* empty = odb->create_index((ODB::IndexType)type, ODB::DO_NOT_ADD_TO_ALL, compare_long);
+
+    // Added out of order, so the index is doing the sorting.
+    for (long d = 0; d < DUPS; d++)
+    {
+        for (long i = 0; i < N; i++)
+        {
+            long v = (i * 7) % N;
+            odb->add_data(&v);
+        }
+    }
+
+    std::vector<long> none;
+    bool success = (check_index(unique, 1) && check_index(dups, DUPS) &&
+                    check(empty->query_top_k(5), none, 5) &&
+                    check(empty->query_top_k(5, -1), none, 5));
+
+    delete odb;
+
+    return success;
+}
+
+TEST_OPT_PREAMBLE("unit-topk")
+TEST_OPT("Top-k queries on red-black trees")
+TEST_OPT("Top-k queries on linked lists")
+TEST_OPT("Top-k queries on skip lists")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    return (run(ODB::RED_BLACK_TREE) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    return (run(ODB::LINKED_LIST) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    return (run(ODB::SKIP_LIST) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()
@@ -0,0 +1,212 @@
+/* MPL2.0 HEADER START
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * MPL2.0 HEADER END
+ *
+ * Copyright 2010-2013 Michael Himbeault and Travis Friesen
+ *
+ */
+
+#include "unittest.hpp"
+#include "odb.hpp"
+#include "index.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+using namespace libodb;
+
+#define KEYS 100
+#define REPEATS 50
+#define THREADS 4
+
+struct counter
+{
+    long key;
+    long count;
+};
+
+int32_t compare_key(void* a, void* b)
+{
+    long x = ((struct counter*)a)->key;
+    long y = ((struct counter*)b)->key;
+    return ((x < y) ? -1 : (x > y));
+}
+
+void* merge_count(void* new_data, void* old_data)
+{
+    ((struct counter*)old_data)->count += ((struct counter*)new_data)->count;
+    return old_data;
+}
+
+// Each key has to have been counted REPEATS times per adder.
+bool counted(Index* ind, long adders)
+{
+    for (long k = 0; k < KEYS; k++)
+    {
+        struct counter c = { k, 0 };
+        struct counter* row = (struct counter*)(ind->lookup(&c));
+
+        if ((row == NULL) || (row->count != REPEATS * adders))
+        {
+            fprintf(stderr, "Key %ld counted %ld times\n", k, (row == NULL ? 0 : row->count));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+ODB* odb;
+Index* keys;
+
+void* adder(void* arg)
+{
+    for (long i = 0; i < REPEATS; i++)
+    {
+        for (long k = 0; k < KEYS; k++)
+        {
+            struct counter c = { k, 1 };
+            odb->upsert(&c, keys);
+        }
+    }
+
+    return NULL;
+}
+
+TEST_OPT_PREAMBLE("unit-upsert")
+TEST_OPT("Upserts merge into existing rows without adding to the datastore")
+TEST_OPT("New keys go into every index table, and racing upserts all count")
+TEST_OPT("Upserts on unsuitable index tables are refused")
+TEST_OPT("New keys are found by the next upsert with a scheduler running")
+TEST_OPT_END()
+
+TEST_CASES_BEGIN()
+TEST_BEGIN(0)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(struct counter));
+    keys = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_key, merge_count);
+    long added = 0;
+
+    for (long i = 0; i < REPEATS; i++)
+    {
+        for (long k = 0; k < KEYS; k++)
+        {
+            struct counter c = { k, 1 };
+
+            if (!odb->upsert(&c, keys))
+            {
+                added++;
+            }
+        }
+    }
+
+    bool success = ((added == KEYS) &&
+                    (odb->size() == KEYS) &&
+                    (keys->size() == KEYS) &&
+                    counted(keys, 1));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(1)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(struct counter));
+    keys = odb->create_index(ODB::SKIP_LIST, ODB::DROP_DUPLICATES, compare_key, merge_count);
+
+    // Nothing sorts on the count, which merges change.
+    Index* by_key = odb->create_index(ODB::LINKED_LIST, ODB::NONE, compare_key);
+
+    pthread_t threads[THREADS];
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, adder, NULL);
+    }
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Racing misses on the same new key add only one row between them.
+    bool success = ((keys->size() == KEYS) &&
+                    (by_key->size() == KEYS) &&
+                    (odb->size() == KEYS) &&
+                    counted(keys, THREADS));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(2)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(struct counter));
+    Index* dups = odb->create_index(ODB::RED_BLACK_TREE, ODB::NONE, compare_key);
+    ODB* other = new ODB(ODB::BANK_DS, sizeof(struct counter));
+    Index* foreign = other->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_key);
+    struct counter c = { 1, 1 };
+    int refused = 0;
+
+    try
+    {
+        odb->upsert(&c, dups);
+    }
+    catch (const char* e)
+    {
+        refused += (strcmp(e, "NO_DROP_DUPS") == 0);
+    }
+
+    try
+    {
+        odb->upsert(&c, foreign);
+    }
+    catch (const char* e)
+    {
+        refused += (strcmp(e, "IDENT_MISMATCH") == 0);
+    }
+
+    bool success = ((refused == 2) && (odb->size() == 0) && (other->size() == 0));
+
+    delete other;
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_BEGIN(3)
+{
+    odb = new ODB(ODB::BANK_DS, sizeof(struct counter));
+    keys = odb->create_index(ODB::RED_BLACK_TREE, ODB::DROP_DUPLICATES, compare_key, merge_count);
+    odb->start_scheduler(2);
+
+    pthread_t threads[THREADS];
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_create(&(threads[i]), NULL, adder, NULL);
+    }
+
+    for (long i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool success = ((keys->size() == KEYS) &&
+                    (odb->size() == KEYS) &&
+                    counted(keys, THREADS));
+
+    delete odb;
+
+    return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+TEST_CASES_END()